@@ -0,0 +1,119 @@
+/* Arena allocator
+ *
+ * Allocations are bumped out of a chain of blocks and are never freed one by one;
+ * ArenaReset or ArenaFree releases everything at once. Blocks never move, so
+ * pointers into them stay good until then. ArenaAllocate aligns to ARENA_ALIGNMENT
+ * bytes and ArenaAllocateBytes not at all. A request larger than the block size gets
+ * a block of its own. The interner keeps its strings in one.
+ *
+ * The arena keeps count of what it hands out: bytes_allocated is what is in use
+ * right now, high_water the most that was ever in use at once, across resets. */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 8
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *blocks; // Newest first
+    size_t bytes_allocated;
+    size_t bytes_reserved;
+    size_t high_water;
+} Arena;
+
+Arena CreateArena(void)
+{
+    Arena arena;
+    memset(&arena, 0, sizeof arena);
+
+    return arena;
+}
+
+/* Bumps `size` bytes starting at a multiple of `alignment` out of the newest block,
+ * or out of a new one if they do not fit */
+static void *ArenaBump(Arena *arena, size_t size, size_t alignment)
+{
+    ArenaBlock *block = arena->blocks;
+    size_t start = block ? (block->used + alignment - 1) & ~(alignment - 1) : 0;
+    if(!block || start > block->capacity || block->capacity - start < size)
+    {
+        size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof *block + capacity);
+        Assert(block);
+        block->used = 0;
+        block->capacity = capacity;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->bytes_reserved += capacity;
+        start = 0;
+    }
+
+    void *result = block->data + start;
+    block->used = start + size;
+
+    arena->bytes_allocated += size;
+    if(arena->bytes_allocated > arena->high_water)
+    {
+        arena->high_water = arena->bytes_allocated;
+    }
+
+    return result;
+}
+
+void *ArenaAllocate(Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    return ArenaBump(arena, size, ARENA_ALIGNMENT);
+}
+
+/* For bytes that need no alignment, like the interner's strings, which would
+ * otherwise waste up to ARENA_ALIGNMENT - 1 bytes each */
+void *ArenaAllocateBytes(Arena *arena, size_t size)
+{
+    return ArenaBump(arena, size, 1);
+}
+
+/* Frees everything but the newest block, which is kept for the next round of
+ * allocations. Pointers into the arena are invalid afterwards. */
+void ArenaReset(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    if(!block)
+    {
+        return;
+    }
+
+    ArenaBlock *next = block->next;
+    while(next)
+    {
+        ArenaBlock *after = next->next;
+        arena->bytes_reserved -= next->capacity;
+        free(next);
+        next = after;
+    }
+
+    block->next = NULL;
+    block->used = 0;
+    arena->bytes_allocated = 0;
+}
+
+void ArenaFree(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while(block)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    memset(arena, 0, sizeof *arena);
+}
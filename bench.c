@@ -0,0 +1,2104 @@
+/* Benchmarks. Run with `./a.out --bench` on an optimized build. */
+
+typedef struct
+{
+    struct timespec start;
+} BenchmarkTimer;
+
+BenchmarkTimer BenchmarkTimerStart(void)
+{
+    BenchmarkTimer timer;
+    clock_gettime(CLOCK_MONOTONIC, &timer.start);
+
+    return timer;
+}
+
+double BenchmarkTimerSeconds(BenchmarkTimer *timer)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return (double)(end.tv_sec - timer->start.tv_sec) + (double)(end.tv_nsec - timer->start.tv_nsec) / 1e9;
+}
+
+/* Hardware cache miss counter. Reads as -1 where perf events are unavailable. */
+typedef struct
+{
+    int file_descriptor;
+} BenchmarkCacheMisses;
+
+BenchmarkCacheMisses BenchmarkCacheMissesStart(void)
+{
+    BenchmarkCacheMisses counter;
+    counter.file_descriptor = -1;
+
+#ifdef __linux__
+    struct perf_event_attr attributes;
+    memset(&attributes, 0, sizeof attributes);
+    attributes.type = PERF_TYPE_HARDWARE;
+    attributes.size = sizeof attributes;
+    attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+    attributes.disabled = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv = 1;
+
+    counter.file_descriptor = (int)syscall(SYS_perf_event_open, &attributes, 0, -1, -1, 0);
+    if(counter.file_descriptor >= 0)
+    {
+        ioctl(counter.file_descriptor, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter.file_descriptor, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+
+    return counter;
+}
+
+long long BenchmarkCacheMissesStop(BenchmarkCacheMisses *counter)
+{
+    long long count = -1;
+
+#ifdef __linux__
+    if(counter->file_descriptor >= 0)
+    {
+        ioctl(counter->file_descriptor, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(counter->file_descriptor, &count, sizeof count) != sizeof count)
+        {
+            count = -1;
+        }
+
+        close(counter->file_descriptor);
+    }
+#else
+    (void)counter;
+#endif
+
+    return count;
+}
+
+char const *BenchmarkFormatCount(long long count, char *buffer, int size)
+{
+    if(count < 0)
+    {
+        return "n/a";
+    }
+
+    snprintf(buffer, size, "%lld", count);
+    return buffer;
+}
+
+/* Small deterministic generator so every run lexes the same corpus */
+static uint64_t benchmark_random_state = 0x9e3779b97f4a7c15ull;
+
+uint32_t BenchmarkRandom(void)
+{
+    uint64_t x = benchmark_random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    benchmark_random_state = x;
+
+    return (uint32_t)(x >> 32);
+}
+
+/* Identifiers of 1 to 16 characters drawn from a vocabulary of vocabulary_size names,
+ * roughly one in five being a keyword */
+char *GenerateIdentifierCorpus(int size, int vocabulary_size)
+{
+    static char const first_characters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+    static char const other_characters[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+
+    char (*vocabulary)[17] = malloc(vocabulary_size * sizeof *vocabulary);
+    Assert(vocabulary);
+
+    int word = 0;
+    while(word < vocabulary_size)
+    {
+        int identifier_length = 1 + BenchmarkRandom() % 16;
+        vocabulary[word][0] = first_characters[BenchmarkRandom() % (sizeof first_characters - 1)];
+
+        int i = 1;
+        while(i < identifier_length)
+        {
+            vocabulary[word][i] = other_characters[BenchmarkRandom() % (sizeof other_characters - 1)];
+            i++;
+        }
+
+        vocabulary[word][identifier_length] = 0;
+        word++;
+    }
+
+    char *corpus = malloc(size + 1);
+    Assert(corpus);
+
+    int length = 0;
+    while(length < size - (KEYWORD_MAX_LENGTH + 17))
+    {
+        char const *name;
+        if(BenchmarkRandom() % 5 == 0)
+        {
+            name = token_string_table[TOKEN_KEYWORD_BEGIN + BenchmarkRandom() % (TOKEN_KEYWORD_END - TOKEN_KEYWORD_BEGIN)];
+        } else
+        {
+            name = vocabulary[BenchmarkRandom() % vocabulary_size];
+        }
+
+        int name_length = (int)strlen(name);
+        memcpy(corpus + length, name, name_length);
+        length += name_length;
+
+        corpus[length++] = (BenchmarkRandom() % 8 == 0) ? '\n' : ' ';
+    }
+
+    corpus[length] = 0;
+    free(vocabulary);
+
+    return corpus;
+}
+
+/* The keyword scan LexerRun used before the hashed table, kept as a baseline */
+TokenKind LinearKeywordLookup(char const *name, int length)
+{
+    int token_kind = TOKEN_KEYWORD_BEGIN;
+    while(token_kind < TOKEN_KEYWORD_END)
+    {
+        if(strncmp(name, token_string_table[token_kind], length) == 0)
+        {
+            return token_kind;
+        }
+
+        token_kind++;
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+typedef struct
+{
+    char const *start;
+    int length;
+} BenchmarkSpan;
+
+void BenchmarkKeywordClassification(void)
+{
+    int corpus_size = 16 * 1024 * 1024;
+    char *corpus = GenerateIdentifierCorpus(corpus_size, 4096);
+    int corpus_length = (int)strlen(corpus);
+
+    /* Split the names out up front so only classification is timed */
+    BenchmarkSpan *names = NULL;
+    char *cursor = corpus;
+    while(*cursor)
+    {
+        BenchmarkSpan name;
+        name.start = cursor;
+        while(*cursor && *cursor != ' ' && *cursor != '\n')
+        {
+            cursor++;
+        }
+
+        name.length = (int)(cursor - name.start);
+        BufferPush(names, name);
+
+        while(*cursor == ' ' || *cursor == '\n')
+        {
+            cursor++;
+        }
+    }
+
+    int identifier_count = BufferLength(names);
+    int linear_keywords = 0;
+    int hashed_keywords = 0;
+    int i;
+
+    BenchmarkTimer timer = BenchmarkTimerStart();
+    i = 0;
+    while(i < identifier_count)
+    {
+        linear_keywords += LinearKeywordLookup(names[i].start, names[i].length) != TOKEN_IDENTIFIER;
+        i++;
+    }
+    double linear_seconds = BenchmarkTimerSeconds(&timer);
+
+    timer = BenchmarkTimerStart();
+    i = 0;
+    while(i < identifier_count)
+    {
+        hashed_keywords += LexerClassifyKeyword(names[i].start, names[i].length) != TOKEN_IDENTIFIER;
+        i++;
+    }
+    double hashed_seconds = BenchmarkTimerSeconds(&timer);
+
+    BufferFree(names);
+
+    /* End to end lexing of the same corpus */
+    timer = BenchmarkTimerStart();
+    Token *tokens = LexerRun(corpus);
+    double lex_seconds = BenchmarkTimerSeconds(&timer);
+    BufferFree(tokens);
+
+    printf("keyword classification: %d identifiers (%.1f MB)\n", identifier_count, corpus_length / 1e6);
+    printf("  linear strncmp scan  %8.2f M identifiers/s (%d matches, prefix semantics)\n",
+           identifier_count / linear_seconds / 1e6, linear_keywords);
+    printf("  hashed table         %8.2f M identifiers/s (%d matches)\n",
+           identifier_count / hashed_seconds / 1e6, hashed_keywords);
+    printf("  LexerRun             %8.2f M identifiers/s, %.1f MB/s\n",
+           identifier_count / lex_seconds / 1e6, corpus_length / lex_seconds / 1e6);
+
+    free(corpus);
+}
+
+/* Layout of Token before identifiers were interned */
+typedef struct
+{
+    TokenKind kind;
+    int line;
+    int column;
+    ErrorKind error;
+
+    union
+    {
+        unsigned int number;
+        char name[32];
+        char *string;
+    };
+} LegacyToken;
+
+void BenchmarkTokenMemory(void)
+{
+    int corpus_size = 16 * 1024 * 1024;
+    char *corpus = GenerateIdentifierCorpus(corpus_size, 16384);
+    int corpus_length = (int)strlen(corpus);
+
+    size_t interner_bytes_before = InternerBytes(&global_interner);
+    Token *tokens = LexerRun(corpus);
+    size_t interner_bytes = InternerBytes(&global_interner) - interner_bytes_before;
+
+    double token_count = BufferLength(tokens);
+    double legacy_bytes = token_count * sizeof(LegacyToken);
+    double interned_bytes = token_count * sizeof(Token) + interner_bytes;
+
+    printf("token memory: %.0f tokens (%.1f MB of source)\n", token_count, corpus_length / 1e6);
+    printf("  inline name[32]      %6.2f bytes/token, %7.1f MB\n", legacy_bytes / token_count, legacy_bytes / 1e6);
+    printf("  interned symbols     %6.2f bytes/token, %7.1f MB (%zu byte tokens + %.1f MB interner)\n",
+           interned_bytes / token_count, interned_bytes / 1e6, sizeof(Token), interner_bytes / 1e6);
+
+    BufferFree(tokens);
+    free(corpus);
+}
+
+/* Lines of the form `12 + 345 * 6 - 78;` */
+char *GenerateExpressionCorpus(int size)
+{
+    static char const operators[] = "+-*%<>^";
+
+    char *corpus = malloc(size + 1);
+    Assert(corpus);
+
+    int length = 0;
+    while(length < size - 64)
+    {
+        int terms = 2 + BenchmarkRandom() % 6;
+        int i = 0;
+        while(i < terms)
+        {
+            if(i > 0)
+            {
+                corpus[length++] = ' ';
+                corpus[length++] = operators[BenchmarkRandom() % (sizeof operators - 1)];
+                corpus[length++] = ' ';
+            }
+
+            length += sprintf(corpus + length, "%u", BenchmarkRandom() % 1000);
+            i++;
+        }
+
+        corpus[length++] = ';';
+        corpus[length++] = '\n';
+    }
+
+    corpus[length] = 0;
+
+    return corpus;
+}
+
+void BenchmarkTokenStorage(void)
+{
+    int corpus_size = 32 * 1024 * 1024;
+    char *corpus = GenerateExpressionCorpus(corpus_size);
+    int corpus_length = (int)strlen(corpus);
+
+    BenchmarkTimer timer = BenchmarkTimerStart();
+    Token *tokens = LexerRun(corpus);
+    double array_lex_seconds = BenchmarkTimerSeconds(&timer);
+
+    timer = BenchmarkTimerStart();
+    TokenStream stream = LexerRunCompact(corpus);
+    double stream_lex_seconds = BenchmarkTimerSeconds(&timer);
+
+    int token_count = BufferLength(tokens);
+    int passes = 10;
+
+    /* Walk the tokens the way MatchToken does, looking only at kinds */
+    long long array_matches = 0;
+    BenchmarkCacheMisses misses = BenchmarkCacheMissesStart();
+    timer = BenchmarkTimerStart();
+    int pass = 0;
+    while(pass < passes)
+    {
+        int i = 0;
+        while(i < token_count)
+        {
+            array_matches += tokens[i].kind == TOKEN_SEMICOLON;
+            i++;
+        }
+
+        pass++;
+    }
+    double array_walk_seconds = BenchmarkTimerSeconds(&timer);
+    long long array_misses = BenchmarkCacheMissesStop(&misses);
+
+    long long stream_matches = 0;
+    misses = BenchmarkCacheMissesStart();
+    timer = BenchmarkTimerStart();
+    pass = 0;
+    while(pass < passes)
+    {
+        int i = 0;
+        while(i < token_count)
+        {
+            stream_matches += stream.kinds[i] == TOKEN_SEMICOLON;
+            i++;
+        }
+
+        pass++;
+    }
+    double stream_walk_seconds = BenchmarkTimerSeconds(&timer);
+    long long stream_misses = BenchmarkCacheMissesStop(&misses);
+
+    Assert(array_matches == stream_matches);
+
+    double array_bytes = (double)token_count * sizeof(Token);
+    double stream_bytes = (double)token_count * (sizeof *stream.kinds + sizeof *stream.offsets + sizeof *stream.payloads);
+
+    char count_buffer[32];
+    printf("token storage: %d tokens (%.1f MB of source)\n", token_count, corpus_length / 1e6);
+    printf("  Token array   lex %7.1f MB/s  walk %8.1f M tokens/s  %6.1f MB  %s cache misses\n",
+           corpus_length / array_lex_seconds / 1e6, (double)token_count * passes / array_walk_seconds / 1e6,
+           array_bytes / 1e6, BenchmarkFormatCount(array_misses, count_buffer, sizeof count_buffer));
+    printf("  TokenStream   lex %7.1f MB/s  walk %8.1f M tokens/s  %6.1f MB  %s cache misses\n",
+           corpus_length / stream_lex_seconds / 1e6, (double)token_count * passes / stream_walk_seconds / 1e6,
+           stream_bytes / 1e6, BenchmarkFormatCount(stream_misses, count_buffer, sizeof count_buffer));
+
+    BufferFree(tokens);
+    FreeTokenStream(&stream);
+    free(corpus);
+}
+
+/* Indented C-like statements: declarations, calls, string literals and operators */
+char *GenerateCSourceCorpus(int size)
+{
+    static char const *types[] = { "int", "unsigned", "char", "long", "static int", "const char" };
+    static char const *names[] = { "buffer_length", "i", "result", "token_start", "current_line",
+                                   "LexerScan", "value", "error_count", "table_entry", "x" };
+    static char const *strings[] = { "unexpected character", "%s:%d:%d: %s", "", "could not open file: %s",
+                                     "a somewhat longer diagnostic message with \\\"quotes\\\"" };
+    static char const *operators[] = { "+", "-", "*", "<<", "&&", "|", "==", "<", ">>=" };
+
+    char *corpus = malloc(size + 1);
+    Assert(corpus);
+
+    int length = 0;
+    while(length < size - 256)
+    {
+        int indent = 4 * (BenchmarkRandom() % 4);
+        memset(corpus + length, ' ', indent);
+        length += indent;
+
+        char const *name = names[BenchmarkRandom() % 10];
+        char const *other = names[BenchmarkRandom() % 10];
+        switch(BenchmarkRandom() % 4)
+        {
+            case 0:
+                length += sprintf(corpus + length, "%s %s = %s %s %u;\n", types[BenchmarkRandom() % 6], name,
+                                  other, operators[BenchmarkRandom() % 9], BenchmarkRandom() % 100000);
+                break;
+            case 1:
+                length += sprintf(corpus + length, "ReportError(\"%s\", %s, %s);\n",
+                                  strings[BenchmarkRandom() % 5], name, other);
+                break;
+            case 2:
+                length += sprintf(corpus + length, "if(%s %s 0x%x)\n", name,
+                                  operators[BenchmarkRandom() % 9], BenchmarkRandom() % 4096);
+                break;
+            default:
+                length += sprintf(corpus + length, "{\n\n}\n");
+                break;
+        }
+    }
+
+    corpus[length] = 0;
+
+    return corpus;
+}
+
+void BenchmarkScanModes(void)
+{
+    int corpus_size = 32 * 1024 * 1024;
+    char *corpus = GenerateCSourceCorpus(corpus_size);
+    int corpus_length = (int)strlen(corpus);
+
+    printf("lexer scan modes: %.1f MB of C-like source\n", corpus_length / 1e6);
+
+    LexerScanMode mode = LEXER_SCAN_SCALAR;
+    while(mode <= LEXER_SCAN_AVX2)
+    {
+        if(LexerSelectScanMode(mode))
+        {
+            double best_seconds = 1e9;
+            int repetition = 0;
+            while(repetition < 3)
+            {
+                BenchmarkTimer timer = BenchmarkTimerStart();
+                TokenStream tokens = LexerRunCompact(corpus);
+                double seconds = BenchmarkTimerSeconds(&timer);
+                FreeTokenStream(&tokens);
+
+                if(seconds < best_seconds)
+                {
+                    best_seconds = seconds;
+                }
+
+                repetition++;
+            }
+
+            printf("  %-8s %8.1f MB/s\n", lexer_scan_mode_string_table[mode], corpus_length / best_seconds / 1e6);
+        } else
+        {
+            printf("  %-8s not supported\n", lexer_scan_mode_string_table[mode]);
+        }
+
+        mode++;
+    }
+
+    LexerSelectScanMode(LEXER_SCAN_AUTO);
+    free(corpus);
+}
+
+/* Random picks from `pieces`, each followed by a space, until the corpus is about `size` bytes */
+char *GeneratePieceCorpus(int size, char const **pieces, int piece_count)
+{
+    char *corpus = malloc(size + 1);
+    Assert(corpus);
+
+    int length = 0;
+    for(;;)
+    {
+        char const *piece = pieces[BenchmarkRandom() % piece_count];
+        int piece_length = (int)strlen(piece);
+        if(length + piece_length + 1 > size)
+        {
+            break;
+        }
+
+        memcpy(corpus + length, piece, piece_length);
+        length += piece_length;
+        corpus[length++] = ' ';
+    }
+
+    corpus[length] = 0;
+
+    return corpus;
+}
+
+/* Lexer throughput on inputs made of mostly one kind of token, to see which paths of
+ * LexerScan are slow */
+void BenchmarkLexerTokenKinds(void)
+{
+    static char const *numbers[] = { "0", "7", "42", "1234", "99999", "0x1f", "0xdeadbeef", "0777", "65536" };
+    static char const *operators[] = { "+", "-", "*", "/", "%", "==", "<<=", ">>", "&&", "|=", ",", ";",
+                                       "(", ")", "{", "}", "[", "]", "~=", "!", "?", ":" };
+    static char const *whitespace[] = { "x", "\n\n\n", "        ", "\t\t\t\t", "  \r\n  ",
+                                        "                                                        " };
+    static char const *strings[] = { "\"\"", "\"short\"", "\"%s:%d:%d: %s\"",
+                                     "\"a somewhat longer diagnostic message with \\\"quotes\\\"\"",
+                                     "\"could not open file: %s because the path does not exist\"" };
+
+    int corpus_size = 8 * 1024 * 1024;
+    struct
+    {
+        char const *name;
+        char *corpus;
+    } corpora[] = {
+        { "identifiers", GenerateIdentifierCorpus(corpus_size, 4096) },
+        { "numbers", GeneratePieceCorpus(corpus_size, numbers, sizeof numbers / sizeof *numbers) },
+        { "operators", GeneratePieceCorpus(corpus_size, operators, sizeof operators / sizeof *operators) },
+        { "whitespace", GeneratePieceCorpus(corpus_size, whitespace, sizeof whitespace / sizeof *whitespace) },
+        { "strings", GeneratePieceCorpus(corpus_size, strings, sizeof strings / sizeof *strings) }
+    };
+
+    printf("lexer by token kind:\n");
+
+    int i = 0;
+    while(i < (int)(sizeof corpora / sizeof *corpora))
+    {
+        int corpus_length = (int)strlen(corpora[i].corpus);
+        int token_count = 0;
+        double best_seconds = 1e9;
+
+        int repetition = 0;
+        while(repetition < 3)
+        {
+            BenchmarkTimer timer = BenchmarkTimerStart();
+            TokenStream tokens = LexerRunCompact(corpora[i].corpus);
+            double seconds = BenchmarkTimerSeconds(&timer);
+            token_count = TokenStreamLength(&tokens);
+            FreeTokenStream(&tokens);
+
+            if(seconds < best_seconds)
+            {
+                best_seconds = seconds;
+            }
+
+            repetition++;
+        }
+
+        printf("  %-12s %8.1f MB/s  %6.2f ns/token  (%d tokens)\n", corpora[i].name,
+               corpus_length / best_seconds / 1e6, best_seconds * 1e9 / token_count, token_count);
+
+        free(corpora[i].corpus);
+        i++;
+    }
+}
+
+void BenchmarkParallelLexing(void)
+{
+    int corpus_size = 64 * 1024 * 1024;
+    char *corpus = GenerateCSourceCorpus(corpus_size);
+    size_t corpus_length = strlen(corpus);
+
+    printf("parallel lexing: %.1f MB of C-like source, %d cores\n", corpus_length / 1e6, ThreadPoolCoreCount());
+
+    int workers = 0;
+    while(workers <= ThreadPoolCoreCount())
+    {
+        ThreadPool pool;
+        if(workers > 0)
+        {
+            ThreadPoolInit(&pool, workers);
+        }
+
+        double best_seconds = 1e9;
+        int repetition = 0;
+        while(repetition < 3)
+        {
+            BenchmarkTimer timer = BenchmarkTimerStart();
+            TokenStream tokens = workers > 0 ? LexerRunParallel(&pool, corpus, corpus_length, workers * 4) : LexerRunCompact(corpus);
+            double seconds = BenchmarkTimerSeconds(&timer);
+            FreeTokenStream(&tokens);
+
+            if(seconds < best_seconds)
+            {
+                best_seconds = seconds;
+            }
+
+            repetition++;
+        }
+
+        if(workers > 0)
+        {
+            printf("  %2d workers %8.1f MB/s\n", workers, corpus_length / best_seconds / 1e6);
+            ThreadPoolFree(&pool);
+            workers *= 2;
+        } else
+        {
+            printf("  sequential %8.1f MB/s\n", corpus_length / best_seconds / 1e6);
+            workers = 1;
+        }
+    }
+
+    free(corpus);
+}
+
+/* Layout of Expression before trees were flattened into an ExpressionPool: one
+ * malloc per node, linked by pointers */
+typedef struct LegacyExpression
+{
+    ExpressionKind kind;
+    TokenKind operator;
+
+    union
+    {
+        int number;
+        struct LegacyExpression *unary;
+
+        struct
+        {
+            struct LegacyExpression *left;
+            struct LegacyExpression *right;
+        };
+    };
+} LegacyExpression;
+
+static int EvaluateLegacyExpression(LegacyExpression *expression)
+{
+    switch(expression->kind)
+    {
+        case EXPRESSION_NUMBER:
+            return expression->number;
+        case EXPRESSION_UNARY:
+            return -EvaluateLegacyExpression(expression->unary);
+        case EXPRESSION_BINARY:
+        {
+            int left = EvaluateLegacyExpression(expression->left);
+            int right = EvaluateLegacyExpression(expression->right);
+            return expression->operator == TOKEN_PLUS ? left + right : left - right;
+        }
+        default:
+            return 0;
+    }
+}
+
+/* Operands come first in the pool, so one pass in id order evaluates every node */
+static int EvaluateExpressionPool(ExpressionPool *pool, int *values)
+{
+    int count = BufferLength(pool->nodes);
+    ExpressionId id = 1;
+    while((int)id < count)
+    {
+        ExpressionNode *node = &pool->nodes[id];
+        switch(node->kind)
+        {
+            case EXPRESSION_NUMBER:
+                values[id] = pool->numbers[node->first];
+                break;
+            case EXPRESSION_UNARY:
+                values[id] = -values[node->first];
+                break;
+            case EXPRESSION_BINARY:
+                values[id] = node->operator == TOKEN_PLUS ? values[node->first] + values[node->second]
+                                                          : values[node->first] - values[node->second];
+                break;
+            default:
+                break;
+        }
+
+        id++;
+    }
+
+    return values[count - 1];
+}
+
+/* Builds the same random tree of `leaves` numbers both ways, operands first the way
+ * a parser would. Random splits keep the depth around a few dozen. */
+static ExpressionId BuildBenchmarkExpression(ExpressionPool *pool, LegacyExpression **legacy, int leaves)
+{
+    ExpressionId id;
+    LegacyExpression *expression = malloc(sizeof *expression);
+    Assert(expression);
+
+    if(leaves == 1)
+    {
+        int number = (int)(BenchmarkRandom() % 1000);
+        expression->kind = EXPRESSION_NUMBER;
+        expression->number = number;
+        id = CreateNumberExpression(pool, number);
+    } else
+    {
+        int left_leaves = 1 + (int)(BenchmarkRandom() % (leaves - 1));
+        TokenKind operator = BenchmarkRandom() & 1 ? TOKEN_PLUS : TOKEN_MINUS;
+
+        LegacyExpression *left;
+        LegacyExpression *right;
+        ExpressionId left_id = BuildBenchmarkExpression(pool, &left, left_leaves);
+        ExpressionId right_id = BuildBenchmarkExpression(pool, &right, leaves - left_leaves);
+
+        expression->kind = EXPRESSION_BINARY;
+        expression->operator = operator;
+        expression->left = left;
+        expression->right = right;
+        id = CreateBinaryExpression(pool, left_id, right_id, operator);
+    }
+
+    if(BenchmarkRandom() % 8 == 0)
+    {
+        LegacyExpression *negation = malloc(sizeof *negation);
+        Assert(negation);
+        negation->kind = EXPRESSION_UNARY;
+        negation->operator = TOKEN_MINUS;
+        negation->unary = expression;
+        expression = negation;
+        id = CreateUnaryExpression(pool, id, TOKEN_MINUS);
+    }
+
+    *legacy = expression;
+
+    return id;
+}
+
+static void FreeLegacyExpression(LegacyExpression *expression)
+{
+    if(expression->kind == EXPRESSION_UNARY)
+    {
+        FreeLegacyExpression(expression->unary);
+    } else if(expression->kind == EXPRESSION_BINARY)
+    {
+        FreeLegacyExpression(expression->left);
+        FreeLegacyExpression(expression->right);
+    }
+
+    free(expression);
+}
+
+/* Compares memory and the time to evaluate a whole tree in both layouts */
+void BenchmarkExpressionLayout(void)
+{
+    ExpressionPool pool = CreateExpressionPool();
+    LegacyExpression *legacy_root;
+    BuildBenchmarkExpression(&pool, &legacy_root, 2 * 1000 * 1000);
+    int node_count = BufferLength(pool.nodes) - 1;
+    size_t legacy_bytes = (size_t)node_count * sizeof(LegacyExpression);
+
+    int *values = malloc(BufferLength(pool.nodes) * sizeof *values);
+    Assert(values);
+
+    double legacy_seconds = 1e9;
+    double pool_seconds = 1e9;
+    int legacy_result = 0;
+    int pool_result = 0;
+    int repetition = 0;
+    while(repetition < 5)
+    {
+        BenchmarkTimer timer = BenchmarkTimerStart();
+        legacy_result = EvaluateLegacyExpression(legacy_root);
+        double seconds = BenchmarkTimerSeconds(&timer);
+        if(seconds < legacy_seconds)
+        {
+            legacy_seconds = seconds;
+        }
+
+        timer = BenchmarkTimerStart();
+        pool_result = EvaluateExpressionPool(&pool, values);
+        seconds = BenchmarkTimerSeconds(&timer);
+        if(seconds < pool_seconds)
+        {
+            pool_seconds = seconds;
+        }
+
+        repetition++;
+    }
+
+    Assert(legacy_result == pool_result);
+
+    size_t pool_bytes = (size_t)(BufferLength(pool.nodes) - 1) * sizeof(ExpressionNode) +
+                        (size_t)BufferLength(pool.numbers) * sizeof *pool.numbers;
+
+    printf("expression layout: %d nodes\n", node_count);
+    printf("  pointer tree  %7.1f MB (+ malloc overhead)  evaluate %7.2f ms\n", legacy_bytes / 1e6, legacy_seconds * 1e3);
+    printf("  flat pool     %7.1f MB                      evaluate %7.2f ms\n", pool_bytes / 1e6, pool_seconds * 1e3);
+
+    free(values);
+    FreeExpressionPool(&pool);
+    FreeLegacyExpression(legacy_root);
+}
+
+/* How stringifying used to work: every subtree becomes its own malloc'd string,
+ * which its parent copies into a bigger one and frees */
+static char *StringifyExpressionPerSubtree(ExpressionPool *pool, ExpressionId id)
+{
+    ExpressionNode *expression = GetExpression(pool, id);
+    char *result;
+    char *operand;
+    char *other_operand;
+
+    switch(expression->kind)
+    {
+        case EXPRESSION_NUMBER:
+            return FormatString("%d", ExpressionNumber(pool, id));
+        case EXPRESSION_UNARY:
+            operand = StringifyExpressionPerSubtree(pool, expression->first);
+            result = FormatString("(%s %s)", token_string_table[expression->operator], operand);
+            free(operand);
+            return result;
+        case EXPRESSION_BINARY:
+            operand = StringifyExpressionPerSubtree(pool, expression->first);
+            other_operand = StringifyExpressionPerSubtree(pool, expression->second);
+            result = FormatString("(%s %s %s)", token_string_table[expression->operator], operand, other_operand);
+            free(operand);
+            free(other_operand);
+            return result;
+        default:
+            return FormatString("");
+    }
+}
+
+/* Pretty-prints a 100k node tree with a string per subtree and with one shared builder */
+void BenchmarkPrettyPrint(void)
+{
+    ExpressionPool pool = CreateExpressionPool();
+    LegacyExpression *legacy_root;
+    ExpressionId root = BuildBenchmarkExpression(&pool, &legacy_root, 44 * 1000);
+    FreeLegacyExpression(legacy_root);
+    int node_count = BufferLength(pool.nodes) - 1;
+
+    double per_subtree_seconds = 1e9;
+    double builder_seconds = 1e9;
+    size_t length = 0;
+    int repetition = 0;
+    while(repetition < 5)
+    {
+        BenchmarkTimer timer = BenchmarkTimerStart();
+        char *per_subtree = StringifyExpressionPerSubtree(&pool, root);
+        double seconds = BenchmarkTimerSeconds(&timer);
+        if(seconds < per_subtree_seconds)
+        {
+            per_subtree_seconds = seconds;
+        }
+
+        timer = BenchmarkTimerStart();
+        char *built = StringifyExpression(&pool, root);
+        seconds = BenchmarkTimerSeconds(&timer);
+        if(seconds < builder_seconds)
+        {
+            builder_seconds = seconds;
+        }
+
+        Assert(strcmp(per_subtree, built) == 0);
+        length = strlen(built);
+        free(per_subtree);
+        free(built);
+        repetition++;
+    }
+
+    printf("pretty print: %d nodes, %zu bytes of text\n", node_count, length);
+    printf("  string per subtree  %7.2f ms  (%d allocations)\n", per_subtree_seconds * 1e3, node_count);
+    printf("  shared builder      %7.2f ms\n", builder_seconds * 1e3);
+
+    FreeExpressionPool(&pool);
+}
+
+/* The straightforward way to run a tree: recurse, and look variables up by Symbol */
+static int EvaluateExpressionRecursive(ExpressionPool *pool, ExpressionId id, int *values)
+{
+    ExpressionNode *node = GetExpression(pool, id);
+    int left;
+    int right;
+
+    switch(node->kind)
+    {
+        case EXPRESSION_NUMBER:
+            return ExpressionNumber(pool, id);
+        case EXPRESSION_IDENTIFIER:
+            return values[node->first];
+        case EXPRESSION_UNARY:
+            left = EvaluateExpressionRecursive(pool, node->first, values);
+            return node->operator == TOKEN_MINUS ? (int)(0u - (uint32_t)left) : node->operator == TOKEN_BITWISE_NOT ? ~left : !left;
+        case EXPRESSION_TERNARY:
+            return EvaluateExpressionRecursive(pool, pool->branches[node->second + !EvaluateExpressionRecursive(pool, node->first, values)], values);
+        case EXPRESSION_BINARY:
+            left = EvaluateExpressionRecursive(pool, node->first, values);
+            if(node->operator == TOKEN_LOGICAL_AND && !left) return 0;
+            if(node->operator == TOKEN_LOGICAL_OR && left) return 1;
+            right = EvaluateExpressionRecursive(pool, node->second, values);
+
+            switch(node->operator)
+            {
+                case TOKEN_PLUS: return (int)((uint32_t)left + (uint32_t)right);
+                case TOKEN_MINUS: return (int)((uint32_t)left - (uint32_t)right);
+                case TOKEN_STAR: return (int)((uint32_t)left * (uint32_t)right);
+                case TOKEN_SLASH: return right && !(left == INT_MIN && right == -1) ? left / right : 0;
+                case TOKEN_PERCENT: return right && !(left == INT_MIN && right == -1) ? left % right : 0;
+                case TOKEN_BITWISE_LEFT_SHIFT: return (int)((uint32_t)left << (right & 31));
+                case TOKEN_BITWISE_RIGHT_SHIFT: return left >> (right & 31);
+                case TOKEN_LESS_THAN: return left < right;
+                case TOKEN_GREATER_THAN: return left > right;
+                case TOKEN_LESS_EQUAL: return left <= right;
+                case TOKEN_GREATER_EQUAL: return left >= right;
+                case TOKEN_DOUBLE_EQUALS: return left == right;
+                case TOKEN_NOT_EQUAL: return left != right;
+                case TOKEN_BITWISE_AND: return left & right;
+                case TOKEN_BITWISE_OR: return left | right;
+                case TOKEN_BITWISE_XOR: return left ^ right;
+                case TOKEN_LOGICAL_AND:
+                case TOKEN_LOGICAL_OR: return right != 0;
+                case TOKEN_COMMA: return right;
+                default: return 0;
+            }
+        default:
+            return 0;
+    }
+}
+
+/* A config rule run millions of times with changing inputs, by walking the tree and
+ * through the bytecode VM */
+void BenchmarkBytecodeVm(void)
+{
+    char const *rule = "(a * 3 + b) % 7 == 2 && (c > 4 || a - b < 10) ? (a << 2) + c * 9 - (b >> 1) : "
+                       "(b ^ c * 5) - (a & 15) + (c % 13 <= 6 ? a / 3 : -b)";
+    int evaluations = 5 * 1000 * 1000;
+
+    TokenStream tokens = LexerRunCompact(rule);
+    ExpressionPool pool = CreateExpressionPool();
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId root = ParseExpression(&parser);
+
+    Bytecode bytecode = CreateBytecode();
+    Symbol symbols[3] = { InternString(&global_interner, "a", 1), InternString(&global_interner, "b", 1),
+                          InternString(&global_interner, "c", 1) };
+    int i = 0;
+    while(i < 3)
+    {
+        VariableSlot(&bytecode.variables, symbols[i]);
+        i++;
+    }
+    Assert(CompileBytecode(&bytecode, &pool, root));
+
+    int inputs[1024][3];
+    i = 0;
+    while(i < 1024)
+    {
+        inputs[i][0] = (int)(BenchmarkRandom() % 2000) - 1000;
+        inputs[i][1] = (int)(BenchmarkRandom() % 2000) - 1000;
+        inputs[i][2] = (int)(BenchmarkRandom() % 2000) + 1;
+        i++;
+    }
+
+    int *values = calloc(InternerCount(&global_interner) + 1, sizeof *values);
+    int *stack = malloc(bytecode.max_stack * sizeof *stack);
+    Assert(values && stack);
+
+    BenchmarkTimer timer = BenchmarkTimerStart();
+    long long tree_sum = 0;
+    i = 0;
+    while(i < evaluations)
+    {
+        int *input = inputs[i & 1023];
+        values[symbols[0]] = input[0];
+        values[symbols[1]] = input[1];
+        values[symbols[2]] = input[2];
+        tree_sum += EvaluateExpressionRecursive(&pool, root, values);
+        i++;
+    }
+    double tree_seconds = BenchmarkTimerSeconds(&timer);
+
+    timer = BenchmarkTimerStart();
+    long long vm_sum = 0;
+    i = 0;
+    while(i < evaluations)
+    {
+        int variables[3];
+        memcpy(variables, inputs[i & 1023], sizeof variables);
+        int result;
+        VmStatus status = VmRun(&bytecode, variables, stack, &result);
+        Assert(status == VM_OK);
+        vm_sum += result;
+        i++;
+    }
+    double vm_seconds = BenchmarkTimerSeconds(&timer);
+
+    X86Program program = CreateX86Program();
+    i = 0;
+    while(i < 3)
+    {
+        VariableSlot(&program.variables, symbols[i]);
+        i++;
+    }
+    JitCode jit;
+    Assert(CompileX86(&program, &pool, root, "rule", NULL) && JitLoad(&jit, &program));
+
+    timer = BenchmarkTimerStart();
+    long long jit_sum = 0;
+    i = 0;
+    while(i < evaluations)
+    {
+        int variables[3];
+        memcpy(variables, inputs[i & 1023], sizeof variables);
+        int status;
+        jit_sum += jit.function(variables, &status);
+        Assert(status == VM_OK);
+        i++;
+    }
+    double jit_seconds = BenchmarkTimerSeconds(&timer);
+
+    Assert(tree_sum == vm_sum && vm_sum == jit_sum);
+    printf("bytecode vm: %d evaluations of a %d node rule, %d instructions\n", evaluations,
+           BufferLength(pool.nodes) - 1, BufferLength(bytecode.code));
+    printf("  recursive tree walk  %7.2f ms  %6.1f ns/evaluation\n", tree_seconds * 1e3, tree_seconds * 1e9 / evaluations);
+    printf("  %-20s %7.2f ms  %6.1f ns/evaluation\n", VM_THREADED_DISPATCH ? "threaded vm" : "switch vm",
+           vm_seconds * 1e3, vm_seconds * 1e9 / evaluations);
+    printf("  x86-64 jit, %4d B    %7.2f ms  %6.1f ns/evaluation\n", BufferLength(program.code), jit_seconds * 1e3,
+           jit_seconds * 1e9 / evaluations);
+
+    JitFree(&jit);
+    FreeX86Program(&program);
+    free(stack);
+    free(values);
+    FreeBytecode(&bytecode);
+    FreeExpressionPool(&pool);
+    FreeTokenStream(&tokens);
+}
+
+/* `prefix` depth times, then `leaf`, then `suffix` depth times */
+static char *GenerateDeepExpression(char const *prefix, char const *leaf, char const *suffix, int depth)
+{
+    size_t prefix_length = strlen(prefix);
+    size_t leaf_length = strlen(leaf);
+    size_t suffix_length = strlen(suffix);
+    char *source = malloc(depth * (prefix_length + suffix_length) + leaf_length + 1);
+    Assert(source);
+
+    char *cursor = source;
+    int i = 0;
+    while(i < depth)
+    {
+        memcpy(cursor, prefix, prefix_length);
+        cursor += prefix_length;
+        i++;
+    }
+
+    memcpy(cursor, leaf, leaf_length);
+    cursor += leaf_length;
+
+    i = 0;
+    while(i < depth)
+    {
+        memcpy(cursor, suffix, suffix_length);
+        cursor += suffix_length;
+        i++;
+    }
+    *cursor = 0;
+
+    return source;
+}
+
+/* Expressions a million levels deep, in every shape that nests: the parser's frame
+ * stack and the walker's path grow on the heap, the C stack does not grow at all */
+void BenchmarkDeepExpressions(void)
+{
+    struct
+    {
+        char const *name;
+        char const *prefix;
+        char const *leaf;
+        char const *suffix;
+    } shapes[] = {
+        { "parentheses", "(", "1", ")" },
+        { "prefix", "-", "1", "" },
+        { "assignment", "a=", "1", "" },
+        { "ternary", "a?", "1", ":1" },
+        { "addition", "1+", "1", "" }
+    };
+    int depth = 1000 * 1000;
+
+    printf("deep expressions: depth %d, limit %d\n", depth, max_expression_depth);
+
+    int i = 0;
+    while(i < (int)(sizeof shapes / sizeof shapes[0]))
+    {
+        char *source = GenerateDeepExpression(shapes[i].prefix, shapes[i].leaf, shapes[i].suffix, depth);
+        TokenStream tokens = LexerRunCompact(source);
+        ExpressionPool pool = CreateExpressionPool();
+
+        BenchmarkTimer timer = BenchmarkTimerStart();
+        Parser parser = CreateParser(&tokens, &pool);
+        ExpressionId root = ParseExpression(&parser);
+        double parse_seconds = BenchmarkTimerSeconds(&timer);
+        Assert(root && PeekToken(&parser) == TOKEN_EOF);
+
+        timer = BenchmarkTimerStart();
+        ExpressionWalker walker = CreateExpressionWalker(&pool, root);
+        ExpressionWalkEvent event;
+        ExpressionId id;
+        int nodes = 0;
+        while(ExpressionWalkerNext(&walker, &event, &id))
+        {
+            nodes += event == EXPRESSION_WALK_ENTER;
+        }
+        double walk_seconds = BenchmarkTimerSeconds(&timer);
+
+        printf("  %-12s %8d nodes  parse %7.2f ms, %5.1f MB frames  walk %7.2f ms, %5.1f MB path\n",
+               shapes[i].name, nodes, parse_seconds * 1e3, parser.max_depth * sizeof(ParserFrame) / 1e6,
+               walk_seconds * 1e3, walker.max_depth * sizeof(ExpressionWalkFrame) / 1e6);
+
+        FreeExpressionWalker(&walker);
+        FreeExpressionPool(&pool);
+        FreeTokenStream(&tokens);
+        free(source);
+        i++;
+    }
+}
+
+/* A rule as generators tend to write them: repeated subexpressions, multiplications
+ * by powers of two, identities and a test that is always false. Runs it as IR before
+ * and after optimizing, then in the VM compiled from the tree and lowered from the
+ * optimized IR. */
+void BenchmarkIrPasses(void)
+{
+    char const *rule = "(a * 8 + b * 4) % 7 + (b * 4 + a * 8) / 3 + c * 1 + (16 * 2 > 30 ? a * 8 : b) - "
+                       "((a * 8 + b * 4) % 7 == 2 && 0) + (c << 2) * (1 + 0) + (a * 8 + b * 4 > c * 16 ? c * 16 : a)";
+    int evaluations = 5 * 1000 * 1000;
+
+    TokenStream tokens = LexerRunCompact(rule);
+    ExpressionPool pool = CreateExpressionPool();
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId root = ParseExpression(&parser);
+
+    int inputs[1024][3];
+    int i = 0;
+    while(i < 1024)
+    {
+        inputs[i][0] = (int)(BenchmarkRandom() % 2000) - 1000;
+        inputs[i][1] = (int)(BenchmarkRandom() % 2000) - 1000;
+        inputs[i][2] = (int)(BenchmarkRandom() % 2000) + 1;
+        i++;
+    }
+
+    IrFunction functions[2];
+    IrPassStatistics statistics[IR_PASS_COUNT];
+    int rounds = 0;
+    long long sums[2];
+    double seconds[2];
+    int version = 0;
+    while(version < 2)
+    {
+        IrFunction *function = &functions[version];
+        *function = CreateIrFunction();
+        Symbol symbols[3] = { InternString(&global_interner, "a", 1), InternString(&global_interner, "b", 1),
+                              InternString(&global_interner, "c", 1) };
+        i = 0;
+        while(i < 3)
+        {
+            VariableSlot(&function->variables, symbols[i]);
+            i++;
+        }
+        Assert(LowerIr(function, &pool, root));
+        if(version == 1)
+        {
+            rounds = OptimizeIr(function, statistics);
+        }
+
+        int *values = malloc(BufferLength(function->instructions) * sizeof *values);
+        Assert(values);
+
+        BenchmarkTimer timer = BenchmarkTimerStart();
+        sums[version] = 0;
+        i = 0;
+        while(i < evaluations)
+        {
+            int variables[3];
+            memcpy(variables, inputs[i & 1023], sizeof variables);
+            int result;
+            VmStatus status = IrRun(function, variables, values, &result);
+            Assert(status == VM_OK);
+            sums[version] += result;
+            i++;
+        }
+        seconds[version] = BenchmarkTimerSeconds(&timer);
+
+        free(values);
+        version++;
+    }
+
+    /* The VM running the tree's bytecode and the optimized function's */
+    Bytecode bytecodes[2];
+    long long bytecode_sums[2];
+    double bytecode_seconds[2];
+    version = 0;
+    while(version < 2)
+    {
+        Bytecode *bytecode = &bytecodes[version];
+        *bytecode = CreateBytecode();
+        if(version == 0)
+        {
+            i = 0;
+            while(i < 3)
+            {
+                VariableSlot(&bytecode->variables, functions[1].variables[i]);
+                i++;
+            }
+            Assert(CompileBytecode(bytecode, &pool, root));
+        } else
+        {
+            Assert(LowerIrToBytecode(bytecode, &functions[1]));
+        }
+
+        int *stack = malloc(bytecode->max_stack * sizeof *stack);
+        Assert(stack);
+
+        BenchmarkTimer timer = BenchmarkTimerStart();
+        bytecode_sums[version] = 0;
+        i = 0;
+        while(i < evaluations)
+        {
+            int variables[3];
+            memcpy(variables, inputs[i & 1023], sizeof variables);
+            int result;
+            VmStatus status = VmRun(bytecode, variables, stack, &result);
+            Assert(status == VM_OK);
+            bytecode_sums[version] += result;
+            i++;
+        }
+        bytecode_seconds[version] = BenchmarkTimerSeconds(&timer);
+
+        free(stack);
+        version++;
+    }
+
+    Assert(sums[0] == sums[1] && bytecode_sums[0] == sums[0] && bytecode_sums[1] == sums[0]);
+    printf("ir passes: %d evaluations of a %d node rule, optimized in %d rounds\n", evaluations,
+           BufferLength(pool.nodes) - 1, rounds);
+    PrintIrPassStatistics(stdout, statistics);
+    printf("  lowered     %4d instructions %7.2f ms  %6.1f ns/evaluation\n", IrInstructionCount(&functions[0]),
+           seconds[0] * 1e3, seconds[0] * 1e9 / evaluations);
+    printf("  optimized   %4d instructions %7.2f ms  %6.1f ns/evaluation\n", IrInstructionCount(&functions[1]),
+           seconds[1] * 1e3, seconds[1] * 1e9 / evaluations);
+    printf("  vm, tree    %4d instructions %7.2f ms  %6.1f ns/evaluation\n", BufferLength(bytecodes[0].code),
+           bytecode_seconds[0] * 1e3, bytecode_seconds[0] * 1e9 / evaluations);
+    printf("  vm, ir      %4d instructions %7.2f ms  %6.1f ns/evaluation, %d temporaries\n", BufferLength(bytecodes[1].code),
+           bytecode_seconds[1] * 1e3, bytecode_seconds[1] * 1e9 / evaluations, bytecodes[1].temporaries);
+
+    FreeBytecode(&bytecodes[0]);
+    FreeBytecode(&bytecodes[1]);
+    FreeIrFunction(&functions[0]);
+    FreeIrFunction(&functions[1]);
+    FreeExpressionPool(&pool);
+    FreeTokenStream(&tokens);
+}
+
+/* Generated sources repeat a handful of subexpressions over and over. Parses them
+ * into a plain pool and a sharing one and compares every statement with the first. */
+void BenchmarkExpressionSharing(void)
+{
+    char const *templates[] = {
+        "x = (a * 3 + b) %% 7 + (a * 3 + b) / 2 + (c ? a * 3 + b : %d);\n",
+        "y = (a * 3 + b) %% 7 + (a * 3 + b) / 2 + (c ? a * 3 + b : %d);\n",
+        "z = ((a << 2) | (b & 255)) - ((a << 2) | (b & 255)) * %d;\n"
+    };
+    int statement_count = 200 * 1000;
+
+    StringBuilder builder = CreateStringBuilder();
+    int i = 0;
+    while(i < statement_count)
+    {
+        PushToStringBuilder(&builder, templates[BenchmarkRandom() % 3], (int)(BenchmarkRandom() % 16));
+        i++;
+    }
+    char *source = FinalizeStringBuilder(&builder);
+    TokenStream tokens = LexerRunCompact(source);
+
+    printf("expression sharing: %d statements\n", statement_count);
+
+    int shared = 0;
+    while(shared < 2)
+    {
+        ExpressionPool pool = CreateExpressionPool();
+        if(shared)
+        {
+            ShareExpressions(&pool);
+        }
+
+        BenchmarkTimer timer = BenchmarkTimerStart();
+        Parser parser = CreateParser(&tokens, &pool);
+        ExpressionId *statements = ParseTranslationUnit(&parser);
+        double parse_seconds = BenchmarkTimerSeconds(&timer);
+        Assert(BufferLength(statements) == statement_count);
+
+        timer = BenchmarkTimerStart();
+        int equal = 0;
+        i = 0;
+        while(i < statement_count)
+        {
+            equal += ExpressionsEqual(&pool, statements[0], statements[i]);
+            i++;
+        }
+        double compare_seconds = BenchmarkTimerSeconds(&timer);
+
+        printf("  %-7s %8d nodes %7.1f MB  parse %7.2f ms  compare %7.2f ms (%d equal)", shared ? "shared" : "plain",
+               BufferLength(pool.nodes) - 1, ExpressionPoolBytes(&pool) / 1e6, parse_seconds * 1e3,
+               compare_seconds * 1e3, equal);
+        if(shared)
+        {
+            printf("  %.0fx sharing", (double)pool.constructions / (pool.constructions - pool.shared_hits));
+        }
+        printf("\n");
+
+        BufferFree(statements);
+        FreeExpressionPool(&pool);
+        shared++;
+    }
+
+    FreeTokenStream(&tokens);
+    free(source);
+}
+
+/* Keystrokes in a large file: lexing the whole text again against re-lexing around
+ * the edit and splicing. Typing in one place only costs the edit; jumping to a random
+ * place first also moves the stream's gap there. */
+void BenchmarkIncrementalLexing(void)
+{
+    static char const *keystrokes[] = { " ", "+", ";", "(", "\n" };
+    int corpus_size = 16 * 1024 * 1024;
+
+    /* Splitting a name like x2d leaves a bad number behind; nobody needs to see that */
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    CompileContext context = *CurrentContext();
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    char *source = GenerateCSourceCorpus(corpus_size);
+    size_t length = strlen(source);
+    int edit_count = 200;
+
+    BenchmarkTimer timer = BenchmarkTimerStart();
+    TokenStream tokens = LexerRunCompact(source);
+    double full_seconds = BenchmarkTimerSeconds(&timer);
+
+    printf("incremental lexing: %.1f MB, %d tokens, %d single character edits\n", length / 1e6,
+           TokenStreamLength(&tokens), edit_count);
+
+    /* Every other round types at the place the round before jumped to. The text is
+     * one array the lexer reads, so editing it moves everything after the edit; that
+     * is timed on its own. */
+    double seconds[2] = { 0, 0 };
+    double text_seconds = 0;
+    long long relexed_tokens = 0;
+    uint32_t offset = 0;
+    int i = 0;
+    while(i < 2 * edit_count)
+    {
+        bool jump = i % 2 == 0;
+        if(jump)
+        {
+            offset = BenchmarkRandom() % length;
+        }
+
+        SourceEdit edit;
+        edit.offset = offset;
+        edit.removed_length = 0;
+        edit.inserted = keystrokes[BenchmarkRandom() % 5];
+        edit.inserted_length = 1;
+
+        timer = BenchmarkTimerStart();
+        source = ApplySourceEdit(source, length, &edit);
+        text_seconds += BenchmarkTimerSeconds(&timer);
+
+        timer = BenchmarkTimerStart();
+        TokenSplice splice = RelexTokenStream(&tokens, source, &edit);
+        seconds[jump ? 0 : 1] += BenchmarkTimerSeconds(&timer);
+        relexed_tokens += splice.inserted;
+
+        length = length - edit.removed_length + edit.inserted_length;
+        offset++;
+        i++;
+    }
+
+    /* The last edit's result must still match a full run */
+    TokenStream expected = LexerRunCompact(source);
+    TokenStreamCloseGap(&tokens);
+    Assert(TokenStreamLength(&expected) == TokenStreamLength(&tokens));
+    Assert(memcmp(expected.offsets, tokens.offsets, TokenStreamLength(&tokens) * sizeof *tokens.offsets) == 0);
+
+    printf("  full lex     %9.3f ms per edit\n", full_seconds * 1e3);
+    printf("  incremental  %9.3f ms per edit at a random place, %9.3f ms typing on there, "
+           "%.1f tokens lexed again on average\n",
+           seconds[0] * 1e3 / edit_count, seconds[1] * 1e3 / edit_count, (double)relexed_tokens / (2 * edit_count));
+    printf("  text edit    %9.3f ms per edit\n", text_seconds * 1e3 / (2 * edit_count));
+
+    FreeTokenStream(&expected);
+    FreeTokenStream(&tokens);
+    free(source);
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    free(diagnostics);
+}
+
+/* Front end benchmark suite
+ *
+ * `--bench-suite` generates one corpus of each shape, lexes it and parses it a few
+ * times to warm up, then times the given number of repetitions and reports
+ * percentiles of the run time. Throughput is taken at the median. `make bench`
+ * runs it on an optimized build. With --bench-json=PATH the results are also
+ * written as JSON, one object per shape and phase, so runs can be compared over
+ * time. Corpora come from BenchmarkRandom's fixed seed, so a given size and shape
+ * is the same input on every run. */
+
+typedef enum
+{
+    CORPUS_IDENTIFIERS,
+    CORPUS_NUMBERS,
+    CORPUS_OPERATORS,
+    CORPUS_STRINGS,
+    CORPUS_NESTED,
+
+    CORPUS_SHAPE_COUNT
+} CorpusShape;
+
+static char const *corpus_shape_string_table[] = {
+    [CORPUS_IDENTIFIERS] = "identifiers",
+    [CORPUS_NUMBERS] = "numbers",
+    [CORPUS_OPERATORS] = "operators",
+    [CORPUS_STRINGS] = "strings",
+    [CORPUS_NESTED] = "nested"
+};
+
+typedef struct
+{
+    int corpus_size; // Bytes per shape
+    int warmup; // Runs before timing starts
+    int repetitions;
+    int nesting_depth; // Deepest parentheses in the nested corpus
+    bool shapes[CORPUS_SHAPE_COUNT]; // Every shape when none is set
+    char const *json_path; // NULL for no JSON, "-" for stdout
+} BenchmarkSuiteOptions;
+
+BenchmarkSuiteOptions DefaultBenchmarkSuiteOptions(void)
+{
+    BenchmarkSuiteOptions options;
+    memset(&options, 0, sizeof options);
+    options.corpus_size = 16 * 1024 * 1024;
+    options.warmup = 2;
+    options.repetitions = 10;
+    options.nesting_depth = 64;
+
+    return options;
+}
+
+/* Returns false for a name that is not a shape */
+bool SelectCorpusShape(BenchmarkSuiteOptions *options, char const *name)
+{
+    int shape = 0;
+    while(shape < CORPUS_SHAPE_COUNT)
+    {
+        if(strcmp(name, corpus_shape_string_table[shape]) == 0)
+        {
+            options->shapes[shape] = true;
+            return true;
+        }
+        shape++;
+    }
+
+    return false;
+}
+
+static char const benchmark_binary_operators[][3] = { "+", "-", "*", "/", "%", "<<", ">>", "<", ">", "<=", ">=",
+                                                      "==", "!=", "&", "^", "|", "&&", "||" };
+#define BENCHMARK_BINARY_OPERATOR_COUNT (int)(sizeof benchmark_binary_operators / sizeof *benchmark_binary_operators)
+
+static char const *BenchmarkBinaryOperator(void)
+{
+    return benchmark_binary_operators[BenchmarkRandom() % BENCHMARK_BINARY_OPERATOR_COUNT];
+}
+
+/* Names of 2 to 24 characters ending in a digit, so none of them is a keyword */
+static void PushBenchmarkName(StringBuilder *builder, uint32_t seed)
+{
+    static char const characters[] = "abcdefghijklmnopqrstuvwxyz_";
+
+    char name[25];
+    int length = 1 + seed % 23;
+    int i = 0;
+    while(i < length)
+    {
+        seed = seed * 1103515245u + 12345u;
+        name[i] = characters[(seed >> 16) % (sizeof characters - 1)];
+        i++;
+    }
+    name[length] = '0' + seed % 10;
+
+    PushCharactersToStringBuilder(builder, name, length + 1);
+}
+
+static void PushBenchmarkNumber(StringBuilder *builder)
+{
+    switch(BenchmarkRandom() % 4)
+    {
+        case 0: PushToStringBuilder(builder, "%u", BenchmarkRandom() % 10); break;
+        case 1: PushToStringBuilder(builder, "%u", BenchmarkRandom() % 100000); break;
+        case 2: PushToStringBuilder(builder, "0x%x", BenchmarkRandom()); break;
+        default: PushToStringBuilder(builder, "0%o", BenchmarkRandom() % 4096); break;
+    }
+}
+
+/* One statement of the given shape. Every shape but strings parses without errors. */
+static void PushBenchmarkStatement(StringBuilder *builder, CorpusShape shape, int nesting_depth)
+{
+    static char const *strings[] = { "\"\"", "\"short\"", "\"%s:%d:%d: %s\"",
+                                     "\"a somewhat longer diagnostic message with \\\"quotes\\\"\"",
+                                     "\"could not open file: %s because the path does not exist\"" };
+    static char const unary_operators[][2] = { "-", "!", "~" };
+
+    int operands = 2 + BenchmarkRandom() % 6;
+    int i = 0;
+    switch(shape)
+    {
+        case CORPUS_IDENTIFIERS:
+            /* A vocabulary of 4096 names, like a large translation unit */
+            PushBenchmarkName(builder, BenchmarkRandom() % 4096);
+            PushToStringBuilder(builder, " = ");
+            while(i < operands)
+            {
+                if(i > 0)
+                {
+                    PushToStringBuilder(builder, " %s ", BenchmarkBinaryOperator());
+                }
+                PushBenchmarkName(builder, BenchmarkRandom() % 4096);
+                i++;
+            }
+            break;
+        case CORPUS_NUMBERS:
+            while(i < operands)
+            {
+                if(i > 0)
+                {
+                    PushToStringBuilder(builder, " %s ", BenchmarkBinaryOperator());
+                }
+                PushBenchmarkNumber(builder);
+                i++;
+            }
+            break;
+        case CORPUS_OPERATORS:
+            /* One letter operands, so nearly every byte is an operator */
+            operands *= 2;
+            while(i < operands)
+            {
+                if(i > 0)
+                {
+                    PushToStringBuilder(builder, "%s", BenchmarkBinaryOperator());
+                }
+                if(BenchmarkRandom() % 3 == 0)
+                {
+                    PushToStringBuilder(builder, "%s", unary_operators[BenchmarkRandom() % 3]);
+                }
+                PushToStringBuilder(builder, "%c", 'a' + BenchmarkRandom() % 26);
+                i++;
+            }
+            break;
+        case CORPUS_STRINGS:
+            while(i < operands)
+            {
+                PushToStringBuilder(builder, "%s%s", i > 0 ? " " : "", strings[BenchmarkRandom() % 5]);
+                i++;
+            }
+            break;
+        default:
+        {
+            /* (a + (b * (c - ... z))) */
+            int depth = 1 + BenchmarkRandom() % nesting_depth;
+            while(i < depth)
+            {
+                PushToStringBuilder(builder, "(%c %s ", 'a' + BenchmarkRandom() % 26, BenchmarkBinaryOperator());
+                i++;
+            }
+            PushBenchmarkNumber(builder);
+            while(i > 0)
+            {
+                PushToStringBuilder(builder, ")");
+                i--;
+            }
+            break;
+        }
+    }
+
+    PushToStringBuilder(builder, ";\n");
+}
+
+/* Whole statements of one shape until the corpus is about `size` bytes */
+char *GenerateShapedCorpus(CorpusShape shape, int size, int nesting_depth)
+{
+    StringBuilder builder = CreateStringBuilder();
+    while(StringBuilderLength(&builder) < size)
+    {
+        PushBenchmarkStatement(&builder, shape, nesting_depth);
+    }
+
+    return FinalizeStringBuilder(&builder);
+}
+
+/* Run times of the timed repetitions, in seconds */
+typedef struct
+{
+    double minimum;
+    double median;
+    double p90;
+    double p99;
+    double maximum;
+} BenchmarkPercentiles;
+
+static int CompareSeconds(void const *a, void const *b)
+{
+    double left = *(double const *)a;
+    double right = *(double const *)b;
+
+    return (left > right) - (left < right);
+}
+
+/* Nearest rank: the smallest sample with at least `percent` of the samples at or below it */
+static double BenchmarkPercentile(double const *sorted, int count, int percent)
+{
+    int rank = (percent * count + 99) / 100;
+
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+BenchmarkPercentiles ComputeBenchmarkPercentiles(double *seconds, int count)
+{
+    qsort(seconds, count, sizeof *seconds, CompareSeconds);
+
+    BenchmarkPercentiles percentiles;
+    percentiles.minimum = seconds[0];
+    percentiles.median = BenchmarkPercentile(seconds, count, 50);
+    percentiles.p90 = BenchmarkPercentile(seconds, count, 90);
+    percentiles.p99 = BenchmarkPercentile(seconds, count, 99);
+    percentiles.maximum = seconds[count - 1];
+
+    return percentiles;
+}
+
+typedef enum
+{
+    BENCHMARK_PHASE_LEX,
+    BENCHMARK_PHASE_PARSE
+} BenchmarkPhase;
+
+/* Times one phase over the corpus. Parsing works on tokens lexed beforehand, so it
+ * is timed on its own. */
+static BenchmarkPercentiles TimeBenchmarkPhase(BenchmarkSuiteOptions *options, BenchmarkPhase phase, char const *corpus,
+                                               int *token_count)
+{
+    double *seconds = malloc(options->repetitions * sizeof *seconds);
+    Assert(seconds);
+
+    TokenStream tokens;
+    if(phase == BENCHMARK_PHASE_PARSE)
+    {
+        tokens = LexerRunCompact(corpus);
+        *token_count = TokenStreamLength(&tokens);
+    }
+
+    int run = 0;
+    while(run < options->warmup + options->repetitions)
+    {
+        double run_seconds;
+        if(phase == BENCHMARK_PHASE_LEX)
+        {
+            BenchmarkTimer timer = BenchmarkTimerStart();
+            TokenStream lexed = LexerRunCompact(corpus);
+            run_seconds = BenchmarkTimerSeconds(&timer);
+            *token_count = TokenStreamLength(&lexed);
+            FreeTokenStream(&lexed);
+        } else
+        {
+            int errors_before = CurrentContext()->errors_reported;
+            ExpressionPool pool = CreateExpressionPool();
+            BenchmarkTimer timer = BenchmarkTimerStart();
+            Parser parser = CreateParser(&tokens, &pool);
+            ExpressionId *statements = ParseTranslationUnit(&parser);
+            run_seconds = BenchmarkTimerSeconds(&timer);
+            Assert(CurrentContext()->errors_reported == errors_before);
+
+            if(statements)
+            {
+                BufferFree(statements);
+            }
+            FreeExpressionPool(&pool);
+        }
+
+        if(run >= options->warmup)
+        {
+            seconds[run - options->warmup] = run_seconds;
+        }
+        run++;
+    }
+
+    if(phase == BENCHMARK_PHASE_PARSE)
+    {
+        FreeTokenStream(&tokens);
+    }
+
+    BenchmarkPercentiles percentiles = ComputeBenchmarkPercentiles(seconds, options->repetitions);
+    free(seconds);
+
+    return percentiles;
+}
+
+void RunBenchmarkSuite(BenchmarkSuiteOptions *options)
+{
+    bool all_shapes = true;
+    int shape = 0;
+    while(shape < CORPUS_SHAPE_COUNT)
+    {
+        all_shapes = all_shapes && !options->shapes[shape];
+        shape++;
+    }
+
+    if(options->repetitions < 1)
+    {
+        options->repetitions = 1;
+    }
+
+    if(options->nesting_depth < 1)
+    {
+        options->nesting_depth = 1;
+    }
+
+    if(options->warmup < 0)
+    {
+        options->warmup = 0;
+    }
+
+    if(options->corpus_size < 1)
+    {
+        options->corpus_size = 1;
+    }
+
+    FILE *json = NULL;
+    if(options->json_path)
+    {
+        json = strcmp(options->json_path, "-") == 0 ? stdout : fopen(options->json_path, "w");
+        if(!json)
+        {
+            ReportError("%s: could not write benchmark results: %s\n", options->json_path, strerror(errno));
+            return;
+        }
+        fprintf(json, "{\n  \"corpus_size\": %d,\n  \"warmup\": %d,\n  \"repetitions\": %d,\n  \"results\": [",
+                options->corpus_size, options->warmup, options->repetitions);
+    }
+
+    /* The JSON may be going to stdout too */
+    FILE *output = json == stdout ? stderr : stdout;
+    fprintf(output, "front end suite: %.1f MB per shape, %d warmup runs, %d repetitions\n",
+            options->corpus_size / 1e6, options->warmup, options->repetitions);
+    fprintf(output, "  %-12s %-5s %9s %9s %8s %9s %9s %9s\n", "shape", "phase", "MB/s", "Mtok/s", "ns/tok",
+            "p50 ms", "p90 ms", "p99 ms");
+
+    bool first_result = true;
+    shape = 0;
+    while(shape < CORPUS_SHAPE_COUNT)
+    {
+        if(!all_shapes && !options->shapes[shape])
+        {
+            shape++;
+            continue;
+        }
+
+        benchmark_random_state = 0x9e3779b97f4a7c15ull;
+        char *corpus = GenerateShapedCorpus(shape, options->corpus_size, options->nesting_depth);
+        size_t corpus_length = strlen(corpus);
+
+        /* String literals are not expressions, so that corpus is only lexed */
+        BenchmarkPhase last_phase = shape == CORPUS_STRINGS ? BENCHMARK_PHASE_LEX : BENCHMARK_PHASE_PARSE;
+        BenchmarkPhase phase = BENCHMARK_PHASE_LEX;
+        while(phase <= last_phase)
+        {
+            int token_count = 0;
+            BenchmarkPercentiles percentiles = TimeBenchmarkPhase(options, phase, corpus, &token_count);
+            char const *phase_name = phase == BENCHMARK_PHASE_LEX ? "lex" : "parse";
+            double megabytes_per_second = corpus_length / percentiles.median / 1e6;
+            double tokens_per_second = token_count / percentiles.median;
+            double nanoseconds_per_token = percentiles.median * 1e9 / token_count;
+
+            fprintf(output, "  %-12s %-5s %9.1f %9.1f %8.2f %9.3f %9.3f %9.3f\n", corpus_shape_string_table[shape],
+                    phase_name, megabytes_per_second, tokens_per_second / 1e6, nanoseconds_per_token,
+                    percentiles.median * 1e3, percentiles.p90 * 1e3, percentiles.p99 * 1e3);
+
+            if(json)
+            {
+                fprintf(json, "%s\n    { \"shape\": \"%s\", \"phase\": \"%s\", \"bytes\": %zu, \"tokens\": %d, "
+                        "\"mb_per_second\": %.3f, \"tokens_per_second\": %.0f, \"ns_per_token\": %.4f, "
+                        "\"seconds\": { \"min\": %.9f, \"p50\": %.9f, \"p90\": %.9f, \"p99\": %.9f, \"max\": %.9f } }",
+                        first_result ? "" : ",", corpus_shape_string_table[shape], phase_name, corpus_length,
+                        token_count, megabytes_per_second, tokens_per_second, nanoseconds_per_token,
+                        percentiles.minimum, percentiles.median, percentiles.p90, percentiles.p99, percentiles.maximum);
+                first_result = false;
+            }
+
+            phase++;
+        }
+
+        free(corpus);
+        shape++;
+    }
+
+    if(json)
+    {
+        fprintf(json, "\n  ]\n}\n");
+        if(json != stdout)
+        {
+            fclose(json);
+        }
+    }
+}
+
+/* Replays a typing session against a 50,000 line file: statements typed one character
+ * at a time at random lines, with a few characters taken back and typed again. Every
+ * keystroke is lexed and parsed again around the edit, and its latency is reported
+ * as percentiles, next to what parsing the whole file again costs. */
+void BenchmarkIncrementalParsing(void)
+{
+    static char const *typed = "total = total + item * (count - 1);\n";
+    int line_count = 50000;
+    int session_count = 40;
+    int backspaces = 6;
+
+    /* Half typed statements are errors until their semicolon; every one is counted */
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    CompileContext context = *CurrentContext();
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+    int saved_max_errors = max_allowed_errors;
+    max_allowed_errors = INT_MAX;
+
+    StringBuilder builder = CreateStringBuilder();
+    int i = 0;
+    while(i < line_count)
+    {
+        PushToStringBuilder(&builder, "value_%d = value_%d * %d + (value_%d - %d);\n", i, i / 2, i % 97, i / 3,
+                            i % 13);
+        i++;
+    }
+    char *source = FinalizeStringBuilder(&builder);
+    size_t length = strlen(source);
+
+    /* The trace: each session's keystrokes, recorded up front so every run replays the same edits */
+    SourceEdit *trace = NULL; // Buffer
+    uint32_t *session_starts = NULL; // Buffer, line starts in the original text
+    int typed_length = (int)strlen(typed);
+    int session = 0;
+    while(session < session_count)
+    {
+        uint32_t start = (uint32_t)(BenchmarkRandom() % length);
+        while(start > 0 && source[start - 1] != '\n')
+        {
+            start--;
+        }
+
+        /* Earlier sessions added whole lines at or before it */
+        uint32_t offset = start;
+        int earlier = 0;
+        while(earlier < session)
+        {
+            if(session_starts[earlier] <= start)
+            {
+                offset += (uint32_t)typed_length;
+            }
+            earlier++;
+        }
+        BufferPush(session_starts, start);
+
+        int typed_so_far = 0;
+        int character = 0;
+        bool took_back = false;
+        while(character < typed_length)
+        {
+            SourceEdit edit = { offset + (uint32_t)typed_so_far, 0, typed + character, 1 };
+            BufferPush(trace, edit);
+            typed_so_far++;
+            character++;
+
+            if(character == typed_length / 2 && !took_back)
+            {
+                int taken_back = 0;
+                while(taken_back < backspaces)
+                {
+                    typed_so_far--;
+                    SourceEdit backspace = { offset + (uint32_t)typed_so_far, 1, "", 0 };
+                    BufferPush(trace, backspace);
+                    taken_back++;
+                }
+                character -= backspaces;
+                took_back = true;
+            }
+        }
+
+        session++;
+    }
+    BufferFree(session_starts);
+    int edit_count = BufferLength(trace);
+
+    TokenStream tokens = LexerRunCompact(source);
+    BenchmarkTimer timer = BenchmarkTimerStart();
+    IncrementalParse full = CreateIncrementalParse(&tokens);
+    double full_seconds = BenchmarkTimerSeconds(&timer);
+    FreeIncrementalParse(&full);
+
+    printf("incremental parsing: %d lines, %d tokens, %d keystrokes\n", line_count, TokenStreamLength(&tokens),
+           edit_count);
+
+    IncrementalParse parse = CreateIncrementalParse(&tokens);
+    double *seconds = malloc(edit_count * sizeof *seconds);
+    Assert(seconds);
+    long long reparsed_statements = 0;
+    i = 0;
+    while(i < edit_count)
+    {
+        timer = BenchmarkTimerStart();
+        source = ApplySourceEdit(source, length, &trace[i]);
+        TokenSplice token_splice = RelexTokenStream(&tokens, source, &trace[i]);
+        StatementSplice splice = ReparseAfterEdit(&parse, &token_splice);
+        seconds[i] = BenchmarkTimerSeconds(&timer);
+        reparsed_statements += splice.inserted;
+
+        length = length - trace[i].removed_length + trace[i].inserted_length;
+        i++;
+    }
+
+    /* The statements must match parsing the final text from scratch */
+    TokenStream expected_tokens = LexerRunCompact(source);
+    IncrementalParse expected = CreateIncrementalParse(&expected_tokens);
+    int count = IncrementalParseStatementCount(&expected);
+    Assert(IncrementalParseStatementCount(&parse) == count);
+    Assert(count == line_count + session_count);
+    i = 0;
+    while(i < count)
+    {
+        Assert(parse.statements[i].first_token == expected.statements[i].first_token);
+        Assert(parse.statements[i].end_token == expected.statements[i].end_token);
+        i++;
+    }
+
+    BenchmarkPercentiles percentiles = ComputeBenchmarkPercentiles(seconds, edit_count);
+    printf("  full parse   %9.3f ms\n", full_seconds * 1e3);
+    printf("  per keystroke p50 %.3f ms, p99 %.3f ms, max %.3f ms, %.1f statements parsed again on average\n",
+           percentiles.median * 1e3, percentiles.p99 * 1e3, percentiles.maximum * 1e3,
+           (double)reparsed_statements / edit_count);
+
+    free(seconds);
+    FreeIncrementalParse(&expected);
+    FreeTokenStream(&expected_tokens);
+    FreeIncrementalParse(&parse);
+    FreeTokenStream(&tokens);
+    BufferFree(trace);
+    free(source);
+
+    max_allowed_errors = saved_max_errors;
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    free(diagnostics);
+}
+
+/* A warm cache against lexing and parsing: hashing the source and mapping its entry,
+ * with the tree copied out, next to what lexing and parsing it costs. Then loading a
+ * token file, which has no tree, against lexing alone. */
+void BenchmarkTokenCache(void)
+{
+    int corpus_size = 16 * 1024 * 1024;
+    char *source = GenerateShapedCorpus(CORPUS_OPERATORS, corpus_size, 16);
+    size_t length = strlen(source);
+
+    /* Every file of a batch has an interner of its own, which is the case that maps as is */
+    Interner interner;
+    memset(&interner, 0, sizeof interner);
+    CompileContext context = *CurrentContext();
+    context.interner = &interner;
+    CompileContext *previous = SetCurrentContext(&context);
+
+    char directory[] = "/tmp/token_cache_bench_XXXXXX";
+    Assert(mkdtemp(directory));
+
+    BenchmarkTimer timer = BenchmarkTimerStart();
+    TokenStream tokens = LexerRunCompact(source);
+    double lex_seconds = BenchmarkTimerSeconds(&timer);
+    timer = BenchmarkTimerStart();
+    ExpressionPool pool = CreateExpressionPool();
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId *statements = ParseTranslationUnit(&parser);
+    double parse_seconds = BenchmarkTimerSeconds(&timer);
+
+    timer = BenchmarkTimerStart();
+    TokenCacheKey key = TokenCacheKeyOf(source, length);
+    double hash_seconds = BenchmarkTimerSeconds(&timer);
+    timer = BenchmarkTimerStart();
+    TokenCacheStore(directory, &key, &tokens, &pool, statements);
+    double store_seconds = BenchmarkTimerSeconds(&timer);
+    int statement_count = BufferLength(statements);
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+    BufferFree(statements);
+    InternerFree(&interner);
+
+    char path[PATH_MAX];
+    TokenCachePath(path, sizeof path, directory, &key);
+    struct stat status;
+    Assert(stat(path, &status) == 0);
+
+    printf("token cache: %.1f MB source, %d statements, %.1f MB entry\n", length / 1e6, statement_count,
+           status.st_size / 1e6);
+
+    int repetitions = 5;
+    double load_seconds = 1e9;
+    int i = 0;
+    while(i < repetitions)
+    {
+        memset(&interner, 0, sizeof interner);
+        timer = BenchmarkTimerStart();
+        key = TokenCacheKeyOf(source, length);
+        TokenCacheResult result = TokenCacheLoad(directory, &key, source, &tokens, &pool, &statements);
+        double seconds = BenchmarkTimerSeconds(&timer);
+        load_seconds = seconds < load_seconds ? seconds : load_seconds;
+
+        Assert(result == TOKEN_CACHE_TREE);
+        Assert(BufferLength(statements) == statement_count);
+        FreeTokenStream(&tokens);
+        FreeExpressionPool(&pool);
+        BufferFree(statements);
+        InternerFree(&interner);
+        i++;
+    }
+
+    printf("  lex + parse  %9.3f ms\n", (lex_seconds + parse_seconds) * 1e3);
+    printf("  hash         %9.3f ms\n", hash_seconds * 1e3);
+    printf("  store        %9.3f ms\n", store_seconds * 1e3);
+    printf("  load         %9.3f ms, hash included, best of %d\n", load_seconds * 1e3, repetitions);
+
+    char tokens_path[PATH_MAX];
+    snprintf(tokens_path, sizeof tokens_path, "%s/corpus.tokens", directory);
+    memset(&interner, 0, sizeof interner);
+    tokens = LexerRunCompact(source);
+    Assert(EmitTokenFile(tokens_path, &tokens));
+    FreeTokenStream(&tokens);
+    InternerFree(&interner);
+
+    double token_file_seconds = 1e9;
+    i = 0;
+    while(i < repetitions)
+    {
+        memset(&interner, 0, sizeof interner);
+        timer = BenchmarkTimerStart();
+        Assert(LoadTokenFile(tokens_path, &tokens));
+        double seconds = BenchmarkTimerSeconds(&timer);
+        token_file_seconds = seconds < token_file_seconds ? seconds : token_file_seconds;
+        FreeTokenStream(&tokens);
+        InternerFree(&interner);
+        i++;
+    }
+
+    printf("  token file   %9.3f ms against %.3f ms lexing, best of %d\n", token_file_seconds * 1e3,
+           lex_seconds * 1e3, repetitions);
+
+    unlink(tokens_path);
+    unlink(path);
+    rmdir(directory);
+    SetCurrentContext(previous);
+    free(source);
+}
+
+void RunBenchmarks(void)
+{
+    BenchmarkKeywordClassification();
+    BenchmarkTokenMemory();
+    BenchmarkTokenStorage();
+    BenchmarkScanModes();
+    BenchmarkLexerTokenKinds();
+    BenchmarkParallelLexing();
+    BenchmarkIncrementalLexing();
+    BenchmarkIncrementalParsing();
+    BenchmarkTokenCache();
+    BenchmarkExpressionLayout();
+    BenchmarkExpressionSharing();
+    BenchmarkDeepExpressions();
+    BenchmarkPrettyPrint();
+    BenchmarkBytecodeVm();
+    BenchmarkIrPasses();
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <stdatomic.h>
 
 typedef struct
 {
@@ -25,8 +26,21 @@ BufferHeaderGet(buffer)->length++ \
 #define BufferLength(buffer) (buffer ? BufferHeaderGet(buffer)->length : 0)
 #define BufferCapacity(buffer) (buffer ? BufferHeaderGet(buffer)->capacity : 0)
 
+/* Counted for --stats. The counters are shared by every thread and only move while
+ * allocation_counting is set, so a normal run pays one branch per call. */
+static _Atomic bool allocation_counting = false;
+static atomic_size_t buffer_reallocations;
+static atomic_size_t buffer_reallocated_bytes;
+
 void BufferReallocate(void **buffer, int item_size, int new_capacity)
 {
+    if(atomic_load_explicit(&allocation_counting, memory_order_relaxed))
+    {
+        atomic_fetch_add_explicit(&buffer_reallocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&buffer_reallocated_bytes, sizeof(BufferHeader) + (size_t)item_size * new_capacity,
+                                  memory_order_relaxed);
+    }
+
     if(!*buffer)
     {
         BufferHeader *header = malloc(sizeof *header + (item_size * new_capacity));
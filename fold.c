@@ -0,0 +1,263 @@
+/* Constant folding
+ *
+ * FoldExpression walks a tree and overwrites every subtree whose value is known at
+ * compile time with a single number node, so (2 + 2) - 2 becomes 2 under the same
+ * id. Arithmetic is C's on 32-bit int: division truncates towards zero, >> of a
+ * negative number shifts in sign bits, comparisons and logical operators give 0 or 1.
+ *
+ * What C leaves undefined is an error instead: overflow, division by zero, shifting
+ * by a negative amount or by the width of int or more, and shifting a negative
+ * number left. The subtree is left as it was, which keeps its users from folding
+ * too, so one mistake is reported once.
+ *
+ * Operands C would not evaluate are not folded or checked, like the right side of
+ * 0 && 1 / 0 or the branch of ?: that is not taken. A ?:, &&, || or comma whose
+ * outcome is known collapses even when the other operands are not constant, since
+ * those operands would never run. */
+
+static bool ExpressionConstant(ExpressionPool *pool, ExpressionId id, int *value)
+{
+    ExpressionNode *node = GetExpression(pool, id);
+    if(node->kind != EXPRESSION_NUMBER)
+    {
+        return false;
+    }
+
+    *value = pool->numbers[node->first];
+
+    return true;
+}
+
+/* Rewrites a node in place, keeping node_counts in step. In a shared pool every
+ * user of the node sees the new value, which is the same value. */
+static void ReplaceExpression(ExpressionPool *pool, ExpressionId id, ExpressionNode replacement)
+{
+    ExpressionNode *node = GetExpression(pool, id);
+    pool->rewritten = true;
+    pool->node_counts[node->kind]--;
+    pool->node_counts[replacement.kind]++;
+    *node = replacement;
+}
+
+static void ReplaceWithNumber(ExpressionPool *pool, ExpressionId id, int number)
+{
+    ExpressionNode replacement;
+    replacement.kind = EXPRESSION_NUMBER;
+    replacement.operator = TOKEN_NUMBER;
+    replacement.unused = 0;
+    replacement.first = (uint32_t)BufferLength(pool->numbers);
+    replacement.second = 0;
+    BufferPush(pool->numbers, number);
+
+    ReplaceExpression(pool, id, replacement);
+}
+
+static void ReportFoldError(ExpressionPool *pool, ExpressionId id, char const *message)
+{
+    char *text = StringifyExpression(pool, id);
+    ReportError("%s in %s\n", message, text);
+    free(text);
+}
+
+/* Folds a binary operator over two constants. Returns false, after reporting, when
+ * C leaves the result undefined. */
+static bool FoldBinary(ExpressionPool *pool, ExpressionId id, TokenKind operator, int left, int right, int *result)
+{
+    int64_t wide = 0;
+
+    switch(operator)
+    {
+        case TOKEN_PLUS: wide = (int64_t)left + right; break;
+        case TOKEN_MINUS: wide = (int64_t)left - right; break;
+        case TOKEN_STAR: wide = (int64_t)left * right; break;
+        case TOKEN_SLASH:
+        case TOKEN_PERCENT:
+            if(right == 0)
+            {
+                ReportFoldError(pool, id, "division by zero");
+                return false;
+            }
+
+            /* INT_MIN / -1 is the one quotient that does not fit */
+            wide = operator == TOKEN_SLASH ? (int64_t)left / right : (int64_t)left % right;
+            if(left == INT_MIN && right == -1)
+            {
+                ReportFoldError(pool, id, "integer overflow");
+                return false;
+            }
+            break;
+        case TOKEN_BITWISE_LEFT_SHIFT:
+        case TOKEN_BITWISE_RIGHT_SHIFT:
+            if(right < 0 || right >= 32)
+            {
+                ReportFoldError(pool, id, "shift count out of range");
+                return false;
+            }
+
+            if(operator == TOKEN_BITWISE_RIGHT_SHIFT)
+            {
+                wide = left >> right;
+            } else if(left < 0)
+            {
+                ReportFoldError(pool, id, "left shift of a negative value");
+                return false;
+            } else
+            {
+                wide = (int64_t)left << right;
+            }
+            break;
+        case TOKEN_LESS_THAN: wide = left < right; break;
+        case TOKEN_GREATER_THAN: wide = left > right; break;
+        case TOKEN_LESS_EQUAL: wide = left <= right; break;
+        case TOKEN_GREATER_EQUAL: wide = left >= right; break;
+        case TOKEN_DOUBLE_EQUALS: wide = left == right; break;
+        case TOKEN_NOT_EQUAL: wide = left != right; break;
+        case TOKEN_BITWISE_AND: wide = left & right; break;
+        case TOKEN_BITWISE_XOR: wide = left ^ right; break;
+        case TOKEN_BITWISE_OR: wide = left | right; break;
+        case TOKEN_LOGICAL_AND: wide = left && right; break;
+        case TOKEN_LOGICAL_OR: wide = left || right; break;
+        case TOKEN_COMMA: wide = right; break;
+        default:
+            return false;
+    }
+
+    if(wide < INT_MIN || wide > INT_MAX)
+    {
+        ReportFoldError(pool, id, "integer overflow");
+        return false;
+    }
+
+    *result = (int)wide;
+
+    return true;
+}
+
+static void FoldNode(ExpressionPool *pool, ExpressionId id)
+{
+    ExpressionNode node = *GetExpression(pool, id);
+    int left;
+    int right;
+    int result;
+
+    switch(node.kind)
+    {
+        case EXPRESSION_UNARY:
+            if(!ExpressionConstant(pool, node.first, &left))
+            {
+                return;
+            }
+
+            switch(node.operator)
+            {
+                case TOKEN_PLUS:
+                    ReplaceWithNumber(pool, id, left);
+                    break;
+                case TOKEN_MINUS:
+                    if(left == INT_MIN)
+                    {
+                        ReportFoldError(pool, id, "integer overflow");
+                        return;
+                    }
+                    ReplaceWithNumber(pool, id, -left);
+                    break;
+                case TOKEN_EXCLAMATION_POINT:
+                    ReplaceWithNumber(pool, id, !left);
+                    break;
+                case TOKEN_BITWISE_NOT:
+                    ReplaceWithNumber(pool, id, ~left);
+                    break;
+                default:
+                    /* * and & need an object */
+                    break;
+            }
+            break;
+        case EXPRESSION_BINARY:
+            if(!ExpressionConstant(pool, node.first, &left))
+            {
+                return;
+            }
+
+            /* A known left side settles these whatever the right side is */
+            if((node.operator == TOKEN_LOGICAL_AND && !left) || (node.operator == TOKEN_LOGICAL_OR && left))
+            {
+                ReplaceWithNumber(pool, id, node.operator == TOKEN_LOGICAL_OR);
+                return;
+            }
+
+            if(node.operator == TOKEN_COMMA)
+            {
+                ReplaceExpression(pool, id, *GetExpression(pool, node.second));
+                return;
+            }
+
+            if(ExpressionConstant(pool, node.second, &right) && FoldBinary(pool, id, node.operator, left, right, &result))
+            {
+                ReplaceWithNumber(pool, id, result);
+            }
+            break;
+        case EXPRESSION_TERNARY:
+            if(ExpressionConstant(pool, node.first, &left))
+            {
+                ExpressionId taken = pool->branches[node.second + (left ? 0 : 1)];
+                ReplaceExpression(pool, id, *GetExpression(pool, taken));
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/* Folds every constant subtree of the tree at root. Returns true when the whole tree
+ * became a number. */
+bool FoldExpression(ExpressionPool *pool, ExpressionId root)
+{
+    ExpressionWalker walker = CreateExpressionWalker(pool, root);
+    ExpressionWalkEvent event;
+    ExpressionId id;
+
+    while(ExpressionWalkerNext(&walker, &event, &id))
+    {
+        if(event == EXPRESSION_WALK_LEAVE)
+        {
+            FoldNode(pool, id);
+            continue;
+        }
+
+        if(event != EXPRESSION_WALK_OPERAND || walker.operand == 0)
+        {
+            continue;
+        }
+
+        /* The first operand is folded by now; skip what it keeps from being evaluated */
+        ExpressionNode *node = GetExpression(pool, id);
+        int condition;
+        if(!ExpressionConstant(pool, node->first, &condition))
+        {
+            continue;
+        }
+
+        bool skip = false;
+        if(node->kind == EXPRESSION_TERNARY)
+        {
+            skip = walker.operand == (condition ? 2 : 1);
+        } else if(node->kind == EXPRESSION_BINARY && node->operator == TOKEN_LOGICAL_AND)
+        {
+            skip = !condition;
+        } else if(node->kind == EXPRESSION_BINARY && node->operator == TOKEN_LOGICAL_OR)
+        {
+            skip = condition;
+        }
+
+        if(skip)
+        {
+            ExpressionWalkerSkipOperand(&walker);
+        }
+    }
+
+    FreeExpressionWalker(&walker);
+
+    int value;
+
+    return ExpressionConstant(pool, root, &value);
+}
@@ -0,0 +1,153 @@
+/* String interning
+ *
+ * Every distinct identifier is stored once and named by a 32-bit Symbol, so tokens
+ * and later stages compare names with a single integer compare. Symbols are handed
+ * out sequentially starting at 1; 0 is never a valid symbol.
+ *
+ * The string bytes live in an Arena, whose blocks never move, so the pointer
+ * returned by InternerString stays valid until InternerFree. Lookups go through an
+ * open addressing table of symbols probed linearly. */
+
+typedef uint32_t Symbol;
+
+#define INTERNER_INITIAL_SLOTS 1024
+
+typedef struct
+{
+    char const *string;
+    int length;
+    uint32_t hash;
+} InternerEntry;
+
+typedef struct
+{
+    InternerEntry *entries; // Buffer, entries[symbol - 1]
+    Symbol *slots;
+    int slot_count; // Always a power of two
+    Arena strings;
+} Interner;
+
+uint32_t HashString(char const *string, int length)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    int i = 0;
+    while(i < length)
+    {
+        hash ^= (unsigned char)string[i];
+        hash *= 16777619u;
+        i++;
+    }
+
+    return hash;
+}
+
+static char *InternerCopyString(Interner *interner, char const *string, int length)
+{
+    char *result = ArenaAllocateBytes(&interner->strings, (size_t)length + 1);
+    memcpy(result, string, length);
+    result[length] = 0;
+
+    return result;
+}
+
+static void InternerGrowSlots(Interner *interner)
+{
+    int new_slot_count = interner->slot_count ? interner->slot_count * 2 : INTERNER_INITIAL_SLOTS;
+    Symbol *new_slots = calloc(new_slot_count, sizeof *new_slots);
+    Assert(new_slots);
+
+    uint32_t mask = (uint32_t)new_slot_count - 1;
+    int i = 0;
+    while(i < BufferLength(interner->entries))
+    {
+        uint32_t slot = interner->entries[i].hash & mask;
+        while(new_slots[slot])
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        new_slots[slot] = (Symbol)(i + 1);
+        i++;
+    }
+
+    free(interner->slots);
+    interner->slots = new_slots;
+    interner->slot_count = new_slot_count;
+}
+
+Symbol InternString(Interner *interner, char const *string, int length)
+{
+    /* Keep the load factor at or below one half */
+    if((BufferLength(interner->entries) + 1) * 2 > interner->slot_count)
+    {
+        InternerGrowSlots(interner);
+    }
+
+    uint32_t hash = HashString(string, length);
+    uint32_t mask = (uint32_t)interner->slot_count - 1;
+    uint32_t slot = hash & mask;
+
+    Symbol symbol;
+    while((symbol = interner->slots[slot]) != 0)
+    {
+        InternerEntry *entry = &interner->entries[symbol - 1];
+        if(entry->hash == hash && entry->length == length && memcmp(entry->string, string, length) == 0)
+        {
+            return symbol;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    InternerEntry new_entry;
+    new_entry.string = InternerCopyString(interner, string, length);
+    new_entry.length = length;
+    new_entry.hash = hash;
+    BufferPush(interner->entries, new_entry);
+
+    symbol = (Symbol)BufferLength(interner->entries);
+    interner->slots[slot] = symbol;
+
+    return symbol;
+}
+
+char const *InternerString(Interner *interner, Symbol symbol)
+{
+    Assert(symbol > 0 && (int)symbol <= BufferLength(interner->entries));
+    return interner->entries[symbol - 1].string;
+}
+
+int InternerLength(Interner *interner, Symbol symbol)
+{
+    Assert(symbol > 0 && (int)symbol <= BufferLength(interner->entries));
+    return interner->entries[symbol - 1].length;
+}
+
+/* Number of distinct strings, which is also the largest symbol handed out */
+int InternerCount(Interner *interner)
+{
+    return BufferLength(interner->entries);
+}
+
+/* Total heap bytes held by the interner: string blocks, slot table and entries */
+size_t InternerBytes(Interner *interner)
+{
+    return interner->strings.bytes_reserved + (size_t)interner->slot_count * sizeof *interner->slots +
+           BufferCapacity(interner->entries) * sizeof *interner->entries;
+}
+
+void InternerFree(Interner *interner)
+{
+    ArenaFree(&interner->strings);
+    if(interner->entries)
+    {
+        BufferFree(interner->entries);
+    }
+
+    free(interner->slots);
+    memset(interner, 0, sizeof *interner);
+}
+
+/* Used by the lexer for every identifier it produces */
+static Interner global_interner;
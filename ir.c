@@ -0,0 +1,1917 @@
+/* SSA intermediate representation
+ *
+ * LowerIr turns an expression tree into a function of instructions in static single
+ * assignment form: every instruction defines one value, named by its index, and no
+ * value changes after it is defined. Assignments give the variable a new value
+ * instead of writing memory, and where control flow joins a phi picks the value from
+ * whichever block came before. Everything is stored in flat arrays. Instructions are
+ * numbered in the order they run, each block is a contiguous range of them, and
+ * expressions have no loops, so every operand is defined before the instruction
+ * using it and every pass is a single walk over the array.
+ *
+ * Blocks come from &&, || and ?:. A block has at most two predecessors; the operands
+ * of a phi are the values coming from predecessors[0] and predecessors[1].
+ *
+ * Semantics are the VM's: arithmetic wraps, and division by zero, INT_MIN / -1 and
+ * out-of-range shifts stop the function with a VmStatus. Variables are read once at
+ * entry and their final values stored just before returning, so a function that
+ * stops early leaves them untouched.
+ *
+ * Passes never insert or move instructions. They rewrite them in place, turn removed
+ * ones into IR_NOP and forward their users to the value replacing them. OptimizeIr
+ * squeezes the NOPs out once the passes are done, and LowerIrToBytecode turns the
+ * result into bytecode for the VM. */
+
+typedef enum
+{
+    IR_NOP, // Removed by a pass
+
+    IR_CONSTANT, // first is the value
+    IR_LOAD, // Value of variable slot `first` on entry
+    IR_PHI, // first from predecessors[0], second from predecessors[1]
+
+    IR_NEGATE,
+    IR_NOT,
+    IR_BITWISE_NOT,
+    IR_BOOLEAN, // 0 or 1
+
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_MODULO,
+    IR_SHIFT_LEFT,
+    IR_SHIFT_RIGHT,
+    IR_LESS,
+    IR_GREATER,
+    IR_LESS_EQUAL,
+    IR_GREATER_EQUAL,
+    IR_EQUAL,
+    IR_NOT_EQUAL,
+    IR_BITWISE_AND,
+    IR_BITWISE_OR,
+    IR_BITWISE_XOR,
+
+    /* Shifts by a count in 0..31 known at compile time, given in second, which cannot fail */
+    IR_SHIFT_LEFT_IMMEDIATE,
+    IR_SHIFT_RIGHT_IMMEDIATE,
+
+    IR_STORE, // Writes value second into variable slot `first`, only right before the return
+    IR_JUMP, // To successors[0]
+    IR_BRANCH, // To successors[0] when first is not zero, otherwise successors[1]
+    IR_RETURN, // Returns first
+
+    IR_OPCODE_COUNT
+} IrOpcode;
+
+static char *ir_opcode_string_table[] = {
+    [IR_NOP] = "nop",
+    [IR_CONSTANT] = "constant",
+    [IR_LOAD] = "load",
+    [IR_PHI] = "phi",
+    [IR_NEGATE] = "negate",
+    [IR_NOT] = "not",
+    [IR_BITWISE_NOT] = "bitwise_not",
+    [IR_BOOLEAN] = "boolean",
+    [IR_ADD] = "add",
+    [IR_SUBTRACT] = "subtract",
+    [IR_MULTIPLY] = "multiply",
+    [IR_DIVIDE] = "divide",
+    [IR_MODULO] = "modulo",
+    [IR_SHIFT_LEFT] = "shift_left",
+    [IR_SHIFT_RIGHT] = "shift_right",
+    [IR_LESS] = "less",
+    [IR_GREATER] = "greater",
+    [IR_LESS_EQUAL] = "less_equal",
+    [IR_GREATER_EQUAL] = "greater_equal",
+    [IR_EQUAL] = "equal",
+    [IR_NOT_EQUAL] = "not_equal",
+    [IR_BITWISE_AND] = "bitwise_and",
+    [IR_BITWISE_OR] = "bitwise_or",
+    [IR_BITWISE_XOR] = "bitwise_xor",
+    [IR_SHIFT_LEFT_IMMEDIATE] = "shift_left_immediate",
+    [IR_SHIFT_RIGHT_IMMEDIATE] = "shift_right_immediate",
+    [IR_STORE] = "store",
+    [IR_JUMP] = "jump",
+    [IR_BRANCH] = "branch",
+    [IR_RETURN] = "return"
+};
+
+#define IR_FIRST_IS_VALUE 1
+#define IR_SECOND_IS_VALUE 2
+
+/* Which operands name values rather than numbers or slots */
+static uint8_t const ir_value_operands_table[IR_OPCODE_COUNT] = {
+    [IR_PHI] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_NEGATE] = IR_FIRST_IS_VALUE,
+    [IR_NOT] = IR_FIRST_IS_VALUE,
+    [IR_BITWISE_NOT] = IR_FIRST_IS_VALUE,
+    [IR_BOOLEAN] = IR_FIRST_IS_VALUE,
+    [IR_ADD] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_SUBTRACT] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_MULTIPLY] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_DIVIDE] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_MODULO] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_SHIFT_LEFT] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_SHIFT_RIGHT] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_LESS] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_GREATER] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_LESS_EQUAL] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_GREATER_EQUAL] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_EQUAL] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_NOT_EQUAL] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_BITWISE_AND] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_BITWISE_OR] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_BITWISE_XOR] = IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE,
+    [IR_SHIFT_LEFT_IMMEDIATE] = IR_FIRST_IS_VALUE,
+    [IR_SHIFT_RIGHT_IMMEDIATE] = IR_FIRST_IS_VALUE,
+    [IR_STORE] = IR_SECOND_IS_VALUE,
+    [IR_BRANCH] = IR_FIRST_IS_VALUE,
+    [IR_RETURN] = IR_FIRST_IS_VALUE
+};
+
+/* Binary operator tokens and the instruction computing them */
+static uint8_t const ir_binary_opcode_table[TOKEN_EOF + 1] = {
+    [TOKEN_PLUS] = IR_ADD,
+    [TOKEN_MINUS] = IR_SUBTRACT,
+    [TOKEN_STAR] = IR_MULTIPLY,
+    [TOKEN_SLASH] = IR_DIVIDE,
+    [TOKEN_PERCENT] = IR_MODULO,
+    [TOKEN_BITWISE_LEFT_SHIFT] = IR_SHIFT_LEFT,
+    [TOKEN_BITWISE_RIGHT_SHIFT] = IR_SHIFT_RIGHT,
+    [TOKEN_LESS_THAN] = IR_LESS,
+    [TOKEN_GREATER_THAN] = IR_GREATER,
+    [TOKEN_LESS_EQUAL] = IR_LESS_EQUAL,
+    [TOKEN_GREATER_EQUAL] = IR_GREATER_EQUAL,
+    [TOKEN_DOUBLE_EQUALS] = IR_EQUAL,
+    [TOKEN_NOT_EQUAL] = IR_NOT_EQUAL,
+    [TOKEN_BITWISE_AND] = IR_BITWISE_AND,
+    [TOKEN_BITWISE_OR] = IR_BITWISE_OR,
+    [TOKEN_BITWISE_XOR] = IR_BITWISE_XOR,
+
+    [TOKEN_PLUS_ASSIGNMENT] = IR_ADD,
+    [TOKEN_MINUS_ASSIGNMENT] = IR_SUBTRACT,
+    [TOKEN_STAR_ASSIGNMENT] = IR_MULTIPLY,
+    [TOKEN_SLASH_ASSIGNMENT] = IR_DIVIDE,
+    [TOKEN_PERCENT_ASSIGNMENT] = IR_MODULO,
+    [TOKEN_LEFT_SHIFT_ASSIGNMENT] = IR_SHIFT_LEFT,
+    [TOKEN_RIGHT_SHIFT_ASSIGNMENT] = IR_SHIFT_RIGHT,
+    [TOKEN_AND_ASSIGNMENT] = IR_BITWISE_AND,
+    [TOKEN_OR_ASSIGNMENT] = IR_BITWISE_OR,
+    [TOKEN_XOR_ASSIGNMENT] = IR_BITWISE_XOR
+};
+
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t unused[3];
+    int32_t first;
+    int32_t second;
+} IrInstruction;
+
+typedef struct
+{
+    int start; // First instruction
+    int end; // One past the last, which is the terminator
+    int predecessors[2];
+    int predecessor_count;
+    int successors[2]; // -1 when absent
+} IrBlock;
+
+typedef struct
+{
+    IrInstruction *instructions; // Buffer, indexed by value
+    IrBlock *blocks; // Buffer, in the order they run
+    Symbol *variables; // Buffer, the Symbol of each variable slot
+} IrFunction;
+
+IrFunction CreateIrFunction(void)
+{
+    IrFunction function;
+    memset(&function, 0, sizeof function);
+
+    return function;
+}
+
+void FreeIrFunction(IrFunction *function)
+{
+    if(function->instructions) BufferFree(function->instructions);
+    if(function->blocks) BufferFree(function->blocks);
+    if(function->variables) BufferFree(function->variables);
+    memset(function, 0, sizeof *function);
+}
+
+/* Instructions that are still there, not counting removed ones */
+int IrInstructionCount(IrFunction *function)
+{
+    int count = 0;
+    int i = 0;
+    while(i < BufferLength(function->instructions))
+    {
+        count += function->instructions[i].opcode != IR_NOP;
+        i++;
+    }
+
+    return count;
+}
+
+static bool IrConstant(IrFunction *function, int value, int *number)
+{
+    IrInstruction *instruction = &function->instructions[value];
+    if(instruction->opcode != IR_CONSTANT)
+    {
+        return false;
+    }
+
+    *number = instruction->first;
+
+    return true;
+}
+
+/* Computes one arithmetic instruction. Shared by IrRun and constant propagation so
+ * the two cannot disagree. */
+static inline VmStatus IrEvaluate(IrOpcode opcode, int left, int right, int *result)
+{
+    switch(opcode)
+    {
+        case IR_NEGATE: *result = (int)(0u - (uint32_t)left); break;
+        case IR_NOT: *result = !left; break;
+        case IR_BITWISE_NOT: *result = ~left; break;
+        case IR_BOOLEAN: *result = left != 0; break;
+        case IR_ADD: *result = (int)((uint32_t)left + (uint32_t)right); break;
+        case IR_SUBTRACT: *result = (int)((uint32_t)left - (uint32_t)right); break;
+        case IR_MULTIPLY: *result = (int)((uint32_t)left * (uint32_t)right); break;
+        case IR_DIVIDE:
+        case IR_MODULO:
+            if(right == 0) return VM_DIVISION_BY_ZERO;
+            if(left == INT_MIN && right == -1) return VM_OVERFLOW;
+            *result = opcode == IR_DIVIDE ? left / right : left % right;
+            break;
+        case IR_SHIFT_LEFT:
+        case IR_SHIFT_RIGHT:
+            if(right < 0 || right >= 32) return VM_SHIFT_OUT_OF_RANGE;
+            *result = opcode == IR_SHIFT_LEFT ? (int)((uint32_t)left << right) : left >> right;
+            break;
+        case IR_SHIFT_LEFT_IMMEDIATE: *result = (int)((uint32_t)left << right); break;
+        case IR_SHIFT_RIGHT_IMMEDIATE: *result = left >> right; break;
+        case IR_LESS: *result = left < right; break;
+        case IR_GREATER: *result = left > right; break;
+        case IR_LESS_EQUAL: *result = left <= right; break;
+        case IR_GREATER_EQUAL: *result = left >= right; break;
+        case IR_EQUAL: *result = left == right; break;
+        case IR_NOT_EQUAL: *result = left != right; break;
+        case IR_BITWISE_AND: *result = left & right; break;
+        case IR_BITWISE_OR: *result = left | right; break;
+        case IR_BITWISE_XOR: *result = left ^ right; break;
+        default: break;
+    }
+
+    return VM_OK;
+}
+
+static bool IrIsArithmetic(IrOpcode opcode)
+{
+    return opcode >= IR_NEGATE && opcode <= IR_SHIFT_RIGHT_IMMEDIATE;
+}
+
+/* Whether an instruction could stop the function, which keeps it alive even when
+ * nothing uses its value */
+static bool IrMayFail(IrFunction *function, IrInstruction *instruction)
+{
+    int right;
+    switch(instruction->opcode)
+    {
+        case IR_DIVIDE:
+        case IR_MODULO:
+            return !IrConstant(function, instruction->second, &right) || right == 0 || right == -1;
+        case IR_SHIFT_LEFT:
+        case IR_SHIFT_RIGHT:
+            return !IrConstant(function, instruction->second, &right) || right < 0 || right >= 32;
+        default:
+            return false;
+    }
+}
+
+/* Lowering */
+
+static int IrEmit(IrFunction *function, IrOpcode opcode, int first, int second)
+{
+    IrInstruction instruction;
+    memset(&instruction, 0, sizeof instruction);
+    instruction.opcode = (uint8_t)opcode;
+    instruction.first = first;
+    instruction.second = second;
+    BufferPush(function->instructions, instruction);
+
+    int value = BufferLength(function->instructions) - 1;
+    function->blocks[BufferLength(function->blocks) - 1].end = value + 1;
+
+    return value;
+}
+
+/* Starts a block; instructions go into it until the next one starts */
+static int IrStartBlock(IrFunction *function)
+{
+    IrBlock block;
+    block.start = BufferLength(function->instructions);
+    block.end = block.start;
+    block.predecessors[0] = -1;
+    block.predecessors[1] = -1;
+    block.predecessor_count = 0;
+    block.successors[0] = -1;
+    block.successors[1] = -1;
+    BufferPush(function->blocks, block);
+
+    return BufferLength(function->blocks) - 1;
+}
+
+static void IrAddEdge(IrFunction *function, int from, int successor, int to)
+{
+    IrBlock *target = &function->blocks[to];
+    Assert(target->predecessor_count < 2);
+    target->predecessors[target->predecessor_count++] = from;
+    function->blocks[from].successors[successor] = to;
+}
+
+/* An &&, || or ?: being lowered */
+typedef struct
+{
+    int condition_block; // Ends in the branch
+    int then_block; // Where the then branch of ?: ended
+    int value; // Constant an && or || gives when it short circuits, the then value of ?:
+} IrLoweringBranch;
+
+typedef struct
+{
+    IrFunction *function;
+    int *values; // Buffer, the expression stack
+    int *current; // Value of each variable slot at this point
+    int *saved; // Buffer, variable values saved at each open branch
+    IrLoweringBranch *branches; // Buffer, innermost last
+} IrLowering;
+
+static void IrPushValue(IrLowering *lowering, int value)
+{
+    BufferPush(lowering->values, value);
+}
+
+static int IrPopValue(IrLowering *lowering)
+{
+    int value = lowering->values[BufferLength(lowering->values) - 1];
+    BufferHeaderGet(lowering->values)->length--;
+
+    return value;
+}
+
+static void IrSaveVariables(IrLowering *lowering)
+{
+    int i = 0;
+    while(i < BufferLength(lowering->function->variables))
+    {
+        BufferPush(lowering->saved, lowering->current[i]);
+        i++;
+    }
+}
+
+static int *IrSavedVariables(IrLowering *lowering)
+{
+    return &lowering->saved[BufferLength(lowering->saved) - BufferLength(lowering->function->variables)];
+}
+
+/* Starts the block after a branch, with a phi for every variable that was assigned
+ * on only one side of it. `saved` holds the values from predecessors[0]. */
+static void IrJoinVariables(IrLowering *lowering)
+{
+    int *saved = IrSavedVariables(lowering);
+    int i = 0;
+    while(i < BufferLength(lowering->function->variables))
+    {
+        if(saved[i] != lowering->current[i])
+        {
+            lowering->current[i] = IrEmit(lowering->function, IR_PHI, saved[i], lowering->current[i]);
+        }
+        i++;
+    }
+
+    BufferHeaderGet(lowering->saved)->length -= BufferLength(lowering->function->variables);
+}
+
+/* Lowers the tree at root into `function`, which has to be empty apart from
+ * variable slots given out in advance. Reports and returns false like
+ * CompileBytecode for what has no equivalent here. */
+bool LowerIr(IrFunction *function, ExpressionPool *pool, ExpressionId root)
+{
+    /* Every variable is read once at entry */
+    ExpressionWalker walker = CreateExpressionWalker(pool, root);
+    ExpressionWalkEvent event;
+    ExpressionId id;
+    while(ExpressionWalkerNext(&walker, &event, &id))
+    {
+        ExpressionNode *node = GetExpression(pool, id);
+        if(event == EXPRESSION_WALK_ENTER && node->kind == EXPRESSION_IDENTIFIER)
+        {
+            VariableSlot(&function->variables, node->first);
+        }
+    }
+    FreeExpressionWalker(&walker);
+
+    IrLowering lowering;
+    lowering.function = function;
+    lowering.values = NULL;
+    lowering.saved = NULL;
+    lowering.branches = NULL;
+    lowering.current = calloc(BufferLength(function->variables) + 1, sizeof *lowering.current);
+    Assert(lowering.current);
+
+    IrStartBlock(function);
+    int slot = 0;
+    while(slot < BufferLength(function->variables))
+    {
+        lowering.current[slot] = IrEmit(function, IR_LOAD, slot, 0);
+        slot++;
+    }
+
+    bool ok = true;
+    walker = CreateExpressionWalker(pool, root);
+    while(ok && ExpressionWalkerNext(&walker, &event, &id))
+    {
+        ExpressionNode *node = GetExpression(pool, id);
+        bool logical = node->kind == EXPRESSION_BINARY &&
+                       (node->operator == TOKEN_LOGICAL_AND || node->operator == TOKEN_LOGICAL_OR);
+
+        if(event == EXPRESSION_WALK_ENTER)
+        {
+            if(node->kind == EXPRESSION_NUMBER)
+            {
+                IrPushValue(&lowering, IrEmit(function, IR_CONSTANT, ExpressionNumber(pool, id), 0));
+            } else if(node->kind == EXPRESSION_IDENTIFIER)
+            {
+                IrPushValue(&lowering, lowering.current[VariableSlot(&function->variables, node->first)]);
+            } else if(node->kind == EXPRESSION_NONE)
+            {
+                ok = false;
+            } else if(node->kind == EXPRESSION_UNARY && (node->operator == TOKEN_STAR || node->operator == TOKEN_BITWISE_AND))
+            {
+                ReportError("the IR has no pointers, %s is not supported\n", token_string_table[node->operator]);
+                ok = false;
+            } else if(node->kind == EXPRESSION_ASSIGNMENT && GetExpression(pool, node->first)->kind != EXPRESSION_IDENTIFIER)
+            {
+                ReportError("the IR can only assign to variables\n");
+                ok = false;
+            }
+        } else if(event == EXPRESSION_WALK_OPERAND)
+        {
+            if(IsUnreadAssignmentTarget(&walker, node))
+            {
+                ExpressionWalkerSkipOperand(&walker);
+            } else if((logical || node->kind == EXPRESSION_TERNARY) && walker.operand == 1)
+            {
+                IrLoweringBranch branch;
+                int condition = IrPopValue(&lowering);
+                branch.value = logical ? IrEmit(function, IR_CONSTANT, node->operator == TOKEN_LOGICAL_OR, 0) : 0;
+                IrEmit(function, IR_BRANCH, condition, 0);
+                branch.condition_block = BufferLength(function->blocks) - 1;
+                branch.then_block = -1;
+                BufferPush(lowering.branches, branch);
+                IrSaveVariables(&lowering);
+
+                /* || evaluates its right side when the condition is zero */
+                int next = IrStartBlock(function);
+                IrAddEdge(function, branch.condition_block, node->operator == TOKEN_LOGICAL_OR ? 1 : 0, next);
+            } else if(node->kind == EXPRESSION_TERNARY && walker.operand == 2)
+            {
+                IrLoweringBranch *branch = &lowering.branches[BufferLength(lowering.branches) - 1];
+                branch->value = IrPopValue(&lowering);
+                IrEmit(function, IR_JUMP, 0, 0);
+                branch->then_block = BufferLength(function->blocks) - 1;
+
+                /* The else branch starts from the variables as they were before the
+                 * condition, and the then branch's are kept for the join */
+                int *saved = IrSavedVariables(&lowering);
+                int i = 0;
+                while(i < BufferLength(function->variables))
+                {
+                    int then_value = lowering.current[i];
+                    lowering.current[i] = saved[i];
+                    saved[i] = then_value;
+                    i++;
+                }
+
+                int next = IrStartBlock(function);
+                IrAddEdge(function, branch->condition_block, 1, next);
+            } else if(node->kind == EXPRESSION_BINARY && node->operator == TOKEN_COMMA && walker.operand == 1)
+            {
+                IrPopValue(&lowering);
+            }
+        } else if(node->kind == EXPRESSION_UNARY)
+        {
+            if(node->operator == TOKEN_MINUS)
+            {
+                IrPushValue(&lowering, IrEmit(function, IR_NEGATE, IrPopValue(&lowering), 0));
+            } else if(node->operator == TOKEN_EXCLAMATION_POINT)
+            {
+                IrPushValue(&lowering, IrEmit(function, IR_NOT, IrPopValue(&lowering), 0));
+            } else if(node->operator == TOKEN_BITWISE_NOT)
+            {
+                IrPushValue(&lowering, IrEmit(function, IR_BITWISE_NOT, IrPopValue(&lowering), 0));
+            }
+        } else if(logical)
+        {
+            IrLoweringBranch branch = lowering.branches[BufferLength(lowering.branches) - 1];
+            BufferHeaderGet(lowering.branches)->length--;
+
+            int right = IrEmit(function, IR_BOOLEAN, IrPopValue(&lowering), 0);
+            IrEmit(function, IR_JUMP, 0, 0);
+            int right_block = BufferLength(function->blocks) - 1;
+
+            int join = IrStartBlock(function);
+            IrAddEdge(function, branch.condition_block, node->operator == TOKEN_LOGICAL_OR ? 0 : 1, join);
+            IrAddEdge(function, right_block, 0, join);
+            IrPushValue(&lowering, IrEmit(function, IR_PHI, branch.value, right));
+            IrJoinVariables(&lowering);
+        } else if(node->kind == EXPRESSION_BINARY)
+        {
+            if(node->operator != TOKEN_COMMA)
+            {
+                int right = IrPopValue(&lowering);
+                int left = IrPopValue(&lowering);
+                IrPushValue(&lowering, IrEmit(function, ir_binary_opcode_table[node->operator], left, right));
+            }
+        } else if(node->kind == EXPRESSION_ASSIGNMENT)
+        {
+            int value = IrPopValue(&lowering);
+            if(node->operator != TOKEN_EQUAL)
+            {
+                int target = IrPopValue(&lowering);
+                value = IrEmit(function, ir_binary_opcode_table[node->operator], target, value);
+            }
+
+            lowering.current[VariableSlot(&function->variables, GetExpression(pool, node->first)->first)] = value;
+            IrPushValue(&lowering, value);
+        } else if(node->kind == EXPRESSION_TERNARY)
+        {
+            IrLoweringBranch branch = lowering.branches[BufferLength(lowering.branches) - 1];
+            BufferHeaderGet(lowering.branches)->length--;
+
+            int else_value = IrPopValue(&lowering);
+            IrEmit(function, IR_JUMP, 0, 0);
+            int else_block = BufferLength(function->blocks) - 1;
+
+            int join = IrStartBlock(function);
+            IrAddEdge(function, branch.then_block, 0, join);
+            IrAddEdge(function, else_block, 0, join);
+            IrPushValue(&lowering, IrEmit(function, IR_PHI, branch.value, else_value));
+            IrJoinVariables(&lowering);
+        }
+    }
+
+    if(ok)
+    {
+        int result = IrPopValue(&lowering);
+        slot = 0;
+        while(slot < BufferLength(function->variables))
+        {
+            if(function->instructions[lowering.current[slot]].opcode != IR_LOAD ||
+               function->instructions[lowering.current[slot]].first != slot)
+            {
+                IrEmit(function, IR_STORE, slot, lowering.current[slot]);
+            }
+            slot++;
+        }
+        IrEmit(function, IR_RETURN, result, 0);
+    }
+
+    FreeExpressionWalker(&walker);
+    free(lowering.current);
+    if(lowering.values) BufferFree(lowering.values);
+    if(lowering.saved) BufferFree(lowering.saved);
+    if(lowering.branches) BufferFree(lowering.branches);
+
+    return ok;
+}
+
+void PrintIrFunction(FILE *output, IrFunction *function)
+{
+    int block_index = 0;
+    while(block_index < BufferLength(function->blocks))
+    {
+        IrBlock *block = &function->blocks[block_index];
+        if(block_index > 0 && block->predecessor_count == 0)
+        {
+            block_index++;
+            continue;
+        }
+
+        fprintf(output, "block %d", block_index);
+        if(block->predecessor_count > 0)
+        {
+            fprintf(output, " (from %d", block->predecessors[0]);
+            if(block->predecessor_count > 1)
+            {
+                fprintf(output, ", %d", block->predecessors[1]);
+            }
+            fprintf(output, ")");
+        }
+        fprintf(output, ":\n");
+
+        int i = block->start;
+        while(i < block->end)
+        {
+            IrInstruction *instruction = &function->instructions[i];
+            IrOpcode opcode = instruction->opcode;
+            uint8_t value_operands = ir_value_operands_table[opcode];
+            i++;
+
+            if(opcode == IR_NOP)
+            {
+                continue;
+            }
+
+            if(opcode == IR_STORE || opcode >= IR_JUMP)
+            {
+                fprintf(output, "    %s", ir_opcode_string_table[opcode]);
+            } else
+            {
+                fprintf(output, "    %%%d = %s", i - 1, ir_opcode_string_table[opcode]);
+            }
+
+            if(opcode == IR_JUMP)
+            {
+                fprintf(output, " block %d", block->successors[0]);
+            } else if(opcode == IR_BRANCH)
+            {
+                fprintf(output, " %%%d, block %d, block %d", instruction->first, block->successors[0], block->successors[1]);
+            } else if(opcode == IR_CONSTANT || opcode == IR_LOAD)
+            {
+                fprintf(output, " %d", instruction->first);
+            } else if(opcode == IR_STORE)
+            {
+                fprintf(output, " %d, %%%d", instruction->first, instruction->second);
+            } else if(value_operands == IR_FIRST_IS_VALUE && (opcode == IR_SHIFT_LEFT_IMMEDIATE || opcode == IR_SHIFT_RIGHT_IMMEDIATE))
+            {
+                fprintf(output, " %%%d, %d", instruction->first, instruction->second);
+            } else if(value_operands == IR_FIRST_IS_VALUE)
+            {
+                fprintf(output, " %%%d", instruction->first);
+            } else
+            {
+                fprintf(output, " %%%d, %%%d", instruction->first, instruction->second);
+            }
+            fprintf(output, "\n");
+        }
+
+        block_index++;
+    }
+}
+
+/* Running */
+
+/* Runs the function against `variables`, one int per slot. `values` needs room for
+ * one int per instruction. */
+VmStatus IrRun(IrFunction const *function, int *variables, int *values, int *result)
+{
+    IrInstruction const *instructions = function->instructions;
+    IrBlock const *blocks = function->blocks;
+    int block = 0;
+    int previous = -1;
+    int next = 0;
+
+    for(;;)
+    {
+        IrBlock const *current = &blocks[block];
+        int i = current->start;
+        while(i < current->end)
+        {
+            IrInstruction const *instruction = &instructions[i];
+            VmStatus status;
+
+            switch(instruction->opcode)
+            {
+                case IR_NOP:
+                    break;
+                case IR_CONSTANT:
+                    values[i] = instruction->first;
+                    break;
+                case IR_LOAD:
+                    values[i] = variables[instruction->first];
+                    break;
+                case IR_PHI:
+                    values[i] = values[previous == current->predecessors[0] ? instruction->first : instruction->second];
+                    break;
+                case IR_STORE:
+                    variables[instruction->first] = values[instruction->second];
+                    break;
+                case IR_JUMP:
+                    next = current->successors[0];
+                    break;
+                case IR_BRANCH:
+                    next = current->successors[values[instruction->first] != 0 ? 0 : 1];
+                    break;
+                case IR_RETURN:
+                    *result = values[instruction->first];
+                    return VM_OK;
+                case IR_SHIFT_LEFT_IMMEDIATE:
+                case IR_SHIFT_RIGHT_IMMEDIATE:
+                    IrEvaluate(instruction->opcode, values[instruction->first], instruction->second, &values[i]);
+                    break;
+                default:
+                    status = IrEvaluate(instruction->opcode, values[instruction->first], values[instruction->second], &values[i]);
+                    if(status != VM_OK)
+                    {
+                        return status;
+                    }
+                    break;
+            }
+
+            i++;
+        }
+
+        previous = block;
+        block = next;
+    }
+}
+
+/* Passes
+ *
+ * A pass returns how many instructions it changed. Each one resolves operands
+ * through `replacements` first, where a removed value points at the value standing
+ * in for it, so users always see the latest version of what they refer to. */
+
+typedef struct
+{
+    IrFunction *function;
+    int *replacements; // One per instruction, the value itself when not replaced
+} IrPass;
+
+static IrPass CreateIrPass(IrFunction *function)
+{
+    IrPass pass;
+    pass.function = function;
+    pass.replacements = malloc((BufferLength(function->instructions) + 1) * sizeof *pass.replacements);
+    Assert(pass.replacements);
+
+    int i = 0;
+    while(i < BufferLength(function->instructions))
+    {
+        pass.replacements[i] = i;
+        i++;
+    }
+
+    return pass;
+}
+
+static void FreeIrPass(IrPass *pass)
+{
+    free(pass->replacements);
+}
+
+/* Points an instruction's operands at the values replacing them */
+static IrInstruction *IrResolve(IrPass *pass, int value)
+{
+    IrInstruction *instruction = &pass->function->instructions[value];
+    uint8_t value_operands = ir_value_operands_table[instruction->opcode];
+    if(value_operands & IR_FIRST_IS_VALUE)
+    {
+        instruction->first = pass->replacements[instruction->first];
+    }
+    if(value_operands & IR_SECOND_IS_VALUE)
+    {
+        instruction->second = pass->replacements[instruction->second];
+    }
+
+    return instruction;
+}
+
+/* Removes `value`, sending its users to `replacement` */
+static void IrReplace(IrPass *pass, int value, int replacement)
+{
+    pass->replacements[value] = pass->replacements[replacement];
+    pass->function->instructions[value].opcode = IR_NOP;
+}
+
+/* Takes away the edge from one block to another, along with the phi operands
+ * coming through it */
+static void IrRemoveEdge(IrFunction *function, int from, int to)
+{
+    IrBlock *target = &function->blocks[to];
+    if(target->predecessors[0] == from)
+    {
+        target->predecessors[0] = target->predecessors[1];
+
+        /* Phis open the block, though removed ones may sit among them */
+        int i = target->start;
+        while(i < target->end)
+        {
+            if(function->instructions[i].opcode == IR_PHI)
+            {
+                function->instructions[i].first = function->instructions[i].second;
+            }
+            i++;
+        }
+    }
+    target->predecessors[1] = -1;
+    target->predecessor_count--;
+}
+
+/* Computes instructions whose operands are all constants, turns branches on a
+ * constant into jumps, and removes the blocks that can no longer run and the phis
+ * left with a single incoming value. What would fail at run time stays as it is. */
+static int PropagateIrConstants(IrPass *pass)
+{
+    IrFunction *function = pass->function;
+    int changes = 0;
+
+    int block_index = 0;
+    while(block_index < BufferLength(function->blocks))
+    {
+        IrBlock *block = &function->blocks[block_index];
+        int i = block->start;
+
+        if(block_index > 0 && block->predecessor_count == 0)
+        {
+            /* Unreachable; so is everything only it leads to */
+            while(i < block->end)
+            {
+                changes += function->instructions[i].opcode != IR_NOP;
+                function->instructions[i].opcode = IR_NOP;
+                i++;
+            }
+
+            int successor = 0;
+            while(successor < 2)
+            {
+                if(block->successors[successor] >= 0)
+                {
+                    IrRemoveEdge(function, block_index, block->successors[successor]);
+                    block->successors[successor] = -1;
+                }
+                successor++;
+            }
+
+            block_index++;
+            continue;
+        }
+
+        while(i < block->end)
+        {
+            IrInstruction *instruction = IrResolve(pass, i);
+            int left;
+            int right = 0;
+            int result;
+
+            if(instruction->opcode == IR_PHI && (block->predecessor_count == 1 || instruction->first == instruction->second))
+            {
+                IrReplace(pass, i, instruction->first);
+                changes++;
+            } else if(IrIsArithmetic(instruction->opcode) && IrConstant(function, instruction->first, &left) &&
+                      (!(ir_value_operands_table[instruction->opcode] & IR_SECOND_IS_VALUE) ||
+                       IrConstant(function, instruction->second, &right)))
+            {
+                if(!(ir_value_operands_table[instruction->opcode] & IR_SECOND_IS_VALUE))
+                {
+                    right = instruction->second;
+                }
+
+                if(IrEvaluate(instruction->opcode, left, right, &result) == VM_OK)
+                {
+                    instruction->opcode = IR_CONSTANT;
+                    instruction->first = result;
+                    instruction->second = 0;
+                    changes++;
+                }
+            } else if(instruction->opcode == IR_BRANCH && IrConstant(function, instruction->first, &left))
+            {
+                int taken = left != 0 ? 0 : 1;
+                IrRemoveEdge(function, block_index, block->successors[1 - taken]);
+                block->successors[0] = block->successors[taken];
+                block->successors[1] = -1;
+                instruction->opcode = IR_JUMP;
+                instruction->first = 0;
+                changes++;
+            }
+
+            i++;
+        }
+
+        block_index++;
+    }
+
+    return changes;
+}
+
+static bool IrIsPowerOfTwo(int number, int *shift)
+{
+    if(number <= 0 || (number & (number - 1)) != 0)
+    {
+        return false;
+    }
+
+    *shift = 0;
+    while((1 << *shift) != number)
+    {
+        (*shift)++;
+    }
+
+    return true;
+}
+
+/* Replaces operations with cheaper ones that give the same result: multiplying by a
+ * power of two becomes a shift, since wrapping multiplication and shifting left agree
+ * on every bit, and identities like x + 0, x * 1 and x & -1 become x. Division is left
+ * alone, as truncating a negative number is not an arithmetic shift. */
+static int ReduceIrStrength(IrPass *pass)
+{
+    IrFunction *function = pass->function;
+    int changes = 0;
+
+    int i = 0;
+    while(i < BufferLength(function->instructions))
+    {
+        IrInstruction *instruction = IrResolve(pass, i);
+        IrOpcode opcode = instruction->opcode;
+        int constant;
+        int left;
+        int shift;
+
+        if(!IrIsArithmetic(opcode) || ir_value_operands_table[opcode] != (IR_FIRST_IS_VALUE | IR_SECOND_IS_VALUE))
+        {
+            i++;
+            continue;
+        }
+
+        /* Constants on the right for the operators where order does not matter */
+        bool commutative = opcode == IR_ADD || opcode == IR_MULTIPLY || opcode == IR_BITWISE_AND ||
+                           opcode == IR_BITWISE_OR || opcode == IR_BITWISE_XOR;
+        if(commutative && IrConstant(function, instruction->first, &constant) && !IrConstant(function, instruction->second, &constant))
+        {
+            int swap = instruction->first;
+            instruction->first = instruction->second;
+            instruction->second = swap;
+        }
+
+        if(!IrConstant(function, instruction->second, &constant) || IrConstant(function, instruction->first, &left))
+        {
+            i++;
+            continue;
+        }
+
+        int value = instruction->first;
+        bool identity = ((opcode == IR_ADD || opcode == IR_SUBTRACT || opcode == IR_BITWISE_OR || opcode == IR_BITWISE_XOR ||
+                          opcode == IR_SHIFT_LEFT || opcode == IR_SHIFT_RIGHT) && constant == 0) ||
+                        ((opcode == IR_MULTIPLY || opcode == IR_DIVIDE) && constant == 1) ||
+                        (opcode == IR_BITWISE_AND && constant == -1);
+
+        if(identity)
+        {
+            IrReplace(pass, i, value);
+            changes++;
+        } else if((opcode == IR_MULTIPLY || opcode == IR_BITWISE_AND) && constant == 0)
+        {
+            IrReplace(pass, i, instruction->second);
+            changes++;
+        } else if(opcode == IR_MULTIPLY && constant == -1)
+        {
+            instruction->opcode = IR_NEGATE;
+            instruction->second = 0;
+            changes++;
+        } else if(opcode == IR_MULTIPLY && IrIsPowerOfTwo(constant, &shift))
+        {
+            instruction->opcode = IR_SHIFT_LEFT_IMMEDIATE;
+            instruction->second = shift;
+            changes++;
+        } else if((opcode == IR_SHIFT_LEFT || opcode == IR_SHIFT_RIGHT) && constant > 0 && constant < 32)
+        {
+            instruction->opcode = opcode == IR_SHIFT_LEFT ? IR_SHIFT_LEFT_IMMEDIATE : IR_SHIFT_RIGHT_IMMEDIATE;
+            instruction->second = constant;
+            changes++;
+        }
+
+        i++;
+    }
+
+    return changes;
+}
+
+static uint32_t IrHash(IrInstruction *instruction)
+{
+    uint32_t hash = instruction->opcode * 0x9E3779B1u;
+    hash ^= (uint32_t)instruction->first * 0x85EBCA77u;
+    hash ^= (uint32_t)instruction->second * 0xC2B2AE3Du;
+
+    return hash ^ (hash >> 15);
+}
+
+/* Hash-conses instructions: the first instruction computing a given opcode from given
+ * operands is kept, and any later copy in a block it dominates is replaced by it. A
+ * copy that is not dominated takes over the table entry instead. Blocks have no
+ * loops, so the dominator of a block comes before it and immediate dominators are
+ * found in one walk. */
+static int EliminateIrCommonSubexpressions(IrPass *pass)
+{
+    IrFunction *function = pass->function;
+    int changes = 0;
+
+    int block_count = BufferLength(function->blocks);
+    int *dominators = malloc(block_count * sizeof *dominators);
+    Assert(dominators);
+
+    int slot_count = 16;
+    while(slot_count < 2 * BufferLength(function->instructions))
+    {
+        slot_count *= 2;
+    }
+    int *slots = malloc(slot_count * sizeof *slots);
+    int *slot_blocks = malloc(slot_count * sizeof *slot_blocks);
+    Assert(slots && slot_blocks);
+    memset(slots, -1, slot_count * sizeof *slots);
+
+    int block_index = 0;
+    while(block_index < block_count)
+    {
+        IrBlock *block = &function->blocks[block_index];
+        dominators[block_index] = -1;
+
+        int predecessor = 0;
+        while(predecessor < block->predecessor_count)
+        {
+            int other = block->predecessors[predecessor];
+            int dominator = dominators[block_index];
+            if(dominator < 0)
+            {
+                dominators[block_index] = other;
+            } else
+            {
+                while(dominator != other)
+                {
+                    while(dominator > other) dominator = dominators[dominator];
+                    while(other > dominator) other = dominators[other];
+                }
+                dominators[block_index] = dominator;
+            }
+            predecessor++;
+        }
+
+        int i = block->start;
+        while(i < block->end)
+        {
+            IrInstruction *instruction = IrResolve(pass, i);
+            IrOpcode opcode = instruction->opcode;
+            if(opcode != IR_CONSTANT && opcode != IR_LOAD && !IrIsArithmetic(opcode))
+            {
+                i++;
+                continue;
+            }
+
+            /* a + b and b + a are the same value */
+            bool commutative = opcode == IR_ADD || opcode == IR_MULTIPLY || opcode == IR_BITWISE_AND ||
+                               opcode == IR_BITWISE_OR || opcode == IR_BITWISE_XOR || opcode == IR_EQUAL ||
+                               opcode == IR_NOT_EQUAL;
+            if(commutative && instruction->first > instruction->second)
+            {
+                int swap = instruction->first;
+                instruction->first = instruction->second;
+                instruction->second = swap;
+            }
+
+            uint32_t slot = IrHash(instruction) & (slot_count - 1);
+            while(slots[slot] >= 0)
+            {
+                IrInstruction *other = &function->instructions[slots[slot]];
+                if(other->opcode == opcode && other->first == instruction->first && other->second == instruction->second)
+                {
+                    break;
+                }
+                slot = (slot + 1) & (slot_count - 1);
+            }
+
+            int dominator = block_index;
+            if(slots[slot] >= 0)
+            {
+                while(dominator > slot_blocks[slot])
+                {
+                    dominator = dominators[dominator];
+                }
+            }
+
+            if(slots[slot] >= 0 && dominator == slot_blocks[slot])
+            {
+                IrReplace(pass, i, slots[slot]);
+                changes++;
+            } else
+            {
+                slots[slot] = i;
+                slot_blocks[slot] = block_index;
+            }
+
+            i++;
+        }
+
+        block_index++;
+    }
+
+    free(slot_blocks);
+    free(slots);
+    free(dominators);
+
+    return changes;
+}
+
+/* Whether a block does nothing but jump on */
+static bool IrBlockIsEmpty(IrFunction *function, int block_index)
+{
+    IrBlock *block = &function->blocks[block_index];
+    int i = block->start;
+    while(i < block->end - 1)
+    {
+        if(function->instructions[i].opcode != IR_NOP)
+        {
+            return false;
+        }
+        i++;
+    }
+
+    return function->instructions[block->end - 1].opcode == IR_JUMP;
+}
+
+/* Where control ends up from a block, passing through blocks that only jump on */
+static int IrSkipEmptyBlocks(IrFunction *function, int block_index)
+{
+    while(IrBlockIsEmpty(function, block_index))
+    {
+        block_index = function->blocks[block_index].successors[0];
+    }
+
+    return block_index;
+}
+
+/* A branch whose two sides do nothing and meet without a phi can just jump */
+static bool IrBranchIsUseless(IrFunction *function, int block_index)
+{
+    IrBlock *block = &function->blocks[block_index];
+    if(function->instructions[block->end - 1].opcode != IR_BRANCH)
+    {
+        return false;
+    }
+
+    int join = IrSkipEmptyBlocks(function, block->successors[0]);
+    if(join != IrSkipEmptyBlocks(function, block->successors[1]))
+    {
+        return false;
+    }
+
+    int i = function->blocks[join].start;
+    while(i < function->blocks[join].end)
+    {
+        if(function->instructions[i].opcode == IR_PHI)
+        {
+            return false;
+        }
+        i++;
+    }
+
+    return true;
+}
+
+/* Removes instructions whose value nothing uses. Walking backwards, every user is
+ * seen before what it uses. Stores, control flow and what could fail are kept,
+ * except stores writing back the value a variable came in with and branches that
+ * make no difference. */
+static int EliminateIrDeadCode(IrPass *pass)
+{
+    IrFunction *function = pass->function;
+    int count = BufferLength(function->instructions);
+    int changes = 0;
+
+    int i = 0;
+    while(i < count)
+    {
+        IrResolve(pass, i);
+        i++;
+    }
+
+    bool *used = calloc(count + 1, sizeof *used);
+    Assert(used);
+
+    int block_index = BufferLength(function->blocks) - 1;
+    while(block_index >= 0)
+    {
+        IrBlock *block = &function->blocks[block_index];
+        if(block->end > block->start && IrBranchIsUseless(function, block_index))
+        {
+            IrRemoveEdge(function, block_index, block->successors[0]);
+            block->successors[0] = block->successors[1];
+            block->successors[1] = -1;
+            function->instructions[block->end - 1].opcode = IR_JUMP;
+            function->instructions[block->end - 1].first = 0;
+            changes++;
+        }
+
+        i = block->end - 1;
+        while(i >= block->start)
+        {
+            IrInstruction *instruction = &function->instructions[i];
+            IrOpcode opcode = instruction->opcode;
+            bool live = used[i] || opcode >= IR_JUMP || IrMayFail(function, instruction);
+            if(opcode == IR_STORE)
+            {
+                IrInstruction *value = &function->instructions[instruction->second];
+                live = value->opcode != IR_LOAD || value->first != instruction->first;
+            }
+
+            if(live && opcode != IR_NOP)
+            {
+                uint8_t value_operands = ir_value_operands_table[opcode];
+                if(value_operands & IR_FIRST_IS_VALUE) used[instruction->first] = true;
+                if(value_operands & IR_SECOND_IS_VALUE) used[instruction->second] = true;
+            } else if(opcode != IR_NOP)
+            {
+                instruction->opcode = IR_NOP;
+                changes++;
+            }
+
+            i--;
+        }
+
+        block_index--;
+    }
+
+    free(used);
+
+    return changes;
+}
+
+typedef struct
+{
+    char const *name;
+    int (*run)(IrPass *pass);
+} IrPassDescription;
+
+/* Constants first, so strength reduction sees them and common subexpressions are
+ * found among the reduced forms; dead code last, to sweep what the others left. */
+static IrPassDescription const ir_pass_table[] = {
+    { "constant propagation", PropagateIrConstants },
+    { "strength reduction", ReduceIrStrength },
+    { "common subexpressions", EliminateIrCommonSubexpressions },
+    { "dead code", EliminateIrDeadCode }
+};
+
+#define IR_PASS_COUNT ((int)(sizeof ir_pass_table / sizeof ir_pass_table[0]))
+
+typedef struct
+{
+    char const *name;
+    int changes;
+    double seconds;
+} IrPassStatistics;
+
+static double IrSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/* Squeezes out removed instructions so running the function does not step over
+ * them, renumbering values and blocks' ranges to match */
+static void CompactIr(IrFunction *function)
+{
+    int count = BufferLength(function->instructions);
+    int *numbers = malloc((count + 1) * sizeof *numbers);
+    Assert(numbers);
+
+    int kept = 0;
+    int block_index = 0;
+    while(block_index < BufferLength(function->blocks))
+    {
+        IrBlock *block = &function->blocks[block_index];
+        int i = block->start;
+        block->start = kept;
+        while(i < block->end)
+        {
+            IrInstruction instruction = function->instructions[i];
+            if(instruction.opcode != IR_NOP)
+            {
+                uint8_t value_operands = ir_value_operands_table[instruction.opcode];
+                if(value_operands & IR_FIRST_IS_VALUE) instruction.first = numbers[instruction.first];
+                if(value_operands & IR_SECOND_IS_VALUE) instruction.second = numbers[instruction.second];
+                numbers[i] = kept;
+                function->instructions[kept++] = instruction;
+            }
+            i++;
+        }
+        block->end = kept;
+        block_index++;
+    }
+
+    BufferHeaderGet(function->instructions)->length = kept;
+    free(numbers);
+}
+
+#define IR_MAX_ROUNDS 8
+
+/* Runs the passes in order until a round changes nothing, since each can expose work
+ * for the others, like a phi whose operands became one value, then compacts the
+ * function. `statistics` add up over the rounds. Returns how many rounds ran. */
+int OptimizeIr(IrFunction *function, IrPassStatistics statistics[IR_PASS_COUNT])
+{
+    int i = 0;
+    while(i < IR_PASS_COUNT)
+    {
+        statistics[i].name = ir_pass_table[i].name;
+        statistics[i].changes = 0;
+        statistics[i].seconds = 0;
+        i++;
+    }
+
+    int rounds = 0;
+    int changes = 1;
+    while(changes > 0 && rounds < IR_MAX_ROUNDS)
+    {
+        changes = 0;
+        i = 0;
+        while(i < IR_PASS_COUNT)
+        {
+            double start = IrSeconds();
+            IrPass pass = CreateIrPass(function);
+            int pass_changes = ir_pass_table[i].run(&pass);
+            FreeIrPass(&pass);
+            statistics[i].seconds += IrSeconds() - start;
+            statistics[i].changes += pass_changes;
+            changes += pass_changes;
+            i++;
+        }
+        rounds++;
+    }
+
+    CompactIr(function);
+
+    return rounds;
+}
+
+void PrintIrPassStatistics(FILE *output, IrPassStatistics statistics[IR_PASS_COUNT])
+{
+    int i = 0;
+    while(i < IR_PASS_COUNT)
+    {
+        fprintf(output, "  %-22s %6d changes %10.3f ms\n", statistics[i].name, statistics[i].changes, statistics[i].seconds * 1e3);
+        i++;
+    }
+}
+
+/* Bytecode
+ *
+ * LowerIrToBytecode turns a function back into bytecode, so the VM runs what the
+ * passes left rather than the tree. A value used once, by an instruction in the same
+ * block with nothing emitted in between, is left on the stack for it, which is all
+ * the tree compiler ever does. Any other value is stored into a temporary and loaded
+ * at each use. Constants are pushed again where they are used, and variables read
+ * from their slot unless a store could have written it first.
+ *
+ * A phi is a temporary its predecessors store into before they jump. When a
+ * predecessor branches, it stores even if it goes the other way; the phi's other
+ * predecessor is then on that path and stores after it. */
+
+typedef enum
+{
+    IR_HOME_TEMPORARY, // Stored after being computed, loaded at each use
+    IR_HOME_STACK, // Left on the stack for its only user
+    IR_HOME_NONE, // Computed for whether it fails and popped
+    IR_HOME_CONSTANT, // Pushed at each use
+    IR_HOME_VARIABLE, // Loaded from its variable slot at each use
+    IR_HOME_PHI // A temporary stored by the predecessors
+} IrHome;
+
+/* Instructions computing a value and the VM instruction doing the same */
+static uint8_t const ir_bytecode_opcode_table[IR_OPCODE_COUNT] = {
+    [IR_NEGATE] = OPCODE_NEGATE,
+    [IR_NOT] = OPCODE_NOT,
+    [IR_BITWISE_NOT] = OPCODE_BITWISE_NOT,
+    [IR_BOOLEAN] = OPCODE_BOOLEAN,
+    [IR_ADD] = OPCODE_ADD,
+    [IR_SUBTRACT] = OPCODE_SUBTRACT,
+    [IR_MULTIPLY] = OPCODE_MULTIPLY,
+    [IR_DIVIDE] = OPCODE_DIVIDE,
+    [IR_MODULO] = OPCODE_MODULO,
+    [IR_SHIFT_LEFT] = OPCODE_SHIFT_LEFT,
+    [IR_SHIFT_RIGHT] = OPCODE_SHIFT_RIGHT,
+    [IR_LESS] = OPCODE_LESS,
+    [IR_GREATER] = OPCODE_GREATER,
+    [IR_LESS_EQUAL] = OPCODE_LESS_EQUAL,
+    [IR_GREATER_EQUAL] = OPCODE_GREATER_EQUAL,
+    [IR_EQUAL] = OPCODE_EQUAL,
+    [IR_NOT_EQUAL] = OPCODE_NOT_EQUAL,
+    [IR_BITWISE_AND] = OPCODE_BITWISE_AND,
+    [IR_BITWISE_OR] = OPCODE_BITWISE_OR,
+    [IR_BITWISE_XOR] = OPCODE_BITWISE_XOR,
+    [IR_SHIFT_LEFT_IMMEDIATE] = OPCODE_SHIFT_LEFT,
+    [IR_SHIFT_RIGHT_IMMEDIATE] = OPCODE_SHIFT_RIGHT
+};
+
+typedef struct
+{
+    IrFunction *function;
+    BytecodeCompiler compiler;
+    uint8_t *homes; // One IrHome per value
+    int *temporaries; // One per value, its temporary when it has one
+    int *tree_starts; // One per value, where the instructions computing it on the stack start
+    bool *swapped; // One per value, whether its operands are pushed the other way around
+    bool *silent; // One per instruction, whether nothing is emitted where it is
+    int *block_starts; // One per block, where its bytecode starts
+    int block_start; // Where the block being emitted starts
+} IrBytecodeLowering;
+
+/* Whether an instruction's value is made at its uses rather than where it is defined */
+static bool IrIsRematerialized(IrBytecodeLowering *lowering, int value)
+{
+    IrHome home = lowering->homes[value];
+    return home == IR_HOME_CONSTANT || home == IR_HOME_VARIABLE || home == IR_HOME_PHI;
+}
+
+/* The same comparison or operation with its operands swapped, 0 for none */
+static uint8_t const ir_swapped_opcode_table[IR_OPCODE_COUNT] = {
+    [IR_ADD] = IR_ADD,
+    [IR_MULTIPLY] = IR_MULTIPLY,
+    [IR_LESS] = IR_GREATER,
+    [IR_GREATER] = IR_LESS,
+    [IR_LESS_EQUAL] = IR_GREATER_EQUAL,
+    [IR_GREATER_EQUAL] = IR_LESS_EQUAL,
+    [IR_EQUAL] = IR_EQUAL,
+    [IR_NOT_EQUAL] = IR_NOT_EQUAL,
+    [IR_BITWISE_AND] = IR_BITWISE_AND,
+    [IR_BITWISE_OR] = IR_BITWISE_OR,
+    [IR_BITWISE_XOR] = IR_BITWISE_XOR
+};
+
+/* Tries to leave operands on the stack for `value`. They have to end up in operand
+ * order right below it, so walking back from the last operand, each has to be
+ * computed just before the ones after it, and operands pushed at the use can only
+ * come after all of those. Leaves nothing marked when that fails. */
+static bool IrTryStackOperands(IrBytecodeLowering *lowering, int region_start, int value, int *operands, int operand_count, int *uses)
+{
+    int start = value;
+    int stacked = 0;
+    int k = operand_count - 1;
+    while(k >= 0)
+    {
+        int operand = operands[k];
+        while(start > region_start && start - 1 != operand && lowering->silent[start - 1])
+        {
+            start--;
+        }
+
+        if(start - 1 == operand && operand >= region_start && uses[operand] == 1 && lowering->homes[operand] == IR_HOME_TEMPORARY)
+        {
+            lowering->homes[operand] = IR_HOME_STACK;
+            start = lowering->tree_starts[operand];
+            stacked++;
+        } else if(stacked > 0)
+        {
+            break;
+        } else if(start - 1 == operand && IrIsRematerialized(lowering, operand))
+        {
+            start--;
+        }
+        k--;
+    }
+
+    if(k >= 0)
+    {
+        while(k < operand_count)
+        {
+            if(lowering->homes[operands[k]] == IR_HOME_STACK) lowering->homes[operands[k]] = IR_HOME_TEMPORARY;
+            k++;
+        }
+        return false;
+    }
+
+    lowering->tree_starts[value] = start;
+
+    return true;
+}
+
+/* Decides which operands of `value` stay on the stack, swapping them when only
+ * that lets them */
+static void IrStackOperands(IrBytecodeLowering *lowering, int region_start, int value, int *uses)
+{
+    IrInstruction *instruction = &lowering->function->instructions[value];
+    uint8_t value_operands = ir_value_operands_table[instruction->opcode];
+    int operands[2];
+    int operand_count = 0;
+    if(value_operands & IR_FIRST_IS_VALUE) operands[operand_count++] = instruction->first;
+    if(value_operands & IR_SECOND_IS_VALUE) operands[operand_count++] = instruction->second;
+
+    lowering->tree_starts[value] = value;
+    if(instruction->opcode == IR_PHI || IrTryStackOperands(lowering, region_start, value, operands, operand_count, uses))
+    {
+        return;
+    }
+
+    if(ir_swapped_opcode_table[instruction->opcode] != 0)
+    {
+        int swapped[2] = { operands[1], operands[0] };
+        lowering->swapped[value] = IrTryStackOperands(lowering, region_start, value, swapped, 2, uses);
+    }
+}
+
+/* Pushes a value for the instruction about to use it */
+static void IrPushOperand(IrBytecodeLowering *lowering, int value)
+{
+    IrInstruction *instruction = &lowering->function->instructions[value];
+    IrHome home = lowering->homes[value];
+    if(home == IR_HOME_CONSTANT)
+    {
+        EmitNumber(&lowering->compiler, instruction->first);
+    } else if(home == IR_HOME_VARIABLE)
+    {
+        EmitInstruction(&lowering->compiler, OPCODE_LOAD, instruction->first);
+    } else if(home != IR_HOME_STACK)
+    {
+        /* Loading what was just stored keeps it on the stack instead */
+        Bytecode *bytecode = lowering->compiler.bytecode;
+        int last = BufferLength(bytecode->code) - 1;
+        uint32_t store = OPCODE_STORE_TEMPORARY | ((uint32_t)lowering->temporaries[value] << 8);
+        if(last >= lowering->block_start && bytecode->code[last] == store)
+        {
+            bytecode->code[last] = OPCODE_COPY_TEMPORARY | ((uint32_t)lowering->temporaries[value] << 8);
+            lowering->compiler.stack_depth++;
+        } else
+        {
+            EmitInstruction(&lowering->compiler, OPCODE_LOAD_TEMPORARY, lowering->temporaries[value]);
+        }
+    }
+}
+
+/* Emits a jump to a block, whose target is filled in once every block is placed */
+static void IrEmitBlockJump(IrBytecodeLowering *lowering, Opcode opcode, int block_index)
+{
+    int position = EmitInstruction(&lowering->compiler, opcode, block_index);
+    BufferPush(lowering->compiler.patches, position);
+}
+
+/* Stores what each phi of the successors gets from `block_index` */
+static void IrStorePhis(IrBytecodeLowering *lowering, int block_index)
+{
+    IrFunction *function = lowering->function;
+    IrBlock *block = &function->blocks[block_index];
+    int successor = 0;
+    while(successor < 2 && block->successors[successor] >= 0)
+    {
+        int target_index = block->successors[successor];
+        IrBlock *target = &function->blocks[target_index];
+        if(successor == 0 || target_index != block->successors[0])
+        {
+            int i = target->start;
+            while(i < target->end)
+            {
+                IrInstruction *instruction = &function->instructions[i];
+                int value = target->predecessors[0] == block_index ? instruction->first : instruction->second;
+                if(instruction->opcode == IR_PHI && lowering->temporaries[value] != lowering->temporaries[i])
+                {
+                    IrPushOperand(lowering, value);
+                    EmitInstruction(&lowering->compiler, OPCODE_STORE_TEMPORARY, lowering->temporaries[i]);
+                }
+                i++;
+            }
+        }
+        successor++;
+    }
+}
+
+static bool IrBlockIsReachable(IrFunction *function, int block_index)
+{
+    return block_index == 0 || function->blocks[block_index].predecessor_count > 0;
+}
+
+/* Lowers `function`, optimized or not, into `bytecode`, which has to be empty. The
+ * variable slots stay the same. Reports and returns false when the function is too
+ * big for bytecode operands. */
+bool LowerIrToBytecode(Bytecode *bytecode, IrFunction *function)
+{
+    int count = BufferLength(function->instructions);
+    int block_count = BufferLength(function->blocks);
+    int variable_count = BufferLength(function->variables);
+
+    IrBytecodeLowering lowering;
+    lowering.function = function;
+    lowering.compiler.bytecode = bytecode;
+    lowering.compiler.stack_depth = 0;
+    lowering.compiler.patches = NULL;
+    lowering.homes = calloc(count + 1, sizeof *lowering.homes);
+    lowering.temporaries = malloc((count + 1) * sizeof *lowering.temporaries);
+    lowering.tree_starts = malloc((count + 1) * sizeof *lowering.tree_starts);
+    lowering.swapped = calloc(count + 1, sizeof *lowering.swapped);
+    lowering.silent = calloc(count + 1, sizeof *lowering.silent);
+    bool *continues = calloc(block_count + 1, sizeof *continues);
+    lowering.block_starts = malloc((block_count + 1) * sizeof *lowering.block_starts);
+    int *uses = calloc(count + 1, sizeof *uses);
+    bool *late_uses = calloc(count + 1, sizeof *late_uses);
+    bool *stored = calloc(variable_count + 1, sizeof *stored);
+    Assert(lowering.homes && lowering.temporaries && lowering.tree_starts && lowering.swapped && lowering.silent &&
+           lowering.block_starts && continues && uses && late_uses && stored);
+
+    int i = 0;
+    while(i < variable_count)
+    {
+        BufferPush(bytecode->variables, function->variables[i]);
+        i++;
+    }
+
+    /* Stores and the return come last, after any store that could change a variable.
+     * Returning the value just stored takes it from the stack, where the store left it. */
+    int kept_store = -1;
+    i = 0;
+    while(i < count)
+    {
+        IrInstruction *instruction = &function->instructions[i];
+        uint8_t value_operands = ir_value_operands_table[instruction->opcode];
+        bool late = instruction->opcode == IR_STORE || instruction->opcode == IR_RETURN;
+        if(instruction->opcode == IR_RETURN && i > 0 && function->instructions[i - 1].opcode == IR_STORE &&
+           function->instructions[i - 1].second == instruction->first)
+        {
+            kept_store = i - 1;
+            i++;
+            continue;
+        }
+        if(value_operands & IR_FIRST_IS_VALUE)
+        {
+            uses[instruction->first]++;
+            late_uses[instruction->first] |= late;
+        }
+        if(value_operands & IR_SECOND_IS_VALUE)
+        {
+            uses[instruction->second]++;
+            late_uses[instruction->second] |= late;
+        }
+        if(instruction->opcode == IR_STORE)
+        {
+            stored[instruction->first] = true;
+        }
+        i++;
+    }
+
+    i = 0;
+    while(i < count)
+    {
+        IrInstruction *instruction = &function->instructions[i];
+        IrHome home = IR_HOME_TEMPORARY;
+        if(instruction->opcode == IR_CONSTANT)
+        {
+            home = IR_HOME_CONSTANT;
+        } else if(instruction->opcode == IR_PHI)
+        {
+            home = IR_HOME_PHI;
+        } else if(instruction->opcode == IR_LOAD && !(late_uses[i] && stored[instruction->first]))
+        {
+            home = IR_HOME_VARIABLE;
+        } else if(uses[i] == 0)
+        {
+            home = IR_HOME_NONE;
+        }
+        lowering.homes[i] = (uint8_t)home;
+        i++;
+    }
+
+    /* A block only entered by falling through from the one before continues its
+     * stack. The jump between them emits nothing, and neither do blocks that never run. */
+    int previous = -1;
+    int block_index = 0;
+    while(block_index < block_count)
+    {
+        IrBlock *block = &function->blocks[block_index];
+        bool reachable = IrBlockIsReachable(function, block_index);
+        if(reachable && previous >= 0 && block->predecessor_count == 1 && block->predecessors[0] == previous &&
+           function->instructions[function->blocks[previous].end - 1].opcode == IR_JUMP)
+        {
+            continues[block_index] = true;
+            i = block->start;
+            while(i < block->end)
+            {
+                continues[block_index] &= function->instructions[i].opcode != IR_PHI;
+                i++;
+            }
+            lowering.silent[function->blocks[previous].end - 1] = continues[block_index];
+        }
+
+        i = block->start;
+        while(i < block->end)
+        {
+            lowering.silent[i] |= !reachable || function->instructions[i].opcode == IR_NOP || IrIsRematerialized(&lowering, i);
+            i++;
+        }
+
+        if(reachable)
+        {
+            previous = block_index;
+        }
+        block_index++;
+    }
+
+    int region_start = 0;
+    block_index = 0;
+    while(block_index < block_count)
+    {
+        IrBlock *block = &function->blocks[block_index];
+        if(IrBlockIsReachable(function, block_index) && !continues[block_index])
+        {
+            region_start = block->start;
+        }
+
+        i = block->start;
+        while(IrBlockIsReachable(function, block_index) && i < block->end)
+        {
+            IrStackOperands(&lowering, region_start, i, uses);
+            i++;
+        }
+        block_index++;
+    }
+
+    /* A value only a phi uses, computed at the end of the block the phi takes it from,
+     * goes straight into the phi's temporary */
+    int *phi_users = malloc((count + 1) * sizeof *phi_users);
+    Assert(phi_users);
+    i = 0;
+    while(i < count)
+    {
+        phi_users[i] = -1;
+        i++;
+    }
+    block_index = 0;
+    while(block_index < block_count)
+    {
+        IrBlock *block = &function->blocks[block_index];
+        i = block->start;
+        while(IrBlockIsReachable(function, block_index) && i < block->end)
+        {
+            IrInstruction *instruction = &function->instructions[i];
+            int operand = 0;
+            while(instruction->opcode == IR_PHI && operand < block->predecessor_count)
+            {
+                int value = operand == 0 ? instruction->first : instruction->second;
+                IrBlock *predecessor = &function->blocks[block->predecessors[operand]];
+                if(uses[value] == 1 && lowering.homes[value] == IR_HOME_TEMPORARY && value >= predecessor->start &&
+                   value < predecessor->end)
+                {
+                    phi_users[value] = i;
+                }
+                operand++;
+            }
+            i++;
+        }
+        block_index++;
+    }
+
+    int temporaries = 0;
+    i = 0;
+    while(i < count)
+    {
+        IrHome home = lowering.homes[i];
+        lowering.temporaries[i] = -1;
+        if((home == IR_HOME_TEMPORARY && uses[i] > 0 && phi_users[i] < 0) || home == IR_HOME_PHI)
+        {
+            lowering.temporaries[i] = temporaries++;
+        }
+        i++;
+    }
+    i = 0;
+    while(i < count)
+    {
+        if(phi_users[i] >= 0)
+        {
+            lowering.temporaries[i] = lowering.temporaries[phi_users[i]];
+        }
+        i++;
+    }
+    free(phi_users);
+
+    bool ok = temporaries <= BYTECODE_OPERAND_MAX;
+    if(!ok)
+    {
+        ReportError("bytecode has more than %d temporaries\n", BYTECODE_OPERAND_MAX);
+    }
+
+    block_index = 0;
+    while(ok && block_index < block_count)
+    {
+        IrBlock *block = &function->blocks[block_index];
+        lowering.block_starts[block_index] = BufferLength(bytecode->code);
+        lowering.block_start = lowering.block_starts[block_index];
+        if(!IrBlockIsReachable(function, block_index))
+        {
+            block_index++;
+            continue;
+        }
+
+        int next = block_index + 1;
+        while(next < block_count && !IrBlockIsReachable(function, next))
+        {
+            next++;
+        }
+
+        i = block->start;
+        while(i < block->end)
+        {
+            IrInstruction *instruction = &function->instructions[i];
+            IrOpcode opcode = instruction->opcode;
+            IrHome home = lowering.homes[i];
+
+            if(opcode == IR_NOP || IrIsRematerialized(&lowering, i))
+            {
+                i++;
+                continue;
+            }
+
+            if(opcode == IR_LOAD)
+            {
+                EmitInstruction(&lowering.compiler, OPCODE_LOAD, instruction->first);
+            } else if(opcode == IR_STORE)
+            {
+                IrPushOperand(&lowering, instruction->second);
+                EmitInstruction(&lowering.compiler, OPCODE_STORE, instruction->first);
+                if(i != kept_store)
+                {
+                    EmitInstruction(&lowering.compiler, OPCODE_POP, 0);
+                }
+            } else if(opcode == IR_JUMP)
+            {
+                IrStorePhis(&lowering, block_index);
+                if(block->successors[0] != next)
+                {
+                    IrEmitBlockJump(&lowering, OPCODE_JUMP, block->successors[0]);
+                }
+            } else if(opcode == IR_BRANCH)
+            {
+                IrStorePhis(&lowering, block_index);
+                IrPushOperand(&lowering, instruction->first);
+                IrEmitBlockJump(&lowering, OPCODE_JUMP_IF_ZERO, block->successors[1]);
+                if(block->successors[0] != next)
+                {
+                    IrEmitBlockJump(&lowering, OPCODE_JUMP, block->successors[0]);
+                }
+            } else if(opcode == IR_RETURN)
+            {
+                if(i - 1 != kept_store)
+                {
+                    IrPushOperand(&lowering, instruction->first);
+                }
+                EmitInstruction(&lowering.compiler, OPCODE_RETURN, 0);
+            } else if(opcode == IR_SHIFT_LEFT_IMMEDIATE || opcode == IR_SHIFT_RIGHT_IMMEDIATE)
+            {
+                IrPushOperand(&lowering, instruction->first);
+                EmitInstruction(&lowering.compiler, OPCODE_IMMEDIATE, instruction->second);
+                EmitInstruction(&lowering.compiler, ir_bytecode_opcode_table[opcode], 0);
+            } else if(lowering.swapped[i])
+            {
+                IrPushOperand(&lowering, instruction->second);
+                IrPushOperand(&lowering, instruction->first);
+                EmitInstruction(&lowering.compiler, ir_bytecode_opcode_table[ir_swapped_opcode_table[opcode]], 0);
+            } else
+            {
+                IrPushOperand(&lowering, instruction->first);
+                if(ir_value_operands_table[opcode] & IR_SECOND_IS_VALUE)
+                {
+                    IrPushOperand(&lowering, instruction->second);
+                }
+                EmitInstruction(&lowering.compiler, ir_bytecode_opcode_table[opcode], 0);
+            }
+
+            if(opcode < IR_STORE && home == IR_HOME_NONE)
+            {
+                EmitInstruction(&lowering.compiler, OPCODE_POP, 0);
+            } else if(opcode < IR_STORE && home == IR_HOME_TEMPORARY)
+            {
+                EmitInstruction(&lowering.compiler, OPCODE_STORE_TEMPORARY, lowering.temporaries[i]);
+            }
+            i++;
+        }
+
+        block_index++;
+    }
+
+    ok = ok && BytecodeFits(bytecode);
+    i = 0;
+    while(ok && i < BufferLength(lowering.compiler.patches))
+    {
+        int position = lowering.compiler.patches[i];
+        uint32_t target = (uint32_t)lowering.block_starts[BytecodeOperand(bytecode->code[position])];
+        bytecode->code[position] = BytecodeOpcode(bytecode->code[position]) | (target << 8);
+        i++;
+    }
+
+    bytecode->temporaries = temporaries;
+    bytecode->max_stack += temporaries;
+
+    if(lowering.compiler.patches) BufferFree(lowering.compiler.patches);
+    free(lowering.homes);
+    free(lowering.temporaries);
+    free(lowering.tree_starts);
+    free(lowering.swapped);
+    free(lowering.silent);
+    free(continues);
+    free(lowering.block_starts);
+    free(uses);
+    free(late_uses);
+    free(stored);
+
+    return ok;
+}
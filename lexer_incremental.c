@@ -0,0 +1,305 @@
+/* Incremental re-lexing
+ *
+ * An editor changes a file a few bytes at a time. RelexTokenStream takes the tokens
+ * of the text before an edit and the text after it, and lexes again only around the
+ * edit:
+ *
+ * - It restarts at the last token starting before the edit. Every token before that
+ *   one ended, and the lexer looked at most one character past its end, before the
+ *   edit, so those tokens are still right. Restarting one token early also covers an
+ *   edit that joins onto the end of a token, like typing `=` after `<`.
+ * - It stops once it starts a token past the inserted text at a place where an old
+ *   token started too. Both lexers are then at the same point of the same text, so
+ *   every token after that is the old one, moved by the length difference.
+ *
+ * The new tokens go into the gap of the stream's arrays (see token_stream.c), which
+ * is moved to the edit first. The tokens after the gap only get the length change
+ * added to a shift they all share, and the line starts the stream found past the
+ * edit are dropped, to be found again when a diagnostic needs them. The relexer does
+ * not count the lines before where it starts unless it reports something. An edit
+ * then costs about as much as it is long, plus moving the gap from the last edit,
+ * so typing in one place never touches the rest of the file.
+ *
+ * Diagnostics are only reported for the text lexed again, and new identifiers go
+ * into the current context's interner, which has to be the one the stream was lexed
+ * with. */
+
+typedef struct
+{
+    uint32_t offset; // Where the edit starts in the old text
+    uint32_t removed_length;
+    char const *inserted;
+    uint32_t inserted_length;
+} SourceEdit;
+
+/* Tokens [first, first + removed) of the old stream were replaced by tokens
+ * [first, first + inserted) of the new one */
+typedef struct
+{
+    int first;
+    int removed;
+    int inserted;
+} TokenSplice;
+
+/* Edits `source`, a malloc'd NUL terminated text `length` bytes long, in place and
+ * returns it, moved if it had to grow. Only the text after the edit is moved. */
+char *ApplySourceEdit(char *source, size_t length, SourceEdit const *edit)
+{
+    size_t new_length = length - edit->removed_length + edit->inserted_length;
+    if(new_length > length)
+    {
+        source = realloc(source, new_length + 1);
+        Assert(source);
+    }
+
+    size_t tail = edit->offset + edit->removed_length;
+    memmove(source + edit->offset + edit->inserted_length, source + tail, length - tail);
+    memcpy(source + edit->offset, edit->inserted, edit->inserted_length);
+    source[new_length] = 0;
+
+    return source;
+}
+
+/* Makes room for `length` items without changing the Buffer's length */
+static void *RelexReserve(void *buffer, int item_size, int length)
+{
+    if(length > BufferCapacity(buffer))
+    {
+        int capacity = BufferCapacity(buffer) ? BufferCapacity(buffer) : 32;
+        while(capacity < length)
+        {
+            capacity *= 2;
+        }
+        BufferReallocate(&buffer, item_size, capacity);
+    }
+
+    return buffer;
+}
+
+/* Replaces `removed` items at `at` with `inserted` items from `items`. The items
+ * after them are left alone when the count does not change. */
+static void *RelexSpliceBuffer(void *buffer, int item_size, int at, int removed, void const *items, int inserted)
+{
+    int length = BufferLength(buffer);
+    int new_length = length - removed + inserted;
+    buffer = RelexReserve(buffer, item_size, new_length);
+
+    if(!buffer)
+    {
+        return buffer;
+    }
+
+    char *bytes = buffer;
+    if(inserted != removed)
+    {
+        memmove(bytes + (size_t)(at + inserted) * item_size, bytes + (size_t)(at + removed) * item_size,
+                (size_t)(length - at - removed) * item_size);
+    }
+    if(inserted)
+    {
+        memcpy(bytes + (size_t)at * item_size, items, (size_t)inserted * item_size);
+    }
+    BufferHeaderGet(buffer)->length = new_length;
+
+    return buffer;
+}
+
+/* Start of the line `offset` is on, found by looking back from it */
+static uint32_t RelexLineStart(char const *source, uint32_t offset)
+{
+    uint32_t line_start = offset;
+    while(line_start > 0 && source[line_start - 1] != '\n')
+    {
+        line_start--;
+    }
+
+    return line_start;
+}
+
+/* Drops the line starts TokenStreamLocate found past the edit */
+static void RelexLineStarts(TokenStream *tokens, SourceEdit const *edit)
+{
+    if(!tokens->line_starts)
+    {
+        return;
+    }
+
+    /* Lines starting at or before the edit began after a newline before it */
+    uint32_t *line_starts = tokens->line_starts;
+    int low = 0;
+    int high = BufferLength(line_starts);
+    while(low < high)
+    {
+        int middle = (low + high) / 2;
+        if(line_starts[middle] <= edit->offset)
+        {
+            low = middle + 1;
+        } else
+        {
+            high = middle;
+        }
+    }
+
+    BufferHeaderGet(line_starts)->length = low;
+    if(tokens->lines_scanned > edit->offset)
+    {
+        tokens->lines_scanned = edit->offset;
+    }
+}
+
+/* Slack left in the gap when it has to grow, so growing is rare */
+#define RELEX_GAP_SLACK 1024
+
+/* Makes the gap at least `count` tokens long */
+static void RelexWidenGap(TokenStream *tokens, int count)
+{
+    if(tokens->gap_length >= count)
+    {
+        return;
+    }
+
+    int length = BufferLength(tokens->kinds);
+    int widen = count - tokens->gap_length + RELEX_GAP_SLACK;
+    tokens->kinds = RelexReserve(tokens->kinds, sizeof *tokens->kinds, length + widen);
+    tokens->offsets = RelexReserve(tokens->offsets, sizeof *tokens->offsets, length + widen);
+    tokens->payloads = RelexReserve(tokens->payloads, sizeof *tokens->payloads, length + widen);
+
+    int tail_start = tokens->gap + tokens->gap_length;
+    int tail = length - tail_start;
+    memmove(tokens->kinds + tail_start + widen, tokens->kinds + tail_start, tail * sizeof *tokens->kinds);
+    memmove(tokens->offsets + tail_start + widen, tokens->offsets + tail_start, tail * sizeof *tokens->offsets);
+    memmove(tokens->payloads + tail_start + widen, tokens->payloads + tail_start, tail * sizeof *tokens->payloads);
+
+    BufferHeaderGet(tokens->kinds)->length = length + widen;
+    BufferHeaderGet(tokens->offsets)->length = length + widen;
+    BufferHeaderGet(tokens->payloads)->length = length + widen;
+    tokens->gap_length += widen;
+}
+
+/* Brings `tokens`, lexed from the text before `edit`, up to date with `source`, the
+ * text after it. The stream refers to `source` from then on. */
+TokenSplice RelexTokenStream(TokenStream *tokens, char const *source, SourceEdit const *edit)
+{
+    int old_count = TokenStreamLength(tokens);
+    uint32_t old_end = edit->offset + edit->removed_length;
+    uint32_t new_end = edit->offset + edit->inserted_length;
+    int64_t delta = (int64_t)edit->inserted_length - edit->removed_length;
+
+    /* Last token starting before the edit, or the first token */
+    int low = 0;
+    int high = old_count;
+    while(low < high)
+    {
+        int middle = (low + high) / 2;
+        if(TokenStreamOffset(tokens, middle) < edit->offset)
+        {
+            low = middle + 1;
+        } else
+        {
+            high = middle;
+        }
+    }
+    int first = low > 0 ? low - 1 : 0;
+    uint32_t restart = low > 0 ? TokenStreamOffset(tokens, first) : 0;
+
+    Lexer state;
+    LexerInit(&state, source);
+    state.cursor = source + restart;
+    state.token_start = state.cursor;
+    state.line_start = RelexLineStart(source, restart);
+    state.uncounted_end = state.line_start;
+
+    /* Lex until a token starts where an old one did, both past the edit */
+    TokenStream lexed = CreateTokenStream(source);
+    int resume = old_count; // First old token kept after the new ones
+    int old = first;
+    Token current_token;
+    bool synchronized = false;
+    while(LexerScan(&state, &current_token))
+    {
+        uint32_t offset = LexerOffset(&state, state.token_start);
+        if(offset >= new_end)
+        {
+            uint32_t old_offset = (uint32_t)(offset - delta);
+            while(old < old_count && TokenStreamOffset(tokens, old) < old_offset)
+            {
+                old++;
+            }
+
+            if(old < old_count && TokenStreamOffset(tokens, old) == old_offset && old_offset >= old_end)
+            {
+                resume = old;
+                synchronized = true;
+                break;
+            }
+        }
+
+        TokenStreamPush(&lexed, &current_token, offset);
+    }
+
+    if(!synchronized)
+    {
+        Token eof_token = LexerEndOfFileToken(&state);
+        TokenStreamPush(&lexed, &eof_token, LexerOffset(&state, state.cursor));
+    }
+
+    TokenSplice splice;
+    splice.first = first;
+    splice.removed = resume - first;
+    splice.inserted = TokenStreamLength(&lexed);
+
+    /* The replaced tokens become part of the gap, the new ones are put at its start,
+     * and the tokens after it move by the length change */
+    TokenStreamMoveGap(tokens, resume);
+    tokens->gap = first;
+    tokens->gap_length += splice.removed;
+    RelexWidenGap(tokens, splice.inserted);
+    if(splice.inserted)
+    {
+        memcpy(tokens->kinds + first, lexed.kinds, splice.inserted * sizeof *tokens->kinds);
+        memcpy(tokens->offsets + first, lexed.offsets, splice.inserted * sizeof *tokens->offsets);
+        memcpy(tokens->payloads + first, lexed.payloads, splice.inserted * sizeof *tokens->payloads);
+    }
+    tokens->gap += splice.inserted;
+    tokens->gap_length -= splice.inserted;
+    tokens->gap_shift += (uint32_t)delta;
+
+    /* Errors are sorted by index: drop the replaced ones, put the new ones in their
+     * place and renumber the ones after */
+    int error_count = BufferLength(tokens->errors);
+    int first_error = 0;
+    while(first_error < error_count && tokens->errors[first_error].index < first)
+    {
+        first_error++;
+    }
+
+    int last_error = first_error;
+    while(last_error < error_count && tokens->errors[last_error].index < resume)
+    {
+        last_error++;
+    }
+
+    int new_errors = BufferLength(lexed.errors);
+    int i = 0;
+    while(i < new_errors)
+    {
+        lexed.errors[i].index += first;
+        i++;
+    }
+
+    tokens->errors = RelexSpliceBuffer(tokens->errors, sizeof *tokens->errors, first_error, last_error - first_error,
+                                       lexed.errors, new_errors);
+
+    i = first_error + new_errors;
+    while(i < BufferLength(tokens->errors))
+    {
+        tokens->errors[i].index += splice.inserted - splice.removed;
+        i++;
+    }
+
+    tokens->source = source;
+    RelexLineStarts(tokens, edit);
+    FreeTokenStream(&lexed);
+
+    return splice;
+}
@@ -0,0 +1,388 @@
+/* Parallel lexing of a single large input
+ *
+ * The input is cut into chunks at newlines and each chunk is lexed on its own thread.
+ * A newline is a safe place to cut unless it is inside a string literal, and whether
+ * it is depends on every quote before it. So there are three passes, each running
+ * the chunks on a ThreadPool:
+ *
+ * 1. Pre-scan: every chunk runs a small quote automaton (outside a string, inside
+ *    one, inside one right after a backslash) from both possible starting states
+ *    at once and records the state it ends in for each, plus its newline count.
+ *    Chaining those from the first chunk tells which cuts are outside strings and
+ *    which line every chunk starts on. Cuts inside a string are dropped, merging
+ *    the chunk into the one before it.
+ * 2. Lex: every chunk is lexed into its own TokenStream with its own interner and
+ *    its own diagnostics, starting at the right line. The lexer is given the end of
+ *    the chunk and told more input follows, so it stops at the chunk's last newline.
+ * 3. Stitch: the chunk interners are merged into the caller's interner in chunk
+ *    order, which hands out the same symbols a single lexer would have, and then
+ *    every chunk copies its tokens into place with its symbols renumbered.
+ *
+ * Diagnostics are passed on to the caller's context in chunk order afterwards. */
+
+#define LEXER_PARALLEL_MIN_CHUNK_SIZE (256 * 1024)
+
+enum
+{
+    QUOTE_OUTSIDE,
+    QUOTE_INSIDE,
+    QUOTE_ESCAPED
+};
+
+typedef struct
+{
+    char const *source; // Whole input
+    char const *start;
+    char const *end; // Just past the chunk's last newline, or the input's terminator
+    bool last;
+
+    /* Pre-scan */
+    int newlines;
+    uint8_t end_state[2]; // Indexed by the state the chunk starts in
+
+    /* Lex */
+    int first_line;
+    TokenStream tokens;
+    Interner interner;
+    char *diagnostics;
+    size_t diagnostics_length;
+    int errors_reported;
+
+    /* Stitch */
+    Symbol *symbols; // symbols[local symbol] is the caller's symbol
+    int first_token;
+    int first_error;
+    TokenStream *result;
+} LexerChunk;
+
+/* Rows are states, columns are: other character, '"', '\\' */
+static uint8_t const lexer_quote_transition[3][3] = {
+    [QUOTE_OUTSIDE] = { QUOTE_OUTSIDE, QUOTE_INSIDE, QUOTE_OUTSIDE },
+    [QUOTE_INSIDE] = { QUOTE_INSIDE, QUOTE_OUTSIDE, QUOTE_ESCAPED },
+    [QUOTE_ESCAPED] = { QUOTE_INSIDE, QUOTE_INSIDE, QUOTE_INSIDE }
+};
+
+/* Runs one quote state from p to end, jumping between quotes and backslashes */
+static uint8_t LexerQuoteRun(char const *p, char const *end, uint8_t state)
+{
+    while(p < end)
+    {
+        if(state == QUOTE_OUTSIDE)
+        {
+            p = memchr(p, '"', end - p);
+            if(!p)
+            {
+                break;
+            }
+
+            state = QUOTE_INSIDE;
+            p++;
+        } else if(state == QUOTE_ESCAPED)
+        {
+            state = QUOTE_INSIDE;
+            p++;
+        } else
+        {
+            /* The input is NUL terminated, so this stops at the latest at its end */
+            p = LexerStringEnd(p);
+            if(p >= end)
+            {
+                break;
+            }
+
+            state = *p == '"' ? QUOTE_OUTSIDE : QUOTE_ESCAPED;
+            p++;
+        }
+    }
+
+    return state;
+}
+
+static void LexerChunkPrescan(void *argument)
+{
+    LexerChunk *chunk = argument;
+    uint8_t from_outside = QUOTE_OUTSIDE;
+    uint8_t from_inside = QUOTE_INSIDE;
+
+    /* Both starting states in step until they agree, which they usually do at the
+     * first quote, and from then on one is enough */
+    char const *p = chunk->start;
+    while(p < chunk->end && from_outside != from_inside)
+    {
+        char c = *p++;
+        int column = c == '"' ? 1 : c == '\\' ? 2 : 0;
+        from_outside = lexer_quote_transition[from_outside][column];
+        from_inside = lexer_quote_transition[from_inside][column];
+    }
+
+    if(from_outside == from_inside)
+    {
+        from_outside = LexerQuoteRun(p, chunk->end, from_outside);
+        from_inside = from_outside;
+    }
+
+    int newlines = 0;
+    p = chunk->start;
+    while(p < chunk->end)
+    {
+        newlines += *p++ == '\n';
+    }
+
+    chunk->newlines = newlines;
+    chunk->end_state[QUOTE_OUTSIDE] = from_outside;
+    chunk->end_state[QUOTE_INSIDE] = from_inside;
+}
+
+static void LexerChunkLex(void *argument)
+{
+    LexerChunk *chunk = argument;
+
+    memset(&chunk->interner, 0, sizeof chunk->interner);
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &chunk->interner;
+    context.output = NULL;
+    context.diagnostics = open_memstream(&chunk->diagnostics, &chunk->diagnostics_length);
+    Assert(context.diagnostics);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    Lexer state;
+    LexerInit(&state, chunk->source);
+    state.cursor = chunk->start;
+    state.token_start = chunk->start;
+    state.line = chunk->first_line;
+    state.line_start = LexerOffset(&state, chunk->start);
+    if(!chunk->last)
+    {
+        state.end = chunk->end;
+        state.more_input = true;
+    }
+
+    chunk->tokens = CreateTokenStream(chunk->source);
+    Token current_token;
+    while(LexerScan(&state, &current_token))
+    {
+        TokenStreamPush(&chunk->tokens, &current_token, LexerOffset(&state, state.token_start));
+    }
+
+    if(chunk->last)
+    {
+        Token eof_token = LexerEndOfFileToken(&state);
+        TokenStreamPush(&chunk->tokens, &eof_token, LexerOffset(&state, state.cursor));
+    }
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    chunk->errors_reported = context.errors_reported;
+}
+
+static void LexerChunkStitch(void *argument)
+{
+    LexerChunk *chunk = argument;
+    TokenStream *result = chunk->result;
+    int count = TokenStreamLength(&chunk->tokens);
+
+    memcpy(result->kinds + chunk->first_token, chunk->tokens.kinds, count * sizeof *result->kinds);
+    memcpy(result->offsets + chunk->first_token, chunk->tokens.offsets, count * sizeof *result->offsets);
+
+    TokenPayload *payloads = result->payloads + chunk->first_token;
+    int i = 0;
+    while(i < count)
+    {
+        TokenPayload payload = chunk->tokens.payloads[i];
+        payloads[i] = chunk->tokens.kinds[i] == TOKEN_IDENTIFIER ? chunk->symbols[payload] : payload;
+        i++;
+    }
+
+    i = 0;
+    while(i < BufferLength(chunk->tokens.errors))
+    {
+        TokenError error = chunk->tokens.errors[i];
+        error.index += chunk->first_token;
+        result->errors[chunk->first_error + i] = error;
+        i++;
+    }
+
+    FreeTokenStream(&chunk->tokens);
+    InternerFree(&chunk->interner);
+    free(chunk->symbols);
+    chunk->symbols = NULL;
+}
+
+/* Resizes a Buffer to exactly `length` items, contents undefined */
+static void *LexerParallelBuffer(void *buffer, int item_size, int length)
+{
+    if(length == 0)
+    {
+        return buffer;
+    }
+
+    BufferReallocate(&buffer, item_size, length);
+    BufferHeaderGet(buffer)->length = length;
+
+    return buffer;
+}
+
+/* Same tokens, symbols and diagnostics as LexerRunCompact(source), lexed in up to
+ * chunk_count pieces on `pool`. Must not be called from a task running in the pool. */
+TokenStream LexerRunParallel(ThreadPool *pool, char const *source, size_t length, int chunk_count)
+{
+    if(chunk_count > (int)(length / LEXER_PARALLEL_MIN_CHUNK_SIZE))
+    {
+        chunk_count = (int)(length / LEXER_PARALLEL_MIN_CHUNK_SIZE);
+    }
+
+    if(chunk_count <= 1)
+    {
+        return LexerRunCompact(source);
+    }
+
+    /* Scan mode selection is not thread safe, so settle it before the workers start */
+    if(lexer_scan_mode == LEXER_SCAN_AUTO)
+    {
+        LexerSelectScanMode(LEXER_SCAN_AUTO);
+    }
+
+    LexerChunk *chunks = calloc(chunk_count, sizeof *chunks);
+    Assert(chunks);
+
+    /* Cut just after the first newline at or past each even share of the input */
+    char const *input_end = source + length;
+    char const *start = source;
+    int count = 0;
+    while(count < chunk_count && start < input_end)
+    {
+        char const *end = input_end;
+        if(count < chunk_count - 1)
+        {
+            char const *target = source + (length / chunk_count) * (count + 1);
+            if(target < start)
+            {
+                target = start;
+            }
+
+            char const *newline = memchr(target, '\n', input_end - target);
+            if(newline)
+            {
+                end = newline + 1;
+            }
+        }
+
+        chunks[count].source = source;
+        chunks[count].start = start;
+        chunks[count].end = end;
+        count++;
+        start = end;
+    }
+
+    int i = 0;
+    while(i < count)
+    {
+        ThreadPoolSubmit(pool, LexerChunkPrescan, &chunks[i]);
+        i++;
+    }
+    ThreadPoolWait(pool);
+
+    /* Follow the quote state along the cuts, merging away cuts inside strings. A chunk
+     * ends on a newline, so it never ends right after a backslash. */
+    int kept = 0;
+    int line = 1;
+    uint8_t state = QUOTE_OUTSIDE;
+    i = 0;
+    while(i < count)
+    {
+        if(i == 0 || state == QUOTE_OUTSIDE)
+        {
+            chunks[kept] = chunks[i];
+            chunks[kept].first_line = line;
+            kept++;
+        } else
+        {
+            chunks[kept - 1].end = chunks[i].end;
+        }
+
+        line += chunks[i].newlines;
+        state = chunks[i].end_state[state == QUOTE_OUTSIDE ? QUOTE_OUTSIDE : QUOTE_INSIDE];
+        i++;
+    }
+
+    count = kept;
+    chunks[count - 1].last = true;
+
+    i = 0;
+    while(i < count)
+    {
+        ThreadPoolSubmit(pool, LexerChunkLex, &chunks[i]);
+        i++;
+    }
+    ThreadPoolWait(pool);
+
+    /* Interning each chunk's names in chunk order, and within a chunk in the order
+     * they first appeared, numbers them the way one lexer going front to back would */
+    CompileContext *context = CurrentContext();
+    TokenStream result = CreateTokenStream(source);
+    int token_count = 0;
+    int error_count = 0;
+    i = 0;
+    while(i < count)
+    {
+        LexerChunk *chunk = &chunks[i];
+        int symbol_count = InternerCount(&chunk->interner);
+        chunk->symbols = malloc((symbol_count + 1) * sizeof *chunk->symbols);
+        Assert(chunk->symbols);
+        chunk->symbols[0] = 0;
+
+        Symbol symbol = 1;
+        while((int)symbol <= symbol_count)
+        {
+            chunk->symbols[symbol] = InternString(context->interner, InternerString(&chunk->interner, symbol),
+                                                  InternerLength(&chunk->interner, symbol));
+            symbol++;
+        }
+
+        chunk->first_token = token_count;
+        chunk->first_error = error_count;
+        chunk->result = &result;
+        token_count += TokenStreamLength(&chunk->tokens);
+        error_count += BufferLength(chunk->tokens.errors);
+        i++;
+    }
+
+    result.kinds = LexerParallelBuffer(result.kinds, sizeof *result.kinds, token_count);
+    result.offsets = LexerParallelBuffer(result.offsets, sizeof *result.offsets, token_count);
+    result.payloads = LexerParallelBuffer(result.payloads, sizeof *result.payloads, token_count);
+    result.errors = LexerParallelBuffer(result.errors, sizeof *result.errors, error_count);
+
+    i = 0;
+    while(i < count)
+    {
+        ThreadPoolSubmit(pool, LexerChunkStitch, &chunks[i]);
+        i++;
+    }
+    ThreadPoolWait(pool);
+
+    /* Every diagnostic is one line; a chunk that hit the error limit also wrote the
+     * limit message, which the caller's context writes itself if it gets there */
+    i = 0;
+    while(i < count)
+    {
+        char const *line_start = chunks[i].diagnostics;
+        char const *diagnostics_end = chunks[i].diagnostics + chunks[i].diagnostics_length;
+        int forwarded = 0;
+        while(line_start < diagnostics_end && forwarded < chunks[i].errors_reported && forwarded < max_allowed_errors)
+        {
+            char const *newline = memchr(line_start, '\n', diagnostics_end - line_start);
+            char const *next = newline ? newline + 1 : diagnostics_end;
+            ReportError("%.*s", (int)(next - line_start), line_start);
+            line_start = next;
+            forwarded++;
+        }
+
+        free(chunks[i].diagnostics);
+        i++;
+    }
+
+    free(chunks);
+
+    return result;
+}
@@ -0,0 +1,188 @@
+/* Streaming lexer
+ *
+ * LexerStream reads its input through a file descriptor in fixed size chunks and
+ * hands out one token per LexerNext call, so memory use does not depend on the size
+ * of the input. A token that straddles two reads is rescanned once the rest of it
+ * has been read; when a single token is longer than the chunk, the chunk grows to fit.
+ *
+ * String spans use offsets into the whole input, but the text itself is only kept
+ * until the next LexerNext call (see LexerStreamText). Offsets wrap past 4 GiB;
+ * line and column numbers do not. */
+
+#define LEXER_STREAM_READ_SIZE (64 * 1024)
+
+typedef struct
+{
+    Lexer lexer;
+    int file_descriptor;
+    char *chunk; // NUL terminated
+    int chunk_length;
+    int chunk_capacity;
+    int read_size;
+    bool end_of_input;
+    bool stopped_at_nul;
+} LexerStream;
+
+void LexerStreamInit(LexerStream *stream, int file_descriptor, int read_size)
+{
+    stream->file_descriptor = file_descriptor;
+    stream->read_size = read_size;
+    stream->chunk_capacity = read_size * 2;
+    stream->chunk = malloc(stream->chunk_capacity + 1);
+    Assert(stream->chunk);
+    stream->chunk[0] = 0;
+    stream->chunk_length = 0;
+    stream->end_of_input = false;
+    stream->stopped_at_nul = false;
+
+    LexerInit(&stream->lexer, stream->chunk);
+    stream->lexer.end = stream->chunk;
+    stream->lexer.more_input = true;
+}
+
+/* Drops everything before the lexer's cursor and reads the next chunk after what is left */
+static void LexerStreamRefill(LexerStream *stream)
+{
+    Lexer *lexer = &stream->lexer;
+    int consumed = (int)(lexer->cursor - stream->chunk);
+    int kept = stream->chunk_length - consumed;
+
+    memmove(stream->chunk, stream->chunk + consumed, kept);
+    lexer->base_offset += (uint32_t)consumed;
+
+    if(kept + stream->read_size > stream->chunk_capacity)
+    {
+        stream->chunk_capacity = kept + stream->read_size;
+        stream->chunk = realloc(stream->chunk, stream->chunk_capacity + 1);
+        Assert(stream->chunk);
+    }
+
+    ssize_t count;
+    do
+    {
+        count = read(stream->file_descriptor, stream->chunk + kept, stream->read_size);
+    } while(count < 0 && errno == EINTR);
+
+    if(count < 0)
+    {
+        ReportError("could not read input: %s\n", strerror(errno));
+        count = 0;
+    }
+
+    if(count == 0)
+    {
+        stream->end_of_input = true;
+    }
+
+    stream->chunk_length = kept + (int)count;
+    stream->chunk[stream->chunk_length] = 0;
+
+    lexer->source = stream->chunk;
+    lexer->cursor = stream->chunk;
+    lexer->token_start = stream->chunk;
+    lexer->end = stream->chunk + stream->chunk_length;
+    lexer->more_input = !stream->end_of_input;
+}
+
+/* Returns the next token and stores the offset of its first character in *offset.
+ * Keeps returning TOKEN_EOF once the input is exhausted. */
+Token LexerNext(LexerStream *stream, uint32_t *offset)
+{
+    Lexer *lexer = &stream->lexer;
+    Token token;
+
+    for(;;)
+    {
+        if(LexerScan(lexer, &token))
+        {
+            *offset = LexerOffset(lexer, lexer->token_start);
+            return token;
+        }
+
+        /* A NUL before the end of the chunk ends the input, same as for a SourceFile.
+         * Otherwise the scan stopped at the end of the chunk and needs more input. */
+        bool embedded_nul = *lexer->cursor == 0 && lexer->cursor < lexer->end;
+        if(!lexer->more_input || embedded_nul)
+        {
+            *offset = LexerOffset(lexer, lexer->cursor);
+            if(embedded_nul && !stream->stopped_at_nul)
+            {
+                ReportError("embedded NUL at offset %u\n", *offset);
+                stream->stopped_at_nul = true;
+            }
+            return LexerEndOfFileToken(lexer);
+        }
+
+        LexerStreamRefill(stream);
+    }
+}
+
+/* Text at `offset` of the input, valid until the next LexerNext call */
+char const *LexerStreamText(LexerStream *stream, uint32_t offset)
+{
+    return stream->chunk + (offset - stream->lexer.base_offset);
+}
+
+void LexerStreamFree(LexerStream *stream)
+{
+    free(stream->chunk);
+    stream->chunk = NULL;
+}
+
+/* Lookahead window between a LexerStream and the parser
+ *
+ * Tokens are numbered in the order they are produced and token n lives in slot
+ * n % TOKEN_RING_SIZE. The ring is topped up as the parser consumes tokens, never
+ * overwriting the last token the parser matched. */
+
+#define TOKEN_RING_SIZE 64
+
+typedef struct
+{
+    LexerStream *input;
+    uint8_t kinds[TOKEN_RING_SIZE];
+    TokenPayload payloads[TOKEN_RING_SIZE];
+    int lines[TOKEN_RING_SIZE];
+    int columns[TOKEN_RING_SIZE];
+    int produced;
+    bool finished;
+    size_t *token_counts; // Indexed by kind, counts every token lexed when not NULL
+    uint32_t end_offset; // Where the end of file token is, once it has been lexed
+} TokenRing;
+
+/* Lexes ahead until the ring is full, keeping tokens numbered keep_from and later */
+void TokenRingFill(TokenRing *ring, int keep_from)
+{
+    while(!ring->finished && ring->produced - keep_from < TOKEN_RING_SIZE)
+    {
+        uint32_t offset;
+        Token token = LexerNext(ring->input, &offset);
+
+        int slot = ring->produced & (TOKEN_RING_SIZE - 1);
+        ring->kinds[slot] = (uint8_t)token.kind;
+        ring->payloads[slot] = TokenPayloadOf(&token);
+        ring->lines[slot] = token.line;
+        ring->columns[slot] = token.column;
+        ring->produced++;
+        if(ring->token_counts)
+        {
+            ring->token_counts[token.kind]++;
+        }
+
+        if(token.kind == TOKEN_EOF)
+        {
+            ring->finished = true;
+            ring->end_offset = offset;
+        }
+    }
+}
+
+void TokenRingInit(TokenRing *ring, LexerStream *input, size_t *token_counts)
+{
+    ring->input = input;
+    ring->produced = 0;
+    ring->finished = false;
+    ring->token_counts = token_counts;
+    ring->end_offset = 0;
+    TokenRingFill(ring, 0);
+}
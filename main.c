@@ -1,18 +1,39 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdarg.h>
 #include <string.h>
 #include <limits.h>
 #include <stdbool.h>
-#include <ctype.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 
 /* Assert macro */
 #define Assert(condition) \
     if((condition) == false) fprintf(stderr, "Assertion failed!\nFile: %s\nLine: %d\n", __FILE__, __LINE__);
 
 #include "buffer.c"
+#include "thread_pool.c"
+#include "arena.c"
 #include "string_builder.c"
+#include "intern.c"
 
 /* Token Types */
 typedef enum
@@ -31,6 +52,9 @@ typedef enum
     
     TOKEN_LESS_THAN,
     TOKEN_GREATER_THAN,
+    TOKEN_LESS_EQUAL,
+    TOKEN_GREATER_EQUAL,
+    TOKEN_NOT_EQUAL,
     
     TOKEN_LEFT_PAREN,
     TOKEN_RIGHT_PAREN,
@@ -122,6 +146,49 @@ static char const *token_string_table[] = {
     [TOKEN_IDENTIFIER] = "identifier",
     [TOKEN_STRING] = "string",
     
+    [TOKEN_PLUS] = "+",
+    [TOKEN_MINUS] = "-",
+    [TOKEN_STAR] = "*",
+    [TOKEN_SLASH] = "/",
+    [TOKEN_PERCENT] = "%",
+    [TOKEN_EQUAL] = "=",
+    [TOKEN_DOUBLE_EQUALS] = "==",
+    [TOKEN_LESS_THAN] = "<",
+    [TOKEN_GREATER_THAN] = ">",
+    [TOKEN_LESS_EQUAL] = "<=",
+    [TOKEN_GREATER_EQUAL] = ">=",
+    [TOKEN_NOT_EQUAL] = "!=",
+    [TOKEN_LEFT_PAREN] = "(",
+    [TOKEN_RIGHT_PAREN] = ")",
+    [TOKEN_LEFT_BRACE] = "{",
+    [TOKEN_RIGHT_BRACE] = "}",
+    [TOKEN_LEFT_BRACKET] = "[",
+    [TOKEN_RIGHT_BRACKET] = "]",
+    [TOKEN_LOGICAL_OR] = "||",
+    [TOKEN_LOGICAL_AND] = "&&",
+    [TOKEN_BITWISE_OR] = "|",
+    [TOKEN_BITWISE_AND] = "&",
+    [TOKEN_BITWISE_XOR] = "^",
+    [TOKEN_BITWISE_NOT] = "~",
+    [TOKEN_BITWISE_LEFT_SHIFT] = "<<",
+    [TOKEN_BITWISE_RIGHT_SHIFT] = ">>",
+    [TOKEN_PLUS_ASSIGNMENT] = "+=",
+    [TOKEN_MINUS_ASSIGNMENT] = "-=",
+    [TOKEN_STAR_ASSIGNMENT] = "*=",
+    [TOKEN_SLASH_ASSIGNMENT] = "/=",
+    [TOKEN_PERCENT_ASSIGNMENT] = "%=",
+    [TOKEN_OR_ASSIGNMENT] = "|=",
+    [TOKEN_AND_ASSIGNMENT] = "&=",
+    [TOKEN_XOR_ASSIGNMENT] = "^=",
+    [TOKEN_NOT_ASSIGNMENT] = "~=",
+    [TOKEN_LEFT_SHIFT_ASSIGNMENT] = "<<=",
+    [TOKEN_RIGHT_SHIFT_ASSIGNMENT] = ">>=",
+    [TOKEN_COMMA] = ",",
+    [TOKEN_COLON] = ":",
+    [TOKEN_SEMICOLON] = ";",
+    [TOKEN_QUESTION_MARK] = "?",
+    [TOKEN_EXCLAMATION_POINT] = "!",
+    
     [TOKEN_IF] = "if",
     [TOKEN_ELSE] = "else",
     [TOKEN_WHILE] = "while",
@@ -169,6 +236,13 @@ typedef enum
     ERROR_INTEGER_OVERFLOW
 } ErrorKind;
 
+/* A range of the lexer's input, relative to the start of the input */
+typedef struct
+{
+    uint32_t offset;
+    uint32_t length;
+} TokenSpan;
+
 /* Holds all the information about a token */
 typedef struct
 {
@@ -180,142 +254,403 @@ typedef struct
     union
     {
         unsigned int number; // Used only when kind == TOKEN_NUMBER
-        char name[32]; // Used only when kind == TOKEN_IDENTIFIER
-        char *string; // Used only when kind == TOKEN_STRING
+        Symbol symbol; // Used only when kind == TOKEN_IDENTIFIER, see CompileContext
+        TokenSpan string; // Used only when kind == TOKEN_STRING, contents without the quotes
     };
 } Token;
 
-static int errors_reported = 0;
+/* Per translation unit state
+ *
+ * Everything that used to be global while compiling a file lives here, so several
+ * files can be compiled at once. Each thread has a current context; the main thread
+ * starts out with default_context, which writes straight to stdout and stderr and
+ * exits once too many errors have been reported. Contexts for a batch of files write
+ * into memory instead and are printed in order once the whole batch is done. */
+typedef struct CompileStatistics CompileStatistics;
+
+typedef struct
+{
+    Interner *interner;
+    FILE *output;
+    FILE *diagnostics;
+    int errors_reported;
+    bool had_error;
+    CompileStatistics *statistics; // NULL unless --stats or --stats-json was given
+    char const *path; // File being compiled, put in front of each diagnostic; NULL for none
+} CompileContext;
+
 static int max_allowed_errors = 20;
-static bool had_error = false;
+static CompileContext default_context;
+static _Thread_local CompileContext *current_context = NULL;
+
+CompileContext *CurrentContext(void)
+{
+    if(!current_context)
+    {
+        if(!default_context.interner)
+        {
+            default_context.interner = &global_interner;
+            default_context.output = stdout;
+            default_context.diagnostics = stderr;
+        }
+        
+        current_context = &default_context;
+    }
+    
+    return current_context;
+}
+
+/* Returns the context that was current before */
+CompileContext *SetCurrentContext(CompileContext *context)
+{
+    CompileContext *previous = CurrentContext();
+    current_context = context;
+    
+    return previous;
+}
+
+/* Writes one diagnostic line for `path`. Lines with a line and column read
+ * "path:line:column: message", the others "path: message"; a line that already
+ * names the file is written as it is. */
+void WriteDiagnostic(FILE *stream, char const *path, char const *line, size_t length)
+{
+    size_t path_length = strlen(path);
+    if(length > path_length && memcmp(line, path, path_length) == 0 && line[path_length] == ':')
+    {
+        fwrite(line, 1, length, stream);
+        return;
+    }
+
+    size_t digits = 0;
+    while(digits < length && line[digits] >= '0' && line[digits] <= '9')
+    {
+        digits++;
+    }
+
+    bool located = digits > 0 && digits < length && line[digits] == ':';
+    fprintf(stream, located ? "%s:" : "%s: ", path);
+    fwrite(line, 1, length, stream);
+}
 
 /* Our basic way of reporting errors */
 void ReportError(char const *format, ...)
 {
-    if(errors_reported >= max_allowed_errors)
+    CompileContext *context = CurrentContext();
+    
+    if(context->errors_reported >= max_allowed_errors)
     {
-        fprintf(stderr, "Too many errors!\nMax error limit is %d\n", max_allowed_errors);
-        exit(1);
+        if(context == &default_context)
+        {
+            fprintf(stderr, "Too many errors!\nMax error limit is %d\n", max_allowed_errors);
+            exit(1);
+        }
+        
+        /* Other threads are still working, so only this file stops reporting */
+        if(context->errors_reported == max_allowed_errors)
+        {
+            fprintf(context->diagnostics, "Too many errors!\nMax error limit is %d\n", max_allowed_errors);
+            context->errors_reported++;
+        }
+        
+        return;
     }
     
     va_list argument_list;
     va_start(argument_list, format);
-    vfprintf(stderr, format, argument_list);
+    if(context->path)
+    {
+        char message[256];
+        va_list copy;
+        va_copy(copy, argument_list);
+        int length = vsnprintf(message, sizeof message, format, argument_list);
+        char *text = message;
+        if(length >= (int)sizeof message)
+        {
+            text = malloc(length + 1);
+            Assert(text);
+            vsnprintf(text, length + 1, format, copy);
+        }
+        va_end(copy);
+
+        WriteDiagnostic(context->diagnostics, context->path, text, length);
+        if(text != message)
+        {
+            free(text);
+        }
+    } else
+    {
+        vfprintf(context->diagnostics, format, argument_list);
+    }
     va_end(argument_list);
     
-    errors_reported++;
-    had_error = true;
+    context->errors_reported++;
+    context->had_error = true;
 }
 
-#include "parse.c"
+#include "token_stream.c"
+#include "source.c"
+#include "scan.c"
 
-#define TOKEN_CASE1(ch, token_kind) \
-case ch: \
-{ \
-    current_token.kind = token_kind; \
-    add_token = true; \
-    lexer++; \
-} \
-break \
-
-#define TOKEN_CASE2(ch, ch2, token_kind1, token_kind2) \
-case ch: \
-{ \
-    current_token.kind = token_kind1; \
-    c = *++lexer; \
-    if(c == ch2) \
-    { \
-        current_token.kind = token_kind2; \
-        lexer++; \
-    } \
-    add_token = true; \
-} \
-break \
-
-#define TOKEN_CASE3(ch, ch2, ch3, token_kind1, token_kind2, token_kind3) \
-case ch: \
-{ \
-    current_token.kind = token_kind1; \
-    c = *++lexer; \
-    if(c == ch2) \
-    { \
-        current_token.kind = token_kind2; \
-        c = *++lexer;\
-        if(c == ch3) \
-        { \
-            current_token.kind = token_kind3; \
-            lexer++; \
-        } \
-    } \
-    add_token = true; \
-} \
-break \
-
-Token *LexerRun(char *lexer)
-{
-    int current_line = 1;
-    int current_column = 1;
-    Token *list_of_tokens = NULL;
+/* Keyword recognition
+ *
+ * Every keyword is placed in a 128 slot table at compile time using a hash of its
+ * length, first and last character. The hash is collision free over the keyword set,
+ * so classifying an identifier costs one table lookup and at most one memcmp.
+ * If a keyword is added and two entries land in the same slot, -Woverride-init
+ * (enabled by -Wextra) will point at the collision and the multipliers need retuning. */
+#define KEYWORD_TABLE_SIZE 128
+#define KEYWORD_MIN_LENGTH 2
+#define KEYWORD_MAX_LENGTH 9
+#define KeywordHash(length, first, last) \
+(((length) + (unsigned char)(first) * 9 + (unsigned char)(last) * 31) & (KEYWORD_TABLE_SIZE - 1))
+
+#define KEYWORD_ENTRY(string, first, last, token_kind) \
+[KeywordHash(sizeof string - 1, first, last)] = { string, sizeof string - 1, token_kind }
+
+typedef struct
+{
+    char const *name;
+    int length;
+    TokenKind kind;
+} KeywordEntry;
+
+static KeywordEntry const keyword_table[KEYWORD_TABLE_SIZE] = {
+    KEYWORD_ENTRY("if", 'i', 'f', TOKEN_IF),
+    KEYWORD_ENTRY("else", 'e', 'e', TOKEN_ELSE),
+    KEYWORD_ENTRY("while", 'w', 'e', TOKEN_WHILE),
+    KEYWORD_ENTRY("for", 'f', 'r', TOKEN_FOR),
+    KEYWORD_ENTRY("return", 'r', 'n', TOKEN_RETURN),
+    KEYWORD_ENTRY("switch", 's', 'h', TOKEN_SWITCH),
+    KEYWORD_ENTRY("break", 'b', 'k', TOKEN_BREAK),
+    KEYWORD_ENTRY("case", 'c', 'e', TOKEN_CASE),
+    KEYWORD_ENTRY("do", 'd', 'o', TOKEN_DO),
+    KEYWORD_ENTRY("typedef", 't', 'f', TOKEN_TYPEDEF),
+    KEYWORD_ENTRY("continue", 'c', 'e', TOKEN_CONTINUE),
+    KEYWORD_ENTRY("goto", 'g', 'o', TOKEN_GOTO),
+    KEYWORD_ENTRY("struct", 's', 't', TOKEN_STRUCT),
+    KEYWORD_ENTRY("union", 'u', 'n', TOKEN_UNION),
+    KEYWORD_ENTRY("enum", 'e', 'm', TOKEN_ENUM),
+    KEYWORD_ENTRY("char", 'c', 'r', TOKEN_CHAR),
+    KEYWORD_ENTRY("short", 's', 't', TOKEN_SHORT),
+    KEYWORD_ENTRY("int", 'i', 't', TOKEN_INT),
+    KEYWORD_ENTRY("long", 'l', 'g', TOKEN_LONG),
+    KEYWORD_ENTRY("float", 'f', 't', TOKEN_FLOAT),
+    KEYWORD_ENTRY("double", 'd', 'e', TOKEN_DOUBLE),
+    KEYWORD_ENTRY("signed", 's', 'd', TOKEN_SIGNED),
+    KEYWORD_ENTRY("unsigned", 'u', 'd', TOKEN_UNSIGNED),
+    KEYWORD_ENTRY("register", 'r', 'r', TOKEN_REGISTER),
+    KEYWORD_ENTRY("restrict", 'r', 't', TOKEN_RESTRICT),
+    KEYWORD_ENTRY("volatile", 'v', 'e', TOKEN_VOLATILE),
+    KEYWORD_ENTRY("sizeof", 's', 'f', TOKEN_SIZEOF),
+    KEYWORD_ENTRY("inline", 'i', 'e', TOKEN_INLINE),
+    KEYWORD_ENTRY("static", 's', 'c', TOKEN_STATIC),
+    KEYWORD_ENTRY("extern", 'e', 'n', TOKEN_EXTERN),
+    KEYWORD_ENTRY("auto", 'a', 'o', TOKEN_AUTO),
+    KEYWORD_ENTRY("const", 'c', 't', TOKEN_CONST),
+    KEYWORD_ENTRY("_Bool", '_', 'l', TOKEN_BOOL),
+    KEYWORD_ENTRY("_Generic", '_', 'c', TOKEN_GENERIC),
+    KEYWORD_ENTRY("_Alignof", '_', 'f', TOKEN_ALIGNOF),
+    KEYWORD_ENTRY("_Noreturn", '_', 'n', TOKEN_NORETURN)
+};
+
+/* Returns the keyword kind for an exact match, TOKEN_IDENTIFIER otherwise */
+TokenKind LexerClassifyKeyword(char const *name, int length)
+{
+    if(length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
+    {
+        return TOKEN_IDENTIFIER;
+    }
+
+    KeywordEntry const *entry = &keyword_table[KeywordHash(length, name[0], name[length - 1])];
+    if(entry->length == length && memcmp(entry->name, name, length) == 0)
+    {
+        return entry->kind;
+    }
+
+    return TOKEN_IDENTIFIER;
+}
+
+/* Operators
+ *
+ * An operator is its first character, optionally followed by `second` and then
+ * `third`, each extending the token to a longer operator. If the character after
+ * the first is `alternate` instead of `second`, the operator is those two
+ * characters. A 0 character means there is no such longer operator. */
+typedef struct
+{
+    uint8_t kind;
+    char second;
+    uint8_t second_kind;
+    char third;
+    uint8_t third_kind;
+    char alternate;
+    uint8_t alternate_kind;
+} OperatorEntry;
+
+static OperatorEntry const operator_table[256] = {
+    ['+'] = { TOKEN_PLUS, '=', TOKEN_PLUS_ASSIGNMENT, 0, 0, 0, 0 },
+    ['-'] = { TOKEN_MINUS, '=', TOKEN_MINUS_ASSIGNMENT, 0, 0, 0, 0 },
+    ['*'] = { TOKEN_STAR, '=', TOKEN_STAR_ASSIGNMENT, 0, 0, 0, 0 },
+    ['/'] = { TOKEN_SLASH, '=', TOKEN_SLASH_ASSIGNMENT, 0, 0, 0, 0 },
+    ['%'] = { TOKEN_PERCENT, '=', TOKEN_PERCENT_ASSIGNMENT, 0, 0, 0, 0 },
+    ['='] = { TOKEN_EQUAL, '=', TOKEN_DOUBLE_EQUALS, 0, 0, 0, 0 },
+    ['!'] = { TOKEN_EXCLAMATION_POINT, '=', TOKEN_NOT_EQUAL, 0, 0, 0, 0 },
+
+    ['|'] = { TOKEN_BITWISE_OR, '|', TOKEN_LOGICAL_OR, 0, 0, '=', TOKEN_OR_ASSIGNMENT },
+    ['&'] = { TOKEN_BITWISE_AND, '&', TOKEN_LOGICAL_AND, 0, 0, '=', TOKEN_AND_ASSIGNMENT },
+    ['^'] = { TOKEN_BITWISE_XOR, '=', TOKEN_XOR_ASSIGNMENT, 0, 0, 0, 0 },
+    ['~'] = { TOKEN_BITWISE_NOT, '=', TOKEN_NOT_ASSIGNMENT, 0, 0, 0, 0 },
+    ['<'] = { TOKEN_LESS_THAN, '<', TOKEN_BITWISE_LEFT_SHIFT, '=', TOKEN_LEFT_SHIFT_ASSIGNMENT, '=', TOKEN_LESS_EQUAL },
+    ['>'] = { TOKEN_GREATER_THAN, '>', TOKEN_BITWISE_RIGHT_SHIFT, '=', TOKEN_RIGHT_SHIFT_ASSIGNMENT, '=', TOKEN_GREATER_EQUAL },
+
+    [','] = { TOKEN_COMMA, 0, 0, 0, 0, 0, 0 },
+    [':'] = { TOKEN_COLON, 0, 0, 0, 0, 0, 0 },
+    [';'] = { TOKEN_SEMICOLON, 0, 0, 0, 0, 0, 0 },
+    ['?'] = { TOKEN_QUESTION_MARK, 0, 0, 0, 0, 0, 0 },
+    ['('] = { TOKEN_LEFT_PAREN, 0, 0, 0, 0, 0, 0 },
+    [')'] = { TOKEN_RIGHT_PAREN, 0, 0, 0, 0, 0, 0 },
+    ['{'] = { TOKEN_LEFT_BRACE, 0, 0, 0, 0, 0, 0 },
+    ['}'] = { TOKEN_RIGHT_BRACE, 0, 0, 0, 0, 0, 0 },
+    ['['] = { TOKEN_LEFT_BRACKET, 0, 0, 0, 0, 0, 0 },
+    [']'] = { TOKEN_RIGHT_BRACKET, 0, 0, 0, 0, 0, 0 }
+};
+
+/* Position of the lexer within its input
+ *
+ * When the input arrives in chunks (see LexerStream), `source` is the current chunk,
+ * `base_offset` is where that chunk starts in the whole input and `end` is the
+ * chunk's NUL terminator. While `more_input` is set, a token that runs into `end`
+ * might continue in the next chunk, so LexerScan gives it back instead of finishing it. */
+typedef struct
+{
+    char const *source;
+    char const *cursor;
+    char const *token_start; // First character of the last token scanned
+    char const *end;
+    uint32_t base_offset;
+    uint32_t line_start; // Offset of the first character of the current line
+    int line;
+    uint32_t uncounted_end; // When not 0, `line` leaves out the newlines before this offset
+    bool more_input;
+    Interner *interner; // Identifiers go here, the current context's interner by default
+} Lexer;
+
+void LexerInit(Lexer *state, char const *source)
+{
+    state->source = source;
+    state->cursor = source;
+    state->token_start = source;
+    state->end = NULL;
+    state->base_offset = 0;
+    state->interner = CurrentContext()->interner;
+    state->line_start = 0;
+    state->line = 1;
+    state->uncounted_end = 0;
+    state->more_input = false;
+    
+    if(lexer_scan_mode == LEXER_SCAN_AUTO)
+    {
+        LexerSelectScanMode(LEXER_SCAN_AUTO);
+    }
+}
+
+/* Offset of `position` from the start of the whole input */
+static inline uint32_t LexerOffset(Lexer *state, char const *position)
+{
+    return state->base_offset + (uint32_t)(position - state->source);
+}
+
+static inline int LexerColumn(Lexer *state, char const *position)
+{
+    return (int)(LexerOffset(state, position) - state->line_start) + 1;
+}
+
+/* Line for a diagnostic. RelexTokenStream starts in the middle of a text and keeps no
+ * token lines, so it leaves the newlines before where it started to be counted here,
+ * in the rare case that they are needed. */
+static int LexerLine(Lexer *state)
+{
+    if(state->uncounted_end)
+    {
+        char const *cursor = state->source;
+        char const *end = state->source + state->uncounted_end;
+        while((cursor = memchr(cursor, '\n', end - cursor)) != NULL)
+        {
+            cursor++;
+            state->line++;
+        }
+        state->uncounted_end = 0;
+    }
+
+    return state->line;
+}
+
+/* Scans the next token into *token, skipping any whitespace before it.
+ * Returns false once the end of the input has been reached. */
+bool LexerScan(Lexer *state, Token *token)
+{
+    char const *lexer = state->cursor;
     Token current_token;
-    char *token_start = lexer;
-    char *token_end = token_start;
+    char const *token_start = lexer;
     bool add_token = false;
+    int string_newlines = 0;
+    char const *last_string_newline = NULL;
     char c;
-    while((c = *(token_start = lexer)) != 0)
+    current_token.error = ERROR_NONE;
+    while(!add_token && (c = *(token_start = lexer)) != 0)
     {
-        switch(c)
+        switch(lexer_action_table[(unsigned char)c])
         {
-            case ' ':
-            case '\t':
-            case '\n':
-            lexer++;
-            
-            if(c == '\n')
+            case LEXER_ACTION_WHITESPACE:
             {
-                current_line++;
+                int newlines = 0;
+                char const *last_newline = NULL;
+                lexer = LexerSkipWhitespace(lexer, &newlines, &last_newline);
+                
+                if(newlines)
+                {
+                    state->line += newlines;
+                    state->line_start = LexerOffset(state, last_newline + 1);
+                    
+                    /* A chunk of a split input ends on a newline, and the input goes on past
+                     * `end` without a terminator (see lexer_parallel.c) */
+                    if(state->more_input && lexer >= state->end)
+                    {
+                        goto end_of_chunk;
+                    }
+                }
             }
             break;
             
-            case '0':
-            case '1':
-            case '2':
-            case '3':
-            case '4':
-            case '5':
-            case '6':
-            case '7':
-            case '8':
-            case '9':
+            case LEXER_ACTION_NUMBER:
             {
-            	unsigned int result = 0;
-            	unsigned int base = 10;
-            	
-            	if(c == '0')
-            	{
-            	    base = 8;
-            	    c = *++lexer;
-            	    if(tolower(c) == 'x')
-            	    {
-            	        base = 16;
-            	    }
-            	}            	
-            	
-            	while(isalnum(c))
-            	{
-                    unsigned int digit = 0;
-                    
-                    c = tolower(c);
-                    if(isdigit(c))
-                    {
-                        digit = c - '0';
-                    } else if(c >= 'a' && c <= 'f')
+                unsigned int result = 0;
+                unsigned int base = 10;
+                char const *invalid_digit = NULL;
+                
+                if(c == '0')
+                {
+                    base = 8;
+                    c = *++lexer;
+                    if(c == 'x' || c == 'X')
                     {
-                        digit += (c - 'a') + 10;
+                        base = 16;
+                        c = *++lexer;
                     }
+                }
+                
+                while(character_class_table[(unsigned char)c] & CHARACTER_IDENTIFIER_CONTINUE)
+                {
+                    unsigned int digit = character_digit_table[(unsigned char)c];
                     
-                    if(digit > base)
+                    if(digit >= base)
                     {
-                        Assert(false)
+                        if(!invalid_digit)
+                        {
+                            invalid_digit = lexer;
+                        }
+                        
+                        digit = 0;
                     }
                     
                     if(result >= ((UINT_MAX - digit) / base))
@@ -329,177 +664,215 @@ Token *LexerRun(char *lexer)
                     c = *++lexer;
                 }
                 
+                /* A number running into the end of a partial input is lexed again once
+                 * more has been read, and reported then */
+                if(invalid_digit && !(state->more_input && lexer >= state->end))
+                {
+                    ReportError("%d:%d: invalid digit '%c' in base %u number\n",
+                                LexerLine(state), LexerColumn(state, invalid_digit), *invalid_digit, base);
+                }
+                
                 current_token.number = result;
                 current_token.kind = TOKEN_NUMBER;
                 add_token = true;
             }
             break;
             
-            case 'a':
-            case 'b':
-            case 'c':
-            case 'd':
-            case 'e':
-            case 'f':
-            case 'g':
-            case 'h':
-            case 'i':
-            case 'j':
-            case 'k':
-            case 'l':
-            case 'm':
-            case 'n':
-            case 'o':
-            case 'p':
-            case 'q':
-            case 'r':
-            case 's':
-            case 't':
-            case 'u':
-            case 'v':
-            case 'w':
-            case 'x':
-            case 'y':
-            case 'z':
-            case 'A':
-            case 'B':
-            case 'C':
-            case 'D':
-            case 'E':
-            case 'F':
-            case 'G':
-            case 'H':
-            case 'I':
-            case 'J':
-            case 'K':
-            case 'L':
-            case 'M':
-            case 'N':
-            case 'O':
-            case 'P':
-            case 'Q':
-            case 'R':
-            case 'S':
-            case 'T':
-            case 'U':
-            case 'V':
-            case 'W':
-            case 'X':
-            case 'Y':
-            case 'Z':
-            case '_':
+            case LEXER_ACTION_IDENTIFIER:
             {
-                int index = 0;
-                while(isalnum(c) || c == '_')
+                char const *start = lexer;
+                lexer = LexerIdentifierEnd(lexer);
+                
+                int length = (int)(lexer - start);
+                current_token.kind = LexerClassifyKeyword(start, length);
+                if(current_token.kind == TOKEN_IDENTIFIER && !(state->more_input && lexer >= state->end))
                 {
-                    current_token.name[index] = c;
-                    index++;
-                    c = *++lexer;
+                    current_token.symbol = InternString(state->interner, start, length);
                 }
                 
-                current_token.name[index] = 0;
-                current_token.kind = TOKEN_IDENTIFIER;
-                
-                int token_kind = TOKEN_KEYWORD_BEGIN;
-                bool found_keyword = false;
-                while((token_kind < TOKEN_KEYWORD_END) && !found_keyword)
+                add_token = true;
+            }
+            break;
+            
+            case LEXER_ACTION_STRING:
+            {
+                /* The span keeps escape sequences as written; a backslash only stops
+                 * the character after it from ending the literal */
+                char const *start = ++lexer;
+                for(;;)
                 {
-                    if(strncmp(current_token.name, token_string_table[token_kind], strlen(current_token.name)) == 0)
+                    lexer = LexerStringEnd(lexer);
+                    if(*lexer != '\\')
                     {
-                        current_token.kind = token_kind;
-                        found_keyword = true;
+                        break;
                     }
                     
-                    token_kind++;
+                    lexer++;
+                    if(*lexer != 0)
+                    {
+                        lexer++;
+                    }
+                }
+                
+                c = *lexer;
+                
+                current_token.string.offset = LexerOffset(state, start);
+                current_token.string.length = (uint32_t)(lexer - start);
+                current_token.kind = TOKEN_STRING;
+                
+                /* A string may span lines; the lines are counted once the token is kept */
+                char const *newline = start;
+                while((newline = memchr(newline, '\n', lexer - newline)) != NULL)
+                {
+                    string_newlines++;
+                    last_string_newline = newline++;
+                }
+                
+                if(c == '"')
+                {
+                    lexer++;
+                } else if(!state->more_input)
+                {
+                    ReportError("%d:%d: unterminated string literal\n",
+                                LexerLine(state), LexerColumn(state, token_start));
                 }
                 
                 add_token = true;
             }
             break;
             
-            case '"':
+            case LEXER_ACTION_OPERATOR:
             {
-                char *start = ++lexer;
-                char *end = start;
-                c = *lexer;
-                while(c != '"')
+                OperatorEntry const *entry = &operator_table[(unsigned char)c];
+                current_token.kind = entry->kind;
+                c = *++lexer;
+                if(entry->second && c == entry->second)
                 {
-                    end++;
+                    current_token.kind = entry->second_kind;
                     c = *++lexer;
+                    if(entry->third && c == entry->third)
+                    {
+                        current_token.kind = entry->third_kind;
+                        lexer++;
+                    }
+                } else if(entry->alternate && c == entry->alternate)
+                {
+                    current_token.kind = entry->alternate_kind;
+                    lexer++;
                 }
                 
-                int new_string_length = (int)(end - start);
-                char *new_string = malloc(new_string_length + 1);
-                memcpy(new_string, start, new_string_length);
-                new_string[new_string_length] = 0;
-                
-                current_token.string = new_string;
-                current_token.kind = TOKEN_STRING;
-                
-                lexer++;
-                
                 add_token = true;
             }
             break;
             
-            TOKEN_CASE2('+', '=', TOKEN_PLUS, TOKEN_PLUS_ASSIGNMENT);
-            TOKEN_CASE2('-', '=', TOKEN_MINUS, TOKEN_MINUS_ASSIGNMENT);
-            TOKEN_CASE2('*', '=', TOKEN_STAR, TOKEN_STAR_ASSIGNMENT);
-            TOKEN_CASE2('\\', '=', TOKEN_SLASH, TOKEN_SLASH_ASSIGNMENT);
-            TOKEN_CASE2('%', '=', TOKEN_PERCENT, TOKEN_PERCENT_ASSIGNMENT);
-            TOKEN_CASE2('=', '=', TOKEN_EQUAL, TOKEN_DOUBLE_EQUALS);
-            
-            TOKEN_CASE3('|', '|', '=', TOKEN_LOGICAL_OR, TOKEN_BITWISE_OR, TOKEN_OR_ASSIGNMENT);
-            TOKEN_CASE3('&', '&', '=', TOKEN_LOGICAL_AND, TOKEN_BITWISE_AND, TOKEN_AND_ASSIGNMENT);
-            TOKEN_CASE2('^', '=', TOKEN_BITWISE_XOR, TOKEN_XOR_ASSIGNMENT);
-            TOKEN_CASE2('~', '=', TOKEN_BITWISE_NOT, TOKEN_NOT_ASSIGNMENT);
-            TOKEN_CASE3('<', '<', '=', TOKEN_LESS_THAN, TOKEN_BITWISE_LEFT_SHIFT, TOKEN_LEFT_SHIFT_ASSIGNMENT);
-            TOKEN_CASE3('>', '>', '=', TOKEN_GREATER_THAN, TOKEN_BITWISE_RIGHT_SHIFT, TOKEN_RIGHT_SHIFT_ASSIGNMENT);
-            TOKEN_CASE1(',', TOKEN_COMMA);
-            TOKEN_CASE1(':', TOKEN_COLON);
-            TOKEN_CASE1(';', TOKEN_SEMICOLON);
-            TOKEN_CASE1('?', TOKEN_QUESTION_MARK);
-            TOKEN_CASE1('!', TOKEN_EXCLAMATION_POINT);
-            TOKEN_CASE1('(', TOKEN_LEFT_PAREN);
-            TOKEN_CASE1(')', TOKEN_RIGHT_PAREN);
-            TOKEN_CASE1('{', TOKEN_LEFT_BRACE);
-            TOKEN_CASE1('}', TOKEN_RIGHT_BRACE);
-            TOKEN_CASE1('[', TOKEN_LEFT_BRACKET);
-            TOKEN_CASE1(']', TOKEN_RIGHT_BRACKET);
-            
             default:
-            Assert(false);
+            ReportError("%d:%d: unexpected character '%c'\n",
+                        LexerLine(state), LexerColumn(state, token_start), c);
+            lexer++;
             break;
         }
-        
-        token_end = lexer;
-        current_column = (int)(token_end - token_start);
-        
-        if(add_token)
-        {
-            current_token.line = current_line;
-            current_token.column = current_column;
-            BufferPush(list_of_tokens, current_token);
-            add_token = false;
-        }
     }
     
+    end_of_chunk:
+    state->cursor = lexer;
+    state->token_start = token_start;
+    
+    if(!add_token)
+    {
+        return false;
+    }
+    
+    /* The token touches the end of this chunk, scan it again once more input is in */
+    if(state->more_input && lexer >= state->end)
+    {
+        state->cursor = token_start;
+        return false;
+    }
+    
+    current_token.line = state->line;
+    current_token.column = LexerColumn(state, token_start);
+    *token = current_token;
+    
+    if(string_newlines)
+    {
+        state->line += string_newlines;
+        state->line_start = LexerOffset(state, last_string_newline + 1);
+    }
+    
+    return true;
+}
+
+static Token LexerEndOfFileToken(Lexer *state)
+{
     Token eof_token;
     eof_token.kind = TOKEN_EOF;
+    eof_token.line = state->line;
+    eof_token.column = LexerColumn(state, state->cursor);
+    eof_token.error = ERROR_NONE;
+    eof_token.number = 0;
+    
+    return eof_token;
+}
+
+Token *LexerRun(char const *source)
+{
+    Lexer state;
+    LexerInit(&state, source);
+    
+    Token *list_of_tokens = NULL;
+    Token current_token;
+    while(LexerScan(&state, &current_token))
+    {
+        BufferPush(list_of_tokens, current_token);
+    }
+    
+    Token eof_token = LexerEndOfFileToken(&state);
     BufferPush(list_of_tokens, eof_token);
     
     return list_of_tokens;
 }
 
+/* Same tokens as LexerRun, stored as a TokenStream */
+TokenStream LexerRunCompact(char const *source)
+{
+    Lexer state;
+    LexerInit(&state, source);
+    
+    TokenStream stream = CreateTokenStream(source);
+    Token current_token;
+    while(LexerScan(&state, &current_token))
+    {
+        TokenStreamPush(&stream, &current_token, LexerOffset(&state, state.token_start));
+    }
+    
+    Token eof_token = LexerEndOfFileToken(&state);
+    TokenStreamPush(&stream, &eof_token, LexerOffset(&state, state.cursor));
+    
+    return stream;
+}
+
+#include "lexer_stream.c"
+#include "lexer_parallel.c"
+#include "lexer_incremental.c"
+#include "parse.c"
+#include "parse_incremental.c"
+#include "fold.c"
+#include "vm.c"
+#include "x86_64.c"
+#include "ir.c"
+#include "statistics.c"
+#include "token_cache.c"
+
 /* Macros used for lexing testing */
 #define TokenAssertIdentifier(tokens, string) \
-Assert(strncmp(tokens->name, string, strlen(tokens->name)) == 0); tokens++ \
+Assert(strcmp(InternerString(&global_interner, tokens->symbol), string) == 0); tokens++ \
 
 #define TokenAssertNumber(tokens, value) \
 Assert(tokens->number == value); tokens++\
 
-#define TokenAssertString(tokens, string_value) \
-Assert(strncmp(tokens->string, string_value, strlen(tokens->string)) == 0); tokens++ \
+#define TokenAssertString(tokens, source, string_value) \
+Assert(tokens->string.length == strlen(string_value) && \
+       memcmp(source + tokens->string.offset, string_value, tokens->string.length) == 0); tokens++ \
 
 #define TokenAssertKind(tokens, token_kind) \
 Assert(tokens->kind == token_kind); tokens++ \
@@ -535,16 +908,44 @@ void LexerTest(void)
     
     BufferFree(old_test_tokens_pointer);
     
-    test_tokens = LexerRun("\"test string\" \"another test string\"");
+    /* Identifiers of any length are interned, and equal names share a symbol */
+    test_tokens = LexerRun("a_name_that_is_much_longer_than_thirty_two_characters number a_string number");
+    old_test_tokens_pointer = test_tokens;
+    
+    Assert(test_tokens[1].symbol == test_tokens[3].symbol);
+    Assert(test_tokens[1].symbol != test_tokens[2].symbol);
+    Assert(InternerLength(&global_interner, test_tokens[0].symbol) == 53);
+    TokenAssertIdentifier(test_tokens, "a_name_that_is_much_longer_than_thirty_two_characters");
+    TokenAssertIdentifier(test_tokens, "number");
+    TokenAssertIdentifier(test_tokens, "a_string");
+    TokenAssertIdentifier(test_tokens, "number");
+    TokenAssertKind(test_tokens, TOKEN_EOF);
+    
+    BufferFree(old_test_tokens_pointer);
+    
+    char *test_source = "\"test string\" \"another test string\" \"\"";
+    test_tokens = LexerRun(test_source);
+    old_test_tokens_pointer = test_tokens;
+    
+    TokenAssertString(test_tokens, test_source, "test string");
+    TokenAssertString(test_tokens, test_source, "another test string");
+    TokenAssertString(test_tokens, test_source, "");
+    TokenAssertKind(test_tokens, TOKEN_EOF);
+    
+    BufferFree(old_test_tokens_pointer);
+    
+    test_source = "\"escaped \\\" quote\" \"\\\\\" x";
+    test_tokens = LexerRun(test_source);
     old_test_tokens_pointer = test_tokens;
     
-    TokenAssertString(test_tokens, "test string");
-    TokenAssertString(test_tokens, "another test string");
+    TokenAssertString(test_tokens, test_source, "escaped \\\" quote");
+    TokenAssertString(test_tokens, test_source, "\\\\");
+    TokenAssertIdentifier(test_tokens, "x");
     TokenAssertKind(test_tokens, TOKEN_EOF);
     
     BufferFree(old_test_tokens_pointer);
     
-    test_tokens = LexerRun("01 02 03 0123 0567 0xa 0xb 0xc 0xff 0xabcdef 0x7fffffff");
+    test_tokens = LexerRun("01 02 03 0123 0567 0xa 0xb 0xc 0xff 0xabcdef 0x7fffffff 0X1F 0xAbC");
     old_test_tokens_pointer = test_tokens;
     
     TokenAssertNumber(test_tokens, 01);
@@ -558,6 +959,8 @@ void LexerTest(void)
     TokenAssertNumber(test_tokens, 0xff);
     TokenAssertNumber(test_tokens, 0xabcdef);
     TokenAssertNumber(test_tokens, 0x7fffffff);
+    TokenAssertNumber(test_tokens, 0X1F);
+    TokenAssertNumber(test_tokens, 0xAbC);
     TokenAssertKind(test_tokens, TOKEN_EOF);
     
     BufferFree(old_test_tokens_pointer);
@@ -569,7 +972,7 @@ void LexerTest(void)
 
     BufferFree(old_test_tokens_pointer);
     
-    test_tokens = LexerRun("+-*\\% +=-=*=\\=%= <> |& ||&&^~<<>>,;:?! = == <<=>>=||=&&=~= (){}[]");
+    test_tokens = LexerRun("+-*/% +=-=*=/=%= <> ||&& |&^~<<>>,;:?! = == <<=>>=|=&=~= != <= >= <<= (){}[]");
     old_test_tokens_pointer = test_tokens;
     
     TokenAssertKind(test_tokens, TOKEN_PLUS);
@@ -604,6 +1007,10 @@ void LexerTest(void)
     TokenAssertKind(test_tokens, TOKEN_OR_ASSIGNMENT);
     TokenAssertKind(test_tokens, TOKEN_AND_ASSIGNMENT);
     TokenAssertKind(test_tokens, TOKEN_NOT_ASSIGNMENT);
+    TokenAssertKind(test_tokens, TOKEN_NOT_EQUAL);
+    TokenAssertKind(test_tokens, TOKEN_LESS_EQUAL);
+    TokenAssertKind(test_tokens, TOKEN_GREATER_EQUAL);
+    TokenAssertKind(test_tokens, TOKEN_LEFT_SHIFT_ASSIGNMENT);
     TokenAssertKind(test_tokens, TOKEN_LEFT_PAREN);
     TokenAssertKind(test_tokens, TOKEN_RIGHT_PAREN);
     TokenAssertKind(test_tokens, TOKEN_LEFT_BRACE);
@@ -654,6 +1061,19 @@ void LexerTest(void)
     TokenAssertKind(test_tokens, TOKEN_NORETURN);
 
     BufferFree(old_test_tokens_pointer);
+
+    /* Prefixes and extensions of keywords are plain identifiers */
+    test_tokens = LexerRun("d i in dos iff _ _B doubles returns char1 Int");
+    old_test_tokens_pointer = test_tokens;
+
+    while(test_tokens->kind != TOKEN_EOF)
+    {
+        TokenAssertKind(test_tokens, TOKEN_IDENTIFIER);
+    }
+
+    Assert(BufferLength(old_test_tokens_pointer) == 12);
+
+    BufferFree(old_test_tokens_pointer);
 }
 
 void BufferTest(void)
@@ -678,21 +1098,3102 @@ void BufferTest(void)
     BufferFree(numbers);
 }
 
-void ParserTest(void)
+void StringBuilderTest(void)
+{
+    StringBuilder builder = CreateStringBuilder();
+    char *text = FinalizeStringBuilder(&builder);
+    Assert(strcmp(text, "") == 0);
+    free(text);
+
+    /* Far past the first few doublings, through both ways of appending */
+    int i = 0;
+    while(i < 1000)
+    {
+        PushToStringBuilder(&builder, "%d,", i % 10);
+        PushCharactersToStringBuilder(&builder, "ab", 2);
+        i++;
+    }
+    Assert(StringBuilderLength(&builder) == 4000);
+    Assert(strncmp(builder.buffer + 3996, "9,ab", 4) == 0);
+
+    /* A single piece bigger than everything so far has to be formatted again */
+    char long_piece[10000];
+    memset(long_piece, 'x', sizeof long_piece - 1);
+    long_piece[sizeof long_piece - 1] = 0;
+    PushToStringBuilder(&builder, "[%s]", long_piece);
+    Assert(StringBuilderLength(&builder) == 4000 + 10001);
+
+    text = FinalizeStringBuilder(&builder);
+    Assert(strlen(text) == 14001);
+    Assert(text[4000] == '[' && text[4001] == 'x' && text[14000] == ']');
+    Assert(builder.buffer == NULL);
+    free(text);
+
+    /* Trees of any size print into one builder */
+    TokenStream tokens = LexerRunCompact("1 + 2 * 3");
+    ExpressionPool pool = CreateExpressionPool();
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    i = 0;
+    while(i < 100)
+    {
+        StringifyExpressionInto(&builder, &pool, expression);
+        i++;
+    }
+    Assert(StringBuilderLength(&builder) == 100 * (int)strlen("(+ 1 (* 2 3))"));
+    Assert(strncmp(builder.buffer, "(+ 1 (* 2 3))(+ 1", 17) == 0);
+    FreeStringBuilder(&builder);
+    FreeExpressionPool(&pool);
+    FreeTokenStream(&tokens);
+}
+
+void TokenStreamTest(void)
+{
+    char *source = "first 12 \"text\"\n  + second\n\n0x10 ; \"two\nlines\" tail";
+    Token *tokens = LexerRun(source);
+    TokenStream stream = LexerRunCompact(source);
+    
+    Assert(TokenStreamLength(&stream) == BufferLength(tokens));
+    
+    int i = 0;
+    while(i < TokenStreamLength(&stream))
+    {
+        int line;
+        int column;
+        TokenStreamLocate(&stream, i, &line, &column);
+        
+        Assert(stream.kinds[i] == tokens[i].kind);
+        Assert(line == tokens[i].line);
+        Assert(column == tokens[i].column);
+        i++;
+    }
+    
+    Assert(stream.payloads[0] == tokens[0].symbol);
+    Assert(stream.payloads[1] == 12);
+    Assert(stream.payloads[2] == 4);
+    Assert(memcmp(source + stream.offsets[2] + 1, "text", 4) == 0);
+    Assert(stream.offsets[3] == 18);
+    Assert(tokens[3].line == 2 && tokens[3].column == 3);
+    Assert(tokens[5].line == 4 && tokens[5].column == 1);
+    Assert(tokens[7].line == 4 && tokens[7].column == 8);
+    Assert(tokens[8].line == 5 && tokens[8].column == 8);
+    
+    BufferFree(tokens);
+    FreeTokenStream(&stream);
+}
+
+/* Writes source to an unnamed temporary file and returns a descriptor positioned at its start */
+int OpenTemporarySource(char const *source)
 {
-    // char *test_expression_string = "2 + 2";
-    // Token *tokens = LexerRun(test_expression_string);
-    // Expression *expression = ParseNumber(&tokens);
+    FILE *file = tmpfile();
+    Assert(file);
+    fputs(source, file);
+    fflush(file);
 
-    Expression *test_stringify_expression;
-    memset(&test_stringify_expression, 0, sizeof test_stringify_expression);
-    test_stringify_expression = CreateBinaryExpression(CreateBinaryExpression(CreateNumberExpression(2), CreateNumberExpression(2), TOKEN_PLUS), CreateNumberExpression(2), TOKEN_MINUS);
-    printf("expression = %s\n", StringifyExpression(test_stringify_expression));
+    int file_descriptor = dup(fileno(file));
+    fclose(file);
+    lseek(file_descriptor, 0, SEEK_SET);
+
+    return file_descriptor;
 }
 
-int main(void)    
+void LexerStreamTest(void)
 {
-    BufferTest();
-    LexerTest();
-    ParserTest();
+    char *source = "alpha 0x1f2e \"a string that is longer than a chunk\" <<= beta_gamma\n"
+                   "  12345 + \"\" ||= identifier_with_a_long_name;\n\n 7";
+    Token *expected = LexerRun(source);
+
+    /* Every read size from a single byte up, so each token gets split at every position */
+    int read_size = 1;
+    while(read_size <= 24)
+    {
+        int file_descriptor = OpenTemporarySource(source);
+        LexerStream stream;
+        LexerStreamInit(&stream, file_descriptor, read_size);
+
+        int i = 0;
+        for(;;)
+        {
+            uint32_t offset;
+            Token token = LexerNext(&stream, &offset);
+
+            Assert(i < BufferLength(expected));
+            Assert(token.kind == expected[i].kind);
+            Assert(token.line == expected[i].line);
+            Assert(token.column == expected[i].column);
+            Assert(TokenPayloadOf(&token) == TokenPayloadOf(&expected[i]));
+
+            if(token.kind == TOKEN_STRING)
+            {
+                Assert(token.string.offset == expected[i].string.offset);
+                Assert(memcmp(LexerStreamText(&stream, token.string.offset),
+                              source + expected[i].string.offset, token.string.length) == 0);
+            }
+
+            i++;
+            if(token.kind == TOKEN_EOF)
+            {
+                break;
+            }
+        }
+
+        Assert(i == BufferLength(expected));
+
+        LexerStreamFree(&stream);
+        close(file_descriptor);
+        read_size++;
+    }
+
+    BufferFree(expected);
+
+    /* The parser pulls tokens through the ring as it goes */
+    int file_descriptor = OpenTemporarySource("1 + 2");
+    LexerStream stream;
+    LexerStreamInit(&stream, file_descriptor, 2);
+    TokenRing ring;
+    TokenRingInit(&ring, &stream, NULL);
+    ExpressionPool pool = CreateExpressionPool();
+    Parser parser = CreateStreamParser(&ring, &pool);
+
+    ExpressionId expression = ParseExpression(&parser);
+    char *text = StringifyExpression(&pool, expression);
+    Assert(strcmp(text, "(+ 1 2)") == 0);
+    Assert(PeekToken(&parser) == TOKEN_EOF);
+
+    free(text);
+    FreeExpressionPool(&pool);
+    LexerStreamFree(&stream);
+    close(file_descriptor);
+
+    /* Input ends at a NUL byte, and both ways of reading a file say so */
+    char path[] = "/tmp/embedded_nul_XXXXXX";
+    file_descriptor = mkstemp(path);
+    Assert(file_descriptor >= 0);
+    Assert(write(file_descriptor, "a;\0b;\n", 6) == 6);
+    Assert(lseek(file_descriptor, 0, SEEK_SET) == 0);
+
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    CompileContext context = *CurrentContext();
+    context.errors_reported = 0;
+    context.path = NULL;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    LexerStreamInit(&stream, file_descriptor, 4);
+    int count = 0;
+    uint32_t offset;
+    while(LexerNext(&stream, &offset).kind != TOKEN_EOF)
+    {
+        count++;
+    }
+    Assert(count == 2 && offset == 2);
+    Assert(LexerNext(&stream, &offset).kind == TOKEN_EOF);
+    LexerStreamFree(&stream);
+    close(file_descriptor);
+
+    SourceFile file;
+    Assert(SourceFileOpen(&file, path));
+    Assert(file.length == 2);
+    SourceFileClose(&file);
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    char expected_diagnostics[96];
+    snprintf(expected_diagnostics, sizeof expected_diagnostics,
+             "embedded NUL at offset 2\n%s: embedded NUL at offset 2\n", path);
+    Assert(context.errors_reported == 2);
+    Assert(strcmp(diagnostics, expected_diagnostics) == 0);
+    free(diagnostics);
+    unlink(path);
+
+    /* A bad number split by a read is lexed twice but reported once */
+    file_descriptor = OpenTemporarySource("  0999;");
+    context.errors_reported = 0;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    previous = SetCurrentContext(&context);
+    LexerStreamInit(&stream, file_descriptor, 4);
+    while(LexerNext(&stream, &offset).kind != TOKEN_EOF)
+    {
+    }
+    LexerStreamFree(&stream);
+    close(file_descriptor);
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    Assert(context.errors_reported == 1);
+    Assert(strcmp(diagnostics, "1:4: invalid digit '9' in base 8 number\n") == 0);
+    free(diagnostics);
+}
+
+/* Every scan mode the machine supports has to produce exactly the scalar tokens */
+void LexerScanModeTest(void)
+{
+    char *source = NULL;
+    int i = 0;
+    while(i < 80)
+    {
+        int j = 0;
+        while(j < i)
+        {
+            char whitespace = " \t\n  \r\n "[(i + j) % 9];
+            BufferPush(source, whitespace);
+            j++;
+        }
+        
+        j = 0;
+        while(j <= i)
+        {
+            char identifier = "_aZ9qQ0z"[(i * 7 + j) % 8];
+            if(j == 0 && (identifier == '9' || identifier == '0'))
+            {
+                identifier = 'n';
+            }
+            
+            BufferPush(source, identifier);
+            j++;
+        }
+        
+        char separator = ' ';
+        BufferPush(source, separator);
+        
+        char quote = '"';
+        BufferPush(source, quote);
+        j = 0;
+        while(j < i)
+        {
+            char text = "ab cdxyz"[(i + j * 3) % 8];
+            if((i + j) % 5 == 0)
+            {
+                char backslash = '\\';
+                BufferPush(source, backslash);
+                text = '"';
+            }
+            
+            BufferPush(source, text);
+            j++;
+        }
+        
+        BufferPush(source, quote);
+        BufferPush(source, separator);
+        i++;
+    }
+    
+    char terminator = 0;
+    BufferPush(source, terminator);
+    
+    LexerScanMode modes[] = { LEXER_SCAN_SSE2, LEXER_SCAN_AVX2 };
+    
+    /* Shift the input so runs start at every alignment */
+    int shift = 0;
+    while(shift < 32)
+    {
+        char *shifted = malloc(BufferLength(source) + shift);
+        Assert(shifted);
+        memcpy(shifted + shift, source, BufferLength(source));
+        
+        LexerSelectScanMode(LEXER_SCAN_SCALAR);
+        TokenStream expected = LexerRunCompact(shifted + shift);
+        
+        int mode = 0;
+        while(mode < (int)(sizeof modes / sizeof modes[0]))
+        {
+            if(LexerSelectScanMode(modes[mode]))
+            {
+                TokenStream tokens = LexerRunCompact(shifted + shift);
+                Assert(TokenStreamLength(&tokens) == TokenStreamLength(&expected));
+                
+                int token = 0;
+                while(token < TokenStreamLength(&tokens) && token < TokenStreamLength(&expected))
+                {
+                    int line;
+                    int column;
+                    int expected_line;
+                    int expected_column;
+                    TokenStreamLocate(&tokens, token, &line, &column);
+                    TokenStreamLocate(&expected, token, &expected_line, &expected_column);
+                    
+                    Assert(tokens.kinds[token] == expected.kinds[token]);
+                    Assert(tokens.offsets[token] == expected.offsets[token]);
+                    Assert(tokens.payloads[token] == expected.payloads[token]);
+                    Assert(line == expected_line && column == expected_column);
+                    token++;
+                }
+                
+                FreeTokenStream(&tokens);
+            }
+            
+            mode++;
+        }
+        
+        FreeTokenStream(&expected);
+        free(shifted);
+        shift++;
+    }
+    
+    /* Line numbers from the whitespace scan agree with a plain newline count */
+    LexerSelectScanMode(LEXER_SCAN_AUTO);
+    Token *tokens = LexerRun(source);
+    Token *last = &tokens[BufferLength(tokens) - 1];
+    int newlines = 0;
+    i = 0;
+    while(source[i])
+    {
+        newlines += source[i] == '\n';
+        i++;
+    }
+    
+    Assert(last->kind == TOKEN_EOF);
+    Assert(last->line == newlines + 1);
+    
+    BufferFree(tokens);
+    BufferFree(source);
+}
+
+typedef struct
+{
+    ThreadPool *pool;
+    int *results;
+    int index;
+} ThreadPoolTestTask;
+
+static ThreadPoolTestTask thread_pool_test_tasks[1024];
+
+/* Task i marks slot i, and tasks below 512 submit task i + 512 from inside the pool */
+static void ThreadPoolTestRun(void *argument)
+{
+    ThreadPoolTestTask *task = argument;
+    task->results[task->index]++;
+
+    if(task->index < 512)
+    {
+        ThreadPoolSubmit(task->pool, ThreadPoolTestRun, &thread_pool_test_tasks[task->index + 512]);
+    }
+}
+
+void ThreadPoolTest(void)
+{
+    int results[1024];
+    memset(results, 0, sizeof results);
+
+    ThreadPool pool;
+    ThreadPoolInit(&pool, 4);
+    Assert(pool.worker_count == 4);
+
+    int i = 0;
+    while(i < 1024)
+    {
+        thread_pool_test_tasks[i].pool = &pool;
+        thread_pool_test_tasks[i].results = results;
+        thread_pool_test_tasks[i].index = i;
+        i++;
+    }
+
+    i = 0;
+    while(i < 512)
+    {
+        ThreadPoolSubmit(&pool, ThreadPoolTestRun, &thread_pool_test_tasks[i]);
+        i++;
+    }
+
+    ThreadPoolWait(&pool);
+
+    /* Every task ran exactly once */
+    i = 0;
+    while(i < 1024)
+    {
+        Assert(results[i] == 1);
+        i++;
+    }
+
+    ThreadPoolFree(&pool);
+}
+
+/* Lexes `source` with diagnostics captured in memory; returns them, caller frees */
+static char *LexWithCapturedDiagnostics(ThreadPool *pool, char const *source, int chunk_count, TokenStream *tokens)
+{
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &global_interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    *tokens = pool ? LexerRunParallel(pool, source, strlen(source), chunk_count) : LexerRunCompact(source);
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+
+    return diagnostics;
+}
+
+/* Splitting the input must not change a single token, symbol or diagnostic, including
+ * when the even cut points land inside multi-line string literals */
+void LexerParallelTest(void)
+{
+    char *source = NULL;
+    char line[128];
+    int i = 0;
+    while(i < 60000)
+    {
+        int length;
+        switch(i % 7)
+        {
+            case 0:
+                length = snprintf(line, sizeof line, "\"a string\nover \\\" %d\n lines\\\\\" + name_%d\n", i, i % 1000);
+                break;
+            case 3:
+                length = snprintf(line, sizeof line, "    value_%d <<= 0x%x $ \"\\\\\"\n", i % 333, i);
+                break;
+            default:
+                length = snprintf(line, sizeof line, "if(x%d == %d) { result += \"text\"; } else { y_%d; }\n", i % 97, i, i % 5000);
+                break;
+        }
+
+        int j = 0;
+        while(j < length)
+        {
+            BufferPush(source, line[j]);
+            j++;
+        }
+
+        i++;
+    }
+
+    char terminator = 0;
+    BufferPush(source, terminator);
+
+    /* Reset the interner so both runs hand out symbols from 1 */
+    InternerFree(&global_interner);
+    int saved_max_errors = max_allowed_errors;
+    max_allowed_errors = INT_MAX;
+
+    TokenStream expected;
+    char *expected_diagnostics = LexWithCapturedDiagnostics(NULL, source, 0, &expected);
+
+    ThreadPool pool;
+    ThreadPoolInit(&pool, 4);
+
+    int chunk_count = 2;
+    while(chunk_count <= 9)
+    {
+        InternerFree(&global_interner);
+
+        TokenStream tokens;
+        char *diagnostics = LexWithCapturedDiagnostics(&pool, source, chunk_count, &tokens);
+
+        int length = TokenStreamLength(&tokens);
+        Assert(length == TokenStreamLength(&expected));
+        Assert(memcmp(tokens.kinds, expected.kinds, length * sizeof *tokens.kinds) == 0);
+        Assert(memcmp(tokens.offsets, expected.offsets, length * sizeof *tokens.offsets) == 0);
+        Assert(memcmp(tokens.payloads, expected.payloads, length * sizeof *tokens.payloads) == 0);
+        Assert(BufferLength(tokens.errors) == BufferLength(expected.errors));
+        Assert(strcmp(diagnostics, expected_diagnostics) == 0);
+
+        free(diagnostics);
+        FreeTokenStream(&tokens);
+        chunk_count++;
+    }
+
+    ThreadPoolFree(&pool);
+    max_allowed_errors = saved_max_errors;
+    free(expected_diagnostics);
+    FreeTokenStream(&expected);
+    BufferFree(source);
+}
+
+/* After every edit the spliced stream must match lexing the new text from scratch,
+ * including edits that open or close strings, join operators and split numbers */
+void LexerRelexTest(void)
+{
+    static char const *pieces[] = { "\"", "\\", "\n", " ", "<", "=", ">", "0x", "7", "name", "if", ";", "(", ")",
+                                    "+", "-", "\"text\"", "$", "\n\n  ", "99999999999" };
+
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    Interner interner;
+    memset(&interner, 0, sizeof interner);
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    char *source = strdup("if(x == 1) { result += \"a string\\n\"; }\nvalue <<= 0x1f;\n\"two\nlines\" + y;\n");
+    TokenStream tokens = LexerRunCompact(source);
+    int line;
+    int column;
+    TokenStreamLocate(&tokens, 0, &line, &column);
+
+    uint32_t random = 12345;
+    int edit = 0;
+    while(edit < 3000)
+    {
+        size_t length = strlen(source);
+        random = random * 1103515245u + 12345u;
+        SourceEdit change;
+        change.offset = (random >> 8) % (length + 1);
+        random = random * 1103515245u + 12345u;
+        change.removed_length = (random >> 8) % 4;
+        if(change.offset + change.removed_length > length)
+        {
+            change.removed_length = (uint32_t)(length - change.offset);
+        }
+        random = random * 1103515245u + 12345u;
+        change.inserted = pieces[(random >> 8) % (sizeof pieces / sizeof *pieces)];
+        change.inserted_length = (uint32_t)strlen(change.inserted);
+
+        source = ApplySourceEdit(source, length, &change);
+        TokenSplice splice = RelexTokenStream(&tokens, source, &change);
+
+        /* The gap is left where it is, so the next edit has to move it */
+        TokenStream expected = LexerRunCompact(source);
+        int count = TokenStreamLength(&expected);
+        Assert(TokenStreamLength(&tokens) == count);
+        int i = 0;
+        while(i < count && i < TokenStreamLength(&tokens))
+        {
+            Assert(TokenStreamKind(&tokens, i) == expected.kinds[i]);
+            Assert(TokenStreamOffset(&tokens, i) == expected.offsets[i]);
+            Assert(TokenStreamPayload(&tokens, i) == expected.payloads[i]);
+            i++;
+        }
+        Assert(BufferLength(tokens.errors) == BufferLength(expected.errors));
+        Assert(BufferLength(tokens.errors) == 0 ||
+               memcmp(tokens.errors, expected.errors, BufferLength(tokens.errors) * sizeof *tokens.errors) == 0);
+        Assert(splice.first + splice.inserted <= count);
+
+        int expected_line;
+        int expected_column;
+        TokenStreamLocate(&tokens, count - 1, &line, &column);
+        TokenStreamLocate(&expected, count - 1, &expected_line, &expected_column);
+        Assert(line == expected_line && column == expected_column);
+        TokenStreamLocate(&tokens, splice.first, &line, &column);
+        TokenStreamLocate(&expected, splice.first, &expected_line, &expected_column);
+        Assert(line == expected_line && column == expected_column);
+
+        FreeTokenStream(&expected);
+        edit++;
+    }
+    FreeTokenStream(&tokens);
+    free(source);
+
+    /* Deleting a character in the middle of a long file lexes just the token it was in */
+    StringBuilder builder = CreateStringBuilder();
+    int i = 0;
+    while(i < 1000)
+    {
+        PushToStringBuilder(&builder, "value_%d = value_%d * %d;\n", i, i / 2, i);
+        i++;
+    }
+    source = FinalizeStringBuilder(&builder);
+    tokens = LexerRunCompact(source);
+    int old_count = TokenStreamLength(&tokens);
+
+    char const *target = strstr(source, "value_500 =");
+    SourceEdit change = { (uint32_t)(target - source) + 5, 1, "", 0 };
+    source = ApplySourceEdit(source, strlen(source), &change);
+    TokenSplice splice = RelexTokenStream(&tokens, source, &change);
+    Assert(splice.removed == 1 && splice.inserted == 1);
+    Assert(TokenStreamLength(&tokens) == old_count);
+    Assert(TokenStreamKind(&tokens, splice.first) == TOKEN_IDENTIFIER);
+    Assert(strcmp(InternerString(&interner, TokenStreamPayload(&tokens, splice.first)), "value500") == 0);
+
+    /* A diagnostic from lexing again still has the right line */
+    context.errors_reported = 0;
+    fflush(context.diagnostics);
+    size_t diagnostics_before = diagnostics_length;
+    target = strstr(source, "value_700 =");
+    SourceEdit stray = { (uint32_t)(target - source) + 10, 0, "$", 1 };
+    source = ApplySourceEdit(source, strlen(source), &stray);
+    RelexTokenStream(&tokens, source, &stray);
+    fflush(context.diagnostics);
+    Assert(strcmp(diagnostics + diagnostics_before, "701:11: unexpected character '$'\n") == 0);
+
+    FreeTokenStream(&tokens);
+    free(source);
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    free(diagnostics);
+    InternerFree(&interner);
+}
+
+/* After every edit the reparsed statements must match parsing the new tokens from
+ * scratch, and the statements past the edit must keep their trees */
+void IncrementalParseTest(void)
+{
+    static char const *pieces[] = { ";", "(", ")", "name", "x", "42", "+", "*", "-", "=", "?", ":", ",", " ",
+                                    "a = b;", "(1 + 2) * c;" };
+
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    Interner interner;
+    memset(&interner, 0, sizeof interner);
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    /* Statements with errors only match if every error is counted */
+    int saved_max_errors = max_allowed_errors;
+    max_allowed_errors = INT_MAX;
+
+    char *source = strdup("a = 1;\nb = a + 2 * 3;\nc ? d : e;\n(f, g);\n-h;\ni = j = k;\n");
+    TokenStream tokens = LexerRunCompact(source);
+    IncrementalParse parse = CreateIncrementalParse(&tokens);
+
+    uint32_t random = 777;
+    int edit = 0;
+    while(edit < 3000)
+    {
+        size_t length = strlen(source);
+        random = random * 1103515245u + 12345u;
+        SourceEdit change;
+        change.offset = (random >> 8) % (length + 1);
+        random = random * 1103515245u + 12345u;
+        change.removed_length = (random >> 8) % 3;
+        if(change.offset + change.removed_length > length)
+        {
+            change.removed_length = (uint32_t)(length - change.offset);
+        }
+        random = random * 1103515245u + 12345u;
+        change.inserted = pieces[(random >> 8) % (sizeof pieces / sizeof *pieces)];
+        change.inserted_length = (uint32_t)strlen(change.inserted);
+
+        source = ApplySourceEdit(source, length, &change);
+        TokenSplice token_splice = RelexTokenStream(&tokens, source, &change);
+
+        int old_count = IncrementalParseStatementCount(&parse);
+        StatementSplice splice = ReparseAfterEdit(&parse, &token_splice);
+        Assert(IncrementalParseStatementCount(&parse) == old_count - splice.removed + splice.inserted);
+
+        IncrementalParse expected = CreateIncrementalParse(&tokens);
+        int count = IncrementalParseStatementCount(&expected);
+        Assert(IncrementalParseStatementCount(&parse) == count);
+
+        int i = 0;
+        while(i < count && i < IncrementalParseStatementCount(&parse))
+        {
+            ParsedStatement *actual_statement = &parse.statements[i];
+            ParsedStatement *expected_statement = &expected.statements[i];
+            Assert(actual_statement->first_token == expected_statement->first_token);
+            Assert(actual_statement->end_token == expected_statement->end_token);
+            Assert(!actual_statement->expression == !expected_statement->expression);
+            if(actual_statement->expression && expected_statement->expression)
+            {
+                char *actual_text = StringifyExpression(&parse.pool, actual_statement->expression);
+                char *expected_text = StringifyExpression(&expected.pool, expected_statement->expression);
+                Assert(strcmp(actual_text, expected_text) == 0);
+                free(actual_text);
+                free(expected_text);
+
+                int actual_first, actual_end, expected_first, expected_end;
+                ExpressionTokenRange(&parse, i, actual_statement->expression, &actual_first, &actual_end);
+                ExpressionTokenRange(&expected, i, expected_statement->expression, &expected_first, &expected_end);
+                Assert(actual_first == expected_first && actual_end == expected_end);
+            }
+            i++;
+        }
+
+        FreeIncrementalParse(&expected);
+        edit++;
+    }
+    FreeIncrementalParse(&parse);
+    FreeTokenStream(&tokens);
+    free(source);
+
+    /* Every node knows the tokens it came from */
+    source = strdup("x;\n(a + b) * -c;\n");
+    tokens = LexerRunCompact(source);
+    parse = CreateIncrementalParse(&tokens);
+    Assert(IncrementalParseStatementCount(&parse) == 2);
+
+    ExpressionId product = parse.statements[1].expression;
+    ExpressionNode *node = GetExpression(&parse.pool, product);
+    Assert(node->kind == EXPRESSION_BINARY && node->operator == TOKEN_STAR);
+    int first, end;
+    ExpressionTokenRange(&parse, 1, product, &first, &end);
+    Assert(first == 2 && end == 10);
+    ExpressionTokenRange(&parse, 1, node->first, &first, &end);
+    Assert(first == 2 && end == 7);
+    ExpressionTokenRange(&parse, 1, node->second, &first, &end);
+    Assert(first == 8 && end == 10);
+
+    /* Editing the first statement reparses it alone and keeps the second tree */
+    SourceEdit change = { 0, 1, "y", 1 };
+    source = ApplySourceEdit(source, strlen(source), &change);
+    TokenSplice token_splice = RelexTokenStream(&tokens, source, &change);
+    StatementSplice splice = ReparseAfterEdit(&parse, &token_splice);
+    Assert(splice.first == 0 && splice.removed == 1 && splice.inserted == 1);
+    Assert(parse.statements[1].expression == product);
+
+    FreeIncrementalParse(&parse);
+    FreeTokenStream(&tokens);
+    free(source);
+
+    max_allowed_errors = saved_max_errors;
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    free(diagnostics);
+    InternerFree(&interner);
+}
+
+/* Parses one expression and prints it back, or returns the diagnostics if there were any */
+static char *ParseToString(char const *source)
+{
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &global_interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact(source);
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    if(!context.had_error && PeekToken(&parser) != TOKEN_EOF)
+    {
+        ReportError("trailing %s\n", token_string_table[PeekToken(&parser)]);
+    }
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+
+    char *text;
+    if(context.had_error)
+    {
+        text = diagnostics;
+    } else
+    {
+        text = StringifyExpression(&pool, expression);
+        free(diagnostics);
+    }
+
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    return text;
+}
+
+void ParserTest(void)
+{
+    char const *cases[][2] = {
+        { "2 + 2", "(+ 2 2)" },
+        { "1 + 2 + 3", "(+ (+ 1 2) 3)" },
+        { "1 - 2 - 3", "(- (- 1 2) 3)" },
+        { "1 + 2 * 3", "(+ 1 (* 2 3))" },
+        { "1 * 2 + 3", "(+ (* 1 2) 3)" },
+        { "(1 + 2) * 3", "(* (+ 1 2) 3)" },
+        { "8 / 4 % 3", "(% (/ 8 4) 3)" },
+        { "1 << 2 + 3", "(<< 1 (+ 2 3))" },
+        { "1 < 2 == 3 >= 4", "(== (< 1 2) (>= 3 4))" },
+        { "1 | 2 ^ 3 & 4", "(| 1 (^ 2 (& 3 4)))" },
+        { "a || b && c != d", "(|| a (&& b (!= c d)))" },
+        { "a = b = 3", "(= a (= b 3))" },
+        { "a += b -= 1", "(+= a (-= b 1))" },
+        { "*p = &a", "(= (* p) (& a))" },
+        { "-!~x", "(- (! (~ x)))" },
+        { "- 1 * 2", "(* (- 1) 2)" },
+        { "a ? b : c ? d : e", "(? a b (? c d e))" },
+        { "a ? b, c : d", "(? a (, b c) d)" },
+        { "a || b ? c : d", "(? (|| a b) c d)" },
+        { "a = b ? c : d", "(= a (? b c d))" },
+        { "a = 1, b = 2", "(, (= a 1) (= b 2))" },
+        { "1 + ", "1:5: expected expression but found End of file\n" },
+        { "(1 + 2", "1:7: expected ) but found End of file\n" },
+        { "1 = 2", "1:3: cannot assign to the left side of =\n" },
+        { "a ? b", "1:6: expected : but found End of file\n" }
+    };
+
+    int i = 0;
+    while(i < (int)(sizeof cases / sizeof cases[0]))
+    {
+        char *text = ParseToString(cases[i][0]);
+        if(strcmp(text, cases[i][1]) != 0)
+        {
+            printf("%s parsed as %s, expected %s\n", cases[i][0], text, cases[i][1]);
+        }
+        Assert(strcmp(text, cases[i][1]) == 0);
+        free(text);
+        i++;
+    }
+
+    /* Only what is still waiting for an operand counts towards the depth limit */
+    int saved_max_depth = max_expression_depth;
+    max_expression_depth = 4;
+    char const *depth_cases[][2] = {
+        { "((((1))))", "1" },
+        { "(((((1)))))", "1:5: expression nested too deeply at (\n" },
+        { "a = b = c = d = e = f", "1:19: expression nested too deeply at =\n" },
+        { "- - - - - 1", "1:9: expression nested too deeply at -\n" },
+        { "1 + 1 + 1 + 1 + 1 + 1 + 1", "(+ (+ (+ (+ (+ (+ 1 1) 1) 1) 1) 1) 1)" }
+    };
+
+    i = 0;
+    while(i < (int)(sizeof depth_cases / sizeof depth_cases[0]))
+    {
+        char *text = ParseToString(depth_cases[i][0]);
+        Assert(strcmp(text, depth_cases[i][1]) == 0);
+        free(text);
+        i++;
+    }
+    max_expression_depth = saved_max_depth;
+
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact("2 + 2");
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    char *text = StringifyExpression(&pool, expression);
+    Assert(strcmp(text, "(+ 2 2)") == 0);
+    Assert(PeekToken(&parser) == TOKEN_EOF);
+    FreeTokenStream(&tokens);
+    free(text);
+
+    ExpressionId test_stringify_expression = CreateBinaryExpression(&pool, CreateBinaryExpression(&pool, CreateNumberExpression(&pool, 2), CreateNumberExpression(&pool, 2), TOKEN_PLUS), CreateNumberExpression(&pool, 2), TOKEN_MINUS);
+    text = StringifyExpression(&pool, test_stringify_expression);
+    printf("expression = %s\n", text);
+    free(text);
+
+    /* Three nodes from parsing, five built by hand, and the placeholder at id 0 */
+    Assert(pool.node_counts[EXPRESSION_NUMBER] == 5);
+    Assert(pool.node_counts[EXPRESSION_BINARY] == 3);
+    Assert(BufferLength(pool.nodes) == 9);
+    Assert(BufferLength(pool.numbers) == 5);
+    Assert(sizeof(ExpressionNode) == 12);
+
+    /* Operands always come before the node using them */
+    ExpressionNode *root = GetExpression(&pool, test_stringify_expression);
+    Assert(root->kind == EXPRESSION_BINARY && root->operator == TOKEN_MINUS);
+    Assert(root->first < test_stringify_expression && root->second < test_stringify_expression);
+    Assert(ExpressionNumber(&pool, root->second) == 2);
+
+    /* The walker sees every node once, operands in order */
+    ExpressionWalker walker = CreateExpressionWalker(&pool, test_stringify_expression);
+    ExpressionWalkEvent event;
+    ExpressionId id;
+    int entered = 0;
+    int left = 0;
+    while(ExpressionWalkerNext(&walker, &event, &id))
+    {
+        entered += event == EXPRESSION_WALK_ENTER;
+        left += event == EXPRESSION_WALK_LEAVE;
+    }
+    Assert(entered == 5 && left == 5);
+    Assert(walker.max_depth == 3);
+    FreeExpressionWalker(&walker);
+    FreeExpressionPool(&pool);
+}
+
+static ExpressionId ParseIntoPool(ExpressionPool *pool, TokenStream *tokens, char const *source)
+{
+    *tokens = LexerRunCompact(source);
+    Parser parser = CreateParser(tokens, pool);
+    ExpressionId expression = ParseExpression(&parser);
+    Assert(expression && PeekToken(&parser) == TOKEN_EOF);
+
+    return expression;
+}
+
+void ExpressionSharingTest(void)
+{
+    /* A repeated subexpression is built once */
+    ExpressionPool pool = CreateExpressionPool();
+    ShareExpressions(&pool);
+    TokenStream tokens;
+    ExpressionId root = ParseIntoPool(&pool, &tokens, "(a + 1) * (a + 1) + (a + 1)");
+    Assert(BufferLength(pool.nodes) - 1 == 5 && pool.constructions == 11 && pool.shared_hits == 6);
+    ExpressionNode *node = GetExpression(&pool, root);
+    Assert(GetExpression(&pool, node->first)->first == node->second);
+    Assert(ExpressionsEqual(&pool, GetExpression(&pool, node->first)->second, node->second));
+    Assert(!ExpressionsEqual(&pool, node->first, node->second));
+
+    /* It still prints, and runs, as the tree it was written as */
+    char *text = StringifyExpression(&pool, root);
+    Assert(strcmp(text, "(+ (* (+ a 1) (+ a 1)) (+ a 1))") == 0);
+    free(text);
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    /* Numbers are shared by value and ternaries by their branches */
+    pool = CreateExpressionPool();
+    ShareExpressions(&pool);
+    root = ParseIntoPool(&pool, &tokens, "(c ? 7 : 8) + (c ? 7 : 8) + 7");
+    Assert(BufferLength(pool.nodes) - 1 == 6 && BufferLength(pool.numbers) == 2 && BufferLength(pool.branches) == 2);
+    FreeTokenStream(&tokens);
+
+    /* Side effects happen once per place they are written */
+    ExpressionId assignments = ParseIntoPool(&pool, &tokens, "(a += 1) + (a += 1)");
+    Assert(GetExpression(&pool, assignments)->first == GetExpression(&pool, assignments)->second);
+    Bytecode bytecode = CreateBytecode();
+    Assert(CompileBytecode(&bytecode, &pool, assignments));
+    int variables[1] = { 7 };
+    int stack[4];
+    int result;
+    Assert(bytecode.max_stack <= 4 && VmRun(&bytecode, variables, stack, &result) == VM_OK);
+    Assert(result == 17 && variables[0] == 9);
+    FreeBytecode(&bytecode);
+    FreeTokenStream(&tokens);
+
+    /* Folding rewrites a shared node for all of its users, and equality falls back to structure */
+    root = ParseIntoPool(&pool, &tokens, "(2 * 3 + b) - (2 * 3 + b)");
+    FoldExpression(&pool, root);
+    text = StringifyExpression(&pool, root);
+    Assert(strcmp(text, "(- (+ 6 b) (+ 6 b))") == 0);
+    free(text);
+    Assert(pool.rewritten && ExpressionsEqual(&pool, GetExpression(&pool, root)->first, GetExpression(&pool, root)->second));
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    /* Without sharing every occurrence is its own node, and equality compares structure */
+    pool = CreateExpressionPool();
+    root = ParseIntoPool(&pool, &tokens, "(a + 1) * (a + 1) + (a + 1)");
+    Assert(BufferLength(pool.nodes) - 1 == 11 && pool.constructions == 0);
+    node = GetExpression(&pool, root);
+    Assert(node->second != GetExpression(&pool, node->first)->first);
+    Assert(ExpressionsEqual(&pool, GetExpression(&pool, node->first)->first, node->second));
+    Assert(!ExpressionsEqual(&pool, node->first, node->second));
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+}
+
+/* Parses, folds and prints one expression, or returns the diagnostics */
+static char *FoldToString(char const *source)
+{
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &global_interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact(source);
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    Assert(!context.had_error);
+    FoldExpression(&pool, expression);
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+
+    char *text;
+    if(context.had_error)
+    {
+        text = diagnostics;
+    } else
+    {
+        text = StringifyExpression(&pool, expression);
+        free(diagnostics);
+    }
+
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    return text;
+}
+
+void FoldTest(void)
+{
+    char const *cases[][2] = {
+        { "(2 + 2) - 2", "2" },
+        { "1 + 2 * 3 - 4 / 2", "5" },
+        { "7 / -2", "-3" },
+        { "-7 % 2", "-1" },
+        { "-16 >> 2", "-4" },
+        { "1 << 30", "1073741824" },
+        { "~0 & 255 | 1 ^ 3", "255" },
+        { "!5 + !0 + (3 < 4) + (3 >= 4) + (2 == 2) + (2 != 2)", "3" },
+        { "2 && 3 || 0", "1" },
+        { "-2147483647 - 1", "-2147483648" },
+        { "x + 2 * 3", "(+ x 6)" },
+        { "x = (1 + 1) * y", "(= x (* 2 y))" },
+        { "*p + -(1 + 1)", "(+ (* p) -2)" },
+
+        /* Operands C does not evaluate are neither folded nor checked */
+        { "0 && 1 / 0", "0" },
+        { "1 || x", "1" },
+        { "x || 1 / 0", "division by zero in (/ 1 0)\n" },
+        { "1 ? x : 1 / 0", "x" },
+        { "0 ? 1 / 0 : y + 1 * 1", "(+ y 1)" },
+        { "x ? 1 + 1 : 2 + 2", "(? x 2 4)" },
+        { "(1, x)", "x" },
+
+        /* What C leaves undefined is reported, and the subtree stays as it was */
+        { "1 / (2 - 2)", "division by zero in (/ 1 0)\n" },
+        { "5 % 0 + 1", "division by zero in (% 5 0)\n" },
+        { "2147483647 + 1", "integer overflow in (+ 2147483647 1)\n" },
+        { "-2147483647 - 2", "integer overflow in (- -2147483647 2)\n" },
+        { "65536 * 65536", "integer overflow in (* 65536 65536)\n" },
+        { "(-2147483647 - 1) / -1", "integer overflow in (/ -2147483648 -1)\n" },
+        { "-(-2147483647 - 1)", "integer overflow in (- -2147483648)\n" },
+        { "1 << 31", "integer overflow in (<< 1 31)\n" },
+        { "1 << 32", "shift count out of range in (<< 1 32)\n" },
+        { "1 >> -1", "shift count out of range in (>> 1 -1)\n" },
+        { "-1 << 1", "left shift of a negative value in (<< -1 1)\n" }
+    };
+
+    int i = 0;
+    while(i < (int)(sizeof cases / sizeof cases[0]))
+    {
+        char *text = FoldToString(cases[i][0]);
+        if(strcmp(text, cases[i][1]) != 0)
+        {
+            printf("%s folded to %s, expected %s\n", cases[i][0], text, cases[i][1]);
+        }
+        Assert(strcmp(text, cases[i][1]) == 0);
+        free(text);
+        i++;
+    }
+
+    /* Folding rewrites nodes in place, so the root keeps its id */
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact("(2 + 2) - 2");
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId root = ParseExpression(&parser);
+    Assert(pool.node_counts[EXPRESSION_BINARY] == 2);
+    Assert(FoldExpression(&pool, root));
+    Assert(ExpressionNumber(&pool, root) == 2);
+    Assert(pool.node_counts[EXPRESSION_BINARY] == 0);
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+}
+
+/* Compiles one expression and runs it with a = 7, b = -3 and c = 100 */
+static VmStatus RunExpression(char const *source, int *result, int *variables_after)
+{
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact(source);
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+
+    Bytecode bytecode = CreateBytecode();
+    int names[3] = { 'a', 'b', 'c' };
+    int values[3] = { 7, -3, 100 };
+    int i = 0;
+    while(i < 3)
+    {
+        char name = (char)names[i];
+        VariableSlot(&bytecode.variables, InternString(&global_interner, &name, 1));
+        i++;
+    }
+
+    bool compiled = CompileBytecode(&bytecode, &pool, expression);
+    Assert(compiled);
+
+    int *variables = calloc(BufferLength(bytecode.variables), sizeof *variables);
+    int *stack = malloc(bytecode.max_stack * sizeof *stack);
+    Assert(variables && stack);
+    memcpy(variables, values, sizeof values);
+
+    VmStatus status = VmRun(&bytecode, variables, stack, result);
+    if(variables_after)
+    {
+        memcpy(variables_after, variables, sizeof values);
+    }
+
+    free(stack);
+    free(variables);
+    FreeBytecode(&bytecode);
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    return status;
+}
+
+void VmTest(void)
+{
+    struct
+    {
+        char const *source;
+        int result;
+    } cases[] = {
+        { "1 + 2 * 3", 7 },
+        { "a * b - c / 7", -35 },
+        { "-a % 4 + (b >> 1) + (c << 2)", 395 },
+        { "~a & 0xff ^ 1 | 256", 505 },
+        { "a < b == (c >= 100) != !0", 1 },
+        { "a && b", 1 },
+        { "a && 0", 0 },
+        { "0 || b", 1 },
+        { "0 || 0", 0 },
+        { "a > 5 ? b ? 10 : 20 : 30", 10 },
+        { "a < 5 ? 10 : b < 0 ? 20 : 30", 20 },
+        { "(a, b, c)", 100 },
+        { "2147483647 + a", -2147483642 },
+        { "-(-2147483647 - 1)", INT_MIN },
+        { "123456789 * 2 + 8388608 - 8388609", 246913577 },
+        { "0 && 1 / 0", 0 },
+        { "1 || 1 % 0", 1 },
+        { "a ? c : 1 / 0", 100 },
+        { "1 + (2 + (3 + (4 + (5 + (6 + (7 + (8 + a)))))))", 43 }
+    };
+
+    int i = 0;
+    while(i < (int)(sizeof cases / sizeof cases[0]))
+    {
+        int result = 0;
+        VmStatus status = RunExpression(cases[i].source, &result, NULL);
+        if(status != VM_OK || result != cases[i].result)
+        {
+            printf("%s ran to %d (%s), expected %d\n", cases[i].source, result, vm_status_string_table[status], cases[i].result);
+        }
+        Assert(status == VM_OK && result == cases[i].result);
+        i++;
+    }
+
+    /* Assignments write the variables back */
+    int result = 0;
+    int variables[3];
+    Assert(RunExpression("a = b += c *= 2", &result, variables) == VM_OK);
+    Assert(result == 197 && variables[0] == 197 && variables[1] == 197 && variables[2] == 200);
+    Assert(RunExpression("d = a <<= 2", &result, variables) == VM_OK);
+    Assert(result == 28 && variables[0] == 28);
+
+    /* What C leaves undefined stops the program instead */
+    Assert(RunExpression("a / (b + 3)", &result, NULL) == VM_DIVISION_BY_ZERO);
+    Assert(RunExpression("c % 0", &result, NULL) == VM_DIVISION_BY_ZERO);
+    Assert(RunExpression("(-2147483647 - 1) / -1", &result, NULL) == VM_OVERFLOW);
+    Assert(RunExpression("a << 32", &result, NULL) == VM_SHIFT_OUT_OF_RANGE);
+    Assert(RunExpression("a >> b", &result, NULL) == VM_SHIFT_OUT_OF_RANGE);
+
+    /* The stack is sized by the compiler: a right-leaning chain needs one slot per level */
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact("1 - (2 - (3 - 4)) + (a ? 5 : 6)");
+    Parser parser = CreateParser(&tokens, &pool);
+    Bytecode bytecode = CreateBytecode();
+    Assert(CompileBytecode(&bytecode, &pool, ParseExpression(&parser)));
+    Assert(bytecode.max_stack == 4);
+    FreeBytecode(&bytecode);
+    FreeTokenStream(&tokens);
+
+    /* Code too long for a jump target to reach its end fails instead of wrapping.
+     * The code buffer starts out full but untouched, so it costs no memory. */
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    CompileContext context = *CurrentContext();
+    context.errors_reported = 0;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    tokens = LexerRunCompact("a ? 5 : 6");
+    parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    IrFunction function = CreateIrFunction();
+    Assert(LowerIr(&function, &pool, expression));
+    int backend = 0;
+    while(backend < 2)
+    {
+        bytecode = CreateBytecode();
+        BufferReallocate((void **)&bytecode.code, sizeof *bytecode.code, BYTECODE_OPERAND_MAX);
+        BufferHeaderGet(bytecode.code)->length = BYTECODE_OPERAND_MAX - 4;
+        bool compiled = backend == 0 ? CompileBytecode(&bytecode, &pool, expression) : LowerIrToBytecode(&bytecode, &function);
+        Assert(!compiled);
+        FreeBytecode(&bytecode);
+        backend++;
+    }
+    FreeIrFunction(&function);
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    Assert(context.errors_reported == 2);
+    Assert(strcmp(diagnostics, "bytecode has more than 8388607 instructions\n"
+                               "bytecode has more than 8388607 instructions\n") == 0);
+    free(diagnostics);
+}
+
+/* Appends a random expression over a, b and c, nested up to `depth` levels */
+static void GenerateRandomExpression(StringBuilder *builder, uint32_t *seed, int depth)
+{
+    static char const *binary_operators[] = {
+        "+", "-", "*", "/", "%", "<<", ">>", "<", ">", "<=", ">=", "==", "!=", "&", "|", "^", "&&", "||", ","
+    };
+    static char const *assignment_operators[] = { "=", "+=", "-=", "*=", "^=" };
+
+    *seed = *seed * 1664525 + 1013904223;
+    uint32_t choice = (*seed >> 16) % (depth > 0 ? 10 : 2);
+
+    if(choice == 0)
+    {
+        PushToStringBuilder(builder, "%d", (int)((*seed >> 8) % 41) - 20);
+    } else if(choice == 1)
+    {
+        PushToStringBuilder(builder, "%c", "abc"[(*seed >> 8) % 3]);
+    } else if(choice == 2)
+    {
+        PushToStringBuilder(builder, "%c(", "-~!"[(*seed >> 8) % 3]);
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, ")");
+    } else if(choice == 3)
+    {
+        PushToStringBuilder(builder, "(");
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, " ? ");
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, " : ");
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, ")");
+    } else if(choice == 4)
+    {
+        PushToStringBuilder(builder, "(%c %s ", "abc"[(*seed >> 8) % 3], assignment_operators[(*seed >> 4) % 5]);
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, ")");
+    } else
+    {
+        PushToStringBuilder(builder, "(");
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, " %s ", binary_operators[(*seed >> 8) % 19]);
+        GenerateRandomExpression(builder, seed, depth - 1);
+        PushToStringBuilder(builder, ")");
+    }
+}
+
+typedef struct
+{
+    VmStatus status;
+    int result;
+    int variables[3];
+} ExpressionRun;
+
+/* Runs one expression through the VM and as native code, with a = 7, b = -3, c = 100 */
+static void RunExpressionBothWays(char const *source, ExpressionRun *vm_run, ExpressionRun *native_run,
+                                  X86Program *program, StringBuilder *assembly, char const *name)
+{
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact(source);
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    Assert(PeekToken(&parser) == TOKEN_EOF);
+
+    Bytecode bytecode = CreateBytecode();
+    int i = 0;
+    while(i < 3)
+    {
+        Symbol symbol = InternString(&global_interner, &"abc"[i], 1);
+        VariableSlot(&bytecode.variables, symbol);
+        VariableSlot(&program->variables, symbol);
+        i++;
+    }
+
+    Assert(CompileBytecode(&bytecode, &pool, expression));
+    Assert(CompileX86(program, &pool, expression, name, assembly));
+    Assert(BufferLength(bytecode.variables) == 3 && BufferLength(program->variables) == 3);
+
+    int initial[3] = { 7, -3, 100 };
+    int *stack = malloc(bytecode.max_stack * sizeof *stack);
+    Assert(stack);
+    memcpy(vm_run->variables, initial, sizeof initial);
+    vm_run->result = 0;
+    vm_run->status = VmRun(&bytecode, vm_run->variables, stack, &vm_run->result);
+    free(stack);
+
+    JitCode jit;
+    Assert(JitLoad(&jit, program));
+    int status;
+    memcpy(native_run->variables, initial, sizeof initial);
+    native_run->result = jit.function(native_run->variables, &status);
+    native_run->status = (VmStatus)status;
+    JitFree(&jit);
+
+    FreeBytecode(&bytecode);
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+}
+
+static bool ExpressionRunsMatch(ExpressionRun *expected, ExpressionRun *actual)
+{
+    if(expected->status != actual->status)
+    {
+        return false;
+    }
+
+    /* A program that stopped early has no result, and may have assigned some variables */
+    return expected->status != VM_OK ||
+           (expected->result == actual->result && memcmp(expected->variables, actual->variables, sizeof expected->variables) == 0);
+}
+
+/* Native code has to agree with the VM, run from memory and after going through the
+ * system assembler */
+void X86Test(void)
+{
+    char const *fixed_sources[] = {
+        "1 + 2 * 3",
+        "a * b - c / 7",
+        "-a % 4 + (b >> 1) + (c << 2)",
+        "~a & 0xff ^ 1 | 256",
+        "a < b == (c >= 100) != !0",
+        "a && b || c && 0",
+        "a > 5 ? b ? 10 : 20 : 30",
+        "(a, b, c)",
+        "2147483647 + a",
+        "a = b += c *= 2",
+        "c / (a + b - 4)",
+        "(-2147483647 - 1) / -1",
+        "a << 32",
+        "a >> b",
+        /* Deeper than the registers, so values go through the machine stack */
+        "1 - (2 - (3 - (4 - (5 - (6 - (7 - (a - (b / (c % (9 << (a ? 1 : 2)))))))))))",
+        "a - (b - (c - (a - (b - (c - (a && (b || (c ? a / b : c % a))))))))"
+    };
+
+    StringBuilder assembly = CreateStringBuilder();
+    PushToStringBuilder(&assembly, "    .text\n");
+    char *sources[64];
+    ExpressionRun expected_runs[64];
+    int source_count = 0;
+
+    uint32_t seed = 12345;
+    int failures = 0;
+    int i = 0;
+    while(i < 1000)
+    {
+        StringBuilder random_source = CreateStringBuilder();
+        char *source;
+        if(i < (int)(sizeof fixed_sources / sizeof fixed_sources[0]))
+        {
+            PushToStringBuilder(&random_source, "%s", fixed_sources[i]);
+        } else
+        {
+            GenerateRandomExpression(&random_source, &seed, 6);
+        }
+        source = FinalizeStringBuilder(&random_source);
+
+        /* Only the first few go through the assembler, to keep the test quick */
+        bool keep = source_count < 64;
+        char name[32];
+        snprintf(name, sizeof name, "expression_%d", i);
+
+        X86Program program = CreateX86Program();
+        ExpressionRun vm_run;
+        ExpressionRun native_run;
+        RunExpressionBothWays(source, &vm_run, &native_run, &program, keep ? &assembly : NULL, name);
+        if(!ExpressionRunsMatch(&vm_run, &native_run))
+        {
+            printf("%s: vm %d (%s), native %d (%s)\n", source, vm_run.result, vm_status_string_table[vm_run.status],
+                   native_run.result, vm_status_string_table[native_run.status]);
+            failures++;
+        }
+        FreeX86Program(&program);
+
+        if(keep)
+        {
+            sources[source_count] = source;
+            expected_runs[source_count] = vm_run;
+            source_count++;
+        } else
+        {
+            free(source);
+        }
+
+        i++;
+    }
+    Assert(failures == 0);
+
+    /* Assemble the text into a shared library and call it from there */
+    PushToStringBuilder(&assembly, "    .section .note.GNU-stack,\"\",@progbits\n");
+    char *text = FinalizeStringBuilder(&assembly);
+    char assembly_path[] = "/tmp/x86_test_XXXXXX.s";
+    int file_descriptor = mkstemps(assembly_path, 2);
+    Assert(file_descriptor >= 0);
+    Assert(write(file_descriptor, text, strlen(text)) == (ssize_t)strlen(text));
+    close(file_descriptor);
+    free(text);
+
+    char library_path[64];
+    char command[256];
+    snprintf(library_path, sizeof library_path, "%.*s.so", (int)strlen(assembly_path) - 2, assembly_path);
+    snprintf(command, sizeof command, "cc -shared -o %s %s 2>&1", library_path, assembly_path);
+    void *library = NULL;
+    if(system(command) == 0)
+    {
+        library = dlopen(library_path, RTLD_NOW);
+    }
+
+    if(!library)
+    {
+        printf("X86Test: no system assembler, skipping the assembled comparison\n");
+    }
+
+    i = 0;
+    while(library && i < source_count)
+    {
+        char name[32];
+        snprintf(name, sizeof name, "expression_%d", i);
+        void *symbol = dlsym(library, name);
+        Assert(symbol);
+        JitFunction function;
+        memcpy(&function, &symbol, sizeof function);
+
+        ExpressionRun assembled_run;
+        int initial[3] = { 7, -3, 100 };
+        int status;
+        memcpy(assembled_run.variables, initial, sizeof initial);
+        assembled_run.result = function(assembled_run.variables, &status);
+        assembled_run.status = (VmStatus)status;
+        if(!ExpressionRunsMatch(&expected_runs[i], &assembled_run))
+        {
+            printf("%s: assembled %d (%s)\n", sources[i], assembled_run.result, vm_status_string_table[assembled_run.status]);
+        }
+        Assert(ExpressionRunsMatch(&expected_runs[i], &assembled_run));
+        i++;
+    }
+
+    if(library)
+    {
+        dlclose(library);
+    }
+    unlink(assembly_path);
+    unlink(library_path);
+
+    i = 0;
+    while(i < source_count)
+    {
+        free(sources[i]);
+        i++;
+    }
+}
+
+/* Lowers one expression over a, b and c, optimized when `statistics` is given */
+static IrFunction LowerIrSource(char const *source, IrPassStatistics *statistics)
+{
+    ExpressionPool pool = CreateExpressionPool();
+    TokenStream tokens = LexerRunCompact(source);
+    Parser parser = CreateParser(&tokens, &pool);
+    ExpressionId expression = ParseExpression(&parser);
+    Assert(PeekToken(&parser) == TOKEN_EOF);
+
+    IrFunction function = CreateIrFunction();
+    int i = 0;
+    while(i < 3)
+    {
+        VariableSlot(&function.variables, InternString(&global_interner, &"abc"[i], 1));
+        i++;
+    }
+    Assert(LowerIr(&function, &pool, expression));
+    if(statistics)
+    {
+        OptimizeIr(&function, statistics);
+    }
+
+    FreeTokenStream(&tokens);
+    FreeExpressionPool(&pool);
+
+    return function;
+}
+
+/* Runs a function from LowerIrSource with a = 7, b = -3, c = 100 */
+static void RunIrFunction(IrFunction *function, ExpressionRun *run)
+{
+    int initial[3] = { 7, -3, 100 };
+    int *values = malloc(BufferLength(function->instructions) * sizeof *values);
+    Assert(values);
+    memcpy(run->variables, initial, sizeof initial);
+    run->result = 0;
+    run->status = IrRun(function, run->variables, values, &run->result);
+    free(values);
+}
+
+/* Lowers a function from LowerIrSource to bytecode and runs that the same way */
+static void RunIrBytecode(IrFunction *function, ExpressionRun *run, Bytecode *bytecode)
+{
+    int initial[3] = { 7, -3, 100 };
+    *bytecode = CreateBytecode();
+    Assert(LowerIrToBytecode(bytecode, function));
+    int *stack = malloc(bytecode->max_stack * sizeof *stack);
+    Assert(stack && BufferLength(bytecode->variables) == 3);
+    memcpy(run->variables, initial, sizeof initial);
+    run->result = 0;
+    run->status = VmRun(bytecode, run->variables, stack, &run->result);
+    free(stack);
+}
+
+static int IrOpcodeCount(IrFunction *function, IrOpcode opcode)
+{
+    int count = 0;
+    int i = 0;
+    while(i < BufferLength(function->instructions))
+    {
+        count += function->instructions[i].opcode == opcode;
+        i++;
+    }
+
+    return count;
+}
+
+/* The IR has to agree with the VM before and after optimizing */
+void IrTest(void)
+{
+    IrPassStatistics statistics[IR_PASS_COUNT];
+    ExpressionRun run;
+    Bytecode bytecode;
+
+    /* Multiplying by a power of two becomes a shift, by one nothing. Lowered to
+     * bytecode, values used once stay on the stack. */
+    IrFunction function = LowerIrSource("a * 8 + b * 1", statistics);
+    RunIrFunction(&function, &run);
+    Assert(run.status == VM_OK && run.result == 53);
+    Assert(IrOpcodeCount(&function, IR_MULTIPLY) == 0 && IrOpcodeCount(&function, IR_SHIFT_LEFT_IMMEDIATE) == 1);
+    Assert(statistics[1].changes == 2);
+    RunIrBytecode(&function, &run, &bytecode);
+    Assert(run.status == VM_OK && run.result == 53 && bytecode.temporaries == 0 && BufferLength(bytecode.code) == 6);
+    FreeBytecode(&bytecode);
+    FreeIrFunction(&function);
+
+    /* The same sum in either order is computed once */
+    function = LowerIrSource("(a + b) * (b + a) - (a + b)", statistics);
+    RunIrFunction(&function, &run);
+    Assert(run.status == VM_OK && run.result == 12);
+    Assert(IrOpcodeCount(&function, IR_ADD) == 1 && statistics[2].changes == 2);
+    RunIrBytecode(&function, &run, &bytecode);
+    Assert(run.status == VM_OK && run.result == 12 && bytecode.temporaries == 1);
+    FreeBytecode(&bytecode);
+    FreeIrFunction(&function);
+
+    /* A branch on a constant goes, and so does the side that cannot run */
+    function = LowerIrSource("0 && a / 0", statistics);
+    RunIrFunction(&function, &run);
+    Assert(run.status == VM_OK && run.result == 0);
+    Assert(IrOpcodeCount(&function, IR_BRANCH) == 0 && IrOpcodeCount(&function, IR_DIVIDE) == 0);
+    FreeIrFunction(&function);
+
+    /* Unused values go, unless computing them could fail */
+    function = LowerIrSource("a + b, 5", statistics);
+    Assert(IrInstructionCount(&function) == 2 && statistics[3].changes == 4);
+    FreeIrFunction(&function);
+    function = LowerIrSource("a / b, 5", statistics);
+    Assert(IrOpcodeCount(&function, IR_DIVIDE) == 1);
+    FreeIrFunction(&function);
+
+    /* Variables assigned on one side of a branch meet in a phi; the unused value of ?: is gone */
+    function = LowerIrSource("(b ? (a = 2) : c), a * 3", statistics);
+    RunIrFunction(&function, &run);
+    Assert(run.status == VM_OK && run.result == 6 && run.variables[0] == 2);
+    Assert(IrOpcodeCount(&function, IR_PHI) == 1);
+    RunIrBytecode(&function, &run, &bytecode);
+    Assert(run.status == VM_OK && run.result == 6 && run.variables[0] == 2);
+    FreeBytecode(&bytecode);
+    FreeIrFunction(&function);
+
+    /* Lowered to bytecode, a variable read after a store to it was copied first */
+    function = LowerIrSource("c = a, a = b, b = c", statistics);
+    RunIrBytecode(&function, &run, &bytecode);
+    Assert(run.status == VM_OK && run.result == 7 && run.variables[0] == -3 && run.variables[1] == 7 && run.variables[2] == 7);
+    FreeBytecode(&bytecode);
+    FreeIrFunction(&function);
+
+    uint32_t seed = 54321;
+    int failures = 0;
+    int i = 0;
+    while(i < 1000)
+    {
+        StringBuilder random_source = CreateStringBuilder();
+        GenerateRandomExpression(&random_source, &seed, 6);
+        char *source = FinalizeStringBuilder(&random_source);
+
+        ExpressionRun vm_run;
+        vm_run.status = RunExpression(source, &vm_run.result, vm_run.variables);
+
+        ExpressionRun plain_run;
+        ExpressionRun plain_lowered_run;
+        function = LowerIrSource(source, NULL);
+        RunIrFunction(&function, &plain_run);
+        RunIrBytecode(&function, &plain_lowered_run, &bytecode);
+        FreeBytecode(&bytecode);
+        FreeIrFunction(&function);
+
+        ExpressionRun optimized_run;
+        ExpressionRun lowered_run;
+        function = LowerIrSource(source, statistics);
+        RunIrFunction(&function, &optimized_run);
+        RunIrBytecode(&function, &lowered_run, &bytecode);
+        FreeBytecode(&bytecode);
+        FreeIrFunction(&function);
+
+        /* Stores come last in both, so even a run that stopped leaves the same variables */
+        if(!ExpressionRunsMatch(&vm_run, &plain_run) || !ExpressionRunsMatch(&vm_run, &optimized_run) ||
+           !ExpressionRunsMatch(&plain_run, &plain_lowered_run) || !ExpressionRunsMatch(&optimized_run, &lowered_run) ||
+           memcmp(plain_run.variables, plain_lowered_run.variables, sizeof plain_run.variables) != 0 ||
+           memcmp(optimized_run.variables, lowered_run.variables, sizeof lowered_run.variables) != 0)
+        {
+            printf("%s: vm %d (%s), ir %d (%s), optimized %d (%s), bytecode %d (%s)\n", source, vm_run.result,
+                   vm_status_string_table[vm_run.status], plain_run.result, vm_status_string_table[plain_run.status],
+                   optimized_run.result, vm_status_string_table[optimized_run.status], lowered_run.result,
+                   vm_status_string_table[lowered_run.status]);
+            failures++;
+        }
+
+        free(source);
+        i++;
+    }
+    Assert(failures == 0);
+}
+
+void ArenaTest(void)
+{
+    Arena arena = CreateArena();
+
+    char *first = ArenaAllocate(&arena, 3);
+    char *second = ArenaAllocate(&arena, 5);
+    Assert(((uintptr_t)first & (ARENA_ALIGNMENT - 1)) == 0);
+    Assert(second == first + ARENA_ALIGNMENT);
+    memset(first, 'a', 3);
+    memset(second, 'b', 5);
+    Assert(first[2] == 'a' && second[0] == 'b');
+
+    /* Larger than a block: gets a block of its own */
+    char *large = ArenaAllocate(&arena, ARENA_BLOCK_SIZE * 2);
+    memset(large, 0, ARENA_BLOCK_SIZE * 2);
+    Assert(arena.bytes_allocated == 2 * ARENA_ALIGNMENT + ARENA_BLOCK_SIZE * 2);
+    Assert(arena.bytes_reserved == ARENA_BLOCK_SIZE * 3);
+
+    /* Many small allocations chain new blocks and never overlap */
+    int *previous = NULL;
+    int i = 0;
+    while(i < 100000)
+    {
+        int *value = ArenaAllocate(&arena, sizeof *value);
+        *value = i;
+        if(previous)
+        {
+            Assert(*previous == i - 1);
+        }
+
+        previous = value;
+        i++;
+    }
+
+    size_t high_water = arena.high_water;
+    Assert(high_water == arena.bytes_allocated);
+
+    ArenaReset(&arena);
+    Assert(arena.bytes_allocated == 0);
+    Assert(arena.high_water == high_water);
+    Assert(arena.blocks && !arena.blocks->next);
+
+    ArenaAllocate(&arena, 16);
+    Assert(arena.bytes_allocated == 16);
+
+    /* Bytes pack tightly, and the next aligned allocation skips past them */
+    char *bytes = ArenaAllocateBytes(&arena, 3);
+    char *more_bytes = ArenaAllocateBytes(&arena, 2);
+    char *aligned = ArenaAllocate(&arena, 8);
+    Assert(more_bytes == bytes + 3);
+    Assert(aligned == bytes + ARENA_ALIGNMENT);
+    Assert(arena.bytes_allocated == 16 + 5 + 8);
+
+    ArenaFree(&arena);
+    Assert(arena.blocks == NULL && arena.bytes_reserved == 0);
+}
+
+#include "bench.c"
+
+/* `text` is the first character of a string token's contents */
+void DumpToken(char const *path, int line, int column, TokenKind kind, TokenPayload payload, char const *text)
+{
+    FILE *output = CurrentContext()->output;
+    fprintf(output, "%s:%d:%d: %s", path, line, column, token_string_table[kind]);
+
+    switch(kind)
+    {
+        case TOKEN_NUMBER:
+            fprintf(output, " %u", payload);
+            break;
+        case TOKEN_IDENTIFIER:
+            fprintf(output, " %s", InternerString(CurrentContext()->interner, payload));
+            break;
+        case TOKEN_STRING:
+            fprintf(output, " \"%.*s\"", (int)payload, text);
+            break;
+        default:
+            break;
+    }
+
+    fprintf(output, "\n");
+}
+
+void DumpTokens(char const *path, TokenStream *tokens)
+{
+    int i = 0;
+    while(i < TokenStreamLength(tokens))
+    {
+        int line;
+        int column;
+        TokenStreamLocate(tokens, i, &line, &column);
+        DumpToken(path, line, column, tokens->kinds[i], tokens->payloads[i], tokens->source + tokens->offsets[i] + 1);
+        i++;
+    }
+}
+
+typedef struct
+{
+    bool dump_tokens;
+    bool stream_input;
+    bool parse;
+    bool ast_statistics;
+    bool share_expressions; // Hash-cons the tree, building each distinct subexpression once
+    bool fold; // Fold constant subtrees after parsing
+    bool evaluate; // Print the value of every statement, or report it is not constant
+    bool bytecode; // Print the bytecode of every statement
+    bool emit_assembly; // Print GNU as source with one function per statement
+    bool ir; // Print the IR of every statement before and after optimizing
+    bool statistics; // Time the phases and count what they make
+    char const *cache_directory; // Reuse the tokens and trees of files seen before, when set
+    bool emit_tokens; // Write the tokens of every file to its name with .tokens added
+    bool load_tokens; // The inputs are token files written by emit_tokens
+    ThreadPool *pool; // Splits large files across threads when set; NULL for batches
+} CompileOptions;
+
+/* The passes over one statement. LexFile runs each over every statement in turn,
+ * LexFileStreaming all of them over a statement before parsing the next. */
+static void EvaluateStatement(ExpressionPool *pool, ExpressionId expression, CompileOptions *options)
+{
+    int errors_before = CurrentContext()->errors_reported;
+    bool constant = FoldExpression(pool, expression);
+    if(options->evaluate && constant)
+    {
+        fprintf(CurrentContext()->output, "%d\n", ExpressionNumber(pool, expression));
+    } else if(options->evaluate && CurrentContext()->errors_reported == errors_before)
+    {
+        char *text = StringifyExpression(pool, expression);
+        ReportError("not a constant expression: %s\n", text);
+        free(text);
+    }
+}
+
+/* `index` counts the statements without errors from 0 */
+static void PrintStatementBytecode(char const *path, int index, ExpressionPool *pool, ExpressionId expression)
+{
+    Bytecode bytecode = CreateBytecode();
+    if(CompileBytecode(&bytecode, pool, expression))
+    {
+        fprintf(CurrentContext()->output, "%s: statement %d, stack %d\n", path, index + 1, bytecode.max_stack);
+        PrintBytecode(CurrentContext()->output, &bytecode);
+    }
+    FreeBytecode(&bytecode);
+}
+
+static void PrintStatementIr(char const *path, int index, ExpressionPool *pool, ExpressionId expression)
+{
+    IrFunction function = CreateIrFunction();
+    if(LowerIr(&function, pool, expression))
+    {
+        FILE *output = CurrentContext()->output;
+        IrPassStatistics statistics[IR_PASS_COUNT];
+        int before = IrInstructionCount(&function);
+        fprintf(output, "%s: statement %d, %d instructions\n", path, index + 1, before);
+        PrintIrFunction(output, &function);
+        int rounds = OptimizeIr(&function, statistics);
+        PrintIrPassStatistics(output, statistics);
+        fprintf(output, "%s: statement %d optimized in %d rounds, %d instructions\n", path, index + 1, rounds,
+                IrInstructionCount(&function));
+        PrintIrFunction(output, &function);
+
+        Bytecode bytecode = CreateBytecode();
+        if(LowerIrToBytecode(&bytecode, &function))
+        {
+            fprintf(output, "%s: statement %d lowered to bytecode, stack %d\n", path, index + 1, bytecode.max_stack);
+            PrintBytecode(output, &bytecode);
+        }
+        FreeBytecode(&bytecode);
+    }
+    FreeIrFunction(&function);
+}
+
+static void EmitStatementAssembly(int index, ExpressionPool *pool, ExpressionId expression, StringBuilder *assembly)
+{
+    char name[32];
+    snprintf(name, sizeof name, "statement_%d", index + 1);
+
+    X86Program program = CreateX86Program();
+    CompileX86(&program, pool, expression, name, assembly);
+    FreeX86Program(&program);
+}
+
+/* Lexes one file straight out of its mapping, then parses it if asked to */
+void LexFile(char const *path, CompileOptions *options)
+{
+    CompileStatistics *statistics = CurrentContext()->statistics;
+    int errors_before_lexing = CurrentContext()->errors_reported;
+    CompilePhaseTimer timer = CompilePhaseStart();
+    SourceFile file;
+    TokenStream tokens;
+    if(options->load_tokens)
+    {
+        /* A token file brings its own copy of the source, which ends where the end of file token is */
+        if(!LoadTokenFile(path, &tokens))
+        {
+            return;
+        }
+        memset(&file, 0, sizeof file);
+        file.length = tokens.offsets[TokenStreamLength(&tokens) - 1];
+    } else if(!SourceFileOpen(&file, path))
+    {
+        return;
+    }
+    CompilePhaseEnd(&timer, COMPILE_PHASE_READ);
+
+    if(file.length > UINT32_MAX)
+    {
+        ReportError("%s: files larger than 4 GiB are not supported\n", path);
+        SourceFileClose(&file);
+        return;
+    }
+
+    /* A file seen before comes from the cache, with its tree when it was parsed the same way */
+    char const *cache_directory = options->load_tokens ? NULL : options->cache_directory;
+    bool cache_tree = options->parse && !options->share_expressions;
+    TokenCacheKey cache_key;
+    TokenCacheResult cached = TOKEN_CACHE_MISS;
+    ExpressionPool pool;
+    ExpressionId *expressions = NULL; // Buffer
+    if(cache_directory)
+    {
+        timer = CompilePhaseStart();
+        cache_key = TokenCacheKeyOf(file.data, file.length);
+        cached = TokenCacheLoad(cache_directory, &cache_key, file.data, &tokens, cache_tree ? &pool : NULL,
+                                &expressions);
+        CompilePhaseEnd(&timer, COMPILE_PHASE_CACHE_LOAD);
+
+        if(statistics)
+        {
+            statistics->cache_hits += cached != TOKEN_CACHE_MISS;
+            statistics->cache_misses += cached == TOKEN_CACHE_MISS;
+            statistics->cache_bytes_saved += cached != TOKEN_CACHE_MISS ? file.length : 0;
+        }
+    }
+
+    if(cached == TOKEN_CACHE_MISS && !options->load_tokens)
+    {
+        timer = CompilePhaseStart();
+        if(options->pool)
+        {
+            tokens = LexerRunParallel(options->pool, file.data, file.length, options->pool->worker_count * 4);
+        } else
+        {
+            tokens = LexerRunCompact(file.data);
+        }
+        CompilePhaseEnd(&timer, COMPILE_PHASE_LEX);
+    }
+
+    /* Loading the tokens of a file with errors would not report them again */
+    if(options->emit_tokens && !options->load_tokens && CurrentContext()->errors_reported == errors_before_lexing)
+    {
+        timer = CompilePhaseStart();
+        char tokens_path[PATH_MAX];
+        snprintf(tokens_path, sizeof tokens_path, "%s.tokens", path);
+        EmitTokenFile(tokens_path, &tokens);
+        CompilePhaseEnd(&timer, COMPILE_PHASE_EMIT_TOKENS);
+    }
+
+    if(statistics)
+    {
+        statistics->files++;
+        statistics->bytes += file.length;
+        CountTokens(statistics, &tokens);
+    }
+
+    if(options->dump_tokens)
+    {
+        DumpTokens(path, &tokens);
+    }
+
+    if(options->parse && cached != TOKEN_CACHE_TREE)
+    {
+        /* The tree lives as long as the file's tokens */
+        timer = CompilePhaseStart();
+        pool = CreateExpressionPool();
+        if(options->share_expressions)
+        {
+            ShareExpressions(&pool);
+        }
+        Parser parser = CreateParser(&tokens, &pool);
+        expressions = ParseTranslationUnit(&parser);
+        CompilePhaseEnd(&timer, COMPILE_PHASE_PARSE);
+    }
+
+    /* Diagnostics are not kept, so only files without any are cached */
+    bool cache_is_missing = cached == TOKEN_CACHE_MISS || (cached == TOKEN_CACHE_TOKENS && cache_tree);
+    if(cache_directory && cache_is_missing && CurrentContext()->errors_reported == errors_before_lexing)
+    {
+        timer = CompilePhaseStart();
+        TokenCacheStore(cache_directory, &cache_key, &tokens, cache_tree ? &pool : NULL, expressions);
+        CompilePhaseEnd(&timer, COMPILE_PHASE_CACHE_STORE);
+    }
+
+    if(options->parse)
+    {
+        if(statistics)
+        {
+            CountExpressions(statistics, &pool);
+        }
+
+        timer = CompilePhaseStart();
+        int i = 0;
+        while(options->fold && i < BufferLength(expressions))
+        {
+            EvaluateStatement(&pool, expressions[i], options);
+            i++;
+        }
+
+        if(options->fold)
+        {
+            CompilePhaseEnd(&timer, COMPILE_PHASE_FOLD);
+        }
+
+        timer = CompilePhaseStart();
+        i = 0;
+        while(options->bytecode && i < BufferLength(expressions))
+        {
+            PrintStatementBytecode(path, i, &pool, expressions[i]);
+            i++;
+        }
+
+        if(options->bytecode)
+        {
+            CompilePhaseEnd(&timer, COMPILE_PHASE_BYTECODE);
+        }
+
+        timer = CompilePhaseStart();
+        i = 0;
+        while(options->ir && i < BufferLength(expressions))
+        {
+            PrintStatementIr(path, i, &pool, expressions[i]);
+            i++;
+        }
+        if(options->ir)
+        {
+            CompilePhaseEnd(&timer, COMPILE_PHASE_IR);
+        }
+
+        timer = CompilePhaseStart();
+        if(options->emit_assembly)
+        {
+            StringBuilder assembly = CreateStringBuilder();
+            PushToStringBuilder(&assembly, "    .text\n");
+
+            i = 0;
+            while(i < BufferLength(expressions))
+            {
+                EmitStatementAssembly(i, &pool, expressions[i], &assembly);
+                i++;
+            }
+
+            PushToStringBuilder(&assembly, "    .section .note.GNU-stack,\"\",@progbits\n");
+            fputs(assembly.buffer, CurrentContext()->output);
+            FreeStringBuilder(&assembly);
+        }
+        if(options->emit_assembly)
+        {
+            CompilePhaseEnd(&timer, COMPILE_PHASE_ASSEMBLY);
+        }
+
+        if(expressions)
+        {
+            BufferFree(expressions);
+        }
+
+        if(options->ast_statistics)
+        {
+            fprintf(CurrentContext()->output, "%s: ", path);
+            PrintExpressionPoolStatistics(CurrentContext()->output, &pool);
+        }
+
+        FreeExpressionPool(&pool);
+    }
+
+    FreeTokenStream(&tokens);
+    SourceFileClose(&file);
+}
+
+/* Parses a file one statement at a time as its tokens come through a TokenRing, and
+ * runs the passes over each statement before parsing the next, so output from more
+ * than one pass comes statement by statement. Unless the expressions are shared the
+ * pool only ever holds the statement at hand. */
+static void ParseFileStreaming(char const *path, LexerStream *stream, CompileOptions *options)
+{
+    CompileStatistics *statistics = CurrentContext()->statistics;
+    FILE *output = CurrentContext()->output;
+
+    /* Reading, lexing, parsing and the passes overlap here, so it all counts as parsing;
+     * timing every statement's passes would cost more than some of the passes do */
+    CompilePhaseTimer timer = CompilePhaseStart();
+    TokenRing ring;
+    TokenRingInit(&ring, stream, statistics ? statistics->token_counts : NULL);
+    ExpressionPool pool = CreateExpressionPool();
+    if(options->share_expressions)
+    {
+        ShareExpressions(&pool);
+    }
+    Parser parser = CreateStreamParser(&ring, &pool);
+
+    if(options->emit_assembly)
+    {
+        fputs("    .text\n", output);
+    }
+
+    /* Only what the parser built is counted, as in LexFile, not what the passes add */
+    size_t counted[EXPRESSION_KIND_COUNT] = { 0 };
+    int index = 0;
+    while(PeekToken(&parser) != TOKEN_EOF)
+    {
+        ExpressionId expression = ParseStatement(&parser);
+
+        int kind = 0;
+        while(statistics && kind < EXPRESSION_KIND_COUNT)
+        {
+            statistics->expression_counts[kind] += pool.node_counts[kind] - counted[kind];
+            kind++;
+        }
+
+        if(expression && options->fold)
+        {
+            EvaluateStatement(&pool, expression, options);
+        }
+
+        if(expression && options->bytecode)
+        {
+            PrintStatementBytecode(path, index, &pool, expression);
+        }
+
+        if(expression && options->ir)
+        {
+            PrintStatementIr(path, index, &pool, expression);
+        }
+
+        if(expression && options->emit_assembly)
+        {
+            StringBuilder assembly = CreateStringBuilder();
+            EmitStatementAssembly(index, &pool, expression, &assembly);
+            fputs(assembly.buffer, output);
+            FreeStringBuilder(&assembly);
+        }
+
+        index += expression != 0;
+        if(!options->share_expressions)
+        {
+            ClearExpressionPool(&pool);
+        }
+        memcpy(counted, pool.node_counts, sizeof counted);
+    }
+    CompilePhaseEnd(&timer, COMPILE_PHASE_PARSE);
+
+    if(options->emit_assembly)
+    {
+        fputs("    .section .note.GNU-stack,\"\",@progbits\n", output);
+    }
+
+    if(statistics)
+    {
+        /* The end of file token sits just past the last byte */
+        statistics->files++;
+        statistics->bytes += ring.end_offset;
+    }
+
+    FreeExpressionPool(&pool);
+}
+
+/* Lexes one file through a LexerStream, holding only one chunk of it in memory, and
+ * parses it as it goes if asked to */
+void LexFileStreaming(char const *path, CompileOptions *options)
+{
+    int file_descriptor = open(path, O_RDONLY);
+    if(file_descriptor < 0)
+    {
+        ReportError("%s: could not open file: %s\n", path, strerror(errno));
+        return;
+    }
+
+    LexerStream stream;
+    LexerStreamInit(&stream, file_descriptor, LEXER_STREAM_READ_SIZE);
+    if(options->parse)
+    {
+        ParseFileStreaming(path, &stream, options);
+        LexerStreamFree(&stream);
+        close(file_descriptor);
+        return;
+    }
+
+    /* Reading and lexing overlap here, so it all counts as lexing */
+    CompileStatistics *statistics = CurrentContext()->statistics;
+    CompilePhaseTimer timer = CompilePhaseStart();
+
+    Token token;
+    do
+    {
+        uint32_t offset;
+        token = LexerNext(&stream, &offset);
+        if(statistics)
+        {
+            statistics->token_counts[token.kind]++;
+        }
+
+        if(options->dump_tokens)
+        {
+            char const *text = token.kind == TOKEN_STRING ? LexerStreamText(&stream, token.string.offset) : NULL;
+            DumpToken(path, token.line, token.column, token.kind, TokenPayloadOf(&token), text);
+        }
+
+        /* The end of file token sits just past the last byte */
+        if(statistics && token.kind == TOKEN_EOF)
+        {
+            statistics->files++;
+            statistics->bytes += offset;
+        }
+    } while(token.kind != TOKEN_EOF);
+
+    LexerStreamFree(&stream);
+    close(file_descriptor);
+    CompilePhaseEnd(&timer, COMPILE_PHASE_LEX);
+}
+
+void CompileFile(char const *path, CompileOptions *options)
+{
+    if(options->stream_input && !options->load_tokens)
+    {
+        LexFileStreaming(path, options);
+    } else
+    {
+        LexFile(path, options);
+    }
+}
+
+/* Batch compilation
+ *
+ * Each file gets its own CompileContext with its own interner, and its output and
+ * diagnostics go to memory. The files are compiled on a ThreadPool in whatever order
+ * the workers pick them up; CompileJobsFinish then prints everything in the order
+ * the files were given, so the output does not depend on the scheduling. */
+typedef struct
+{
+    char const *path;
+    CompileOptions *options;
+    CompileContext context;
+    Interner interner;
+    char *output;
+    size_t output_length;
+    char *diagnostics;
+    size_t diagnostics_length;
+    CompileStatistics statistics;
+} CompileJob;
+
+static void CompileJobRun(void *argument)
+{
+    CompileJob *job = argument;
+    memset(&job->interner, 0, sizeof job->interner);
+    memset(&job->context, 0, sizeof job->context);
+    job->context.interner = &job->interner;
+    job->context.statistics = job->options->statistics ? &job->statistics : NULL;
+    job->context.path = job->path;
+    job->context.output = open_memstream(&job->output, &job->output_length);
+    job->context.diagnostics = open_memstream(&job->diagnostics, &job->diagnostics_length);
+    Assert(job->context.output && job->context.diagnostics);
+
+    CompileContext *previous = SetCurrentContext(&job->context);
+    CompileFile(job->path, job->options);
+    SetCurrentContext(previous);
+
+    fclose(job->context.output);
+    fclose(job->context.diagnostics);
+    job->context.output = NULL;
+    job->context.diagnostics = NULL;
+    InternerFree(&job->interner);
+}
+
+CompileJob *CreateCompileJobs(char **paths, int count, CompileOptions *options)
+{
+    CompileJob *jobs = calloc(count, sizeof *jobs);
+    Assert(jobs);
+
+    int i = 0;
+    while(i < count)
+    {
+        jobs[i].path = paths[i];
+        jobs[i].options = options;
+        i++;
+    }
+
+    return jobs;
+}
+
+void CompileJobsRun(ThreadPool *pool, CompileJob *jobs, int count)
+{
+    /* Pick the scan mode once, before several lexers want to at the same time */
+    if(lexer_scan_mode == LEXER_SCAN_AUTO)
+    {
+        LexerSelectScanMode(LEXER_SCAN_AUTO);
+    }
+
+    int i = 0;
+    while(i < count)
+    {
+        ThreadPoolSubmit(pool, CompileJobRun, &jobs[i]);
+        i++;
+    }
+
+    ThreadPoolWait(pool);
+}
+
+/* Prints every job's output and diagnostics in order, frees the jobs and returns
+ * the number of files that had errors */
+int CompileJobsFinish(CompileJob *jobs, int count)
+{
+    int failed = 0;
+    int i = 0;
+    while(i < count)
+    {
+        fwrite(jobs[i].output, 1, jobs[i].output_length, stdout);
+        fwrite(jobs[i].diagnostics, 1, jobs[i].diagnostics_length, stderr);
+        free(jobs[i].output);
+        free(jobs[i].diagnostics);
+
+        if(jobs[i].context.statistics && CurrentContext()->statistics)
+        {
+            MergeCompileStatistics(CurrentContext()->statistics, jobs[i].context.statistics);
+        }
+
+        if(jobs[i].context.had_error)
+        {
+            failed++;
+        }
+
+        i++;
+    }
+
+    free(jobs);
+
+    return failed;
+}
+
+/* Diagnostics from a batch come back per file, in the order the files were given */
+void CompileJobsTest(void)
+{
+    char path_template[3][32] = { "/tmp/compile_jobs_XXXXXX", "/tmp/compile_jobs_XXXXXX", "/tmp/compile_jobs_XXXXXX" };
+    char const *sources[3] = { "1 + 2;\n3 + 4;", "1 + ;\n5 + 6;", "apple + ; 2 + 2;" };
+    char *paths[3];
+
+    int i = 0;
+    while(i < 3)
+    {
+        int file_descriptor = mkstemp(path_template[i]);
+        Assert(file_descriptor >= 0);
+        Assert(write(file_descriptor, sources[i], strlen(sources[i])) == (ssize_t)strlen(sources[i]));
+        close(file_descriptor);
+        paths[i] = path_template[i];
+        i++;
+    }
+
+    CompileOptions options;
+    memset(&options, 0, sizeof options);
+    options.parse = true;
+    options.dump_tokens = true;
+
+    ThreadPool pool;
+    ThreadPoolInit(&pool, 3);
+    CompileJob *jobs = CreateCompileJobs(paths, 3, &options);
+    CompileJobsRun(&pool, jobs, 3);
+    ThreadPoolFree(&pool);
+
+    Assert(!jobs[0].context.had_error);
+    Assert(jobs[0].diagnostics_length == 0);
+    char expected_diagnostics[96];
+    Assert(jobs[1].context.errors_reported == 1);
+    snprintf(expected_diagnostics, sizeof expected_diagnostics, "%s:1:5: expected expression but found ;\n", paths[1]);
+    Assert(strcmp(jobs[1].diagnostics, expected_diagnostics) == 0);
+    Assert(jobs[2].context.errors_reported == 1);
+    snprintf(expected_diagnostics, sizeof expected_diagnostics, "%s:1:9: expected expression but found ;\n", paths[2]);
+    Assert(strcmp(jobs[2].diagnostics, expected_diagnostics) == 0);
+
+    /* Messages without a line and column still get a space after the file name */
+    char *written = NULL;
+    size_t written_length = 0;
+    FILE *stream = open_memstream(&written, &written_length);
+    WriteDiagnostic(stream, "x.c", "not a constant expression: a\n", 29);
+    WriteDiagnostic(stream, "x.c", "12:3: trailing ;\n", 17);
+    WriteDiagnostic(stream, "x.c", "x.c: could not open file\n", 25);
+    fclose(stream);
+    Assert(strcmp(written, "x.c: not a constant expression: a\nx.c:12:3: trailing ;\nx.c: could not open file\n") == 0);
+    free(written);
+
+    /* Each file has its own interner, so "apple" is the first symbol of the third file */
+    char expected_output[64];
+    snprintf(expected_output, sizeof expected_output, "%s:1:1: identifier apple\n", paths[2]);
+    Assert(strncmp(jobs[2].output, expected_output, strlen(expected_output)) == 0);
+
+    /* Nothing was printed yet, so drop the output instead of going through CompileJobsFinish */
+    i = 0;
+    while(i < 3)
+    {
+        free(jobs[i].output);
+        free(jobs[i].diagnostics);
+        unlink(paths[i]);
+        i++;
+    }
+
+    free(jobs);
+}
+
+/* Phases only count what they did; allocations are counted while counting is on */
+void StatisticsTest(void)
+{
+    char path[] = "/tmp/statistics_XXXXXX";
+    char const *source = "a = 1 + 2;\nb = a * 3;";
+    int file_descriptor = mkstemp(path);
+    Assert(file_descriptor >= 0);
+    Assert(write(file_descriptor, source, strlen(source)) == (ssize_t)strlen(source));
+    close(file_descriptor);
+
+    CompileStatistics statistics;
+    memset(&statistics, 0, sizeof statistics);
+    Interner interner;
+    memset(&interner, 0, sizeof interner);
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &interner;
+    context.statistics = &statistics;
+    char *output = NULL;
+    size_t output_length = 0;
+    context.output = open_memstream(&output, &output_length);
+    context.diagnostics = context.output;
+
+    CompileOptions options;
+    memset(&options, 0, sizeof options);
+    options.parse = true;
+    options.fold = true;
+
+    CompileContext *previous = SetCurrentContext(&context);
+    CompileFile(path, &options);
+    SetCurrentContext(previous);
+    fclose(context.output);
+
+    Assert(!context.had_error);
+    Assert(statistics.files == 1);
+    Assert(statistics.bytes == strlen(source));
+    Assert(statistics.token_counts[TOKEN_IDENTIFIER] == 3);
+    Assert(statistics.token_counts[TOKEN_NUMBER] == 3);
+    Assert(statistics.token_counts[TOKEN_SEMICOLON] == 2);
+    Assert(statistics.token_counts[TOKEN_EOF] == 1);
+    Assert(statistics.expression_counts[EXPRESSION_ASSIGNMENT] == 2);
+    Assert(statistics.expression_counts[EXPRESSION_BINARY] == 2);
+    Assert(statistics.wall_seconds[COMPILE_PHASE_LEX] > 0);
+    Assert(statistics.wall_seconds[COMPILE_PHASE_PARSE] > 0);
+    Assert(statistics.wall_seconds[COMPILE_PHASE_FOLD] > 0);
+    Assert(statistics.wall_seconds[COMPILE_PHASE_IR] == 0);
+
+    /* Streaming sees the same tokens and bytes */
+    CompileStatistics streamed;
+    memset(&streamed, 0, sizeof streamed);
+    context.statistics = &streamed;
+    context.output = open_memstream(&output, &output_length);
+    options.stream_input = true;
+    previous = SetCurrentContext(&context);
+    CompileFile(path, &options);
+    SetCurrentContext(previous);
+    fclose(context.output);
+    free(output);
+    InternerFree(&interner);
+    unlink(path);
+
+    Assert(streamed.bytes == statistics.bytes);
+    Assert(memcmp(streamed.token_counts, statistics.token_counts, sizeof streamed.token_counts) == 0);
+
+    MergeCompileStatistics(&statistics, &streamed);
+    Assert(statistics.files == 2);
+    Assert(statistics.token_counts[TOKEN_NUMBER] == 6);
+
+    ProcessStatisticsStart start = StartProcessStatistics();
+    ProcessStatistics before = ReadProcessStatistics(&start);
+    int *numbers = NULL;
+    int i = 0;
+    while(i < 10000)
+    {
+        BufferPush(numbers, i);
+        i++;
+    }
+    atomic_store(&allocation_counting, false);
+    ProcessStatistics after = ReadProcessStatistics(&start);
+    BufferFree(numbers);
+
+    /* 32 up to 8192, then 16384, which is still in use. mallinfo2 counts chunks in
+     * malloc's per-thread cache as in use even when free, so the small early buffers
+     * can make the growth look a little smaller or bigger than it is. */
+    Assert(after.buffer_reallocations - before.buffer_reallocations == 10);
+    Assert(after.buffer_reallocated_bytes - before.buffer_reallocated_bytes == 10 * sizeof(BufferHeader) + 32736 * sizeof(int));
+    Assert(!HEAP_USAGE_KNOWN || after.heap_growth_bytes - before.heap_growth_bytes >= (long long)(8192 * sizeof(int)));
+}
+
+/* Compiles `path` in a context of its own, whose interner already holds `seeded` names,
+ * and returns the output and diagnostics */
+static char *CompileWithCache(char const *path, CompileOptions *options, int seeded, CompileStatistics *statistics)
+{
+    Interner interner;
+    memset(&interner, 0, sizeof interner);
+    int i = 0;
+    while(i < seeded)
+    {
+        char name[16];
+        snprintf(name, sizeof name, "seed%d", i);
+        InternString(&interner, name, (int)strlen(name));
+        i++;
+    }
+
+    memset(statistics, 0, sizeof *statistics);
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &interner;
+    context.statistics = statistics;
+    char *output = NULL;
+    size_t output_length = 0;
+    context.output = open_memstream(&output, &output_length);
+    context.diagnostics = context.output;
+
+    CompileContext *previous = SetCurrentContext(&context);
+    CompileFile(path, options);
+    SetCurrentContext(previous);
+    fclose(context.output);
+    InternerFree(&interner);
+
+    return output;
+}
+
+/* Removes the lines of `text` that contain `needle`, in place */
+static void DropLinesContaining(char *text, char const *needle)
+{
+    char *to = text;
+    char const *line = text;
+    while(*line)
+    {
+        char const *end = strchr(line, '\n');
+        end = end ? end + 1 : line + strlen(line);
+        char const *found = strstr(line, needle);
+        if(!found || found >= end)
+        {
+            memmove(to, line, end - line);
+            to += end - line;
+        }
+        line = end;
+    }
+    *to = 0;
+}
+
+/* Streaming runs the same passes over the same statements as compiling the mapped file */
+void StreamingCompileTest(void)
+{
+    char path[] = "/tmp/streaming_XXXXXX";
+    char const *source = "a = 1 + 2;\n4 * (5 - 1);\nb ? 2 : 3;\n-7 + 1;\nc = d = 9;\n(a, 3 * 3);\n";
+    int file_descriptor = mkstemp(path);
+    Assert(file_descriptor >= 0);
+    Assert(write(file_descriptor, source, strlen(source)) == (ssize_t)strlen(source));
+    close(file_descriptor);
+
+    CompileOptions passes[5];
+    memset(passes, 0, sizeof passes);
+    int i = 0;
+    while(i < 5)
+    {
+        passes[i].parse = true;
+        i++;
+    }
+    passes[0].fold = true;
+    passes[0].evaluate = true;
+    passes[1].bytecode = true;
+    passes[2].ir = true;
+    passes[3].emit_assembly = true;
+    passes[4].fold = true;
+    passes[4].evaluate = true;
+    passes[4].share_expressions = true;
+
+    i = 0;
+    while(i < 5)
+    {
+        CompileStatistics statistics;
+        CompileStatistics streamed;
+        char *expected = CompileWithCache(path, &passes[i], 0, &statistics);
+        passes[i].stream_input = true;
+        char *output = CompileWithCache(path, &passes[i], 0, &streamed);
+        /* Pass timings differ from run to run */
+        DropLinesContaining(expected, " changes ");
+        DropLinesContaining(output, " changes ");
+        Assert(strlen(expected) > 0);
+        Assert(strcmp(output, expected) == 0);
+        Assert(streamed.bytes == statistics.bytes);
+        Assert(memcmp(streamed.token_counts, statistics.token_counts, sizeof streamed.token_counts) == 0);
+        Assert(memcmp(streamed.expression_counts, statistics.expression_counts, sizeof streamed.expression_counts) == 0);
+        free(expected);
+        free(output);
+        i++;
+    }
+
+    /* Parse errors come out the same too */
+    FILE *file = fopen(path, "w");
+    Assert(file);
+    fputs("1 +;\nx = (2;\ny;\n", file);
+    fclose(file);
+    CompileOptions options;
+    memset(&options, 0, sizeof options);
+    options.parse = true;
+    CompileStatistics statistics;
+    char *expected = CompileWithCache(path, &options, 0, &statistics);
+    options.stream_input = true;
+    char *output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strstr(expected, "2:") != NULL);
+    Assert(strcmp(output, expected) == 0);
+    free(expected);
+    free(output);
+    unlink(path);
+}
+
+void TokenCacheTest(void)
+{
+    /* Known XXH64 values */
+    Assert(HashBytes("", 0, 0) == 0xEF46DB3751D8E999ull);
+    Assert(HashBytes("a", 1, 0) == 0xD24EC4F1A98C6E5Bull);
+    Assert(HashBytes("abc", 3, 0) == 0x44BC2CF5AD770999ull);
+    char const *long_text = "Nobody inspects the spammish repetition";
+    Assert(HashBytes(long_text, strlen(long_text), 0) == 0xFBCEA83C8A378BF1ull);
+
+    char directory[] = "/tmp/token_cache_XXXXXX";
+    Assert(mkdtemp(directory));
+    char cache_directory[64];
+    snprintf(cache_directory, sizeof cache_directory, "%s/cache", directory);
+    char path[64];
+    snprintf(path, sizeof path, "%s/source.c", directory);
+
+    char const *source = "1 + 2;\n(3 * x, 4) ? 5 : 6;\nx = y + 1;\n";
+    FILE *file = fopen(path, "w");
+    Assert(file);
+    fputs(source, file);
+    fclose(file);
+
+    CompileOptions options;
+    memset(&options, 0, sizeof options);
+    options.evaluate = true;
+    options.fold = true;
+    options.parse = true;
+    char *expected = CompileWithCache(path, &options, 0, &(CompileStatistics){ 0 });
+
+    /* The first run fills the cache, which does not change what comes out */
+    options.cache_directory = cache_directory;
+    CompileStatistics statistics;
+    char *output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.cache_hits == 0 && statistics.cache_misses == 1);
+    Assert(statistics.wall_seconds[COMPILE_PHASE_CACHE_STORE] > 0);
+    free(output);
+
+    TokenCacheKey key = TokenCacheKeyOf(source, strlen(source));
+    char entry[PATH_MAX];
+    TokenCachePath(entry, sizeof entry, cache_directory, &key);
+    Assert(access(entry, R_OK) == 0);
+
+    /* The second skips lexing and parsing */
+    output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.cache_hits == 1 && statistics.cache_bytes_saved == strlen(source));
+    Assert(statistics.wall_seconds[COMPILE_PHASE_LEX] == 0 && statistics.wall_seconds[COMPILE_PHASE_PARSE] == 0);
+    Assert(statistics.token_counts[TOKEN_IDENTIFIER] == 3);
+    Assert(statistics.expression_counts[EXPRESSION_TERNARY] == 1);
+    free(output);
+
+    /* An interner that already has names renumbers the identifiers */
+    output = CompileWithCache(path, &options, 5, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.cache_hits == 1);
+    free(output);
+
+    /* Tokens alone come from an entry with a tree too */
+    CompileOptions dump_options;
+    memset(&dump_options, 0, sizeof dump_options);
+    dump_options.dump_tokens = true;
+    char *expected_dump = CompileWithCache(path, &dump_options, 0, &statistics);
+    dump_options.cache_directory = cache_directory;
+    output = CompileWithCache(path, &dump_options, 2, &statistics);
+    Assert(strcmp(output, expected_dump) == 0);
+    Assert(statistics.cache_hits == 1);
+    free(output);
+    free(expected_dump);
+
+    /* A damaged entry is a miss and gets written again */
+    int file_descriptor = open(entry, O_RDWR);
+    Assert(file_descriptor >= 0);
+    char byte;
+    Assert(pread(file_descriptor, &byte, 1, 100) == 1);
+    byte ^= 0x20;
+    Assert(pwrite(file_descriptor, &byte, 1, 100) == 1);
+    close(file_descriptor);
+
+    output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.cache_misses == 1);
+    free(output);
+    output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(statistics.cache_hits == 1);
+    free(output);
+
+    /* So is one that gets past the checksum with a tree that does not add up. The last
+     * node is an assignment, its kind and operator the last two bytes; as a unary node
+     * it leaves one operand too many on the stack. */
+    file_descriptor = open(entry, O_RDWR);
+    Assert(file_descriptor >= 0);
+    struct stat status;
+    Assert(fstat(file_descriptor, &status) == 0);
+    size_t entry_size = (size_t)status.st_size;
+    char *bytes = malloc(entry_size);
+    Assert(bytes && pread(file_descriptor, bytes, entry_size, 0) == (ssize_t)entry_size);
+    Assert(bytes[entry_size - 2] == EXPRESSION_ASSIGNMENT);
+    bytes[entry_size - 2] = EXPRESSION_UNARY;
+    TokenCacheHeader header;
+    memcpy(&header, bytes, sizeof header);
+    header.checksum = HashBytes(bytes + sizeof header, entry_size - sizeof header, 0);
+    memcpy(bytes, &header, sizeof header);
+    Assert(pwrite(file_descriptor, bytes, entry_size, 0) == (ssize_t)entry_size);
+    close(file_descriptor);
+    free(bytes);
+
+    output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.cache_misses == 1);
+    free(output);
+    unlink(entry);
+
+    /* Files with errors are not cached, since their diagnostics would be lost */
+    char const *broken = "1 +;\n";
+    file = fopen(path, "w");
+    Assert(file);
+    fputs(broken, file);
+    fclose(file);
+    char *first = CompileWithCache(path, &options, 0, &statistics);
+    char *second = CompileWithCache(path, &options, 0, &statistics);
+    Assert(statistics.cache_misses == 1);
+    Assert(strcmp(first, second) == 0 && strlen(first) > 0);
+    free(first);
+    free(second);
+
+    free(expected);
+    unlink(path);
+    rmdir(cache_directory);
+    rmdir(directory);
+}
+
+void TokenFileTest(void)
+{
+    char directory[] = "/tmp/token_file_XXXXXX";
+    Assert(mkdtemp(directory));
+    char path[64];
+    snprintf(path, sizeof path, "%s/prelude.c", directory);
+    char tokens_path[80];
+    snprintf(tokens_path, sizeof tokens_path, "%s.tokens", path);
+
+    char const *source = "limit = 10 * scale;\nname = \"a \\\"quoted\\\" string\";\nlimit ? scale : 0x1f;\n";
+    FILE *file = fopen(path, "w");
+    Assert(file);
+    fputs(source, file);
+    fclose(file);
+
+    /* Emitting does not change what the compile prints */
+    CompileOptions options;
+    memset(&options, 0, sizeof options);
+    options.dump_tokens = true;
+    CompileStatistics statistics;
+    char *expected = CompileWithCache(path, &options, 0, &statistics);
+    options.emit_tokens = true;
+    char *output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.wall_seconds[COMPILE_PHASE_EMIT_TOKENS] > 0);
+    free(output);
+    free(expected);
+
+    /* Loaded into an empty interner, the arrays are what lexing gives, and the source comes along */
+    char *diagnostics = NULL;
+    size_t diagnostics_length = 0;
+    Interner lexed_interner;
+    memset(&lexed_interner, 0, sizeof lexed_interner);
+    Interner loaded_interner;
+    memset(&loaded_interner, 0, sizeof loaded_interner);
+    CompileContext context;
+    memset(&context, 0, sizeof context);
+    context.interner = &lexed_interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    CompileContext *previous = SetCurrentContext(&context);
+
+    TokenStream lexed = LexerRunCompact(source);
+    context.interner = &loaded_interner;
+    TokenStream loaded;
+    Assert(LoadTokenFile(tokens_path, &loaded));
+    int count = TokenStreamLength(&lexed);
+    Assert(TokenStreamLength(&loaded) == count);
+    Assert(memcmp(loaded.kinds, lexed.kinds, count * sizeof *lexed.kinds) == 0);
+    Assert(memcmp(loaded.offsets, lexed.offsets, count * sizeof *lexed.offsets) == 0);
+    Assert(memcmp(loaded.payloads, lexed.payloads, count * sizeof *lexed.payloads) == 0);
+    Assert(strcmp(loaded.source, source) == 0);
+    FreeTokenStream(&loaded);
+
+    /* An interner with other names in it gets the identifiers renumbered */
+    InternerFree(&loaded_interner);
+    InternString(&loaded_interner, "other", 5);
+    Assert(LoadTokenFile(tokens_path, &loaded));
+    int i = 0;
+    while(i < count)
+    {
+        if(loaded.kinds[i] == TOKEN_IDENTIFIER)
+        {
+            Assert(strcmp(InternerString(&loaded_interner, loaded.payloads[i]),
+                          InternerString(&lexed_interner, lexed.payloads[i])) == 0);
+        }
+        i++;
+    }
+    FreeTokenStream(&loaded);
+    FreeTokenStream(&lexed);
+
+    /* Damaged, cut short, or not a token file at all */
+    int file_descriptor = open(tokens_path, O_RDWR);
+    Assert(file_descriptor >= 0);
+    char byte;
+    Assert(pread(file_descriptor, &byte, 1, 120) == 1);
+    byte ^= 1;
+    Assert(pwrite(file_descriptor, &byte, 1, 120) == 1);
+    Assert(!LoadTokenFile(tokens_path, &loaded));
+    Assert(ftruncate(file_descriptor, 100) == 0);
+    Assert(!LoadTokenFile(tokens_path, &loaded));
+    close(file_descriptor);
+    Assert(!LoadTokenFile(path, &loaded));
+
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    Assert(strstr(diagnostics, "checksum mismatch"));
+    Assert(strstr(diagnostics, "truncated"));
+    Assert(strstr(diagnostics, "not a token file"));
+    free(diagnostics);
+    InternerFree(&loaded_interner);
+    InternerFree(&lexed_interner);
+
+    /* --load-tokens compiles a token file like its source */
+    options.emit_tokens = false;
+    options.dump_tokens = false;
+    options.parse = true;
+    options.fold = true;
+    options.evaluate = true;
+    expected = CompileWithCache(path, &options, 0, &statistics);
+    options.emit_tokens = true;
+    free(CompileWithCache(path, &options, 0, &statistics));
+    options.emit_tokens = false;
+    options.load_tokens = true;
+    output = CompileWithCache(tokens_path, &options, 3, &statistics);
+    Assert(strcmp(output, expected) == 0);
+    Assert(statistics.bytes == strlen(source));
+    Assert(statistics.wall_seconds[COMPILE_PHASE_LEX] == 0);
+    free(output);
+    free(expected);
+
+    /* Lexing ends at a NUL, and so does the source a token file keeps */
+    char nul_path[80];
+    snprintf(nul_path, sizeof nul_path, "%s/nul.tokens", directory);
+    char const nul_source[] = "a;\0b;\n";
+    diagnostics = NULL;
+    context.interner = &lexed_interner;
+    context.diagnostics = open_memstream(&diagnostics, &diagnostics_length);
+    previous = SetCurrentContext(&context);
+    lexed = LexerRunCompact(nul_source);
+    Assert(EmitTokenFile(nul_path, &lexed));
+    Assert(LoadTokenFile(nul_path, &loaded));
+    count = TokenStreamLength(&lexed);
+    Assert(count == 3 && TokenStreamLength(&loaded) == count);
+    Assert(memcmp(loaded.kinds, lexed.kinds, count * sizeof *lexed.kinds) == 0);
+    Assert(memcmp(loaded.offsets, lexed.offsets, count * sizeof *lexed.offsets) == 0);
+    Assert(strcmp(loaded.source, "a;") == 0);
+    FreeTokenStream(&loaded);
+    FreeTokenStream(&lexed);
+    SetCurrentContext(previous);
+    fclose(context.diagnostics);
+    Assert(diagnostics_length == 0);
+    free(diagnostics);
+    InternerFree(&lexed_interner);
+    unlink(nul_path);
+
+    /* A source file with a NUL in it is an error, so it gets no token file */
+    file = fopen(path, "w");
+    Assert(file);
+    Assert(fwrite(nul_source, 1, sizeof nul_source - 1, file) == sizeof nul_source - 1);
+    fclose(file);
+    options.load_tokens = false;
+    options.emit_tokens = true;
+    unlink(tokens_path);
+    output = CompileWithCache(path, &options, 0, &statistics);
+    Assert(strstr(output, "embedded NUL at offset 2"));
+    Assert(access(tokens_path, F_OK) != 0);
+    free(output);
+
+    unlink(tokens_path);
+    unlink(path);
+    rmdir(directory);
+}
+
+void RunTests(void)
+{
+    BufferTest();
+    StringBuilderTest();
+    LexerTest();
+    TokenStreamTest();
+    LexerStreamTest();
+    LexerScanModeTest();
+    ParserTest();
+    ExpressionSharingTest();
+    FoldTest();
+    VmTest();
+    X86Test();
+    IrTest();
+    ArenaTest();
+    ThreadPoolTest();
+    LexerParallelTest();
+    LexerRelexTest();
+    IncrementalParseTest();
+    CompileJobsTest();
+    StatisticsTest();
+    StreamingCompileTest();
+    TokenCacheTest();
+    TokenFileTest();
+}
+
+int main(int argc, char **argv)
+{
+    if(argc == 1)
+    {
+        RunTests();
+        return 0;
+    }
+
+    CompileOptions options;
+    memset(&options, 0, sizeof options);
+    int jobs = 0;
+    char **paths = NULL;
+    bool print_statistics = false;
+    char const *statistics_json_path = NULL;
+    bool run_benchmark_suite = false;
+    BenchmarkSuiteOptions suite = DefaultBenchmarkSuiteOptions();
+
+    int i = 1;
+    while(i < argc)
+    {
+        if(strcmp(argv[i], "--bench") == 0)
+        {
+            RunBenchmarks();
+            return 0;
+        } else if(strcmp(argv[i], "--bench-suite") == 0)
+        {
+            run_benchmark_suite = true;
+        } else if(strncmp(argv[i], "--corpus-size=", 14) == 0)
+        {
+            suite.corpus_size = atoi(argv[i] + 14);
+        } else if(strncmp(argv[i], "--corpus-shape=", 15) == 0)
+        {
+            if(!SelectCorpusShape(&suite, argv[i] + 15))
+            {
+                ReportError("unknown corpus shape: %s\n", argv[i] + 15);
+                return 1;
+            }
+        } else if(strncmp(argv[i], "--nesting=", 10) == 0)
+        {
+            suite.nesting_depth = atoi(argv[i] + 10);
+        } else if(strncmp(argv[i], "--warmup=", 9) == 0)
+        {
+            suite.warmup = atoi(argv[i] + 9);
+        } else if(strncmp(argv[i], "--repetitions=", 14) == 0)
+        {
+            suite.repetitions = atoi(argv[i] + 14);
+        } else if(strncmp(argv[i], "--bench-json=", 13) == 0)
+        {
+            suite.json_path = argv[i] + 13;
+        } else if(strcmp(argv[i], "--test") == 0)
+        {
+            RunTests();
+            return 0;
+        } else if(strcmp(argv[i], "--dump-tokens") == 0)
+        {
+            options.dump_tokens = true;
+        } else if(strcmp(argv[i], "--stream") == 0)
+        {
+            options.stream_input = true;
+        } else if(strcmp(argv[i], "--parse") == 0)
+        {
+            options.parse = true;
+        } else if(strcmp(argv[i], "--ast-stats") == 0)
+        {
+            options.parse = true;
+            options.ast_statistics = true;
+        } else if(strcmp(argv[i], "--share") == 0)
+        {
+            options.parse = true;
+            options.share_expressions = true;
+        } else if(strcmp(argv[i], "--fold") == 0)
+        {
+            options.parse = true;
+            options.fold = true;
+        } else if(strcmp(argv[i], "--evaluate") == 0)
+        {
+            options.parse = true;
+            options.fold = true;
+            options.evaluate = true;
+        } else if(strcmp(argv[i], "--bytecode") == 0)
+        {
+            options.parse = true;
+            options.bytecode = true;
+        } else if(strcmp(argv[i], "--ir") == 0)
+        {
+            options.parse = true;
+            options.ir = true;
+        } else if(strcmp(argv[i], "--emit-asm") == 0)
+        {
+            options.parse = true;
+            options.emit_assembly = true;
+        } else if(strcmp(argv[i], "--stats") == 0)
+        {
+            options.statistics = true;
+            print_statistics = true;
+        } else if(strcmp(argv[i], "--stats-json") == 0 || strncmp(argv[i], "--stats-json=", 13) == 0)
+        {
+            /* Without a path the JSON goes to stdout */
+            options.statistics = true;
+            statistics_json_path = argv[i][12] == '=' ? argv[i] + 13 : "-";
+        } else if(strcmp(argv[i], "--emit-tokens") == 0)
+        {
+            options.emit_tokens = true;
+        } else if(strcmp(argv[i], "--load-tokens") == 0)
+        {
+            options.load_tokens = true;
+        } else if(strncmp(argv[i], "--cache-dir=", 12) == 0)
+        {
+            options.cache_directory = argv[i] + 12;
+        } else if(strncmp(argv[i], "--jobs=", 7) == 0)
+        {
+            jobs = atoi(argv[i] + 7);
+        } else if(strncmp(argv[i], "--max-depth=", 12) == 0)
+        {
+            max_expression_depth = atoi(argv[i] + 12);
+        } else
+        {
+            BufferPush(paths, argv[i]);
+        }
+
+        i++;
+    }
+
+    /* These need the whole file, or every token of it, at once */
+    if(options.stream_input && !options.load_tokens)
+    {
+        char const *flag = options.emit_tokens ? "--emit-tokens"
+                           : options.cache_directory ? "--cache-dir"
+                           : options.ast_statistics ? "--ast-stats"
+                           : options.dump_tokens && options.parse ? "--dump-tokens with parsing"
+                           : NULL;
+        if(flag)
+        {
+            ReportError("--stream cannot be used with %s\n", flag);
+            if(paths)
+            {
+                BufferFree(paths);
+            }
+
+            return 1;
+        }
+    }
+
+    if(run_benchmark_suite)
+    {
+        RunBenchmarkSuite(&suite);
+        if(paths)
+        {
+            BufferFree(paths);
+        }
+
+        return default_context.had_error ? 1 : 0;
+    }
+
+    int path_count = BufferLength(paths);
+    bool failed = false;
+
+    CompileStatistics statistics;
+    ProcessStatisticsStart statistics_start;
+    if(options.statistics)
+    {
+        memset(&statistics, 0, sizeof statistics);
+        CurrentContext()->statistics = &statistics;
+        statistics_start = StartProcessStatistics();
+    }
+
+    if(path_count == 1 || jobs == 1)
+    {
+        /* A single file can still be lexed in pieces */
+        ThreadPool pool;
+        if(path_count == 1 && jobs != 1)
+        {
+            ThreadPoolInit(&pool, jobs);
+            options.pool = &pool;
+        }
+
+        i = 0;
+        while(i < path_count)
+        {
+            default_context.path = paths[i];
+            CompileFile(paths[i], &options);
+            i++;
+        }
+        default_context.path = NULL;
+
+        if(options.pool)
+        {
+            ThreadPoolFree(&pool);
+        }
+
+        failed = default_context.had_error;
+    } else if(path_count > 1)
+    {
+        ThreadPool pool;
+        ThreadPoolInit(&pool, jobs);
+        CompileJob *compile_jobs = CreateCompileJobs(paths, path_count, &options);
+        CompileJobsRun(&pool, compile_jobs, path_count);
+        failed = CompileJobsFinish(compile_jobs, path_count) > 0;
+        ThreadPoolFree(&pool);
+    }
+
+    if(options.statistics)
+    {
+        ProcessStatistics process = ReadProcessStatistics(&statistics_start);
+        if(print_statistics)
+        {
+            PrintCompileStatistics(stderr, &statistics, &process);
+        }
+
+        if(statistics_json_path)
+        {
+            bool to_stdout = strcmp(statistics_json_path, "-") == 0;
+            FILE *json = to_stdout ? stdout : fopen(statistics_json_path, "w");
+            if(json)
+            {
+                PrintCompileStatisticsJson(json, &statistics, &process);
+                if(!to_stdout)
+                {
+                    fclose(json);
+                }
+            } else
+            {
+                ReportError("%s: could not write statistics: %s\n", statistics_json_path, strerror(errno));
+                failed = true;
+            }
+        }
+    }
+
+    if(paths)
+    {
+        BufferFree(paths);
+    }
+
+    return failed ? 1 : 0;
 }
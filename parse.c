@@ -4,60 +4,273 @@ typedef enum
 {
     EXPRESSION_NONE,
     EXPRESSION_NUMBER,
+    EXPRESSION_IDENTIFIER,
     EXPRESSION_UNARY,
-    EXPRESSION_BINARY
+    EXPRESSION_BINARY,
+    EXPRESSION_ASSIGNMENT,
+    EXPRESSION_TERNARY,
+
+    EXPRESSION_KIND_COUNT
 } ExpressionKind;
 
 static char *expression_kind_string_table[] = {
     [EXPRESSION_NONE] = "None",
     [EXPRESSION_NUMBER] = "Number",
+    [EXPRESSION_IDENTIFIER] = "Identifier",
     [EXPRESSION_UNARY] = "Unary",
-    [EXPRESSION_BINARY] = "Binary"
+    [EXPRESSION_BINARY] = "Binary",
+    [EXPRESSION_ASSIGNMENT] = "Assignment",
+    [EXPRESSION_TERNARY] = "Ternary"
 };
 
-static char token_operator_string_table[] = {
-    [TOKEN_PLUS] = '+',
-    [TOKEN_MINUS] = '-'
-};
+/* Flat expression trees
+ *
+ * Nodes live in one array in an ExpressionPool and refer to each other by 32-bit
+ * ExpressionId, their index in that array. Id 0 is a placeholder node of kind
+ * EXPRESSION_NONE, so 0 can stand for "no expression". A node is built after its
+ * operands, so operands always have smaller ids than the node using them and a
+ * pass over the array in order sees every operand before its user.
+ *
+ * Kind and operator are a byte each. Numbers are kept in a side array; a number
+ * node's `first` is its index there. An identifier's `first` is its Symbol. A
+ * ternary has three operands: `first` is the condition and `second` the index of
+ * its two branches in the branches array.
+ *
+ * After ShareExpressions the pool hash-conses: every constructor first looks for a
+ * node with the same kind, operator and operands, comparing numbers by value and
+ * ternaries by their branches, and returns it instead of building a copy. A
+ * subexpression written a thousand times is then one node, trees become DAGs with
+ * maximal sharing, and two subtrees are equal exactly when their ids are. Passes
+ * that walk the tree see a shared node once for every place it is used.
+ *
+ * After RecordExpressionSpans the parser notes which tokens every node was parsed
+ * from, parentheses around it included. Spans count tokens from the start of the
+ * statement the node is in, so a statement that moves because of an edit before it
+ * keeps its nodes and spans exactly as they are (see parse_incremental.c). A shared
+ * node stands for many places at once, so a pool does one or the other. */
+typedef uint32_t ExpressionId;
 
-typedef struct Expression
+typedef struct
 {
-    ExpressionKind kind;
-    TokenKind      operator;
+    uint8_t kind; // ExpressionKind
+    uint8_t operator; // TokenKind
+    uint16_t unused;
+    uint32_t first; // Operand, left operand, condition, Symbol, or index into numbers
+    uint32_t second; // Right operand, or index into branches
+} ExpressionNode;
 
-    union
-    {
-        int number;
-        struct Expression *unary;
+/* Tokens [first, end) of the node's statement */
+typedef struct
+{
+    uint32_t first;
+    uint32_t end;
+} ExpressionSpan;
+
+typedef struct
+{
+    ExpressionNode *nodes; // Buffer, indexed by ExpressionId
+    int *numbers; // Buffer
+    ExpressionId *branches; // Buffer, then and else of each ternary
+    size_t node_counts[EXPRESSION_KIND_COUNT];
+
+    /* Hash-consing, off until ShareExpressions */
+    ExpressionId *shared_slots; // Open addressing table of node ids, 0 when empty
+    int shared_slot_count; // Always a power of two
+    size_t constructions; // Nodes asked for while sharing
+    size_t shared_hits; // Of those, answered with an existing node
+    bool rewritten; // Nodes were changed in place, so equal trees may have different ids
+
+    ExpressionSpan *spans; // Buffer indexed by ExpressionId, NULL until RecordExpressionSpans
+} ExpressionPool;
+
+ExpressionPool CreateExpressionPool(void)
+{
+    ExpressionPool pool;
+    memset(&pool, 0, sizeof pool);
+
+    ExpressionNode none;
+    memset(&none, 0, sizeof none);
+    BufferPush(pool.nodes, none);
+
+    return pool;
+}
+
+void FreeExpressionPool(ExpressionPool *pool)
+{
+    if(pool->nodes) BufferFree(pool->nodes);
+    if(pool->numbers) BufferFree(pool->numbers);
+    if(pool->branches) BufferFree(pool->branches);
+    if(pool->spans) BufferFree(pool->spans);
+    free(pool->shared_slots);
+
+    memset(pool, 0, sizeof *pool);
+}
+
+/* Empties a pool that does not share expressions for the next tree, keeping its
+ * memory. Ids handed out before are no longer valid. */
+void ClearExpressionPool(ExpressionPool *pool)
+{
+    BufferHeaderGet(pool->nodes)->length = 1;
+    if(pool->numbers) BufferHeaderGet(pool->numbers)->length = 0;
+    if(pool->branches) BufferHeaderGet(pool->branches)->length = 0;
+    if(pool->spans) BufferHeaderGet(pool->spans)->length = 1;
+    memset(pool->node_counts, 0, sizeof pool->node_counts);
+    pool->rewritten = false;
+}
+
+static inline ExpressionNode *GetExpression(ExpressionPool *pool, ExpressionId id)
+{
+    return &pool->nodes[id];
+}
+
+static inline int ExpressionNumber(ExpressionPool *pool, ExpressionId id)
+{
+    return pool->numbers[pool->nodes[id].first];
+}
 
-        struct
+/* Bytes held by the pool's arrays, including room reserved for growth */
+size_t ExpressionPoolBytes(ExpressionPool *pool)
+{
+    return BufferCapacity(pool->nodes) * sizeof *pool->nodes + BufferCapacity(pool->numbers) * sizeof *pool->numbers +
+           BufferCapacity(pool->branches) * sizeof *pool->branches + pool->shared_slot_count * sizeof *pool->shared_slots +
+           BufferCapacity(pool->spans) * sizeof *pool->spans;
+}
+
+void PrintExpressionPoolStatistics(FILE *output, ExpressionPool *pool)
+{
+    fprintf(output, "expression pool: %d nodes, %d numbers, %zu bytes reserved\n",
+            BufferLength(pool->nodes) - 1, BufferLength(pool->numbers), ExpressionPoolBytes(pool));
+
+    int kind = EXPRESSION_NUMBER;
+    while(kind < EXPRESSION_KIND_COUNT)
+    {
+        if(pool->node_counts[kind])
         {
-            struct Expression *left;
-            struct Expression *right;
-        };
-    };
-} Expression;
+            size_t bytes = pool->node_counts[kind] * sizeof(ExpressionNode);
+            if(kind == EXPRESSION_NUMBER)
+            {
+                bytes += pool->node_counts[kind] * sizeof *pool->numbers;
+            } else if(kind == EXPRESSION_TERNARY)
+            {
+                bytes += pool->node_counts[kind] * 2 * sizeof *pool->branches;
+            }
+
+            fprintf(output, "  %-10s %8zu nodes %12zu bytes\n", expression_kind_string_table[kind],
+                    pool->node_counts[kind], bytes);
+        }
+
+        kind++;
+    }
 
-static Token global_token;
+    if(pool->shared_slots && pool->constructions > 0)
+    {
+        size_t built = pool->constructions - pool->shared_hits;
+        fprintf(output, "  sharing    %8zu asked %8zu built %8.2fx\n", pool->constructions, built,
+                built ? (double)pool->constructions / built : 0.0);
+    }
+}
 
-bool MatchToken(Token **tokens, TokenKind kind)
+/* Reads tokens either out of a whole TokenStream or out of a TokenRing that is filled
+ * as parsing goes. Token n is at kinds[n & mask]; the mask is all ones for a TokenStream.
+ * `previous` is the number of the last matched token. */
+typedef struct
 {
-    if((*tokens)->kind == kind)
+    uint8_t const *kinds;
+    TokenPayload const *payloads;
+    uint32_t mask;
+    int position;
+    int previous;
+
+    TokenStream *tokens; // NULL when streaming
+    TokenRing *ring; // NULL when parsing a TokenStream
+    ExpressionPool *pool; // Where the parsed tree goes
+    int max_depth; // Most ParserFrames ever waiting at once
+    int statement_start; // First token of the statement being parsed, where spans count from
+} Parser;
+
+Parser CreateParser(TokenStream *tokens, ExpressionPool *pool)
+{
+    Parser parser;
+    parser.kinds = tokens->kinds;
+    parser.payloads = tokens->payloads;
+    parser.mask = UINT32_MAX;
+    parser.position = 0;
+    parser.previous = 0;
+    parser.tokens = tokens;
+    parser.ring = NULL;
+    parser.pool = pool;
+    parser.max_depth = 0;
+    parser.statement_start = 0;
+
+    return parser;
+}
+
+Parser CreateStreamParser(TokenRing *ring, ExpressionPool *pool)
+{
+    Parser parser;
+    parser.kinds = ring->kinds;
+    parser.payloads = ring->payloads;
+    parser.mask = TOKEN_RING_SIZE - 1;
+    parser.position = 0;
+    parser.previous = 0;
+    parser.tokens = NULL;
+    parser.ring = ring;
+    parser.pool = pool;
+    parser.max_depth = 0;
+    parser.statement_start = 0;
+
+    return parser;
+}
+
+TokenKind PeekToken(Parser *parser)
+{
+    return parser->kinds[parser->position & parser->mask];
+}
+
+TokenPayload PreviousTokenPayload(Parser *parser)
+{
+    return parser->payloads[parser->previous & parser->mask];
+}
+
+static void ParserAdvance(Parser *parser)
+{
+    parser->previous = parser->position++;
+    if(parser->ring)
+    {
+        TokenRingFill(parser->ring, parser->previous);
+    }
+}
+
+void ParserLocate(Parser *parser, int position, int *line, int *column)
+{
+    if(parser->ring)
     {
-        global_token = *((*tokens)++);
+        *line = parser->ring->lines[position & parser->mask];
+        *column = parser->ring->columns[position & parser->mask];
+    } else
+    {
+        TokenStreamLocate(parser->tokens, position, line, column);
+    }
+}
+
+bool MatchToken(Parser *parser, TokenKind kind)
+{
+    if(parser->kinds[parser->position & parser->mask] == kind)
+    {
+        ParserAdvance(parser);
         return true;
     }
 
     return false;
 }
 
-bool MatchMultipleTokens(Token **tokens, TokenKind *kinds, int count)
+bool MatchMultipleTokens(Parser *parser, TokenKind *kinds, int count)
 {
     bool result;
     int i = 0;
     while(i < count)
     {
-        result = MatchToken(tokens, kinds[i]);
+        result = MatchToken(parser, kinds[i]);
         if(!result)
         {
             break;
@@ -69,71 +282,657 @@ bool MatchMultipleTokens(Token **tokens, TokenKind *kinds, int count)
     return result;
 }
 
-void DemandToken(Token **tokens, TokenKind kind)
+/* Identifiers are interned, so matching a particular name is an integer compare */
+bool MatchIdentifier(Parser *parser, Symbol symbol)
 {
-    if(!MatchToken(tokens, kind))
+    if(parser->kinds[parser->position & parser->mask] == TOKEN_IDENTIFIER &&
+       parser->payloads[parser->position & parser->mask] == symbol)
     {
-        Assert(0);
+        ParserAdvance(parser);
+        return true;
     }
+
+    return false;
 }
 
-Expression *CreateExpression(ExpressionKind kind)
+void DemandToken(Parser *parser, TokenKind kind)
+{
+    if(!MatchToken(parser, kind))
+    {
+        int line;
+        int column;
+        ParserLocate(parser, parser->position, &line, &column);
+        ReportError("%d:%d: expected %s but found %s\n", line, column,
+                    token_string_table[kind], token_string_table[PeekToken(parser)]);
+    }
+}
+
+/* What makes two nodes the same, with numbers and ternary branches looked up */
+typedef struct
+{
+    uint32_t kind;
+    uint32_t operator;
+    uint32_t first;
+    uint32_t second;
+    uint32_t third;
+} ExpressionKey;
+
+static ExpressionKey ExpressionNodeKey(ExpressionPool *pool, ExpressionNode *node)
 {
-    Expression *expression = malloc(sizeof *expression);
-    expression->kind = kind;
+    ExpressionKey key;
+    key.kind = node->kind;
+    key.operator = node->operator;
+    key.first = node->first;
+    key.second = node->second;
+    key.third = 0;
 
-    return expression;
+    if(node->kind == EXPRESSION_NUMBER)
+    {
+        key.first = (uint32_t)pool->numbers[node->first];
+    } else if(node->kind == EXPRESSION_TERNARY)
+    {
+        key.second = pool->branches[node->second];
+        key.third = pool->branches[node->second + 1];
+    }
+
+    return key;
 }
 
-Expression *CreateNumberExpression(int number)
+static uint32_t HashExpressionKey(ExpressionKey *key)
 {
-    Expression *expression = CreateExpression(EXPRESSION_NUMBER);
-    expression->number = number;
+    /* Multiply and fold; keys are five small words, where bytewise hashing is slow */
+    uint64_t hash = (uint64_t)key->kind << 8 | key->operator;
+    hash = (hash ^ key->first) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ key->second) * 0x9E3779B97F4A7C15ull;
+    hash = (hash ^ key->third) * 0x9E3779B97F4A7C15ull;
 
-    return expression;
+    return (uint32_t)(hash >> 32);
 }
 
-Expression *CreateUnaryExpression(Expression *other_expression, TokenKind operator)
+/* The slot holding the node equal to `key`, or the empty slot where it would go */
+static ExpressionId *FindSharedExpression(ExpressionPool *pool, ExpressionKey *key)
 {
-    Expression *expression = CreateExpression(EXPRESSION_UNARY);
-    expression->operator = operator;
-    expression->unary = other_expression;
+    uint32_t mask = (uint32_t)pool->shared_slot_count - 1;
+    uint32_t slot = HashExpressionKey(key) & mask;
+    while(pool->shared_slots[slot])
+    {
+        ExpressionKey other = ExpressionNodeKey(pool, &pool->nodes[pool->shared_slots[slot]]);
+        if(memcmp(&other, key, sizeof other) == 0)
+        {
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
 
-    return expression;
+    return &pool->shared_slots[slot];
 }
 
-Expression *CreateBinaryExpression(Expression *left_expression, Expression *right_expression, TokenKind operator)
+static void GrowSharedExpressions(ExpressionPool *pool)
 {
-    Expression *expression = CreateExpression(EXPRESSION_BINARY);
-    expression->operator = operator;
-    expression->left = left_expression;
-    expression->right = right_expression;
+    ExpressionId *old_slots = pool->shared_slots;
+    int old_slot_count = pool->shared_slot_count;
 
-    return expression;
+    pool->shared_slot_count *= 2;
+    pool->shared_slots = calloc(pool->shared_slot_count, sizeof *pool->shared_slots);
+    Assert(pool->shared_slots);
+
+    int i = 0;
+    while(i < old_slot_count)
+    {
+        if(old_slots[i])
+        {
+            ExpressionKey key = ExpressionNodeKey(pool, &pool->nodes[old_slots[i]]);
+            *FindSharedExpression(pool, &key) = old_slots[i];
+        }
+        i++;
+    }
+
+    free(old_slots);
+}
+
+#define SHARED_EXPRESSION_INITIAL_SLOTS 1024
+
+/* Turns on hash-consing. Call it before building any nodes. */
+void ShareExpressions(ExpressionPool *pool)
+{
+    Assert(BufferLength(pool->nodes) == 1 && !pool->shared_slots && !pool->spans);
+    pool->shared_slot_count = SHARED_EXPRESSION_INITIAL_SLOTS;
+    pool->shared_slots = calloc(pool->shared_slot_count, sizeof *pool->shared_slots);
+    Assert(pool->shared_slots);
 }
 
-Expression *ParseNumber(Token **tokens)
+/* Turns on token spans for every node the parser builds. Call it before building any nodes. */
+void RecordExpressionSpans(ExpressionPool *pool)
 {
-    Expression *expression = NULL;
+    Assert(BufferLength(pool->nodes) == 1 && !pool->shared_slots && !pool->spans);
+    ExpressionSpan none = { 0, 0 };
+    BufferPush(pool->spans, none);
+}
 
-    DemandToken(tokens, TOKEN_NUMBER);
+/* Looks for an existing node while sharing. Returns it, or 0 with `slot` set to
+ * where the new node's id goes. */
+static ExpressionId LookUpSharedExpression(ExpressionPool *pool, ExpressionKey *key, ExpressionId **slot)
+{
+    size_t built = pool->constructions - pool->shared_hits;
+    if(2 * (built + 1) > (size_t)pool->shared_slot_count)
+    {
+        GrowSharedExpressions(pool);
+    }
 
-    expression = CreateNumberExpression(global_token.number);
+    pool->constructions++;
+    *slot = FindSharedExpression(pool, key);
+    if(**slot)
+    {
+        pool->shared_hits++;
+    }
 
-    return expression;
+    return **slot;
 }
 
-Expression *ParseAdditionAndSubtraction(Token **tokens)
+static ExpressionId AppendExpression(ExpressionPool *pool, ExpressionKind kind, TokenKind operator, uint32_t first, uint32_t second)
 {
-    Expression *result;
-    Expression *number1 = ParseNumber(tokens);
+    ExpressionNode node;
+    node.kind = (uint8_t)kind;
+    node.operator = (uint8_t)operator;
+    node.unused = 0;
+    node.first = first;
+    node.second = second;
+
+    ExpressionId id = (ExpressionId)BufferLength(pool->nodes);
+    BufferPush(pool->nodes, node);
+    pool->node_counts[kind]++;
 
-    while(MatchToken(tokens, TOKEN_PLUS))
+    return id;
+}
+
+ExpressionId CreateExpression(ExpressionPool *pool, ExpressionKind kind, TokenKind operator, uint32_t first, uint32_t second)
+{
+    if(!pool->shared_slots)
     {
-        result = CreateBinaryExpression(number1, ParseNumber(tokens), TOKEN_PLUS);
+        return AppendExpression(pool, kind, operator, first, second);
     }
 
-    return result;
+    ExpressionNode node;
+    node.kind = (uint8_t)kind;
+    node.operator = (uint8_t)operator;
+    node.unused = 0;
+    node.first = first;
+    node.second = second;
+    ExpressionKey key = ExpressionNodeKey(pool, &node);
+
+    ExpressionId *slot;
+    ExpressionId id = LookUpSharedExpression(pool, &key, &slot);
+    if(!id)
+    {
+        id = AppendExpression(pool, kind, operator, first, second);
+        *slot = id;
+    }
+
+    return id;
+}
+
+ExpressionId CreateNumberExpression(ExpressionPool *pool, int number)
+{
+    ExpressionId *slot = NULL;
+    if(pool->shared_slots)
+    {
+        ExpressionKey key = { EXPRESSION_NUMBER, TOKEN_NUMBER, (uint32_t)number, 0, 0 };
+        ExpressionId id = LookUpSharedExpression(pool, &key, &slot);
+        if(id)
+        {
+            return id;
+        }
+    }
+
+    uint32_t index = (uint32_t)BufferLength(pool->numbers);
+    BufferPush(pool->numbers, number);
+
+    ExpressionId id = AppendExpression(pool, EXPRESSION_NUMBER, TOKEN_NUMBER, index, 0);
+    if(slot)
+    {
+        *slot = id;
+    }
+
+    return id;
+}
+
+ExpressionId CreateUnaryExpression(ExpressionPool *pool, ExpressionId other_expression, TokenKind operator)
+{
+    return CreateExpression(pool, EXPRESSION_UNARY, operator, other_expression, 0);
+}
+
+ExpressionId CreateBinaryExpression(ExpressionPool *pool, ExpressionId left_expression, ExpressionId right_expression, TokenKind operator)
+{
+    return CreateExpression(pool, EXPRESSION_BINARY, operator, left_expression, right_expression);
+}
+
+ExpressionId CreateIdentifierExpression(ExpressionPool *pool, Symbol symbol)
+{
+    return CreateExpression(pool, EXPRESSION_IDENTIFIER, TOKEN_IDENTIFIER, symbol, 0);
+}
+
+ExpressionId CreateAssignmentExpression(ExpressionPool *pool, ExpressionId target, ExpressionId value, TokenKind operator)
+{
+    return CreateExpression(pool, EXPRESSION_ASSIGNMENT, operator, target, value);
+}
+
+ExpressionId CreateTernaryExpression(ExpressionPool *pool, ExpressionId condition, ExpressionId then_expression, ExpressionId else_expression)
+{
+    ExpressionId *slot = NULL;
+    if(pool->shared_slots)
+    {
+        ExpressionKey key = { EXPRESSION_TERNARY, TOKEN_QUESTION_MARK, condition, then_expression, else_expression };
+        ExpressionId id = LookUpSharedExpression(pool, &key, &slot);
+        if(id)
+        {
+            return id;
+        }
+    }
+
+    uint32_t index = (uint32_t)BufferLength(pool->branches);
+    BufferPush(pool->branches, then_expression);
+    BufferPush(pool->branches, else_expression);
+
+    ExpressionId id = AppendExpression(pool, EXPRESSION_TERNARY, TOKEN_QUESTION_MARK, condition, index);
+    if(slot)
+    {
+        *slot = id;
+    }
+
+    return id;
+}
+
+/* Expression parsing
+ *
+ * Binary operators are parsed by precedence climbing: one loop that looks the next
+ * token's precedence up in binary_precedence_table and keeps folding operators into
+ * the left operand while they bind at least as tightly as the current minimum. Each
+ * right operand is parsed one level tighter for left associative operators and at
+ * the same level for the right associative ones, assignment and ?:. The levels are
+ * C's, loosest first.
+ *
+ * Nothing recurses. Whatever is waiting for an operand to finish, a prefix operator,
+ * an open parenthesis or the left side of an operator, is pushed on an explicit
+ * stack of ParserFrames together with the minimum precedence to go back to, so
+ * generated code nested a million levels deep costs heap memory instead of overflowing
+ * the C stack. Left associative chains like a + b + c never grow the stack at all.
+ * max_expression_depth caps the stack; going past it is reported as an error. */
+typedef enum
+{
+    PRECEDENCE_NONE,
+    PRECEDENCE_COMMA,
+    PRECEDENCE_ASSIGNMENT,
+    PRECEDENCE_TERNARY,
+    PRECEDENCE_LOGICAL_OR,
+    PRECEDENCE_LOGICAL_AND,
+    PRECEDENCE_BITWISE_OR,
+    PRECEDENCE_BITWISE_XOR,
+    PRECEDENCE_BITWISE_AND,
+    PRECEDENCE_EQUALITY,
+    PRECEDENCE_RELATIONAL,
+    PRECEDENCE_SHIFT,
+    PRECEDENCE_ADDITIVE,
+    PRECEDENCE_MULTIPLICATIVE
+} Precedence;
+
+static uint8_t const binary_precedence_table[TOKEN_EOF + 1] = {
+    [TOKEN_COMMA] = PRECEDENCE_COMMA,
+
+    [TOKEN_EQUAL] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_PLUS_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_MINUS_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_STAR_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_SLASH_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_PERCENT_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_OR_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_AND_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_XOR_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_LEFT_SHIFT_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+    [TOKEN_RIGHT_SHIFT_ASSIGNMENT] = PRECEDENCE_ASSIGNMENT,
+
+    [TOKEN_QUESTION_MARK] = PRECEDENCE_TERNARY,
+    [TOKEN_LOGICAL_OR] = PRECEDENCE_LOGICAL_OR,
+    [TOKEN_LOGICAL_AND] = PRECEDENCE_LOGICAL_AND,
+    [TOKEN_BITWISE_OR] = PRECEDENCE_BITWISE_OR,
+    [TOKEN_BITWISE_XOR] = PRECEDENCE_BITWISE_XOR,
+    [TOKEN_BITWISE_AND] = PRECEDENCE_BITWISE_AND,
+
+    [TOKEN_DOUBLE_EQUALS] = PRECEDENCE_EQUALITY,
+    [TOKEN_NOT_EQUAL] = PRECEDENCE_EQUALITY,
+
+    [TOKEN_LESS_THAN] = PRECEDENCE_RELATIONAL,
+    [TOKEN_GREATER_THAN] = PRECEDENCE_RELATIONAL,
+    [TOKEN_LESS_EQUAL] = PRECEDENCE_RELATIONAL,
+    [TOKEN_GREATER_EQUAL] = PRECEDENCE_RELATIONAL,
+
+    [TOKEN_BITWISE_LEFT_SHIFT] = PRECEDENCE_SHIFT,
+    [TOKEN_BITWISE_RIGHT_SHIFT] = PRECEDENCE_SHIFT,
+
+    [TOKEN_PLUS] = PRECEDENCE_ADDITIVE,
+    [TOKEN_MINUS] = PRECEDENCE_ADDITIVE,
+
+    [TOKEN_STAR] = PRECEDENCE_MULTIPLICATIVE,
+    [TOKEN_SLASH] = PRECEDENCE_MULTIPLICATIVE,
+    [TOKEN_PERCENT] = PRECEDENCE_MULTIPLICATIVE
+};
+
+/* Prefix operators: negation, plus, logical and bitwise not, dereference, address of */
+static bool const unary_operator_table[TOKEN_EOF + 1] = {
+    [TOKEN_MINUS] = true,
+    [TOKEN_PLUS] = true,
+    [TOKEN_EXCLAMATION_POINT] = true,
+    [TOKEN_BITWISE_NOT] = true,
+    [TOKEN_STAR] = true,
+    [TOKEN_BITWISE_AND] = true
+};
+
+typedef enum
+{
+    PARSER_FRAME_UNARY, // Prefix operator waiting for its operand
+    PARSER_FRAME_PARENTHESIS, // Waiting for the inner expression and a )
+    PARSER_FRAME_BINARY, // Left operand and operator waiting for the right operand
+    PARSER_FRAME_ASSIGNMENT, // Target waiting for the value
+    PARSER_FRAME_TERNARY_THEN, // Condition waiting for the middle operand and a :
+    PARSER_FRAME_TERNARY_ELSE // Condition and middle operand waiting for the last one
+} ParserFrameKind;
+
+typedef struct
+{
+    uint8_t kind; // ParserFrameKind
+    uint8_t operator; // TokenKind
+    uint8_t minimum_precedence; // Precedence to go back to once the frame is done
+    ExpressionId left;
+    ExpressionId middle;
+    int first_token; // Where the node the frame builds starts, for its span
+} ParserFrame;
+
+int max_expression_depth = 1 << 20;
+
+/* Notes that `id` was parsed from tokens [first, parser->position) when the pool records spans */
+static void SetExpressionSpan(Parser *parser, ExpressionId id, int first)
+{
+    ExpressionPool *pool = parser->pool;
+    if(!pool->spans || !id)
+    {
+        return;
+    }
+
+    while(BufferLength(pool->spans) < BufferLength(pool->nodes))
+    {
+        ExpressionSpan none = { 0, 0 };
+        BufferPush(pool->spans, none);
+    }
+
+    pool->spans[id].first = (uint32_t)(first - parser->statement_start);
+    pool->spans[id].end = (uint32_t)(parser->position - parser->statement_start);
+}
+
+/* First token of `id`, or `fallback` when there is no span to go by */
+static int ExpressionSpanStart(Parser *parser, ExpressionId id, int fallback)
+{
+    ExpressionPool *pool = parser->pool;
+    if(!pool->spans || !id || (int)id >= BufferLength(pool->spans))
+    {
+        return fallback;
+    }
+
+    return parser->statement_start + (int)pool->spans[id].first;
+}
+
+static void ReportExpressionError(Parser *parser, int position, char const *message, TokenKind kind)
+{
+    int line;
+    int column;
+    ParserLocate(parser, position, &line, &column);
+    ReportError("%d:%d: %s %s\n", line, column, message, token_string_table[kind]);
+}
+
+/* Numbers and identifiers. Returns 0 after an error, without consuming the token. */
+ExpressionId ParsePrimaryExpression(Parser *parser)
+{
+    TokenKind kind = PeekToken(parser);
+
+    if(MatchToken(parser, TOKEN_NUMBER))
+    {
+        return CreateNumberExpression(parser->pool, PreviousTokenPayload(parser));
+    }
+
+    if(MatchToken(parser, TOKEN_IDENTIFIER))
+    {
+        return CreateIdentifierExpression(parser->pool, PreviousTokenPayload(parser));
+    }
+
+    ReportExpressionError(parser, parser->position, "expected expression but found", kind);
+
+    return 0;
+}
+
+/* Only a name or a dereference can be assigned to */
+static bool IsAssignable(ExpressionPool *pool, ExpressionId id)
+{
+    ExpressionNode *node = GetExpression(pool, id);
+
+    return node->kind == EXPRESSION_IDENTIFIER || (node->kind == EXPRESSION_UNARY && node->operator == TOKEN_STAR);
+}
+
+static bool PushParserFrame(Parser *parser, ParserFrame **frames, ParserFrameKind kind, TokenKind operator,
+                            int minimum_precedence, ExpressionId left, int first_token)
+{
+    if((int)BufferLength(*frames) >= max_expression_depth)
+    {
+        ReportExpressionError(parser, parser->position, "expression nested too deeply at", PeekToken(parser));
+        return false;
+    }
+
+    ParserFrame frame;
+    frame.kind = kind;
+    frame.operator = operator;
+    frame.minimum_precedence = minimum_precedence;
+    frame.left = left;
+    frame.middle = 0;
+    frame.first_token = first_token;
+
+    ParserFrame *buffer = *frames;
+    BufferPush(buffer, frame);
+    *frames = buffer;
+
+    if(BufferLength(buffer) > parser->max_depth)
+    {
+        parser->max_depth = BufferLength(buffer);
+    }
+
+    return true;
+}
+
+ExpressionId ParseExpression(Parser *parser)
+{
+    ParserFrame *frames = NULL; // Buffer
+    ExpressionPool *pool = parser->pool;
+    int minimum_precedence = PRECEDENCE_COMMA;
+    ExpressionId value = 0;
+
+    for(;;)
+    {
+        /* Prefix operators and open parentheses, then the operand itself */
+        TokenKind kind = PeekToken(parser);
+        if(unary_operator_table[kind] || kind == TOKEN_LEFT_PAREN)
+        {
+            ParserFrameKind frame_kind = kind == TOKEN_LEFT_PAREN ? PARSER_FRAME_PARENTHESIS : PARSER_FRAME_UNARY;
+            if(!PushParserFrame(parser, &frames, frame_kind, kind, minimum_precedence, 0, parser->position))
+            {
+                value = 0;
+                break;
+            }
+
+            ParserAdvance(parser);
+            if(kind == TOKEN_LEFT_PAREN)
+            {
+                minimum_precedence = PRECEDENCE_COMMA;
+            }
+            continue;
+        }
+
+        value = ParsePrimaryExpression(parser);
+        SetExpressionSpan(parser, value, parser->position - 1);
+
+        /* Apply operators to the operand until one needs another operand */
+        bool need_operand = false;
+        while(!need_operand)
+        {
+            int length = BufferLength(frames);
+            ParserFrame *top = length ? &frames[length - 1] : NULL;
+
+            /* Prefix operators bind tighter than anything after the operand */
+            if(top && top->kind == PARSER_FRAME_UNARY)
+            {
+                value = CreateUnaryExpression(pool, value, top->operator);
+                SetExpressionSpan(parser, value, top->first_token);
+                minimum_precedence = top->minimum_precedence;
+                BufferHeaderGet(frames)->length--;
+                continue;
+            }
+
+            TokenKind operator = PeekToken(parser);
+            int precedence = binary_precedence_table[operator];
+            if(precedence != PRECEDENCE_NONE && precedence >= minimum_precedence)
+            {
+                int operator_position = parser->position;
+                ParserFrameKind frame_kind = PARSER_FRAME_BINARY;
+                int operand_precedence = precedence + 1;
+
+                if(precedence == PRECEDENCE_TERNARY)
+                {
+                    /* The middle operand is a full expression, as if it were parenthesized */
+                    frame_kind = PARSER_FRAME_TERNARY_THEN;
+                    operand_precedence = PRECEDENCE_COMMA;
+                } else if(precedence == PRECEDENCE_ASSIGNMENT)
+                {
+                    if(value && !IsAssignable(pool, value))
+                    {
+                        ReportExpressionError(parser, operator_position, "cannot assign to the left side of", operator);
+                    }
+
+                    frame_kind = PARSER_FRAME_ASSIGNMENT;
+                    operand_precedence = PRECEDENCE_ASSIGNMENT;
+                }
+
+                int first_token = ExpressionSpanStart(parser, value, operator_position);
+                if(!PushParserFrame(parser, &frames, frame_kind, operator, minimum_precedence, value, first_token))
+                {
+                    value = 0;
+                    goto done;
+                }
+
+                ParserAdvance(parser);
+                minimum_precedence = operand_precedence;
+                need_operand = true;
+                continue;
+            }
+
+            /* Nothing more binds at this level, so the innermost frame has its operand */
+            if(!top)
+            {
+                goto done;
+            }
+
+            ParserFrame frame = *top;
+            BufferHeaderGet(frames)->length--;
+            minimum_precedence = frame.minimum_precedence;
+
+            switch(frame.kind)
+            {
+                case PARSER_FRAME_PARENTHESIS:
+                    DemandToken(parser, TOKEN_RIGHT_PAREN);
+                    SetExpressionSpan(parser, value, frame.first_token);
+                    break;
+                case PARSER_FRAME_BINARY:
+                    value = CreateBinaryExpression(pool, frame.left, value, frame.operator);
+                    SetExpressionSpan(parser, value, frame.first_token);
+                    break;
+                case PARSER_FRAME_ASSIGNMENT:
+                    value = CreateAssignmentExpression(pool, frame.left, value, frame.operator);
+                    SetExpressionSpan(parser, value, frame.first_token);
+                    break;
+                case PARSER_FRAME_TERNARY_THEN:
+                    if(MatchToken(parser, TOKEN_COLON))
+                    {
+                        frame.kind = PARSER_FRAME_TERNARY_ELSE;
+                        frame.middle = value;
+                        BufferPush(frames, frame);
+                        minimum_precedence = PRECEDENCE_TERNARY;
+                        need_operand = true;
+                    } else
+                    {
+                        /* Reports the missing colon; parsing an else branch would only report again */
+                        DemandToken(parser, TOKEN_COLON);
+                        value = CreateTernaryExpression(pool, frame.left, value, 0);
+                        SetExpressionSpan(parser, value, frame.first_token);
+                    }
+                    break;
+                case PARSER_FRAME_TERNARY_ELSE:
+                    value = CreateTernaryExpression(pool, frame.left, frame.middle, value);
+                    SetExpressionSpan(parser, value, frame.first_token);
+                    break;
+            }
+        }
+    }
+
+done:
+    if(frames)
+    {
+        BufferFree(frames);
+    }
+
+    return value;
+}
+
+/* One expression and its semicolon. Returns 0 when the statement had an error, after
+ * skipping the rest of it. Reads no token past the semicolon. */
+ExpressionId ParseStatement(Parser *parser)
+{
+    CompileContext *context = CurrentContext();
+    int errors_before = context->errors_reported;
+    parser->statement_start = parser->position;
+    ExpressionId expression = ParseExpression(parser);
+
+    if(MatchToken(parser, TOKEN_SEMICOLON))
+    {
+        return context->errors_reported == errors_before ? expression : 0;
+    }
+
+    /* One error per statement; a bad operand usually leaves no semicolon either */
+    if(context->errors_reported == errors_before)
+    {
+        DemandToken(parser, TOKEN_SEMICOLON);
+    }
+
+    while(PeekToken(parser) != TOKEN_SEMICOLON && PeekToken(parser) != TOKEN_EOF)
+    {
+        ParserAdvance(parser);
+    }
+
+    MatchToken(parser, TOKEN_SEMICOLON);
+
+    return 0;
+}
+
+/* For now a translation unit is a list of expressions, each ending in a semicolon.
+ * After an error the rest of that statement is skipped. */
+ExpressionId *ParseTranslationUnit(Parser *parser)
+{
+    ExpressionId *expressions = NULL; // Buffer
+
+    while(PeekToken(parser) != TOKEN_EOF)
+    {
+        ExpressionId expression = ParseStatement(parser);
+        if(expression)
+        {
+            BufferPush(expressions, expression);
+        }
+    }
+
+    return expressions;
 }
 
 char *FormatString(char const *format, ...)
@@ -142,7 +941,10 @@ char *FormatString(char const *format, ...)
 
     va_list list;
     va_start(list, format);
-    int size = vsnprintf(NULL, 0, format, list);
+    va_list measure;
+    va_copy(measure, list);
+    int size = vsnprintf(NULL, 0, format, measure);
+    va_end(measure);
     result = malloc(size + 1);
     Assert(result);
     vsnprintf(result, size + 1, format, list);
@@ -151,29 +953,259 @@ char *FormatString(char const *format, ...)
     return result;
 }
 
-char *StringifyExpression(Expression *expression)
+/* Tree walking
+ *
+ * An ExpressionWalker visits a tree depth first without recursing; the path from the
+ * root is kept in a Buffer, so trees a million levels deep only cost memory. Every
+ * node produces EXPRESSION_WALK_ENTER, then EXPRESSION_WALK_OPERAND before each of its
+ * operands is visited, then EXPRESSION_WALK_LEAVE. Right after an operand event the
+ * operand can be skipped, which is how a pass leaves out what C would not evaluate. */
+typedef enum
 {
-    StringBuilder expression_builder = CreateStringBuilder();
+    EXPRESSION_WALK_ENTER,
+    EXPRESSION_WALK_OPERAND,
+    EXPRESSION_WALK_LEAVE
+} ExpressionWalkEvent;
+
+typedef struct
+{
+    ExpressionId id;
+    int step; // 0 before entering, then two steps per operand, then leave
+} ExpressionWalkFrame;
+
+typedef struct
+{
+    ExpressionPool *pool;
+    ExpressionWalkFrame *stack; // Buffer, the path from the root
+    int operand; // Which operand comes next, after EXPRESSION_WALK_OPERAND
+    int max_depth;
+} ExpressionWalker;
+
+/* Operands in the order they are walked. Returns how many there are. */
+int ExpressionOperands(ExpressionPool *pool, ExpressionId id, ExpressionId operands[3])
+{
+    ExpressionNode *node = GetExpression(pool, id);
 
-    switch(expression->kind)
+    switch(node->kind)
     {
-        case EXPRESSION_NONE:
-            break;
-        case EXPRESSION_NUMBER:
-            PushToStringBuilder(&expression_builder, "%d", expression->number);
-            break;
         case EXPRESSION_UNARY:
-            PushToStringBuilder(&expression_builder, "(%c %s)",
-                    token_operator_string_table[expression->operator],
-                    StringifyExpression(expression->unary));
-            break;
+            operands[0] = node->first;
+            return 1;
         case EXPRESSION_BINARY:
-            PushToStringBuilder(&expression_builder, "(%c %s %s)",
-                    token_operator_string_table[expression->operator],
-                    StringifyExpression(expression->left),
-                    StringifyExpression(expression->right));
-            break;
+        case EXPRESSION_ASSIGNMENT:
+            operands[0] = node->first;
+            operands[1] = node->second;
+            return 2;
+        case EXPRESSION_TERNARY:
+            operands[0] = node->first;
+            operands[1] = pool->branches[node->second];
+            operands[2] = pool->branches[node->second + 1];
+            return 3;
+        default:
+            return 0;
+    }
+}
+
+ExpressionWalker CreateExpressionWalker(ExpressionPool *pool, ExpressionId root)
+{
+    ExpressionWalker walker;
+    walker.pool = pool;
+    walker.stack = NULL;
+    walker.operand = 0;
+    walker.max_depth = 0;
+
+    ExpressionWalkFrame frame;
+    frame.id = root;
+    frame.step = 0;
+    BufferPush(walker.stack, frame);
+
+    return walker;
+}
+
+/* Produces the next event and the node it is about. Returns false when the walk is over. */
+bool ExpressionWalkerNext(ExpressionWalker *walker, ExpressionWalkEvent *event, ExpressionId *id)
+{
+    for(;;)
+    {
+        int depth = BufferLength(walker->stack);
+        if(depth == 0)
+        {
+            return false;
+        }
+
+        ExpressionWalkFrame *frame = &walker->stack[depth - 1];
+        ExpressionId operands[3];
+        int operand_count = ExpressionOperands(walker->pool, frame->id, operands);
+        int step = frame->step++;
+        *id = frame->id;
+
+        if(step == 0)
+        {
+            if(depth > walker->max_depth)
+            {
+                walker->max_depth = depth;
+            }
+
+            *event = EXPRESSION_WALK_ENTER;
+        } else if(step > 2 * operand_count)
+        {
+            *event = EXPRESSION_WALK_LEAVE;
+            BufferHeaderGet(walker->stack)->length--;
+        } else if(step % 2 == 1)
+        {
+            *event = EXPRESSION_WALK_OPERAND;
+            walker->operand = (step - 1) / 2;
+        } else
+        {
+            /* Nothing to report while descending; the operand's enter comes next */
+            ExpressionWalkFrame child;
+            child.id = operands[(step - 1) / 2];
+            child.step = 0;
+            BufferPush(walker->stack, child);
+            continue;
+        }
+
+        return true;
+    }
+}
+
+/* Leaves out the operand just announced by EXPRESSION_WALK_OPERAND */
+void ExpressionWalkerSkipOperand(ExpressionWalker *walker)
+{
+    walker->stack[BufferLength(walker->stack) - 1].step++;
+}
+
+void FreeExpressionWalker(ExpressionWalker *walker)
+{
+    if(walker->stack)
+    {
+        BufferFree(walker->stack);
+    }
+
+    walker->stack = NULL;
+}
+
+/* Appends the tree as an S-expression, like (+ 1 (* 2 3)) */
+void StringifyExpressionInto(StringBuilder *builder, ExpressionPool *pool, ExpressionId id)
+{
+    ExpressionWalker walker = CreateExpressionWalker(pool, id);
+    ExpressionWalkEvent event;
+    ExpressionId node_id;
+
+    while(ExpressionWalkerNext(&walker, &event, &node_id))
+    {
+        ExpressionNode *expression = GetExpression(pool, node_id);
+
+        if(event == EXPRESSION_WALK_OPERAND)
+        {
+            PushCharactersToStringBuilder(builder, " ", 1);
+            continue;
+        }
+
+        char const *text;
+        switch(expression->kind)
+        {
+            case EXPRESSION_NUMBER:
+                if(event == EXPRESSION_WALK_ENTER)
+                {
+                    PushToStringBuilder(builder, "%d", ExpressionNumber(pool, node_id));
+                }
+                break;
+            case EXPRESSION_IDENTIFIER:
+                if(event == EXPRESSION_WALK_ENTER)
+                {
+                    Interner *interner = CurrentContext()->interner;
+                    PushCharactersToStringBuilder(builder, InternerString(interner, expression->first),
+                                                  InternerLength(interner, expression->first));
+                }
+                break;
+            case EXPRESSION_UNARY:
+            case EXPRESSION_BINARY:
+            case EXPRESSION_ASSIGNMENT:
+            case EXPRESSION_TERNARY:
+                if(event == EXPRESSION_WALK_ENTER)
+                {
+                    text = token_string_table[expression->operator];
+                    PushCharactersToStringBuilder(builder, "(", 1);
+                    PushCharactersToStringBuilder(builder, text, (int)strlen(text));
+                } else
+                {
+                    PushCharactersToStringBuilder(builder, ")", 1);
+                }
+                break;
+            default:
+                break;
+        }
     }
 
+    FreeExpressionWalker(&walker);
+}
+
+char *StringifyExpression(ExpressionPool *pool, ExpressionId id)
+{
+    StringBuilder expression_builder = CreateStringBuilder();
+    StringifyExpressionInto(&expression_builder, pool, id);
+
     return FinalizeStringBuilder(&expression_builder);
 }
+
+/* Whether two trees compute the same thing the same way. With sharing on this is
+ * comparing ids; otherwise, or once folding rewrote nodes in place, the trees are
+ * compared node by node. */
+bool ExpressionsEqual(ExpressionPool *pool, ExpressionId a, ExpressionId b)
+{
+    if(a == b || (pool->shared_slots && !pool->rewritten))
+    {
+        return a == b;
+    }
+
+    ExpressionId *pairs = NULL; // Buffer, pairs of nodes still to compare
+    BufferPush(pairs, a);
+    BufferPush(pairs, b);
+
+    bool equal = true;
+    while(equal && BufferLength(pairs) > 0)
+    {
+        int length = BufferLength(pairs);
+        ExpressionId left = pairs[length - 2];
+        ExpressionId right = pairs[length - 1];
+        BufferHeaderGet(pairs)->length -= 2;
+
+        if(left == right)
+        {
+            continue;
+        }
+
+        ExpressionNode *left_node = GetExpression(pool, left);
+        ExpressionNode *right_node = GetExpression(pool, right);
+
+        if(left_node->kind != right_node->kind || left_node->operator != right_node->operator)
+        {
+            equal = false;
+        } else if(left_node->kind == EXPRESSION_NUMBER)
+        {
+            equal = ExpressionNumber(pool, left) == ExpressionNumber(pool, right);
+        } else if(left_node->kind == EXPRESSION_IDENTIFIER)
+        {
+            equal = left_node->first == right_node->first;
+        } else
+        {
+            ExpressionId left_operands[3];
+            ExpressionId right_operands[3];
+            int count = ExpressionOperands(pool, left, left_operands);
+            ExpressionOperands(pool, right, right_operands);
+
+            int i = 0;
+            while(i < count)
+            {
+                BufferPush(pairs, left_operands[i]);
+                BufferPush(pairs, right_operands[i]);
+                i++;
+            }
+        }
+    }
+
+    BufferFree(pairs);
+
+    return equal;
+}
@@ -0,0 +1,311 @@
+/* Incremental reparsing
+ *
+ * An IncrementalParse keeps every statement of a file with the tokens it covers, in a
+ * pool that records spans. After RelexTokenStream has spliced an edit into the
+ * tokens, ReparseAfterEdit parses statements again from the first one that read a
+ * changed token, and stops as soon as a statement ends where an old statement past
+ * the edit started. Each statement is parsed on its own from its first token and
+ * reads nothing past its semicolon, so every statement from there on is the old one:
+ * its tree is kept as it is, with the same ids, and only its token range moves.
+ * Spans count from the start of their statement, so nothing inside the reused trees
+ * changes either.
+ *
+ * The trees of replaced statements stay in the pool. Once they make up more than half
+ * of it, the live statements are copied into a new pool. A statement's nodes are
+ * built one after another and only refer to each other, so each tree moves as one
+ * block with its ids shifted.
+ *
+ * The parser reads the token arrays directly, so the gap RelexTokenStream leaves in
+ * them is moved past each statement before it is parsed again. A statement ends at
+ * its first semicolon, so that costs as much as the statement is long.
+ *
+ * ParseStatement tells a statement had an error by the error count going up, which
+ * stops once max_allowed_errors is reached, so an editing session should lift the
+ * limit. */
+
+typedef struct
+{
+    ExpressionId expression; // 0 when the statement had an error
+    int first_token;
+    int end_token; // Just past its semicolon, or the end of file token
+    int first_node; // The statement's nodes are [first_node, end_node) of the pool
+    int end_node;
+} ParsedStatement;
+
+typedef struct
+{
+    TokenStream *tokens;
+    ExpressionPool pool;
+    ParsedStatement *statements; // Buffer, in source order
+    int dead_nodes; // Nodes of statements that were parsed again
+} IncrementalParse;
+
+/* Statements that were parsed again: [first, first + removed) of the old list became
+ * [first, first + inserted) */
+typedef struct
+{
+    int first;
+    int removed;
+    int inserted;
+} StatementSplice;
+
+static ParsedStatement ParseIncrementalStatement(IncrementalParse *parse, Parser *parser)
+{
+    ParsedStatement statement;
+    statement.first_token = parser->position;
+    statement.first_node = BufferLength(parse->pool.nodes);
+    statement.expression = ParseStatement(parser);
+    statement.end_token = parser->position;
+    statement.end_node = BufferLength(parse->pool.nodes);
+
+    return statement;
+}
+
+/* Moves the gap in the tokens past the statement starting at `position` and the token
+ * after it, which is all parsing it and checking for the end of file reads */
+static void UncoverStatement(TokenStream *tokens, int position)
+{
+    int count = TokenStreamLength(tokens);
+    int end = position;
+    while(end < count - 1 && TokenStreamKind(tokens, end) != TOKEN_SEMICOLON)
+    {
+        end++;
+    }
+
+    end = end + 2 < count ? end + 2 : count;
+    if(tokens->gap < end)
+    {
+        TokenStreamMoveGap(tokens, end);
+    }
+}
+
+IncrementalParse CreateIncrementalParse(TokenStream *tokens)
+{
+    TokenStreamCloseGap(tokens);
+
+    IncrementalParse parse;
+    memset(&parse, 0, sizeof parse);
+    parse.tokens = tokens;
+    parse.pool = CreateExpressionPool();
+    RecordExpressionSpans(&parse.pool);
+
+    Parser parser = CreateParser(tokens, &parse.pool);
+    while(PeekToken(&parser) != TOKEN_EOF)
+    {
+        ParsedStatement statement = ParseIncrementalStatement(&parse, &parser);
+        BufferPush(parse.statements, statement);
+    }
+
+    return parse;
+}
+
+void FreeIncrementalParse(IncrementalParse *parse)
+{
+    FreeExpressionPool(&parse->pool);
+    if(parse->statements)
+    {
+        BufferFree(parse->statements);
+    }
+
+    memset(parse, 0, sizeof *parse);
+}
+
+int IncrementalParseStatementCount(IncrementalParse *parse)
+{
+    return BufferLength(parse->statements);
+}
+
+/* Token range of `id`, a node of statement `statement` */
+void ExpressionTokenRange(IncrementalParse *parse, int statement, ExpressionId id, int *first, int *end)
+{
+    ExpressionPool *pool = &parse->pool;
+    ExpressionSpan span = (int)id < BufferLength(pool->spans) ? pool->spans[id] : (ExpressionSpan){ 0, 0 };
+    int start = parse->statements[statement].first_token;
+    *first = start + (int)span.first;
+    *end = start + (int)span.end;
+}
+
+static uint32_t MoveOperand(uint32_t operand, int from, int to)
+{
+    return operand ? (uint32_t)((int)operand - from + to) : 0;
+}
+
+/* Copies the trees of the live statements into a new pool */
+static void CompactIncrementalParse(IncrementalParse *parse)
+{
+    ExpressionPool *old = &parse->pool;
+    ExpressionPool pool = CreateExpressionPool();
+    RecordExpressionSpans(&pool);
+
+    int i = 0;
+    while(i < BufferLength(parse->statements))
+    {
+        ParsedStatement *statement = &parse->statements[i];
+        int from = statement->first_node;
+        int to = BufferLength(pool.nodes);
+
+        int id = from;
+        while(id < statement->end_node)
+        {
+            ExpressionNode node = old->nodes[id];
+            switch(node.kind)
+            {
+                case EXPRESSION_NUMBER:
+                    node.first = (uint32_t)BufferLength(pool.numbers);
+                    BufferPush(pool.numbers, old->numbers[old->nodes[id].first]);
+                    break;
+                case EXPRESSION_UNARY:
+                    node.first = MoveOperand(node.first, from, to);
+                    break;
+                case EXPRESSION_BINARY:
+                case EXPRESSION_ASSIGNMENT:
+                    node.first = MoveOperand(node.first, from, to);
+                    node.second = MoveOperand(node.second, from, to);
+                    break;
+                case EXPRESSION_TERNARY:
+                {
+                    ExpressionId then_expression = MoveOperand(old->branches[node.second], from, to);
+                    ExpressionId else_expression = MoveOperand(old->branches[node.second + 1], from, to);
+                    node.first = MoveOperand(node.first, from, to);
+                    node.second = (uint32_t)BufferLength(pool.branches);
+                    BufferPush(pool.branches, then_expression);
+                    BufferPush(pool.branches, else_expression);
+                    break;
+                }
+                default:
+                    break;
+            }
+
+            BufferPush(pool.nodes, node);
+            pool.node_counts[node.kind]++;
+            /* Spans are filled in lazily, so the last nodes may not have one yet */
+            ExpressionSpan span = id < BufferLength(old->spans) ? old->spans[id] : (ExpressionSpan){ 0, 0 };
+            BufferPush(pool.spans, span);
+            id++;
+        }
+
+        statement->expression = MoveOperand(statement->expression, from, to);
+        statement->first_node = to;
+        statement->end_node = BufferLength(pool.nodes);
+        i++;
+    }
+
+    FreeExpressionPool(old);
+    parse->pool = pool;
+    parse->dead_nodes = 0;
+}
+
+/* Brings the statements up to date with the tokens after RelexTokenStream made `tokens`
+ * splice. Diagnostics are reported for the statements parsed again only. */
+StatementSplice ReparseAfterEdit(IncrementalParse *parse, TokenSplice const *tokens)
+{
+    ParsedStatement *old = parse->statements;
+    int old_count = BufferLength(old);
+    int delta = tokens->inserted - tokens->removed;
+    int old_edit_end = tokens->first + tokens->removed;
+    int new_edit_end = tokens->first + tokens->inserted;
+
+    /* A statement is untouched if everything it read, its semicolon or the end of
+     * file token it stopped at, comes before the changed tokens */
+    int low = 0;
+    int high = old_count;
+    while(low < high)
+    {
+        int middle = (low + high) / 2;
+        int end = old[middle].end_token;
+        bool terminated = end > 0 && TokenStreamKind(parse->tokens, end - 1) == TOKEN_SEMICOLON;
+        if(end < tokens->first || (end == tokens->first && terminated))
+        {
+            low = middle + 1;
+        } else
+        {
+            high = middle;
+        }
+    }
+
+    StatementSplice splice;
+    splice.first = low;
+    int position = low < old_count ? old[low].first_token : (old_count ? old[old_count - 1].end_token : 0);
+
+    /* Parse one statement at a time until one ends where an old one past the edit starts */
+    Parser parser = CreateParser(parse->tokens, &parse->pool);
+    parser.position = position;
+    ParsedStatement *parsed = NULL; // Buffer
+    int resume = old_count; // First old statement kept
+    int next = low;
+    UncoverStatement(parse->tokens, position);
+    while(PeekToken(&parser) != TOKEN_EOF)
+    {
+        ParsedStatement statement = ParseIncrementalStatement(parse, &parser);
+        BufferPush(parsed, statement);
+        UncoverStatement(parse->tokens, parser.position);
+
+        if(statement.end_token >= new_edit_end)
+        {
+            int old_start = statement.end_token - delta;
+            while(next < old_count && old[next].first_token < old_start)
+            {
+                next++;
+            }
+
+            if(next < old_count && old[next].first_token == old_start && old_start >= old_edit_end)
+            {
+                resume = next;
+                break;
+            }
+        }
+    }
+
+    splice.removed = resume - splice.first;
+    splice.inserted = BufferLength(parsed);
+
+    int i = splice.first;
+    while(i < resume)
+    {
+        parse->dead_nodes += old[i].end_node - old[i].first_node;
+        i++;
+    }
+
+    /* Splice the new statements in and move the kept ones along */
+    int new_count = old_count - splice.removed + splice.inserted;
+    if(new_count > BufferCapacity(old))
+    {
+        int capacity = BufferCapacity(old) ? BufferCapacity(old) : 32;
+        while(capacity < new_count)
+        {
+            capacity *= 2;
+        }
+        BufferReallocate((void **)&old, sizeof *old, capacity);
+    }
+
+    if(old)
+    {
+        memmove(old + splice.first + splice.inserted, old + resume, (old_count - resume) * sizeof *old);
+        if(splice.inserted)
+        {
+            memcpy(old + splice.first, parsed, splice.inserted * sizeof *old);
+        }
+        BufferHeaderGet(old)->length = new_count;
+    }
+
+    i = splice.first + splice.inserted;
+    while(i < new_count)
+    {
+        old[i].first_token += delta;
+        old[i].end_token += delta;
+        i++;
+    }
+
+    parse->statements = old;
+    if(parsed)
+    {
+        BufferFree(parsed);
+    }
+
+    if(2 * parse->dead_nodes > BufferLength(parse->pool.nodes))
+    {
+        CompactIncrementalParse(parse);
+    }
+
+    return splice;
+}
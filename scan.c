@@ -0,0 +1,641 @@
+/* Character run scanning for the lexer
+ *
+ * The lexer spends most of its time walking runs of whitespace, identifier characters
+ * and string literal contents. Each of those walks has a scalar version and, on x86,
+ * SSE2 and AVX2 versions that test 16 or 32 bytes at a time. The vector versions only
+ * ever load aligned blocks, so they never read across a page boundary past the NUL
+ * terminator; bytes after the terminator are loaded but never matched, since every
+ * scan stops at the NUL.
+ *
+ * LexerSelectScanMode picks the widest version the CPU supports (checked with cpuid
+ * through __builtin_cpu_supports) unless a mode is forced, e.g. by the benchmarks. */
+
+typedef enum
+{
+    LEXER_SCAN_AUTO,
+    LEXER_SCAN_SCALAR,
+    LEXER_SCAN_SSE2,
+    LEXER_SCAN_AVX2
+} LexerScanMode;
+
+static char const *lexer_scan_mode_string_table[] = {
+    [LEXER_SCAN_AUTO] = "auto",
+    [LEXER_SCAN_SCALAR] = "scalar",
+    [LEXER_SCAN_SSE2] = "sse2",
+    [LEXER_SCAN_AVX2] = "avx2"
+};
+
+typedef struct
+{
+    /* Returns the first non whitespace character at or after p. Adds the newlines skipped
+     * to *newlines and points *last_newline at the last of them, if any. */
+    char const *(*skip_whitespace)(char const *p, int *newlines, char const **last_newline);
+    /* Returns the first character at or after p that cannot continue an identifier */
+    char const *(*identifier_end)(char const *p);
+    /* Returns the first '"', '\\' or NUL at or after p */
+    char const *(*string_end)(char const *p);
+} LexerScanFunctions;
+
+/* Character classes
+ *
+ * One lookup per byte instead of a chain of range compares. Bytes >= 0x80 and control
+ * characters other than whitespace have no class. */
+enum
+{
+    CHARACTER_IDENTIFIER_START = 1 << 0,
+    CHARACTER_IDENTIFIER_CONTINUE = 1 << 1,
+    CHARACTER_DIGIT = 1 << 2,
+    CHARACTER_HEX_DIGIT = 1 << 3,
+    CHARACTER_WHITESPACE = 1 << 4,
+    CHARACTER_NEWLINE = 1 << 5,
+    CHARACTER_OPERATOR_START = 1 << 6,
+    CHARACTER_QUOTE = 1 << 7
+};
+
+static uint8_t const character_class_table[256] = {
+    ['\t'] = CHARACTER_WHITESPACE,
+    ['\n'] = CHARACTER_WHITESPACE | CHARACTER_NEWLINE,
+    ['\v'] = CHARACTER_WHITESPACE,
+    ['\f'] = CHARACTER_WHITESPACE,
+    ['\r'] = CHARACTER_WHITESPACE,
+    [' '] = CHARACTER_WHITESPACE,
+    ['!'] = CHARACTER_OPERATOR_START,
+    ['"'] = CHARACTER_QUOTE,
+    ['%'] = CHARACTER_OPERATOR_START,
+    ['&'] = CHARACTER_OPERATOR_START,
+    ['('] = CHARACTER_OPERATOR_START,
+    [')'] = CHARACTER_OPERATOR_START,
+    ['*'] = CHARACTER_OPERATOR_START,
+    ['+'] = CHARACTER_OPERATOR_START,
+    [','] = CHARACTER_OPERATOR_START,
+    ['-'] = CHARACTER_OPERATOR_START,
+    ['0'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['1'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['2'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['3'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['4'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['5'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['6'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['7'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['8'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    ['9'] = CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_DIGIT | CHARACTER_HEX_DIGIT,
+    [':'] = CHARACTER_OPERATOR_START,
+    [';'] = CHARACTER_OPERATOR_START,
+    ['<'] = CHARACTER_OPERATOR_START,
+    ['='] = CHARACTER_OPERATOR_START,
+    ['>'] = CHARACTER_OPERATOR_START,
+    ['?'] = CHARACTER_OPERATOR_START,
+    ['A'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['B'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['C'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['D'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['E'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['F'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['G'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['H'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['I'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['J'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['K'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['L'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['M'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['N'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['O'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['P'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['Q'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['R'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['S'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['T'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['U'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['V'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['W'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['X'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['Y'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['Z'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['['] = CHARACTER_OPERATOR_START,
+    ['/'] = CHARACTER_OPERATOR_START,
+    [']'] = CHARACTER_OPERATOR_START,
+    ['^'] = CHARACTER_OPERATOR_START,
+    ['_'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['a'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['b'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['c'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['d'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['e'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['f'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE | CHARACTER_HEX_DIGIT,
+    ['g'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['h'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['i'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['j'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['k'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['l'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['m'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['n'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['o'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['p'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['q'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['r'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['s'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['t'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['u'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['v'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['w'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['x'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['y'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['z'] = CHARACTER_IDENTIFIER_START | CHARACTER_IDENTIFIER_CONTINUE,
+    ['{'] = CHARACTER_OPERATOR_START,
+    ['|'] = CHARACTER_OPERATOR_START,
+    ['}'] = CHARACTER_OPERATOR_START,
+    ['~'] = CHARACTER_OPERATOR_START
+};
+
+/* Value of a digit in bases up to 36, for every character that can continue an
+ * identifier (and so a number). '_' is never a digit. */
+static uint8_t const character_digit_table[256] = {
+    ['0'] = 0,
+    ['1'] = 1,
+    ['2'] = 2,
+    ['3'] = 3,
+    ['4'] = 4,
+    ['5'] = 5,
+    ['6'] = 6,
+    ['7'] = 7,
+    ['8'] = 8,
+    ['9'] = 9,
+    ['a'] = 10,
+    ['b'] = 11,
+    ['c'] = 12,
+    ['d'] = 13,
+    ['e'] = 14,
+    ['f'] = 15,
+    ['g'] = 16,
+    ['h'] = 17,
+    ['i'] = 18,
+    ['j'] = 19,
+    ['k'] = 20,
+    ['l'] = 21,
+    ['m'] = 22,
+    ['n'] = 23,
+    ['o'] = 24,
+    ['p'] = 25,
+    ['q'] = 26,
+    ['r'] = 27,
+    ['s'] = 28,
+    ['t'] = 29,
+    ['u'] = 30,
+    ['v'] = 31,
+    ['w'] = 32,
+    ['x'] = 33,
+    ['y'] = 34,
+    ['z'] = 35,
+    ['A'] = 10,
+    ['B'] = 11,
+    ['C'] = 12,
+    ['D'] = 13,
+    ['E'] = 14,
+    ['F'] = 15,
+    ['G'] = 16,
+    ['H'] = 17,
+    ['I'] = 18,
+    ['J'] = 19,
+    ['K'] = 20,
+    ['L'] = 21,
+    ['M'] = 22,
+    ['N'] = 23,
+    ['O'] = 24,
+    ['P'] = 25,
+    ['Q'] = 26,
+    ['R'] = 27,
+    ['S'] = 28,
+    ['T'] = 29,
+    ['U'] = 30,
+    ['V'] = 31,
+    ['W'] = 32,
+    ['X'] = 33,
+    ['Y'] = 34,
+    ['Z'] = 35,
+    ['_'] = 36
+};
+
+/* What LexerScan does with a token starting with each character */
+typedef enum
+{
+    LEXER_ACTION_INVALID,
+    LEXER_ACTION_WHITESPACE,
+    LEXER_ACTION_NUMBER,
+    LEXER_ACTION_IDENTIFIER,
+    LEXER_ACTION_STRING,
+    LEXER_ACTION_OPERATOR
+} LexerAction;
+
+static uint8_t const lexer_action_table[256] = {
+    ['\t'] = LEXER_ACTION_WHITESPACE,
+    ['\n'] = LEXER_ACTION_WHITESPACE,
+    ['\v'] = LEXER_ACTION_WHITESPACE,
+    ['\f'] = LEXER_ACTION_WHITESPACE,
+    ['\r'] = LEXER_ACTION_WHITESPACE,
+    [' '] = LEXER_ACTION_WHITESPACE,
+    ['!'] = LEXER_ACTION_OPERATOR,
+    ['"'] = LEXER_ACTION_STRING,
+    ['%'] = LEXER_ACTION_OPERATOR,
+    ['&'] = LEXER_ACTION_OPERATOR,
+    ['('] = LEXER_ACTION_OPERATOR,
+    [')'] = LEXER_ACTION_OPERATOR,
+    ['*'] = LEXER_ACTION_OPERATOR,
+    ['+'] = LEXER_ACTION_OPERATOR,
+    [','] = LEXER_ACTION_OPERATOR,
+    ['-'] = LEXER_ACTION_OPERATOR,
+    ['0'] = LEXER_ACTION_NUMBER,
+    ['1'] = LEXER_ACTION_NUMBER,
+    ['2'] = LEXER_ACTION_NUMBER,
+    ['3'] = LEXER_ACTION_NUMBER,
+    ['4'] = LEXER_ACTION_NUMBER,
+    ['5'] = LEXER_ACTION_NUMBER,
+    ['6'] = LEXER_ACTION_NUMBER,
+    ['7'] = LEXER_ACTION_NUMBER,
+    ['8'] = LEXER_ACTION_NUMBER,
+    ['9'] = LEXER_ACTION_NUMBER,
+    [':'] = LEXER_ACTION_OPERATOR,
+    [';'] = LEXER_ACTION_OPERATOR,
+    ['<'] = LEXER_ACTION_OPERATOR,
+    ['='] = LEXER_ACTION_OPERATOR,
+    ['>'] = LEXER_ACTION_OPERATOR,
+    ['?'] = LEXER_ACTION_OPERATOR,
+    ['A'] = LEXER_ACTION_IDENTIFIER,
+    ['B'] = LEXER_ACTION_IDENTIFIER,
+    ['C'] = LEXER_ACTION_IDENTIFIER,
+    ['D'] = LEXER_ACTION_IDENTIFIER,
+    ['E'] = LEXER_ACTION_IDENTIFIER,
+    ['F'] = LEXER_ACTION_IDENTIFIER,
+    ['G'] = LEXER_ACTION_IDENTIFIER,
+    ['H'] = LEXER_ACTION_IDENTIFIER,
+    ['I'] = LEXER_ACTION_IDENTIFIER,
+    ['J'] = LEXER_ACTION_IDENTIFIER,
+    ['K'] = LEXER_ACTION_IDENTIFIER,
+    ['L'] = LEXER_ACTION_IDENTIFIER,
+    ['M'] = LEXER_ACTION_IDENTIFIER,
+    ['N'] = LEXER_ACTION_IDENTIFIER,
+    ['O'] = LEXER_ACTION_IDENTIFIER,
+    ['P'] = LEXER_ACTION_IDENTIFIER,
+    ['Q'] = LEXER_ACTION_IDENTIFIER,
+    ['R'] = LEXER_ACTION_IDENTIFIER,
+    ['S'] = LEXER_ACTION_IDENTIFIER,
+    ['T'] = LEXER_ACTION_IDENTIFIER,
+    ['U'] = LEXER_ACTION_IDENTIFIER,
+    ['V'] = LEXER_ACTION_IDENTIFIER,
+    ['W'] = LEXER_ACTION_IDENTIFIER,
+    ['X'] = LEXER_ACTION_IDENTIFIER,
+    ['Y'] = LEXER_ACTION_IDENTIFIER,
+    ['Z'] = LEXER_ACTION_IDENTIFIER,
+    ['['] = LEXER_ACTION_OPERATOR,
+    ['/'] = LEXER_ACTION_OPERATOR,
+    [']'] = LEXER_ACTION_OPERATOR,
+    ['^'] = LEXER_ACTION_OPERATOR,
+    ['_'] = LEXER_ACTION_IDENTIFIER,
+    ['a'] = LEXER_ACTION_IDENTIFIER,
+    ['b'] = LEXER_ACTION_IDENTIFIER,
+    ['c'] = LEXER_ACTION_IDENTIFIER,
+    ['d'] = LEXER_ACTION_IDENTIFIER,
+    ['e'] = LEXER_ACTION_IDENTIFIER,
+    ['f'] = LEXER_ACTION_IDENTIFIER,
+    ['g'] = LEXER_ACTION_IDENTIFIER,
+    ['h'] = LEXER_ACTION_IDENTIFIER,
+    ['i'] = LEXER_ACTION_IDENTIFIER,
+    ['j'] = LEXER_ACTION_IDENTIFIER,
+    ['k'] = LEXER_ACTION_IDENTIFIER,
+    ['l'] = LEXER_ACTION_IDENTIFIER,
+    ['m'] = LEXER_ACTION_IDENTIFIER,
+    ['n'] = LEXER_ACTION_IDENTIFIER,
+    ['o'] = LEXER_ACTION_IDENTIFIER,
+    ['p'] = LEXER_ACTION_IDENTIFIER,
+    ['q'] = LEXER_ACTION_IDENTIFIER,
+    ['r'] = LEXER_ACTION_IDENTIFIER,
+    ['s'] = LEXER_ACTION_IDENTIFIER,
+    ['t'] = LEXER_ACTION_IDENTIFIER,
+    ['u'] = LEXER_ACTION_IDENTIFIER,
+    ['v'] = LEXER_ACTION_IDENTIFIER,
+    ['w'] = LEXER_ACTION_IDENTIFIER,
+    ['x'] = LEXER_ACTION_IDENTIFIER,
+    ['y'] = LEXER_ACTION_IDENTIFIER,
+    ['z'] = LEXER_ACTION_IDENTIFIER,
+    ['{'] = LEXER_ACTION_OPERATOR,
+    ['|'] = LEXER_ACTION_OPERATOR,
+    ['}'] = LEXER_ACTION_OPERATOR,
+    ['~'] = LEXER_ACTION_OPERATOR
+};
+
+static inline bool IsLexerWhitespace(char c)
+{
+    return character_class_table[(unsigned char)c] & CHARACTER_WHITESPACE;
+}
+
+static inline bool IsIdentifierCharacter(char c)
+{
+    return character_class_table[(unsigned char)c] & CHARACTER_IDENTIFIER_CONTINUE;
+}
+
+static char const *SkipWhitespaceScalar(char const *p, int *newlines, char const **last_newline)
+{
+    while(IsLexerWhitespace(*p))
+    {
+        if(*p == '\n')
+        {
+            (*newlines)++;
+            *last_newline = p;
+        }
+
+        p++;
+    }
+
+    return p;
+}
+
+static char const *IdentifierEndScalar(char const *p)
+{
+    while(IsIdentifierCharacter(*p))
+    {
+        p++;
+    }
+
+    return p;
+}
+
+static char const *StringEndScalar(char const *p)
+{
+    while(*p != '"' && *p != '\\' && *p != 0)
+    {
+        p++;
+    }
+
+    return p;
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define LEXER_SCAN_HAS_X86 1
+
+#include <immintrin.h>
+
+/* Bytes in [low, high], for ASCII ranges; bytes >= 0x80 compare as negative and never match */
+#define SSE2_IN_RANGE(block, low, high) \
+_mm_and_si128(_mm_cmpgt_epi8(block, _mm_set1_epi8((low) - 1)), _mm_cmplt_epi8(block, _mm_set1_epi8((high) + 1)))
+
+#define AVX2_IN_RANGE(block, low, high) \
+_mm256_and_si256(_mm256_cmpgt_epi8(block, _mm256_set1_epi8((low) - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8((high) + 1), block))
+
+static inline __m128i Sse2WhitespaceMask(__m128i block)
+{
+    return _mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')), SSE2_IN_RANGE(block, '\t', '\r'));
+}
+
+static inline __m128i Sse2IdentifierMask(__m128i block)
+{
+    __m128i lower = _mm_or_si128(block, _mm_set1_epi8(0x20));
+    __m128i letter = SSE2_IN_RANGE(lower, 'a', 'z');
+    __m128i digit = SSE2_IN_RANGE(block, '0', '9');
+    __m128i underscore = _mm_cmpeq_epi8(block, _mm_set1_epi8('_'));
+
+    return _mm_or_si128(_mm_or_si128(letter, digit), underscore);
+}
+
+static inline __m128i Sse2StringStopMask(__m128i block)
+{
+    return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8('"')),
+                                     _mm_cmpeq_epi8(block, _mm_set1_epi8('\\'))),
+                        _mm_cmpeq_epi8(block, _mm_setzero_si128()));
+}
+
+static char const *SkipWhitespaceSse2(char const *p, int *newlines, char const **last_newline)
+{
+    char const *block_start = (char const *)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t skip = ~0u << (p - block_start);
+
+    for(;;)
+    {
+        __m128i block = _mm_load_si128((__m128i const *)block_start);
+        uint32_t stop = ~(uint32_t)_mm_movemask_epi8(Sse2WhitespaceMask(block)) & 0xffff & skip;
+        uint32_t newline = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8('\n'))) & skip;
+
+        if(stop)
+        {
+            newline &= (stop & -stop) - 1;
+        }
+
+        if(newline)
+        {
+            *newlines += __builtin_popcount(newline);
+            *last_newline = block_start + (31 - __builtin_clz(newline));
+        }
+
+        if(stop)
+        {
+            return block_start + __builtin_ctz(stop);
+        }
+
+        block_start += 16;
+        skip = ~0u;
+    }
+}
+
+static char const *IdentifierEndSse2(char const *p)
+{
+    char const *block_start = (char const *)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t skip = ~0u << (p - block_start);
+
+    for(;;)
+    {
+        __m128i block = _mm_load_si128((__m128i const *)block_start);
+        uint32_t stop = ~(uint32_t)_mm_movemask_epi8(Sse2IdentifierMask(block)) & 0xffff & skip;
+        if(stop)
+        {
+            return block_start + __builtin_ctz(stop);
+        }
+
+        block_start += 16;
+        skip = ~0u;
+    }
+}
+
+static char const *StringEndSse2(char const *p)
+{
+    char const *block_start = (char const *)((uintptr_t)p & ~(uintptr_t)15);
+    uint32_t skip = ~0u << (p - block_start);
+
+    for(;;)
+    {
+        __m128i block = _mm_load_si128((__m128i const *)block_start);
+        uint32_t stop = (uint32_t)_mm_movemask_epi8(Sse2StringStopMask(block)) & skip;
+        if(stop)
+        {
+            return block_start + __builtin_ctz(stop);
+        }
+
+        block_start += 16;
+        skip = ~0u;
+    }
+}
+
+__attribute__((target("avx2")))
+static char const *SkipWhitespaceAvx2(char const *p, int *newlines, char const **last_newline)
+{
+    char const *block_start = (char const *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t skip = ~0u << (p - block_start);
+
+    for(;;)
+    {
+        __m256i block = _mm256_load_si256((__m256i const *)block_start);
+        __m256i whitespace = _mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8(' ')),
+                                             AVX2_IN_RANGE(block, '\t', '\r'));
+        uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(whitespace) & skip;
+        uint32_t newline = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('\n'))) & skip;
+
+        if(stop)
+        {
+            newline &= (stop & -stop) - 1;
+        }
+
+        if(newline)
+        {
+            *newlines += __builtin_popcount(newline);
+            *last_newline = block_start + (31 - __builtin_clz(newline));
+        }
+
+        if(stop)
+        {
+            return block_start + __builtin_ctz(stop);
+        }
+
+        block_start += 32;
+        skip = ~0u;
+    }
+}
+
+__attribute__((target("avx2")))
+static char const *IdentifierEndAvx2(char const *p)
+{
+    char const *block_start = (char const *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t skip = ~0u << (p - block_start);
+
+    for(;;)
+    {
+        __m256i block = _mm256_load_si256((__m256i const *)block_start);
+        __m256i lower = _mm256_or_si256(block, _mm256_set1_epi8(0x20));
+        __m256i identifier = _mm256_or_si256(_mm256_or_si256(AVX2_IN_RANGE(lower, 'a', 'z'),
+                                                             AVX2_IN_RANGE(block, '0', '9')),
+                                             _mm256_cmpeq_epi8(block, _mm256_set1_epi8('_')));
+        uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(identifier) & skip;
+        if(stop)
+        {
+            return block_start + __builtin_ctz(stop);
+        }
+
+        block_start += 32;
+        skip = ~0u;
+    }
+}
+
+__attribute__((target("avx2")))
+static char const *StringEndAvx2(char const *p)
+{
+    char const *block_start = (char const *)((uintptr_t)p & ~(uintptr_t)31);
+    uint32_t skip = ~0u << (p - block_start);
+
+    for(;;)
+    {
+        __m256i block = _mm256_load_si256((__m256i const *)block_start);
+        __m256i stops = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, _mm256_set1_epi8('"')),
+                                                        _mm256_cmpeq_epi8(block, _mm256_set1_epi8('\\'))),
+                                        _mm256_cmpeq_epi8(block, _mm256_setzero_si256()));
+        uint32_t stop = (uint32_t)_mm256_movemask_epi8(stops) & skip;
+        if(stop)
+        {
+            return block_start + __builtin_ctz(stop);
+        }
+
+        block_start += 32;
+        skip = ~0u;
+    }
+}
+#endif
+
+static LexerScanFunctions lexer_scan;
+static LexerScanMode lexer_scan_mode = LEXER_SCAN_AUTO;
+
+/* Returns false if the requested mode is not supported on this machine */
+bool LexerSelectScanMode(LexerScanMode mode)
+{
+#ifdef LEXER_SCAN_HAS_X86
+    __builtin_cpu_init();
+    bool has_sse2 = __builtin_cpu_supports("sse2");
+    bool has_avx2 = __builtin_cpu_supports("avx2");
+#else
+    bool has_sse2 = false;
+    bool has_avx2 = false;
+#endif
+
+    if(mode == LEXER_SCAN_AUTO)
+    {
+        mode = has_avx2 ? LEXER_SCAN_AVX2 : has_sse2 ? LEXER_SCAN_SSE2 : LEXER_SCAN_SCALAR;
+    }
+
+    switch(mode)
+    {
+        case LEXER_SCAN_AUTO:
+        case LEXER_SCAN_SCALAR:
+            lexer_scan.skip_whitespace = SkipWhitespaceScalar;
+            lexer_scan.identifier_end = IdentifierEndScalar;
+            lexer_scan.string_end = StringEndScalar;
+            break;
+        case LEXER_SCAN_SSE2:
+            if(!has_sse2)
+            {
+                return false;
+            }
+#ifdef LEXER_SCAN_HAS_X86
+            lexer_scan.skip_whitespace = SkipWhitespaceSse2;
+            lexer_scan.identifier_end = IdentifierEndSse2;
+            lexer_scan.string_end = StringEndSse2;
+#endif
+            break;
+        case LEXER_SCAN_AVX2:
+            if(!has_avx2)
+            {
+                return false;
+            }
+#ifdef LEXER_SCAN_HAS_X86
+            lexer_scan.skip_whitespace = SkipWhitespaceAvx2;
+            lexer_scan.identifier_end = IdentifierEndAvx2;
+            lexer_scan.string_end = StringEndAvx2;
+#endif
+            break;
+    }
+
+    lexer_scan_mode = mode;
+
+    return true;
+}
+
+/* The lexer calls these. A single separating space or a one character identifier is
+ * the common case and is handled before paying for a call through lexer_scan. */
+static inline char const *LexerSkipWhitespace(char const *p, int *newlines, char const **last_newline)
+{
+    if(!IsLexerWhitespace(p[1]) && *p != '\n')
+    {
+        return p + 1;
+    }
+
+    return lexer_scan.skip_whitespace(p, newlines, last_newline);
+}
+
+static inline char const *LexerIdentifierEnd(char const *p)
+{
+    if(!IsIdentifierCharacter(p[1]))
+    {
+        return p + 1;
+    }
+
+    return lexer_scan.identifier_end(p + 1);
+}
+
+static inline char const *LexerStringEnd(char const *p)
+{
+    return lexer_scan.string_end(p);
+}
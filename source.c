@@ -0,0 +1,89 @@
+/* Source file input
+ *
+ * Files are mapped read-only and handed to the lexer in place. The mapping is
+ * followed by at least one page of zeros, so the lexer's NUL terminator check
+ * always finds a 0 byte right after the last character without the file being
+ * copied. Tokens refer back into the mapping by offset, so it has to stay open
+ * as long as the tokens are in use.
+ *
+ * The lexer stops at the first 0 byte wherever it is, so a NUL inside the file is
+ * reported as an error and the file's length ends there: everything after the NUL
+ * is left out the same way for every lexer. */
+
+typedef struct
+{
+    char const *data; // NUL terminated
+    size_t length; // Up to the first NUL
+    size_t mapped_length;
+} SourceFile;
+
+bool SourceFileOpen(SourceFile *file, char const *path)
+{
+    memset(file, 0, sizeof *file);
+
+    int file_descriptor = open(path, O_RDONLY);
+    if(file_descriptor < 0)
+    {
+        ReportError("%s: could not open file: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    struct stat status;
+    if(fstat(file_descriptor, &status) != 0)
+    {
+        ReportError("%s: could not stat file: %s\n", path, strerror(errno));
+        close(file_descriptor);
+        return false;
+    }
+
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size_t)status.st_size;
+    size_t mapped_length = ((length + page_size - 1) / page_size) * page_size + page_size;
+
+    /* Reserve the whole range as zero pages, then map the file over the front of it */
+    char *data = mmap(NULL, mapped_length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(data == MAP_FAILED)
+    {
+        ReportError("%s: could not map file: %s\n", path, strerror(errno));
+        close(file_descriptor);
+        return false;
+    }
+
+    if(length > 0)
+    {
+        if(mmap(data, length, PROT_READ, MAP_PRIVATE | MAP_FIXED, file_descriptor, 0) == MAP_FAILED)
+        {
+            ReportError("%s: could not map file: %s\n", path, strerror(errno));
+            munmap(data, mapped_length);
+            close(file_descriptor);
+            return false;
+        }
+
+        madvise(data, length, MADV_SEQUENTIAL);
+
+        char const *nul = memchr(data, 0, length);
+        if(nul)
+        {
+            ReportError("%s: embedded NUL at offset %zu\n", path, (size_t)(nul - data));
+            length = (size_t)(nul - data);
+        }
+    }
+
+    close(file_descriptor);
+
+    file->data = data;
+    file->length = length;
+    file->mapped_length = mapped_length;
+
+    return true;
+}
+
+void SourceFileClose(SourceFile *file)
+{
+    if(file->data)
+    {
+        munmap((void *)file->data, file->mapped_length);
+    }
+
+    memset(file, 0, sizeof *file);
+}
@@ -0,0 +1,349 @@
+/* Compile statistics
+ *
+ * With --stats every CompileContext carries a CompileStatistics and each phase of
+ * LexFile adds its wall and CPU time to it, together with how many tokens of each
+ * kind were lexed and how many nodes of each kind were parsed. Batches give every
+ * file its own CompileStatistics, and CompileJobsFinish adds them up in the main
+ * thread's, so nothing here needs a lock.
+ *
+ * Wall time is CLOCK_MONOTONIC. Phase CPU time is CLOCK_THREAD_CPUTIME_ID of the
+ * thread running the phase, which leaves out the helpers of a file lexed in
+ * parallel; the process total from CLOCK_PROCESS_CPUTIME_ID covers every thread.
+ *
+ * BufferReallocate counts its calls while allocation_counting is set. Every other
+ * allocation is seen through the C library's own books: on glibc, mallinfo2 when
+ * counting starts and when it is read tells how much more heap is in use, the
+ * memory mapped blocks of large allocations included. */
+
+typedef enum
+{
+    COMPILE_PHASE_READ,
+    COMPILE_PHASE_CACHE_LOAD,
+    COMPILE_PHASE_LEX,
+    COMPILE_PHASE_PARSE,
+    COMPILE_PHASE_CACHE_STORE,
+    COMPILE_PHASE_EMIT_TOKENS,
+    COMPILE_PHASE_FOLD,
+    COMPILE_PHASE_BYTECODE,
+    COMPILE_PHASE_IR,
+    COMPILE_PHASE_ASSEMBLY,
+
+    COMPILE_PHASE_COUNT
+} CompilePhase;
+
+static char const *compile_phase_string_table[] = {
+    [COMPILE_PHASE_READ] = "read",
+    [COMPILE_PHASE_CACHE_LOAD] = "cache_load",
+    [COMPILE_PHASE_LEX] = "lex",
+    [COMPILE_PHASE_PARSE] = "parse",
+    [COMPILE_PHASE_CACHE_STORE] = "cache_store",
+    [COMPILE_PHASE_EMIT_TOKENS] = "emit_tokens",
+    [COMPILE_PHASE_FOLD] = "fold",
+    [COMPILE_PHASE_BYTECODE] = "bytecode",
+    [COMPILE_PHASE_IR] = "ir",
+    [COMPILE_PHASE_ASSEMBLY] = "assembly"
+};
+
+struct CompileStatistics
+{
+    double wall_seconds[COMPILE_PHASE_COUNT];
+    double cpu_seconds[COMPILE_PHASE_COUNT];
+    size_t files;
+    size_t bytes;
+    size_t token_counts[TOKEN_EOF + 1];
+    size_t expression_counts[EXPRESSION_KIND_COUNT];
+    size_t cache_hits; // Files whose tokens came from the cache
+    size_t cache_misses;
+    size_t cache_bytes_saved; // Source bytes of the hits, which were not lexed
+};
+
+/* Process wide counts, read once the compile is over */
+typedef struct
+{
+    double wall_seconds;
+    double cpu_seconds;
+    size_t buffer_reallocations;
+    size_t buffer_reallocated_bytes;
+    long long heap_growth_bytes; // Heap in use now less heap in use when counting started
+    long peak_resident_kilobytes;
+} ProcessStatistics;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+
+static long long HeapBytesInUse(void)
+{
+    struct mallinfo2 info = mallinfo2();
+
+    return (long long)(info.uordblks + info.hblkhd);
+}
+
+#define HEAP_USAGE_KNOWN true
+#else
+static long long HeapBytesInUse(void)
+{
+    return 0;
+}
+
+#define HEAP_USAGE_KNOWN false
+#endif
+
+static double TimespecSeconds(struct timespec time)
+{
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+/* Does nothing, not even read the clocks, when the current context has no statistics */
+typedef struct
+{
+    CompileStatistics *statistics;
+    struct timespec wall;
+    struct timespec cpu;
+} CompilePhaseTimer;
+
+CompilePhaseTimer CompilePhaseStart(void)
+{
+    CompilePhaseTimer timer;
+    timer.statistics = CurrentContext()->statistics;
+    if(timer.statistics)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &timer.wall);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &timer.cpu);
+    }
+
+    return timer;
+}
+
+void CompilePhaseEnd(CompilePhaseTimer *timer, CompilePhase phase)
+{
+    if(!timer->statistics)
+    {
+        return;
+    }
+
+    struct timespec wall;
+    struct timespec cpu;
+    clock_gettime(CLOCK_MONOTONIC, &wall);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    timer->statistics->wall_seconds[phase] += TimespecSeconds(wall) - TimespecSeconds(timer->wall);
+    timer->statistics->cpu_seconds[phase] += TimespecSeconds(cpu) - TimespecSeconds(timer->cpu);
+}
+
+void CountTokens(CompileStatistics *statistics, TokenStream *tokens)
+{
+    int i = 0;
+    while(i < TokenStreamLength(tokens))
+    {
+        statistics->token_counts[tokens->kinds[i]]++;
+        i++;
+    }
+}
+
+void CountExpressions(CompileStatistics *statistics, ExpressionPool *pool)
+{
+    int kind = 0;
+    while(kind < EXPRESSION_KIND_COUNT)
+    {
+        statistics->expression_counts[kind] += pool->node_counts[kind];
+        kind++;
+    }
+}
+
+void MergeCompileStatistics(CompileStatistics *into, CompileStatistics const *from)
+{
+    int phase = 0;
+    while(phase < COMPILE_PHASE_COUNT)
+    {
+        into->wall_seconds[phase] += from->wall_seconds[phase];
+        into->cpu_seconds[phase] += from->cpu_seconds[phase];
+        phase++;
+    }
+
+    into->files += from->files;
+    into->bytes += from->bytes;
+    into->cache_hits += from->cache_hits;
+    into->cache_misses += from->cache_misses;
+    into->cache_bytes_saved += from->cache_bytes_saved;
+
+    int kind = 0;
+    while(kind <= TOKEN_EOF)
+    {
+        into->token_counts[kind] += from->token_counts[kind];
+        kind++;
+    }
+
+    kind = 0;
+    while(kind < EXPRESSION_KIND_COUNT)
+    {
+        into->expression_counts[kind] += from->expression_counts[kind];
+        kind++;
+    }
+}
+
+/* Where the process clocks stood when counting started */
+typedef struct
+{
+    struct timespec wall;
+    struct timespec cpu;
+    long long heap_bytes;
+} ProcessStatisticsStart;
+
+ProcessStatisticsStart StartProcessStatistics(void)
+{
+    ProcessStatisticsStart start;
+    clock_gettime(CLOCK_MONOTONIC, &start.wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start.cpu);
+    start.heap_bytes = HeapBytesInUse();
+    atomic_store(&allocation_counting, true);
+
+    return start;
+}
+
+ProcessStatistics ReadProcessStatistics(ProcessStatisticsStart const *start)
+{
+    ProcessStatistics process;
+    memset(&process, 0, sizeof process);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    process.wall_seconds = TimespecSeconds(now) - TimespecSeconds(start->wall);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    process.cpu_seconds = TimespecSeconds(now) - TimespecSeconds(start->cpu);
+
+    process.buffer_reallocations = atomic_load_explicit(&buffer_reallocations, memory_order_relaxed);
+    process.buffer_reallocated_bytes = atomic_load_explicit(&buffer_reallocated_bytes, memory_order_relaxed);
+    process.heap_growth_bytes = HeapBytesInUse() - start->heap_bytes;
+
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        process.peak_resident_kilobytes = usage.ru_maxrss;
+    }
+
+    return process;
+}
+
+void PrintCompileStatistics(FILE *output, CompileStatistics const *statistics, ProcessStatistics const *process)
+{
+    fprintf(output, "statistics: %zu files, %zu bytes\n", statistics->files, statistics->bytes);
+    fprintf(output, "  %-10s %12s %12s\n", "phase", "wall ms", "cpu ms");
+
+    int phase = 0;
+    while(phase < COMPILE_PHASE_COUNT)
+    {
+        if(statistics->wall_seconds[phase] > 0)
+        {
+            fprintf(output, "  %-10s %12.3f %12.3f\n", compile_phase_string_table[phase],
+                    statistics->wall_seconds[phase] * 1e3, statistics->cpu_seconds[phase] * 1e3);
+        }
+        phase++;
+    }
+    fprintf(output, "  %-10s %12.3f %12.3f\n", "process", process->wall_seconds * 1e3, process->cpu_seconds * 1e3);
+
+    size_t total = 0;
+    int kind = 0;
+    while(kind <= TOKEN_EOF)
+    {
+        total += statistics->token_counts[kind];
+        kind++;
+    }
+    fprintf(output, "  tokens     %12zu\n", total);
+
+    kind = 0;
+    while(kind <= TOKEN_EOF)
+    {
+        if(statistics->token_counts[kind])
+        {
+            fprintf(output, "    %-12s %10zu\n", token_string_table[kind], statistics->token_counts[kind]);
+        }
+        kind++;
+    }
+
+    total = 0;
+    kind = 0;
+    while(kind < EXPRESSION_KIND_COUNT)
+    {
+        total += statistics->expression_counts[kind];
+        kind++;
+    }
+    fprintf(output, "  nodes      %12zu\n", total);
+
+    kind = 0;
+    while(kind < EXPRESSION_KIND_COUNT)
+    {
+        if(statistics->expression_counts[kind])
+        {
+            fprintf(output, "    %-12s %10zu\n", expression_kind_string_table[kind], statistics->expression_counts[kind]);
+        }
+        kind++;
+    }
+
+    size_t lookups = statistics->cache_hits + statistics->cache_misses;
+    if(lookups)
+    {
+        fprintf(output, "  cache %zu hits %zu misses, %.1f%% hit rate, %zu bytes not lexed, %.3f ms loading\n",
+                statistics->cache_hits, statistics->cache_misses, 100.0 * statistics->cache_hits / lookups,
+                statistics->cache_bytes_saved, statistics->wall_seconds[COMPILE_PHASE_CACHE_LOAD] * 1e3);
+    }
+
+    fprintf(output, "  buffer reallocations %zu, %zu bytes\n", process->buffer_reallocations,
+            process->buffer_reallocated_bytes);
+    if(HEAP_USAGE_KNOWN)
+    {
+        fprintf(output, "  heap growth %lld bytes\n", process->heap_growth_bytes);
+    }
+    fprintf(output, "  peak resident %ld KiB\n", process->peak_resident_kilobytes);
+}
+
+/* Every name written is a C token or a plain word, so none of them need escaping */
+void PrintCompileStatisticsJson(FILE *output, CompileStatistics const *statistics, ProcessStatistics const *process)
+{
+    fprintf(output, "{\n  \"files\": %zu,\n  \"bytes\": %zu,\n  \"phases\": {", statistics->files, statistics->bytes);
+
+    int phase = 0;
+    while(phase < COMPILE_PHASE_COUNT)
+    {
+        fprintf(output, "%s\n    \"%s\": { \"wall_seconds\": %.9f, \"cpu_seconds\": %.9f }", phase ? "," : "",
+                compile_phase_string_table[phase], statistics->wall_seconds[phase], statistics->cpu_seconds[phase]);
+        phase++;
+    }
+    fprintf(output, "\n  },\n  \"process\": { \"wall_seconds\": %.9f, \"cpu_seconds\": %.9f },\n",
+            process->wall_seconds, process->cpu_seconds);
+
+    fprintf(output, "  \"tokens\": {");
+    bool first = true;
+    int kind = 0;
+    while(kind <= TOKEN_EOF)
+    {
+        if(statistics->token_counts[kind])
+        {
+            fprintf(output, "%s\n    \"%s\": %zu", first ? "" : ",", token_string_table[kind], statistics->token_counts[kind]);
+            first = false;
+        }
+        kind++;
+    }
+
+    fprintf(output, "\n  },\n  \"nodes\": {");
+    first = true;
+    kind = 0;
+    while(kind < EXPRESSION_KIND_COUNT)
+    {
+        if(statistics->expression_counts[kind])
+        {
+            fprintf(output, "%s\n    \"%s\": %zu", first ? "" : ",", expression_kind_string_table[kind],
+                    statistics->expression_counts[kind]);
+            first = false;
+        }
+        kind++;
+    }
+
+    fprintf(output, "\n  },\n  \"cache\": { \"hits\": %zu, \"misses\": %zu, \"bytes_saved\": %zu },\n",
+            statistics->cache_hits, statistics->cache_misses, statistics->cache_bytes_saved);
+    fprintf(output, "  \"buffer_reallocations\": %zu,\n  \"buffer_reallocated_bytes\": %zu,\n",
+            process->buffer_reallocations, process->buffer_reallocated_bytes);
+    if(HEAP_USAGE_KNOWN)
+    {
+        fprintf(output, "  \"heap_growth_bytes\": %lld,\n", process->heap_growth_bytes);
+    }
+    fprintf(output, "  \"peak_resident_kilobytes\": %ld\n}\n", process->peak_resident_kilobytes);
+}
@@ -1,38 +1,115 @@
+/* String builder
+ *
+ * Text is appended to a char Buffer that doubles when it runs out, so building an
+ * N byte string costs O(log N) allocations and copies every byte O(1) times on
+ * average. Many pieces, like every node of a tree being printed, can go into one
+ * shared builder. FinalizeStringBuilder makes the one exact size copy callers own and
+ * releases the Buffer. The Buffer always has room for a terminating zero. */
 typedef struct
 {
-    char buffer[512]; // Will this be enough? For now yes.
-    int length;
+    char *buffer; // Buffer, zero terminated past its length
 } StringBuilder;
 
+#define STRING_BUILDER_INITIAL_CAPACITY 64
+
 StringBuilder CreateStringBuilder(void)
 {
     StringBuilder builder;
-    builder.length = 0;
+    builder.buffer = NULL;
 
     return builder;
 }
 
+int StringBuilderLength(StringBuilder *builder)
+{
+    return BufferLength(builder->buffer);
+}
+
+/* Makes room for `length` more characters and the terminating zero */
+static void StringBuilderReserve(StringBuilder *builder, int length)
+{
+    int needed = BufferLength(builder->buffer) + length + 1;
+    int capacity = BufferCapacity(builder->buffer);
+    if(needed <= capacity)
+    {
+        return;
+    }
+
+    if(capacity < STRING_BUILDER_INITIAL_CAPACITY)
+    {
+        capacity = STRING_BUILDER_INITIAL_CAPACITY;
+    }
+
+    while(capacity < needed)
+    {
+        capacity *= 2;
+    }
+
+    BufferReallocate((void **)&builder->buffer, 1, capacity);
+    Assert(builder->buffer);
+}
+
+void PushCharactersToStringBuilder(StringBuilder *builder, char const *characters, int length)
+{
+    StringBuilderReserve(builder, length);
+
+    int old_length = BufferLength(builder->buffer);
+    memcpy(builder->buffer + old_length, characters, length);
+    BufferHeaderGet(builder->buffer)->length = old_length + length;
+    builder->buffer[old_length + length] = 0;
+}
+
 void PushToStringBuilder(StringBuilder *builder, char const *format, ...)
 {
     va_list list;
     va_start(list, format);
 
-    int chars_written = vsnprintf(builder->buffer + builder->length, 512, format, list);
+    StringBuilderReserve(builder, 0);
+    int length = BufferLength(builder->buffer);
+    int available = BufferCapacity(builder->buffer) - length;
+
+    va_list retry;
+    va_copy(retry, list);
+    int chars_written = vsnprintf(builder->buffer + length, available, format, list);
+    Assert(chars_written >= 0);
 
-    builder->length += chars_written;
-    Assert(builder->length < 512);
+    if(chars_written >= available)
+    {
+        /* Did not fit; grow to the size vsnprintf asked for and format again */
+        StringBuilderReserve(builder, chars_written);
+        vsnprintf(builder->buffer + length, chars_written + 1, format, retry);
+    }
 
+    BufferHeaderGet(builder->buffer)->length = length + chars_written;
+
+    va_end(retry);
     va_end(list);
 }
 
+/* Returns the text as a malloc'd string and leaves the builder empty */
 char *FinalizeStringBuilder(StringBuilder *builder)
 {
-    char *result = malloc(builder->length + 1);
+    int length = BufferLength(builder->buffer);
+    char *result = malloc(length + 1);
     Assert(result);
 
-    memcpy(result, builder->buffer, builder->length);
-    result[builder->length] = 0;
+    if(builder->buffer)
+    {
+        memcpy(result, builder->buffer, length);
+        BufferFree(builder->buffer);
+        builder->buffer = NULL;
+    }
+    result[length] = 0;
 
     return result;
 }
 
+void FreeStringBuilder(StringBuilder *builder)
+{
+    if(builder->buffer)
+    {
+        BufferFree(builder->buffer);
+    }
+
+    builder->buffer = NULL;
+}
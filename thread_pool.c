@@ -0,0 +1,278 @@
+/* Work-stealing thread pool
+ *
+ * Every worker owns a queue. A task submitted from inside a worker goes on that
+ * worker's own queue, which it works through newest first; a worker whose queue is
+ * empty steals the oldest task from another worker's queue. Tasks submitted from
+ * outside the pool are dealt out round robin.
+ *
+ * Queues are short Buffers behind a mutex each. `queued` counts tasks sitting in any
+ * queue, counting from just before a task is pushed until a worker has taken it,
+ * and is only changed under the pool lock, so an idle worker can sleep on
+ * work_available without missing a submission. */
+
+typedef struct
+{
+    void (*function)(void *argument);
+    void *argument;
+} ThreadPoolTask;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    ThreadPoolTask *tasks; // Buffer, live tasks are [head, length)
+    int head;
+} ThreadPoolQueue;
+
+typedef struct ThreadPool ThreadPool;
+
+typedef struct
+{
+    ThreadPool *pool;
+    int index;
+} ThreadPoolWorker;
+
+struct ThreadPool
+{
+    int worker_count;
+    pthread_t *threads;
+    ThreadPoolWorker *workers;
+    ThreadPoolQueue *queues;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work_available;
+    pthread_cond_t all_done;
+    int queued; // Tasks waiting in a queue
+    int pending; // Tasks submitted and not finished yet
+    int next_queue; // Round robin position for submissions from outside the pool
+    bool shutting_down;
+};
+
+/* Index of the worker running on this thread, -1 outside any pool */
+static _Thread_local int thread_pool_worker_index = -1;
+static _Thread_local ThreadPool *thread_pool_current = NULL;
+
+int ThreadPoolCoreCount(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return count > 0 ? (int)count : 1;
+}
+
+static void ThreadPoolQueuePush(ThreadPoolQueue *queue, ThreadPoolTask task)
+{
+    pthread_mutex_lock(&queue->lock);
+    BufferPush(queue->tasks, task);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* The owner takes its newest task, thieves take the oldest */
+static bool ThreadPoolQueueTake(ThreadPoolQueue *queue, bool steal, ThreadPoolTask *task)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&queue->lock);
+    int length = BufferLength(queue->tasks);
+    if(queue->head < length)
+    {
+        if(steal)
+        {
+            *task = queue->tasks[queue->head++];
+        } else
+        {
+            *task = queue->tasks[length - 1];
+            BufferHeaderGet(queue->tasks)->length--;
+        }
+
+        if(queue->head == BufferLength(queue->tasks))
+        {
+            queue->head = 0;
+            BufferHeaderGet(queue->tasks)->length = 0;
+        }
+
+        found = true;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+static bool ThreadPoolFindTask(ThreadPool *pool, int index, ThreadPoolTask *task)
+{
+    if(ThreadPoolQueueTake(&pool->queues[index], false, task))
+    {
+        return true;
+    }
+
+    int i = 1;
+    while(i < pool->worker_count)
+    {
+        if(ThreadPoolQueueTake(&pool->queues[(index + i) % pool->worker_count], true, task))
+        {
+            return true;
+        }
+
+        i++;
+    }
+
+    return false;
+}
+
+static void *ThreadPoolWorkerMain(void *argument)
+{
+    ThreadPoolWorker *worker = argument;
+    ThreadPool *pool = worker->pool;
+    thread_pool_worker_index = worker->index;
+    thread_pool_current = pool;
+
+    for(;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while(pool->queued == 0 && !pool->shutting_down)
+        {
+            pthread_cond_wait(&pool->work_available, &pool->lock);
+        }
+
+        if(pool->queued == 0 && pool->shutting_down)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        ThreadPoolTask task;
+        if(!ThreadPoolFindTask(pool, worker->index, &task))
+        {
+            /* Another worker got there first, or the task is still being pushed */
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        task.function(task.argument);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        if(pool->pending == 0)
+        {
+            pthread_cond_broadcast(&pool->all_done);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/* Starts worker_count threads, or one per core when worker_count is 0 */
+void ThreadPoolInit(ThreadPool *pool, int worker_count)
+{
+    memset(pool, 0, sizeof *pool);
+
+    if(worker_count <= 0)
+    {
+        worker_count = ThreadPoolCoreCount();
+    }
+
+    pool->worker_count = worker_count;
+    pool->threads = malloc(worker_count * sizeof *pool->threads);
+    pool->workers = malloc(worker_count * sizeof *pool->workers);
+    pool->queues = calloc(worker_count, sizeof *pool->queues);
+    Assert(pool->threads && pool->workers && pool->queues);
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_available, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+
+    int i = 0;
+    while(i < worker_count)
+    {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        i++;
+    }
+
+    i = 0;
+    while(i < worker_count)
+    {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+        int result = pthread_create(&pool->threads[i], NULL, ThreadPoolWorkerMain, &pool->workers[i]);
+        Assert(result == 0);
+        i++;
+    }
+}
+
+/* Safe to call from any thread, including from a task running in the pool */
+void ThreadPoolSubmit(ThreadPool *pool, void (*function)(void *argument), void *argument)
+{
+    ThreadPoolTask task;
+    task.function = function;
+    task.argument = argument;
+
+    /* Counted before it can be taken, so finishing it cannot bring pending to zero
+     * while the task submitting it still runs, and queued never goes negative */
+    pthread_mutex_lock(&pool->lock);
+    int index = thread_pool_worker_index;
+    if(thread_pool_current != pool)
+    {
+        index = pool->next_queue;
+        pool->next_queue = (pool->next_queue + 1) % pool->worker_count;
+    }
+    pool->queued++;
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    ThreadPoolQueuePush(&pool->queues[index], task);
+
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Blocks until every task submitted so far, and every task those submitted, has run.
+ * Must not be called from inside a task. */
+void ThreadPoolWait(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending > 0)
+    {
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* Runs whatever is still queued, then stops the workers */
+void ThreadPoolFree(ThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutting_down = true;
+    pthread_cond_broadcast(&pool->work_available);
+    pthread_mutex_unlock(&pool->lock);
+
+    int i = 0;
+    while(i < pool->worker_count)
+    {
+        pthread_join(pool->threads[i], NULL);
+        i++;
+    }
+
+    i = 0;
+    while(i < pool->worker_count)
+    {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+        if(pool->queues[i].tasks)
+        {
+            BufferFree(pool->queues[i].tasks);
+        }
+        i++;
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_available);
+    pthread_cond_destroy(&pool->all_done);
+
+    free(pool->threads);
+    free(pool->workers);
+    free(pool->queues);
+    memset(pool, 0, sizeof *pool);
+}
@@ -0,0 +1,1114 @@
+/* Token cache
+ *
+ * With --cache-dir=DIR the tokens of every file lexed without errors are written to
+ * DIR, and its tree too when it was parsed without hash-consing. The next time the
+ * same bytes come by, LexFile loads the entry and skips lexing, and parsing when the
+ * entry has a tree.
+ *
+ * Entries are named by a 64-bit hash of the source bytes, seeded with a stamp of the
+ * format version and the build, so a new build of the compiler never reads an old
+ * build's entries. The header repeats the hash and length, and a checksum over the
+ * rest of the file catches a torn or corrupted entry, which is then a miss.
+ *
+ * After the header an entry is one stream of bytes, written and read in a single
+ * pass each way. Numbers in it are unsigned LEB128 varints, so most of them take one
+ * byte. In order, it holds:
+ *
+ * - the names of the identifiers, numbered 1, 2, ... in the order they first appear:
+ *   every length, then every name;
+ * - per token its kind, how far it starts after the previous token, and the payload
+ *   of a number, identifier or string;
+ * - per node from 1 up, its kind, then the number of a number node, zigzag coded so
+ *   small negative numbers stay short, the name of an identifier node, or the
+ *   operator of any other node.
+ *
+ * The parser makes the operands of a node right before the node itself, so the
+ * nodes are in postfix order and operands are not stored: loading pushes every node
+ * on a stack, a node pops as many operands as its kind has, and the statements are
+ * what is left on the stack at the end.
+ *
+ * Loading interns the names and builds the arrays back up. Everything read on the
+ * way is checked: token kinds and offsets, identifier numbers, node kinds and
+ * operators, and that the stack never runs out and ends as deep as the header
+ * says there are statements. An entry
+ * damaged in a way the checksum missed is a miss too, and never gets a tree that
+ * points outside its pool into the compile.
+ *
+ * Entries are written to a temporary file and renamed into place, so compiles
+ * running at the same time never see half an entry. */
+
+#define TOKEN_CACHE_MAGIC 0x31434B54u // "TKC1"
+#define TOKEN_CACHE_VERSION 2
+
+
+/* xxHash's XXH64 */
+#define HASH_PRIME64_1 0x9E3779B185EBCA87ull
+#define HASH_PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define HASH_PRIME64_3 0x165667B19E3779F9ull
+#define HASH_PRIME64_4 0x85EBCA77C2B2AE63ull
+#define HASH_PRIME64_5 0x27D4EB2F165667C5ull
+
+static inline uint64_t HashRotate(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t HashRead64(unsigned char const *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof value);
+
+    return value;
+}
+
+static inline uint64_t HashRound(uint64_t accumulator, uint64_t input)
+{
+    accumulator += input * HASH_PRIME64_2;
+    accumulator = HashRotate(accumulator, 31);
+
+    return accumulator * HASH_PRIME64_1;
+}
+
+static inline uint64_t HashMerge(uint64_t hash, uint64_t accumulator)
+{
+    hash ^= HashRound(0, accumulator);
+
+    return hash * HASH_PRIME64_1 + HASH_PRIME64_4;
+}
+
+uint64_t HashBytes(void const *data, size_t length, uint64_t seed)
+{
+    unsigned char const *bytes = data;
+    unsigned char const *end = bytes + length;
+    uint64_t hash;
+
+    if(length >= 32)
+    {
+        uint64_t accumulators[4] = { seed + HASH_PRIME64_1 + HASH_PRIME64_2, seed + HASH_PRIME64_2, seed,
+                                     seed - HASH_PRIME64_1 };
+        while(end - bytes >= 32)
+        {
+            accumulators[0] = HashRound(accumulators[0], HashRead64(bytes));
+            accumulators[1] = HashRound(accumulators[1], HashRead64(bytes + 8));
+            accumulators[2] = HashRound(accumulators[2], HashRead64(bytes + 16));
+            accumulators[3] = HashRound(accumulators[3], HashRead64(bytes + 24));
+            bytes += 32;
+        }
+
+        hash = HashRotate(accumulators[0], 1) + HashRotate(accumulators[1], 7) + HashRotate(accumulators[2], 12) +
+               HashRotate(accumulators[3], 18);
+        hash = HashMerge(hash, accumulators[0]);
+        hash = HashMerge(hash, accumulators[1]);
+        hash = HashMerge(hash, accumulators[2]);
+        hash = HashMerge(hash, accumulators[3]);
+    } else
+    {
+        hash = seed + HASH_PRIME64_5;
+    }
+
+    hash += length;
+
+    while(end - bytes >= 8)
+    {
+        hash ^= HashRound(0, HashRead64(bytes));
+        hash = HashRotate(hash, 27) * HASH_PRIME64_1 + HASH_PRIME64_4;
+        bytes += 8;
+    }
+
+    if(end - bytes >= 4)
+    {
+        uint32_t word;
+        memcpy(&word, bytes, sizeof word);
+        hash ^= word * HASH_PRIME64_1;
+        hash = HashRotate(hash, 23) * HASH_PRIME64_2 + HASH_PRIME64_3;
+        bytes += 4;
+    }
+
+    while(bytes < end)
+    {
+        hash ^= *bytes * HASH_PRIME64_5;
+        hash = HashRotate(hash, 11) * HASH_PRIME64_1;
+        bytes++;
+    }
+
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+
+/* Changes with the format and whenever the token kinds are renumbered */
+static uint64_t TokenFormatStamp(void)
+{
+    uint32_t shape[] = { TOKEN_CACHE_VERSION, TOKEN_EOF, EXPRESSION_KIND_COUNT, sizeof(ExpressionNode) };
+    uint64_t stamp = HashBytes(shape, sizeof shape, 0);
+
+    int kind = 0;
+    while(kind <= TOKEN_EOF)
+    {
+        char const *name = token_string_table[kind] ? token_string_table[kind] : "";
+        stamp = HashBytes(name, strlen(name) + 1, stamp);
+        kind++;
+    }
+
+    return stamp;
+}
+
+/* The cache also changes with every build, whose lexer or parser may differ */
+static uint64_t TokenCacheStamp(void)
+{
+    static char const build[] = __DATE__ " " __TIME__;
+
+    return HashBytes(build, sizeof build - 1, TokenFormatStamp());
+}
+
+/* `length` is how much of the source the lexer sees, which ends at the first NUL */
+typedef struct
+{
+    uint64_t source_hash;
+    uint64_t source_length;
+} TokenCacheKey;
+
+TokenCacheKey TokenCacheKeyOf(char const *source, size_t length)
+{
+    TokenCacheKey key;
+    key.source_hash = HashBytes(source, length, TokenCacheStamp());
+    key.source_length = length;
+
+    return key;
+}
+
+#define TOKEN_FILE_SOURCE 1u // A token file (see below), with the source text after the names
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t stamp;
+    uint64_t source_hash;
+    uint64_t source_length;
+    uint64_t checksum; // Of everything after the header
+    uint32_t token_count;
+    uint32_t symbol_count;
+    uint32_t symbol_bytes;
+    uint32_t statement_count;
+    uint32_t node_count; // 0 when the entry has no tree
+    uint32_t number_count;
+    uint32_t branch_count;
+    uint32_t flags;
+} TokenCacheHeader;
+
+static void TokenCachePath(char *path, size_t size, char const *directory, TokenCacheKey const *key)
+{
+    snprintf(path, size, "%s/%016llx.tokens", directory, (unsigned long long)key->source_hash);
+}
+
+/* The identifiers of a token stream, numbered 1, 2, ... by first appearance */
+typedef struct
+{
+    uint32_t *numbering; // Indexed by Symbol, 0 for the ones the tokens do not use
+    Symbol *order; // Buffer, in numbering order
+    size_t bytes; // Of all their names
+} TokenSymbols;
+
+static TokenSymbols NumberTokenSymbols(TokenStream *tokens)
+{
+    Interner *interner = CurrentContext()->interner;
+    TokenSymbols symbols;
+    symbols.numbering = calloc((size_t)InternerCount(interner) + 1, sizeof *symbols.numbering);
+    Assert(symbols.numbering);
+    symbols.order = NULL;
+    symbols.bytes = 0;
+
+    int count = TokenStreamLength(tokens);
+    int i = 0;
+    while(i < count)
+    {
+        Symbol symbol = tokens->payloads[i];
+        if(tokens->kinds[i] == TOKEN_IDENTIFIER && !symbols.numbering[symbol])
+        {
+            BufferPush(symbols.order, symbol);
+            symbols.numbering[symbol] = (uint32_t)BufferLength(symbols.order);
+            symbols.bytes += (size_t)InternerLength(interner, symbol);
+        }
+        i++;
+    }
+
+    return symbols;
+}
+
+static void FreeTokenSymbols(TokenSymbols *symbols)
+{
+    free(symbols->numbering);
+    if(symbols->order)
+    {
+        BufferFree(symbols->order);
+    }
+}
+
+/* Writes a temporary file next to `path` and renames it into place, so nobody reading
+ * `path` at the same time sees half a file */
+static bool WriteFileReplacing(char const *path, char const *data, size_t size)
+{
+    char temporary[PATH_MAX];
+    if(snprintf(temporary, sizeof temporary, "%s.XXXXXX", path) >= (int)sizeof temporary)
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    int file_descriptor = mkstemp(temporary);
+    if(file_descriptor < 0)
+    {
+        return false;
+    }
+
+    /* mkstemp makes the file private to its owner; other users may share these */
+    fchmod(file_descriptor, 0644);
+    bool written = write(file_descriptor, data, size) == (ssize_t)size;
+    int saved_errno = errno;
+    close(file_descriptor);
+    if(!written || rename(temporary, path) != 0)
+    {
+        saved_errno = written ? errno : saved_errno;
+        unlink(temporary);
+        errno = saved_errno;
+        return false;
+    }
+
+    return true;
+}
+
+/* Where each section of a token file starts. Sections are 8-byte aligned. */
+typedef struct
+{
+    size_t kinds;
+    size_t offsets;
+    size_t payloads;
+    size_t symbol_lengths;
+    size_t symbol_bytes;
+    size_t source;
+    size_t size; // Of the whole file
+} TokenFileLayout;
+
+static size_t TokenFileAlign(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+/* The source length has to fit in 32 bits for the sizes to be right */
+static TokenFileLayout TokenFileLayoutOf(TokenCacheHeader const *header)
+{
+    TokenFileLayout layout;
+    size_t tokens = header->token_count;
+
+    layout.kinds = sizeof *header + sizeof(BufferHeader);
+    layout.offsets = TokenFileAlign(layout.kinds + tokens) + sizeof(BufferHeader);
+    layout.payloads = TokenFileAlign(layout.offsets + tokens * sizeof(uint32_t)) + sizeof(BufferHeader);
+    layout.symbol_lengths = TokenFileAlign(layout.payloads + tokens * sizeof(TokenPayload));
+    layout.symbol_bytes = TokenFileAlign(layout.symbol_lengths + (size_t)header->symbol_count * sizeof(uint32_t));
+    layout.source = TokenFileAlign(layout.symbol_bytes + header->symbol_bytes);
+    layout.size = TokenFileAlign(layout.source + header->source_length + 1);
+
+    return layout;
+}
+
+/* Maps the file at `path` and checks it is whole and written for `stamp`. Returns NULL
+ * with `reason` set when it is not. */
+static char *MapTokenFile(char const *path, uint64_t stamp, size_t *size, char const **reason)
+{
+    int file_descriptor = open(path, O_RDONLY);
+    if(file_descriptor < 0)
+    {
+        *reason = strerror(errno);
+        return NULL;
+    }
+
+    struct stat status;
+    if(fstat(file_descriptor, &status) != 0 || (size_t)status.st_size < sizeof(TokenCacheHeader))
+    {
+        close(file_descriptor);
+        *reason = "not a token file";
+        return NULL;
+    }
+
+    /* Private and writable, so identifiers can be renumbered without touching the file */
+    *size = (size_t)status.st_size;
+    char *file = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file_descriptor, 0);
+    close(file_descriptor);
+    if(file == MAP_FAILED)
+    {
+        *reason = strerror(errno);
+        return NULL;
+    }
+
+    TokenCacheHeader *header = (TokenCacheHeader *)file;
+    *reason = NULL;
+    if(header->magic != TOKEN_CACHE_MAGIC)
+    {
+        *reason = "not a token file";
+    } else if(header->version != TOKEN_CACHE_VERSION || header->stamp != stamp)
+    {
+        *reason = "written by a different version";
+    } else if(header->source_length > UINT32_MAX ||
+              ((header->flags & TOKEN_FILE_SOURCE) && TokenFileLayoutOf(header).size != *size))
+    {
+        *reason = "truncated";
+    } else if(header->checksum != HashBytes(file + sizeof *header, *size - sizeof *header, 0))
+    {
+        *reason = "checksum mismatch";
+    }
+
+    if(*reason)
+    {
+        munmap(file, *size);
+        return NULL;
+    }
+
+    return file;
+}
+
+typedef enum
+{
+    TOKEN_CACHE_MISS,
+    TOKEN_CACHE_TOKENS, // The entry has the tokens only
+    TOKEN_CACHE_TREE // And the tree
+} TokenCacheResult;
+
+/* Enough for any uint32_t */
+#define TOKEN_CACHE_VARINT_SIZE 5
+
+static inline uint8_t *PutVarint(uint8_t *out, uint32_t value)
+{
+    while(value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+
+    return out;
+}
+
+static inline uint32_t ZigZag(int value)
+{
+    return value < 0 ? ~((uint32_t)value << 1) : (uint32_t)value << 1;
+}
+
+static inline int UnZigZag(uint32_t value)
+{
+    return value & 1 ? -(int)(value >> 1) - 1 : (int)(value >> 1);
+}
+
+/* Builds the entry for `tokens`, with the tree of `statements` when `pool` is not NULL.
+ * The header comes filled in with the stamp, hash and length. */
+static char *EncodeTokenCache(TokenCacheHeader header, TokenStream *tokens, ExpressionPool *pool,
+                              ExpressionId *statements, size_t *size)
+{
+    Interner *interner = CurrentContext()->interner;
+    TokenSymbols symbols = NumberTokenSymbols(tokens);
+    int count = TokenStreamLength(tokens);
+
+    header.magic = TOKEN_CACHE_MAGIC;
+    header.version = TOKEN_CACHE_VERSION;
+    header.token_count = (uint32_t)count;
+    header.symbol_count = (uint32_t)BufferLength(symbols.order);
+    header.symbol_bytes = (uint32_t)symbols.bytes;
+    if(pool)
+    {
+        header.statement_count = (uint32_t)BufferLength(statements);
+        header.node_count = (uint32_t)BufferLength(pool->nodes);
+        header.number_count = (uint32_t)BufferLength(pool->numbers);
+        header.branch_count = (uint32_t)BufferLength(pool->branches);
+    }
+
+    /* Room for the longest encoding of everything; only what is written gets touched */
+    size_t capacity = sizeof header + (size_t)header.symbol_count * TOKEN_CACHE_VARINT_SIZE + symbols.bytes +
+                      (size_t)count * (1 + 2 * TOKEN_CACHE_VARINT_SIZE) +
+                      (size_t)header.node_count * (1 + TOKEN_CACHE_VARINT_SIZE);
+    char *file = malloc(capacity);
+    Assert(file);
+    uint8_t *out = (uint8_t *)file + sizeof header;
+
+    int i = 0;
+    while(i < BufferLength(symbols.order))
+    {
+        out = PutVarint(out, (uint32_t)InternerLength(interner, symbols.order[i]));
+        i++;
+    }
+
+    i = 0;
+    while(i < BufferLength(symbols.order))
+    {
+        int length = InternerLength(interner, symbols.order[i]);
+        memcpy(out, InternerString(interner, symbols.order[i]), length);
+        out += length;
+        i++;
+    }
+
+    /* Through locals, since the byte stores could otherwise change any of them */
+    uint8_t const *kinds = tokens->kinds;
+    uint32_t const *offsets = tokens->offsets;
+    TokenPayload const *payloads = tokens->payloads;
+    uint32_t const *numbering = symbols.numbering;
+    uint32_t previous_offset = 0;
+    i = 0;
+    while(i < count)
+    {
+        uint8_t kind = kinds[i];
+        *out++ = kind;
+        out = PutVarint(out, offsets[i] - previous_offset);
+        previous_offset = offsets[i];
+
+        if(kind == TOKEN_IDENTIFIER)
+        {
+            out = PutVarint(out, numbering[payloads[i]]);
+        } else if(kind == TOKEN_NUMBER || kind == TOKEN_STRING)
+        {
+            out = PutVarint(out, payloads[i]);
+        }
+        i++;
+    }
+
+    /* Operands are not written down, so they are checked to be what a postfix reader
+     * will take them for. A pool where they are not, which the parser never builds, is
+     * stored without its tree. */
+    if(pool)
+    {
+        uint8_t *tree = out;
+        ExpressionNode const *nodes = pool->nodes;
+        int const *numbers = pool->numbers;
+        ExpressionId const *branches = pool->branches;
+        ExpressionId *stack = NULL; // Buffer, its length kept in top
+        int top = 0;
+        bool postfix = true;
+        uint32_t id = 1;
+        while(postfix && id < header.node_count)
+        {
+            ExpressionNode node = nodes[id];
+            *out++ = node.kind;
+            switch(node.kind)
+            {
+                case EXPRESSION_NUMBER:
+                    out = PutVarint(out, ZigZag(numbers[node.first]));
+                    break;
+                case EXPRESSION_IDENTIFIER:
+                    out = PutVarint(out, numbering[node.first]);
+                    break;
+                case EXPRESSION_UNARY:
+                    *out++ = node.operator;
+                    postfix = top >= 1 && stack[top - 1] == node.first;
+                    top -= 1;
+                    break;
+                case EXPRESSION_BINARY:
+                case EXPRESSION_ASSIGNMENT:
+                    *out++ = node.operator;
+                    postfix = top >= 2 && stack[top - 2] == node.first && stack[top - 1] == node.second;
+                    top -= 2;
+                    break;
+                case EXPRESSION_TERNARY:
+                    *out++ = node.operator;
+                    postfix = top >= 3 && stack[top - 3] == node.first && stack[top - 2] == branches[node.second] &&
+                              stack[top - 1] == branches[node.second + 1];
+                    top -= 3;
+                    break;
+                default:
+                    postfix = false;
+                    break;
+            }
+
+            if(top == BufferCapacity(stack))
+            {
+                BufferReallocate((void **)&stack, sizeof *stack, top ? top * 2 : 64);
+            }
+            stack[top++] = id;
+            id++;
+        }
+
+        /* What is left are the statements */
+        postfix &= top == (int)header.statement_count &&
+                   (top == 0 || memcmp(stack, statements, top * sizeof *stack) == 0);
+        if(!postfix)
+        {
+            out = tree;
+            header.statement_count = 0;
+            header.node_count = 0;
+            header.number_count = 0;
+            header.branch_count = 0;
+        }
+        if(stack)
+        {
+            BufferFree(stack);
+        }
+    }
+
+    *size = (size_t)(out - (uint8_t *)file);
+    header.checksum = HashBytes(file + sizeof header, *size - sizeof header, 0);
+    memcpy(file, &header, sizeof header);
+    FreeTokenSymbols(&symbols);
+
+    return file;
+}
+
+/* Reads an entry front to back. `failed` is set once it runs past the end or reads a
+ * varint longer than five bytes. */
+typedef struct
+{
+    uint8_t const *cursor;
+    uint8_t const *end;
+    bool failed;
+} TokenCacheReader;
+
+static inline uint8_t ReadCacheByte(TokenCacheReader *reader)
+{
+    if(reader->cursor < reader->end)
+    {
+        return *reader->cursor++;
+    }
+
+    reader->failed = true;
+    return 0;
+}
+
+static uint32_t ReadCacheLongVarint(TokenCacheReader *reader)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    while(reader->cursor < reader->end && shift < 7 * TOKEN_CACHE_VARINT_SIZE)
+    {
+        uint8_t byte = *reader->cursor++;
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if(byte < 0x80)
+        {
+            return value;
+        }
+        shift += 7;
+    }
+
+    reader->failed = true;
+    return 0;
+}
+
+/* Most varints are a single byte */
+static inline uint32_t ReadCacheVarint(TokenCacheReader *reader)
+{
+    if(reader->cursor < reader->end && *reader->cursor < 0x80)
+    {
+        return *reader->cursor++;
+    }
+
+    return ReadCacheLongVarint(reader);
+}
+
+/* A Buffer with room for `count` items, or NULL for none */
+static void *TokenCacheReserve(uint32_t count, int item_size)
+{
+    void *buffer = NULL;
+    if(count)
+    {
+        BufferReallocate(&buffer, item_size, (int)count);
+    }
+
+    return buffer;
+}
+
+/* Builds the tokens, and the tree when `pool` is not NULL and the entry has one, back up
+ * from a mapped entry whose checksum matched. `source` is the text the tokens were
+ * lexed from. Returns TOKEN_CACHE_MISS with nothing allocated when anything in the
+ * entry is out of bounds. */
+static TokenCacheResult DecodeTokenCache(char const *file, size_t size, char const *source, TokenStream *tokens,
+                                         ExpressionPool *pool, ExpressionId **statements)
+{
+    TokenCacheHeader const *header = (TokenCacheHeader const *)file;
+    TokenCacheReader reader;
+    reader.cursor = (uint8_t const *)file + sizeof *header;
+    reader.end = (uint8_t const *)file + size;
+    reader.failed = false;
+
+    /* Every token takes two bytes at least, and every name and node one, so counts bigger
+     * than that are lies that must not size an allocation */
+    size_t body = size - sizeof *header;
+    if(header->token_count == 0 || header->token_count > body / 2 || header->symbol_count > body ||
+       header->node_count > body || header->statement_count > header->node_count ||
+       header->number_count > header->node_count ||
+       header->branch_count > 2 * (size_t)header->node_count)
+    {
+        return TOKEN_CACHE_MISS;
+    }
+
+    /* Intern the names in the order they were numbered in */
+    Interner *interner = CurrentContext()->interner;
+    uint32_t symbol_count = header->symbol_count;
+    uint32_t *lengths = malloc(((size_t)symbol_count + 1) * sizeof *lengths);
+    Symbol *symbols = malloc(((size_t)symbol_count + 1) * sizeof *symbols);
+    Assert(lengths && symbols);
+    symbols[0] = 0;
+    uint64_t symbol_bytes = 0;
+    uint32_t i = 0;
+    while(i < symbol_count)
+    {
+        lengths[i] = ReadCacheVarint(&reader);
+        symbol_bytes += lengths[i];
+        i++;
+    }
+
+    bool valid = !reader.failed && symbol_bytes == header->symbol_bytes &&
+                 symbol_bytes <= (uint64_t)(reader.end - reader.cursor);
+    i = 0;
+    while(valid && i < symbol_count)
+    {
+        if(lengths[i] == 0 || lengths[i] > INT_MAX)
+        {
+            valid = false;
+            break;
+        }
+        symbols[i + 1] = InternString(interner, (char const *)reader.cursor, (int)lengths[i]);
+        reader.cursor += lengths[i];
+        i++;
+    }
+    free(lengths);
+
+    *tokens = CreateTokenStream(source);
+    uint32_t count = header->token_count;
+    uint64_t source_length = header->source_length;
+    if(valid)
+    {
+        tokens->kinds = TokenCacheReserve(count, sizeof *tokens->kinds);
+        tokens->offsets = TokenCacheReserve(count, sizeof *tokens->offsets);
+        tokens->payloads = TokenCacheReserve(count, sizeof *tokens->payloads);
+    }
+
+    /* Through locals, since stores to the kinds could otherwise change any of them */
+    uint8_t *kinds = tokens->kinds;
+    uint32_t *offsets = tokens->offsets;
+    TokenPayload *payloads = tokens->payloads;
+    uint64_t offset = 0;
+    uint8_t kind = 0;
+    i = 0;
+    while(valid && i < count)
+    {
+        kind = ReadCacheByte(&reader);
+        offset += ReadCacheVarint(&reader);
+        TokenPayload payload = 0;
+        if(kind == TOKEN_IDENTIFIER)
+        {
+            uint32_t number = ReadCacheVarint(&reader);
+            valid = number >= 1 && number <= symbol_count;
+            payload = valid ? symbols[number] : 0;
+        } else if(kind == TOKEN_NUMBER || kind == TOKEN_STRING)
+        {
+            payload = ReadCacheVarint(&reader);
+            valid = kind == TOKEN_NUMBER || offset + 1 + payload <= source_length;
+        }
+
+        valid &= !reader.failed && kind <= TOKEN_EOF && offset <= source_length;
+        kinds[i] = kind;
+        offsets[i] = (uint32_t)offset;
+        payloads[i] = payload;
+        i++;
+    }
+
+    valid &= kind == TOKEN_EOF && offset == source_length;
+    if(valid)
+    {
+        BufferHeaderGet(tokens->kinds)->length = (int)count;
+        BufferHeaderGet(tokens->offsets)->length = (int)count;
+        BufferHeaderGet(tokens->payloads)->length = (int)count;
+    }
+
+    TokenCacheResult result = TOKEN_CACHE_TOKENS;
+    if(valid && pool && header->node_count)
+    {
+        uint32_t node_count = header->node_count;
+        *pool = CreateExpressionPool();
+        BufferReallocate((void **)&pool->nodes, sizeof *pool->nodes, (int)node_count);
+        pool->numbers = TokenCacheReserve(header->number_count, sizeof *pool->numbers);
+        pool->branches = TokenCacheReserve(header->branch_count, sizeof *pool->branches);
+        ExpressionId *stack = TokenCacheReserve(header->statement_count + 64, sizeof *stack);
+        int top = 0;
+
+        /* Filled in place, with the counts checked against the header as they grow */
+        ExpressionNode *nodes = pool->nodes;
+        int *numbers = pool->numbers;
+        ExpressionId *branches = pool->branches;
+        uint32_t number_count = 0;
+        uint32_t branch_count = 0;
+        size_t node_counts[EXPRESSION_KIND_COUNT] = { 0 };
+        ExpressionId id = 1;
+        while(valid && id < node_count)
+        {
+            ExpressionNode node;
+            memset(&node, 0, sizeof node);
+            node.kind = ReadCacheByte(&reader);
+            switch(node.kind)
+            {
+                case EXPRESSION_NUMBER:
+                    valid = number_count < header->number_count;
+                    node.first = number_count;
+                    if(valid)
+                    {
+                        numbers[number_count++] = UnZigZag(ReadCacheVarint(&reader));
+                    }
+                    break;
+                case EXPRESSION_IDENTIFIER:
+                {
+                    uint32_t number = ReadCacheVarint(&reader);
+                    valid = number >= 1 && number <= symbol_count;
+                    node.first = valid ? symbols[number] : 0;
+                    break;
+                }
+                case EXPRESSION_UNARY:
+                    node.operator = ReadCacheByte(&reader);
+                    valid = node.operator <= TOKEN_EOF && top >= 1;
+                    if(valid)
+                    {
+                        node.first = stack[top - 1];
+                        top -= 1;
+                    }
+                    break;
+                case EXPRESSION_BINARY:
+                case EXPRESSION_ASSIGNMENT:
+                    node.operator = ReadCacheByte(&reader);
+                    valid = node.operator <= TOKEN_EOF && top >= 2;
+                    if(valid)
+                    {
+                        node.first = stack[top - 2];
+                        node.second = stack[top - 1];
+                        top -= 2;
+                    }
+                    break;
+                case EXPRESSION_TERNARY:
+                    node.operator = ReadCacheByte(&reader);
+                    valid = node.operator <= TOKEN_EOF && top >= 3 && branch_count + 2 <= header->branch_count;
+                    if(valid)
+                    {
+                        node.first = stack[top - 3];
+                        node.second = branch_count;
+                        branches[branch_count++] = stack[top - 2];
+                        branches[branch_count++] = stack[top - 1];
+                        top -= 3;
+                    }
+                    break;
+                default:
+                    valid = false;
+                    break;
+            }
+
+            valid &= !reader.failed;
+            nodes[id] = node;
+            node_counts[valid ? node.kind : EXPRESSION_NONE]++;
+
+            if(top == BufferCapacity(stack))
+            {
+                BufferReallocate((void **)&stack, sizeof *stack, top * 2);
+            }
+            stack[top++] = id;
+            id++;
+        }
+
+        /* What is left on the stack are the statements */
+        *statements = stack;
+        valid &= top == (int)header->statement_count;
+        valid &= number_count == header->number_count && branch_count == header->branch_count &&
+                 reader.cursor == reader.end;
+        if(valid)
+        {
+            BufferHeaderGet(pool->nodes)->length = (int)node_count;
+            if(numbers)
+            {
+                BufferHeaderGet(numbers)->length = (int)number_count;
+            }
+            if(branches)
+            {
+                BufferHeaderGet(branches)->length = (int)branch_count;
+            }
+            BufferHeaderGet(stack)->length = top;
+            memcpy(pool->node_counts, node_counts, sizeof node_counts);
+        } else
+        {
+            FreeExpressionPool(pool);
+            BufferFree(stack);
+            *statements = NULL;
+        }
+        result = TOKEN_CACHE_TREE;
+    }
+
+    free(symbols);
+    if(!valid)
+    {
+        FreeTokenStream(tokens);
+        return TOKEN_CACHE_MISS;
+    }
+
+    return result;
+}
+
+/* Loads the tokens in the entry for `source`, and fills `pool` and `statements` with
+ * its tree when `pool` is not NULL and the entry has one */
+TokenCacheResult TokenCacheLoad(char const *directory, TokenCacheKey const *key, char const *source,
+                                TokenStream *tokens, ExpressionPool *pool, ExpressionId **statements)
+{
+    char path[PATH_MAX];
+    TokenCachePath(path, sizeof path, directory, key);
+    size_t size;
+    char const *reason;
+    char *file = MapTokenFile(path, TokenCacheStamp(), &size, &reason);
+    if(!file)
+    {
+        return TOKEN_CACHE_MISS;
+    }
+
+    TokenCacheResult result = TOKEN_CACHE_MISS;
+    TokenCacheHeader *header = (TokenCacheHeader *)file;
+    if(header->source_hash == key->source_hash && header->source_length == key->source_length &&
+       !(header->flags & TOKEN_FILE_SOURCE))
+    {
+        madvise(file, size, MADV_SEQUENTIAL);
+        result = DecodeTokenCache(file, size, source, tokens, pool, statements);
+    }
+
+    munmap(file, size);
+
+    return result;
+}
+
+/* Writes the entry for `tokens` and, when `pool` is not NULL, the tree of `statements`.
+ * The cache is only ever an optimization, so failing to write it is not an error. */
+void TokenCacheStore(char const *directory, TokenCacheKey const *key, TokenStream *tokens, ExpressionPool *pool,
+                     ExpressionId *statements)
+{
+    TokenCacheHeader header;
+    memset(&header, 0, sizeof header);
+    header.stamp = TokenCacheStamp();
+    header.source_hash = key->source_hash;
+    header.source_length = key->source_length;
+
+    size_t size;
+    char *file = EncodeTokenCache(header, tokens, pool, statements, &size);
+    char path[PATH_MAX];
+    TokenCachePath(path, sizeof path, directory, key);
+    mkdir(directory, 0777);
+    WriteFileReplacing(path, file, size);
+    free(file);
+}
+
+/* Token files
+ *
+ * --emit-tokens writes the tokens of every file it lexes to the file's name with
+ * .tokens added, and --load-tokens compiles such files in place of sources. A token
+ * file has a cache entry's header, but holds the token arrays just as they are in
+ * memory, each with a BufferHeader in front, so the TokenStream points straight into
+ * the mapping. The names follow as 32-bit lengths and then their bytes, and then the
+ * source text. It holds no pointers, so it works wherever it is mapped, and its stamp
+ * only changes with the format and the token kinds, so it outlives the build that
+ * wrote it.
+ *
+ * Identifiers are numbered like in a cache entry. Loading interns the names in that
+ * order, and when the interner was empty the payloads are used as they are. Otherwise
+ * they are renumbered in place, in the mapping's private copy of the page.
+ *
+ * Anyone can hand over a token file, so besides the checksum every token is checked
+ * to stay inside the file before it is used. */
+
+/* Builds the token file for `tokens`. The header comes filled in with everything but
+ * the counts and the checksum. */
+static char *SerializeTokenFile(TokenCacheHeader header, TokenStream *tokens, size_t *size)
+{
+    Interner *interner = CurrentContext()->interner;
+    TokenSymbols symbols = NumberTokenSymbols(tokens);
+    int count = TokenStreamLength(tokens);
+
+    header.magic = TOKEN_CACHE_MAGIC;
+    header.version = TOKEN_CACHE_VERSION;
+    header.token_count = (uint32_t)count;
+    header.symbol_count = (uint32_t)BufferLength(symbols.order);
+    header.symbol_bytes = (uint32_t)symbols.bytes;
+
+    TokenFileLayout layout = TokenFileLayoutOf(&header);
+    char *file = calloc(1, layout.size);
+    Assert(file);
+
+    BufferHeader array = { count, count };
+    memcpy(file + layout.kinds - sizeof array, &array, sizeof array);
+    memcpy(file + layout.offsets - sizeof array, &array, sizeof array);
+    memcpy(file + layout.payloads - sizeof array, &array, sizeof array);
+    memcpy(file + layout.kinds, tokens->kinds, (size_t)count);
+    memcpy(file + layout.offsets, tokens->offsets, (size_t)count * sizeof *tokens->offsets);
+
+    TokenPayload *payloads = (TokenPayload *)(file + layout.payloads);
+    int i = 0;
+    while(i < count)
+    {
+        TokenPayload payload = tokens->payloads[i];
+        payloads[i] = tokens->kinds[i] == TOKEN_IDENTIFIER ? symbols.numbering[payload] : payload;
+        i++;
+    }
+
+    uint32_t *lengths = (uint32_t *)(file + layout.symbol_lengths);
+    char *name = file + layout.symbol_bytes;
+    i = 0;
+    while(i < BufferLength(symbols.order))
+    {
+        lengths[i] = (uint32_t)InternerLength(interner, symbols.order[i]);
+        memcpy(name, InternerString(interner, symbols.order[i]), lengths[i]);
+        name += lengths[i];
+        i++;
+    }
+
+    /* Followed by the 0 calloc left there */
+    memcpy(file + layout.source, tokens->source, header.source_length);
+
+    header.checksum = HashBytes(file + sizeof header, layout.size - sizeof header, 0);
+    memcpy(file, &header, sizeof header);
+    FreeTokenSymbols(&symbols);
+
+    *size = layout.size;
+
+    return file;
+}
+
+/* Everything the loader reads has to be in bounds: a token file may come from anywhere */
+static bool TokensValid(TokenCacheHeader const *header, char const *file, TokenFileLayout const *layout)
+{
+    uint8_t const *kinds = (uint8_t const *)(file + layout->kinds);
+    uint32_t const *offsets = (uint32_t const *)(file + layout->offsets);
+    TokenPayload const *payloads = (TokenPayload const *)(file + layout->payloads);
+    uint32_t count = header->token_count;
+
+    BufferHeader array = { (int)count, (int)count };
+    if(count == 0 || count > INT_MAX || kinds[count - 1] != TOKEN_EOF ||
+       offsets[count - 1] != header->source_length ||
+       memcmp(file + layout->kinds - sizeof array, &array, sizeof array) != 0 ||
+       memcmp(file + layout->offsets - sizeof array, &array, sizeof array) != 0 ||
+       memcmp(file + layout->payloads - sizeof array, &array, sizeof array) != 0)
+    {
+        return false;
+    }
+
+    uint32_t i = 0;
+    while(i < count)
+    {
+        bool valid = kinds[i] <= TOKEN_EOF && offsets[i] <= offsets[count - 1] && (i == 0 || offsets[i - 1] <= offsets[i]);
+        if(kinds[i] == TOKEN_IDENTIFIER)
+        {
+            valid &= payloads[i] >= 1 && payloads[i] <= header->symbol_count;
+        } else if(kinds[i] == TOKEN_STRING)
+        {
+            valid &= (uint64_t)offsets[i] + 1 + payloads[i] <= header->source_length;
+        }
+
+        if(!valid)
+        {
+            return false;
+        }
+        i++;
+    }
+
+    uint32_t const *lengths = (uint32_t const *)(file + layout->symbol_lengths);
+    uint64_t symbol_bytes = 0;
+    i = 0;
+    while(i < header->symbol_count)
+    {
+        symbol_bytes += lengths[i];
+        i++;
+    }
+
+    return symbol_bytes == header->symbol_bytes;
+}
+
+/* Writes `tokens` to `path`. The source they were lexed from ends where the end of
+ * file token is, which is before the end of the file when the file has a NUL in it. */
+bool EmitTokenFile(char const *path, TokenStream *tokens)
+{
+    uint32_t source_length = tokens->offsets[TokenStreamLength(tokens) - 1];
+    TokenCacheHeader header;
+    memset(&header, 0, sizeof header);
+    header.stamp = TokenFormatStamp();
+    header.source_hash = HashBytes(tokens->source, source_length, 0);
+    header.source_length = source_length;
+    header.flags = TOKEN_FILE_SOURCE;
+
+    size_t size;
+    char *file = SerializeTokenFile(header, tokens, &size);
+    bool written = WriteFileReplacing(path, file, size);
+    free(file);
+
+    if(!written)
+    {
+        ReportError("%s: could not write tokens: %s\n", path, strerror(errno));
+    }
+
+    return written;
+}
+
+/* Points `tokens` into the token file at `path`, whose source it refers to. The
+ * stream unmaps the file when it is freed. */
+bool LoadTokenFile(char const *path, TokenStream *tokens)
+{
+    size_t size;
+    char const *reason;
+    char *file = MapTokenFile(path, TokenFormatStamp(), &size, &reason);
+    TokenCacheHeader *header = (TokenCacheHeader *)file;
+    if(file && !(header->flags & TOKEN_FILE_SOURCE))
+    {
+        reason = "a cache entry, not a token file";
+    } else if(file)
+    {
+        TokenFileLayout layout = TokenFileLayoutOf(header);
+        reason = TokensValid(header, file, &layout) ? NULL : "corrupt";
+    }
+
+    if(reason)
+    {
+        if(file)
+        {
+            munmap(file, size);
+        }
+        ReportError("%s: could not load tokens: %s\n", path, reason);
+        return false;
+    }
+
+    TokenFileLayout layout = TokenFileLayoutOf(header);
+
+    /* Intern the names in the order they were numbered in */
+    Interner *interner = CurrentContext()->interner;
+    uint32_t *lengths = (uint32_t *)(file + layout.symbol_lengths);
+    char const *name = file + layout.symbol_bytes;
+    Symbol *symbols = malloc(((size_t)header->symbol_count + 1) * sizeof *symbols);
+    Assert(symbols);
+    symbols[0] = 0;
+    bool renumber = false;
+    uint32_t i = 0;
+    while(i < header->symbol_count)
+    {
+        symbols[i + 1] = InternString(interner, name, (int)lengths[i]);
+        renumber |= symbols[i + 1] != i + 1;
+        name += lengths[i];
+        i++;
+    }
+
+    *tokens = CreateTokenStream(file + layout.source);
+    tokens->kinds = (uint8_t *)(file + layout.kinds);
+    tokens->offsets = (uint32_t *)(file + layout.offsets);
+    tokens->payloads = (TokenPayload *)(file + layout.payloads);
+    tokens->mapping = file;
+    tokens->mapping_length = size;
+
+    i = 0;
+    while(renumber && i < header->token_count)
+    {
+        if(tokens->kinds[i] == TOKEN_IDENTIFIER)
+        {
+            tokens->payloads[i] = symbols[tokens->payloads[i]];
+        }
+        i++;
+    }
+
+    free(symbols);
+
+    return true;
+}
@@ -0,0 +1,259 @@
+/* Compact token storage
+ *
+ * A TokenStream holds the same tokens as the Token array LexerRun returns, split into
+ * parallel arrays. The parser only looks at kinds while matching, so those are kept
+ * one byte each in their own array. Line and column are not stored; each token keeps
+ * the byte offset of its first character and TokenStreamLocate recovers the position
+ * from the source when a diagnostic needs it.
+ *
+ * A stream that RelexTokenStream edits keeps a gap of unused slots in its arrays at
+ * the last edit, so an edit only moves the tokens between it and the one before. The
+ * tokens after the gap have not had the length changes of the edits added to their
+ * offsets yet; `gap_shift` is what they are short by, and it is added in as the gap
+ * moves past them. Such a stream is read through TokenStreamKind, TokenStreamOffset
+ * and TokenStreamPayload, or its arrays are used after TokenStreamCloseGap; a stream
+ * nothing was edited in has no gap and its arrays can be read directly. */
+
+/* Per token payload: the number, the symbol, or for a string the length of its contents,
+ * which start just after the opening quote at the token's offset */
+typedef uint32_t TokenPayload;
+
+typedef struct
+{
+    int index;
+    ErrorKind error;
+} TokenError;
+
+typedef struct
+{
+    uint8_t *kinds; // Buffer
+    uint32_t *offsets; // Buffer
+    TokenPayload *payloads; // Buffer
+    TokenError *errors; // Buffer, sorted by index
+
+    char const *source;
+    uint32_t *line_starts; // Buffer, built by TokenStreamLocate as far as it has looked
+    uint32_t lines_scanned; // Every newline before this offset has its line in line_starts
+
+    int gap; // Index of the first unused slot
+    int gap_length;
+    uint32_t gap_shift; // Added to the stored offsets of the tokens after the gap
+
+    /* A cache entry the arrays point into instead of being Buffers of their own, so
+     * they must not grow (see token_cache.c) */
+    char *mapping;
+    size_t mapping_length;
+} TokenStream;
+
+TokenStream CreateTokenStream(char const *source)
+{
+    TokenStream stream;
+    memset(&stream, 0, sizeof stream);
+    stream.source = source;
+
+    return stream;
+}
+
+TokenPayload TokenPayloadOf(Token *token)
+{
+    switch(token->kind)
+    {
+        case TOKEN_NUMBER:
+            return token->number;
+        case TOKEN_IDENTIFIER:
+            return token->symbol;
+        case TOKEN_STRING:
+            return token->string.length;
+        default:
+            return 0;
+    }
+}
+
+void TokenStreamPush(TokenStream *stream, Token *token, uint32_t offset)
+{
+    uint8_t kind = (uint8_t)token->kind;
+    TokenPayload payload = TokenPayloadOf(token);
+
+    if(token->error != ERROR_NONE)
+    {
+        TokenError error;
+        error.index = BufferLength(stream->kinds);
+        error.error = token->error;
+        BufferPush(stream->errors, error);
+    }
+
+    BufferPush(stream->kinds, kind);
+    BufferPush(stream->offsets, offset);
+    BufferPush(stream->payloads, payload);
+}
+
+int TokenStreamLength(TokenStream *stream)
+{
+    return BufferLength(stream->kinds) - stream->gap_length;
+}
+
+/* Where token `index` is kept in the arrays */
+static inline int TokenStreamSlot(TokenStream *stream, int index)
+{
+    return index < stream->gap ? index : index + stream->gap_length;
+}
+
+TokenKind TokenStreamKind(TokenStream *stream, int index)
+{
+    return stream->kinds[TokenStreamSlot(stream, index)];
+}
+
+uint32_t TokenStreamOffset(TokenStream *stream, int index)
+{
+    if(index < stream->gap)
+    {
+        return stream->offsets[index];
+    }
+
+    return stream->offsets[index + stream->gap_length] + stream->gap_shift;
+}
+
+TokenPayload TokenStreamPayload(TokenStream *stream, int index)
+{
+    return stream->payloads[TokenStreamSlot(stream, index)];
+}
+
+/* Moves the gap to just before token `index`, which costs as much as the number of
+ * tokens it moves past */
+void TokenStreamMoveGap(TokenStream *stream, int index)
+{
+    int gap = stream->gap;
+    int gap_length = stream->gap_length;
+    uint32_t shift = stream->gap_shift;
+    uint32_t *offsets = stream->offsets;
+    if(index < gap)
+    {
+        /* Tokens [index, gap) go after the gap and fall behind by the shift */
+        int count = gap - index;
+        if(gap_length)
+        {
+            memmove(stream->kinds + index + gap_length, stream->kinds + index, count * sizeof *stream->kinds);
+            memmove(stream->payloads + index + gap_length, stream->payloads + index,
+                    count * sizeof *stream->payloads);
+        }
+
+        int i = count - 1;
+        while(i >= 0)
+        {
+            offsets[index + gap_length + i] = offsets[index + i] - shift;
+            i--;
+        }
+    } else if(index > gap)
+    {
+        /* Tokens [gap, index) come out from after the gap with the shift added */
+        int count = index - gap;
+        if(gap_length)
+        {
+            memmove(stream->kinds + gap, stream->kinds + gap + gap_length, count * sizeof *stream->kinds);
+            memmove(stream->payloads + gap, stream->payloads + gap + gap_length, count * sizeof *stream->payloads);
+        }
+
+        int i = 0;
+        while(i < count)
+        {
+            offsets[gap + i] = offsets[gap + gap_length + i] + shift;
+            i++;
+        }
+    }
+
+    stream->gap = index;
+}
+
+/* Makes the arrays hold exactly the tokens, in order */
+void TokenStreamCloseGap(TokenStream *stream)
+{
+    int length = TokenStreamLength(stream);
+    TokenStreamMoveGap(stream, length);
+    if(stream->gap_length)
+    {
+        BufferHeaderGet(stream->kinds)->length = length;
+        BufferHeaderGet(stream->offsets)->length = length;
+        BufferHeaderGet(stream->payloads)->length = length;
+    }
+
+    stream->gap = 0;
+    stream->gap_length = 0;
+    stream->gap_shift = 0;
+}
+
+ErrorKind TokenStreamError(TokenStream *stream, int index)
+{
+    int i = 0;
+    while(i < BufferLength(stream->errors))
+    {
+        if(stream->errors[i].index == index)
+        {
+            return stream->errors[i].error;
+        }
+
+        i++;
+    }
+
+    return ERROR_NONE;
+}
+
+/* Turns the offset of token `index` into a 1-based line and column */
+void TokenStreamLocate(TokenStream *stream, int index, int *line, int *column)
+{
+    if(!stream->line_starts)
+    {
+        uint32_t line_start = 0;
+        BufferPush(stream->line_starts, line_start);
+        stream->lines_scanned = 0;
+    }
+
+    /* Lines are found as far as a diagnostic needs them */
+    uint32_t offset = TokenStreamOffset(stream, index);
+    if(offset > stream->lines_scanned)
+    {
+        char const *cursor = stream->source + stream->lines_scanned;
+        char const *end = stream->source + offset;
+        while((cursor = memchr(cursor, '\n', end - cursor)) != NULL)
+        {
+            cursor++;
+            uint32_t line_start = (uint32_t)(cursor - stream->source);
+            BufferPush(stream->line_starts, line_start);
+        }
+        stream->lines_scanned = offset;
+    }
+
+    /* Last line starting at or before offset */
+    int low = 0;
+    int high = BufferLength(stream->line_starts) - 1;
+    while(low < high)
+    {
+        int middle = (low + high + 1) / 2;
+        if(stream->line_starts[middle] <= offset)
+        {
+            low = middle;
+        } else
+        {
+            high = middle - 1;
+        }
+    }
+
+    *line = low + 1;
+    *column = (int)(offset - stream->line_starts[low]) + 1;
+}
+
+void FreeTokenStream(TokenStream *stream)
+{
+    if(stream->mapping)
+    {
+        munmap(stream->mapping, stream->mapping_length);
+    } else
+    {
+        if(stream->kinds) BufferFree(stream->kinds);
+        if(stream->offsets) BufferFree(stream->offsets);
+        if(stream->payloads) BufferFree(stream->payloads);
+    }
+    if(stream->errors) BufferFree(stream->errors);
+    if(stream->line_starts) BufferFree(stream->line_starts);
+
+    memset(stream, 0, sizeof *stream);
+}
@@ -0,0 +1,662 @@
+/* Bytecode and virtual machine
+ *
+ * An expression tree is lowered once into a flat list of 32-bit stack machine
+ * instructions, which the VM can then run any number of times against different
+ * variable values. Each instruction keeps its opcode in the low 8 bits and a signed
+ * 24-bit operand above it: an immediate number, a variable slot, an index into the
+ * constant table, or an absolute jump target.
+ *
+ * Identifiers become variable slots, numbered in the order they first appear;
+ * bytecode.variables maps each slot back to its Symbol. The caller passes the values
+ * in an array with one int per slot, and assignments write back into it.
+ *
+ * Bytecode lowered from the IR also keeps values in temporaries, numbered slots at
+ * the bottom of the stack below the values being computed with. The tree compiler
+ * never needs them.
+ *
+ * Arithmetic wraps around on overflow instead of being undefined, since a rule
+ * engine has to survive any input. Division by zero, INT_MIN / -1 and shifts by a
+ * negative amount or by 32 or more stop the program with a VmStatus.
+ *
+ * With GCC or Clang the VM jumps from one instruction's handler straight to the next
+ * through a table of label addresses (threaded dispatch). Everywhere else it falls
+ * back to a switch in a loop. */
+
+typedef enum
+{
+    OPCODE_RETURN,
+    OPCODE_IMMEDIATE, // Pushes the operand
+    OPCODE_CONSTANT, // Pushes constants[operand]
+    OPCODE_LOAD, // Pushes variables[operand]
+    OPCODE_STORE, // Stores the top into variables[operand] and leaves it there
+    OPCODE_POP,
+    OPCODE_LOAD_TEMPORARY, // Pushes temporary `operand`
+    OPCODE_STORE_TEMPORARY, // Pops the top into temporary `operand`
+    OPCODE_COPY_TEMPORARY, // Stores the top into temporary `operand` and leaves it there
+
+    OPCODE_NEGATE,
+    OPCODE_NOT,
+    OPCODE_BITWISE_NOT,
+    OPCODE_BOOLEAN, // Turns the top into 0 or 1
+
+    OPCODE_ADD,
+    OPCODE_SUBTRACT,
+    OPCODE_MULTIPLY,
+    OPCODE_DIVIDE,
+    OPCODE_MODULO,
+    OPCODE_SHIFT_LEFT,
+    OPCODE_SHIFT_RIGHT,
+    OPCODE_LESS,
+    OPCODE_GREATER,
+    OPCODE_LESS_EQUAL,
+    OPCODE_GREATER_EQUAL,
+    OPCODE_EQUAL,
+    OPCODE_NOT_EQUAL,
+    OPCODE_BITWISE_AND,
+    OPCODE_BITWISE_OR,
+    OPCODE_BITWISE_XOR,
+
+    OPCODE_JUMP,
+    OPCODE_JUMP_IF_ZERO, // Pops the condition
+    OPCODE_JUMP_IF_ZERO_OR_POP, // Keeps a zero condition on the stack when jumping
+    OPCODE_JUMP_IF_NOT_ZERO_OR_POP,
+
+    OPCODE_COUNT
+} Opcode;
+
+static char *opcode_string_table[] = {
+    [OPCODE_RETURN] = "return",
+    [OPCODE_IMMEDIATE] = "immediate",
+    [OPCODE_CONSTANT] = "constant",
+    [OPCODE_LOAD] = "load",
+    [OPCODE_STORE] = "store",
+    [OPCODE_POP] = "pop",
+    [OPCODE_LOAD_TEMPORARY] = "load_temporary",
+    [OPCODE_STORE_TEMPORARY] = "store_temporary",
+    [OPCODE_COPY_TEMPORARY] = "copy_temporary",
+    [OPCODE_NEGATE] = "negate",
+    [OPCODE_NOT] = "not",
+    [OPCODE_BITWISE_NOT] = "bitwise_not",
+    [OPCODE_BOOLEAN] = "boolean",
+    [OPCODE_ADD] = "add",
+    [OPCODE_SUBTRACT] = "subtract",
+    [OPCODE_MULTIPLY] = "multiply",
+    [OPCODE_DIVIDE] = "divide",
+    [OPCODE_MODULO] = "modulo",
+    [OPCODE_SHIFT_LEFT] = "shift_left",
+    [OPCODE_SHIFT_RIGHT] = "shift_right",
+    [OPCODE_LESS] = "less",
+    [OPCODE_GREATER] = "greater",
+    [OPCODE_LESS_EQUAL] = "less_equal",
+    [OPCODE_GREATER_EQUAL] = "greater_equal",
+    [OPCODE_EQUAL] = "equal",
+    [OPCODE_NOT_EQUAL] = "not_equal",
+    [OPCODE_BITWISE_AND] = "bitwise_and",
+    [OPCODE_BITWISE_OR] = "bitwise_or",
+    [OPCODE_BITWISE_XOR] = "bitwise_xor",
+    [OPCODE_JUMP] = "jump",
+    [OPCODE_JUMP_IF_ZERO] = "jump_if_zero",
+    [OPCODE_JUMP_IF_ZERO_OR_POP] = "jump_if_zero_or_pop",
+    [OPCODE_JUMP_IF_NOT_ZERO_OR_POP] = "jump_if_not_zero_or_pop"
+};
+
+/* How much each instruction grows the stack. Jumps that keep their condition are
+ * counted on the path that pops it; the kept value stands in for the operand that
+ * was skipped. */
+static int8_t const opcode_stack_effect_table[OPCODE_COUNT] = {
+    [OPCODE_RETURN] = -1,
+    [OPCODE_IMMEDIATE] = 1,
+    [OPCODE_CONSTANT] = 1,
+    [OPCODE_LOAD] = 1,
+    [OPCODE_STORE] = 0,
+    [OPCODE_POP] = -1,
+    [OPCODE_LOAD_TEMPORARY] = 1,
+    [OPCODE_STORE_TEMPORARY] = -1,
+    [OPCODE_COPY_TEMPORARY] = 0,
+    [OPCODE_NEGATE] = 0,
+    [OPCODE_NOT] = 0,
+    [OPCODE_BITWISE_NOT] = 0,
+    [OPCODE_BOOLEAN] = 0,
+    [OPCODE_ADD] = -1,
+    [OPCODE_SUBTRACT] = -1,
+    [OPCODE_MULTIPLY] = -1,
+    [OPCODE_DIVIDE] = -1,
+    [OPCODE_MODULO] = -1,
+    [OPCODE_SHIFT_LEFT] = -1,
+    [OPCODE_SHIFT_RIGHT] = -1,
+    [OPCODE_LESS] = -1,
+    [OPCODE_GREATER] = -1,
+    [OPCODE_LESS_EQUAL] = -1,
+    [OPCODE_GREATER_EQUAL] = -1,
+    [OPCODE_EQUAL] = -1,
+    [OPCODE_NOT_EQUAL] = -1,
+    [OPCODE_BITWISE_AND] = -1,
+    [OPCODE_BITWISE_OR] = -1,
+    [OPCODE_BITWISE_XOR] = -1,
+    [OPCODE_JUMP] = 0,
+    [OPCODE_JUMP_IF_ZERO] = -1,
+    [OPCODE_JUMP_IF_ZERO_OR_POP] = -1,
+    [OPCODE_JUMP_IF_NOT_ZERO_OR_POP] = -1
+};
+
+/* Binary operator tokens and the instruction computing them */
+static uint8_t const binary_opcode_table[TOKEN_EOF + 1] = {
+    [TOKEN_PLUS] = OPCODE_ADD,
+    [TOKEN_MINUS] = OPCODE_SUBTRACT,
+    [TOKEN_STAR] = OPCODE_MULTIPLY,
+    [TOKEN_SLASH] = OPCODE_DIVIDE,
+    [TOKEN_PERCENT] = OPCODE_MODULO,
+    [TOKEN_BITWISE_LEFT_SHIFT] = OPCODE_SHIFT_LEFT,
+    [TOKEN_BITWISE_RIGHT_SHIFT] = OPCODE_SHIFT_RIGHT,
+    [TOKEN_LESS_THAN] = OPCODE_LESS,
+    [TOKEN_GREATER_THAN] = OPCODE_GREATER,
+    [TOKEN_LESS_EQUAL] = OPCODE_LESS_EQUAL,
+    [TOKEN_GREATER_EQUAL] = OPCODE_GREATER_EQUAL,
+    [TOKEN_DOUBLE_EQUALS] = OPCODE_EQUAL,
+    [TOKEN_NOT_EQUAL] = OPCODE_NOT_EQUAL,
+    [TOKEN_BITWISE_AND] = OPCODE_BITWISE_AND,
+    [TOKEN_BITWISE_OR] = OPCODE_BITWISE_OR,
+    [TOKEN_BITWISE_XOR] = OPCODE_BITWISE_XOR,
+
+    /* Compound assignments compute with the same instructions */
+    [TOKEN_PLUS_ASSIGNMENT] = OPCODE_ADD,
+    [TOKEN_MINUS_ASSIGNMENT] = OPCODE_SUBTRACT,
+    [TOKEN_STAR_ASSIGNMENT] = OPCODE_MULTIPLY,
+    [TOKEN_SLASH_ASSIGNMENT] = OPCODE_DIVIDE,
+    [TOKEN_PERCENT_ASSIGNMENT] = OPCODE_MODULO,
+    [TOKEN_LEFT_SHIFT_ASSIGNMENT] = OPCODE_SHIFT_LEFT,
+    [TOKEN_RIGHT_SHIFT_ASSIGNMENT] = OPCODE_SHIFT_RIGHT,
+    [TOKEN_AND_ASSIGNMENT] = OPCODE_BITWISE_AND,
+    [TOKEN_OR_ASSIGNMENT] = OPCODE_BITWISE_OR,
+    [TOKEN_XOR_ASSIGNMENT] = OPCODE_BITWISE_XOR
+};
+
+#define BYTECODE_OPERAND_MIN (-(1 << 23))
+#define BYTECODE_OPERAND_MAX ((1 << 23) - 1)
+
+#define BytecodeOpcode(instruction) ((instruction) & 0xFF)
+#define BytecodeOperand(instruction) ((int32_t)(instruction) >> 8)
+
+typedef struct
+{
+    uint32_t *code; // Buffer of instructions
+    int *constants; // Buffer, numbers too big for an immediate
+    Symbol *variables; // Buffer, the Symbol of each variable slot
+    int max_stack; // Stack slots VmRun needs, temporaries included
+    int temporaries; // Slots at the bottom of the stack for values kept across instructions
+} Bytecode;
+
+typedef enum
+{
+    VM_OK,
+    VM_DIVISION_BY_ZERO,
+    VM_OVERFLOW,
+    VM_SHIFT_OUT_OF_RANGE
+} VmStatus;
+
+static char *vm_status_string_table[] = {
+    [VM_OK] = "ok",
+    [VM_DIVISION_BY_ZERO] = "division by zero",
+    [VM_OVERFLOW] = "integer overflow",
+    [VM_SHIFT_OUT_OF_RANGE] = "shift count out of range"
+};
+
+Bytecode CreateBytecode(void)
+{
+    Bytecode bytecode;
+    memset(&bytecode, 0, sizeof bytecode);
+
+    return bytecode;
+}
+
+void FreeBytecode(Bytecode *bytecode)
+{
+    if(bytecode->code) BufferFree(bytecode->code);
+    if(bytecode->constants) BufferFree(bytecode->constants);
+    if(bytecode->variables) BufferFree(bytecode->variables);
+    memset(bytecode, 0, sizeof *bytecode);
+}
+
+/* Slot of a variable in a Buffer of Symbols, giving it the next free one the first
+ * time. The bytecode, the IR and native code all number their variables this way. */
+int VariableSlot(Symbol **variables, Symbol symbol)
+{
+    Symbol *slots = *variables;
+    int slot = 0;
+    while(slot < BufferLength(slots))
+    {
+        if(slots[slot] == symbol)
+        {
+            return slot;
+        }
+
+        slot++;
+    }
+
+    BufferPush(slots, symbol);
+    *variables = slots;
+
+    return slot;
+}
+
+/* Whether the walker is about to go into the target of a plain assignment, which
+ * every backend skips since the assignment never reads it */
+bool IsUnreadAssignmentTarget(ExpressionWalker const *walker, ExpressionNode const *node)
+{
+    return node->kind == EXPRESSION_ASSIGNMENT && walker->operand == 0 && node->operator == TOKEN_EQUAL;
+}
+
+typedef struct
+{
+    Bytecode *bytecode;
+    int stack_depth;
+    int *patches; // Buffer, jumps waiting for their target
+} BytecodeCompiler;
+
+/* Appends an instruction and returns where it went */
+static int EmitInstruction(BytecodeCompiler *compiler, Opcode opcode, int operand)
+{
+    Bytecode *bytecode = compiler->bytecode;
+    Assert(operand >= BYTECODE_OPERAND_MIN && operand <= BYTECODE_OPERAND_MAX);
+
+    uint32_t instruction = (uint32_t)opcode | ((uint32_t)operand << 8);
+    BufferPush(bytecode->code, instruction);
+
+    compiler->stack_depth += opcode_stack_effect_table[opcode];
+    if(compiler->stack_depth > bytecode->max_stack)
+    {
+        bytecode->max_stack = compiler->stack_depth;
+    }
+
+    return BufferLength(bytecode->code) - 1;
+}
+
+static void EmitNumber(BytecodeCompiler *compiler, int number)
+{
+    if(number >= BYTECODE_OPERAND_MIN && number <= BYTECODE_OPERAND_MAX)
+    {
+        EmitInstruction(compiler, OPCODE_IMMEDIATE, number);
+    } else
+    {
+        BufferPush(compiler->bytecode->constants, number);
+        EmitInstruction(compiler, OPCODE_CONSTANT, BufferLength(compiler->bytecode->constants) - 1);
+    }
+}
+
+/* Emits a jump whose target is filled in later by PatchJump */
+static void EmitJump(BytecodeCompiler *compiler, Opcode opcode)
+{
+    int position = EmitInstruction(compiler, opcode, 0);
+    BufferPush(compiler->patches, position);
+}
+
+/* Points the jump at `position` to the next instruction */
+static void SetJumpTarget(Bytecode *bytecode, int position)
+{
+    uint32_t target = (uint32_t)BufferLength(bytecode->code);
+    bytecode->code[position] = BytecodeOpcode(bytecode->code[position]) | (target << 8);
+}
+
+/* Points the most recent unpatched jump at the next instruction */
+static void PatchJump(BytecodeCompiler *compiler)
+{
+    int position = compiler->patches[BufferLength(compiler->patches) - 1];
+    BufferHeaderGet(compiler->patches)->length--;
+    SetJumpTarget(compiler->bytecode, position);
+}
+
+/* Jump targets are operands, so code cannot grow past the largest one */
+static bool BytecodeFits(Bytecode *bytecode)
+{
+    if(BufferLength(bytecode->code) <= BYTECODE_OPERAND_MAX)
+    {
+        return true;
+    }
+
+    ReportError("bytecode has more than %d instructions\n", BYTECODE_OPERAND_MAX);
+
+    return false;
+}
+
+/* Lowers the tree at root into bytecode ending in OPCODE_RETURN. Only what the VM
+ * can compute is accepted; * and & on pointers and assignments to anything but a
+ * plain variable are reported and make it return false. */
+bool CompileBytecode(Bytecode *bytecode, ExpressionPool *pool, ExpressionId root)
+{
+    BytecodeCompiler compiler;
+    compiler.bytecode = bytecode;
+    compiler.stack_depth = 0;
+    compiler.patches = NULL;
+
+    bool ok = true;
+    ExpressionWalker walker = CreateExpressionWalker(pool, root);
+    ExpressionWalkEvent event;
+    ExpressionId id;
+
+    while(ok && ExpressionWalkerNext(&walker, &event, &id))
+    {
+        ExpressionNode *node = GetExpression(pool, id);
+
+        if(event == EXPRESSION_WALK_ENTER)
+        {
+            if(node->kind == EXPRESSION_NUMBER)
+            {
+                EmitNumber(&compiler, ExpressionNumber(pool, id));
+            } else if(node->kind == EXPRESSION_IDENTIFIER)
+            {
+                EmitInstruction(&compiler, OPCODE_LOAD, VariableSlot(&bytecode->variables, node->first));
+            } else if(node->kind == EXPRESSION_NONE)
+            {
+                ok = false;
+            } else if(node->kind == EXPRESSION_UNARY && (node->operator == TOKEN_STAR || node->operator == TOKEN_BITWISE_AND))
+            {
+                ReportError("bytecode has no pointers, %s is not supported\n", token_string_table[node->operator]);
+                ok = false;
+            } else if(node->kind == EXPRESSION_ASSIGNMENT && GetExpression(pool, node->first)->kind != EXPRESSION_IDENTIFIER)
+            {
+                ReportError("bytecode can only assign to variables\n");
+                ok = false;
+            }
+        } else if(event == EXPRESSION_WALK_OPERAND)
+        {
+            if(IsUnreadAssignmentTarget(&walker, node))
+            {
+                ExpressionWalkerSkipOperand(&walker);
+            } else if(node->kind == EXPRESSION_BINARY && walker.operand == 1 && node->operator == TOKEN_LOGICAL_AND)
+            {
+                EmitJump(&compiler, OPCODE_JUMP_IF_ZERO_OR_POP);
+            } else if(node->kind == EXPRESSION_BINARY && walker.operand == 1 && node->operator == TOKEN_LOGICAL_OR)
+            {
+                EmitJump(&compiler, OPCODE_JUMP_IF_NOT_ZERO_OR_POP);
+            } else if(node->kind == EXPRESSION_BINARY && walker.operand == 1 && node->operator == TOKEN_COMMA)
+            {
+                EmitInstruction(&compiler, OPCODE_POP, 0);
+            } else if(node->kind == EXPRESSION_TERNARY && walker.operand == 1)
+            {
+                EmitJump(&compiler, OPCODE_JUMP_IF_ZERO);
+            } else if(node->kind == EXPRESSION_TERNARY && walker.operand == 2)
+            {
+                /* The then branch jumps over the else branch, which starts here */
+                int *pending = &compiler.patches[BufferLength(compiler.patches) - 1];
+                int skip_then = *pending;
+                *pending = EmitInstruction(&compiler, OPCODE_JUMP, 0);
+                SetJumpTarget(bytecode, skip_then);
+
+                /* Only one branch runs, so the else branch starts as deep as the then branch did */
+                compiler.stack_depth--;
+            }
+        } else if(node->kind == EXPRESSION_UNARY)
+        {
+            if(node->operator == TOKEN_MINUS)
+            {
+                EmitInstruction(&compiler, OPCODE_NEGATE, 0);
+            } else if(node->operator == TOKEN_EXCLAMATION_POINT)
+            {
+                EmitInstruction(&compiler, OPCODE_NOT, 0);
+            } else if(node->operator == TOKEN_BITWISE_NOT)
+            {
+                EmitInstruction(&compiler, OPCODE_BITWISE_NOT, 0);
+            }
+        } else if(node->kind == EXPRESSION_BINARY)
+        {
+            if(node->operator == TOKEN_LOGICAL_AND || node->operator == TOKEN_LOGICAL_OR)
+            {
+                PatchJump(&compiler);
+                EmitInstruction(&compiler, OPCODE_BOOLEAN, 0);
+            } else if(node->operator != TOKEN_COMMA)
+            {
+                EmitInstruction(&compiler, binary_opcode_table[node->operator], 0);
+            }
+        } else if(node->kind == EXPRESSION_ASSIGNMENT)
+        {
+            if(node->operator != TOKEN_EQUAL)
+            {
+                EmitInstruction(&compiler, binary_opcode_table[node->operator], 0);
+            }
+
+            Symbol target = GetExpression(pool, node->first)->first;
+            EmitInstruction(&compiler, OPCODE_STORE, VariableSlot(&bytecode->variables, target));
+        } else if(node->kind == EXPRESSION_TERNARY)
+        {
+            PatchJump(&compiler);
+        }
+    }
+
+    if(ok)
+    {
+        EmitInstruction(&compiler, OPCODE_RETURN, 0);
+        ok = BytecodeFits(bytecode);
+    }
+
+    FreeExpressionWalker(&walker);
+    if(compiler.patches)
+    {
+        BufferFree(compiler.patches);
+    }
+
+    return ok;
+}
+
+void PrintBytecode(FILE *output, Bytecode *bytecode)
+{
+    int i = 0;
+    while(i < BufferLength(bytecode->code))
+    {
+        uint32_t instruction = bytecode->code[i];
+        fprintf(output, "%4d  %-24s %d\n", i, opcode_string_table[BytecodeOpcode(instruction)], BytecodeOperand(instruction));
+        i++;
+    }
+}
+
+#if defined(__GNUC__)
+#define VM_THREADED_DISPATCH 1
+
+/* Labels as values are a GNU extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#else
+#define VM_THREADED_DISPATCH 0
+#endif
+
+/* Runs bytecode against `variables`, one int per slot. `stack` needs room for
+ * bytecode->max_stack ints; giving each thread its own lets threads share bytecode. */
+VmStatus VmRun(Bytecode const *bytecode, int *variables, int *stack, int *result)
+{
+    uint32_t const *code = bytecode->code;
+    int const *constants = bytecode->constants;
+    uint32_t const *instruction_pointer = code;
+    int *top = stack + bytecode->temporaries - 1;
+    uint32_t instruction;
+    uint32_t left;
+
+#if VM_THREADED_DISPATCH
+    static void *const dispatch_table[OPCODE_COUNT] = {
+        [OPCODE_RETURN] = &&label_OPCODE_RETURN,
+        [OPCODE_IMMEDIATE] = &&label_OPCODE_IMMEDIATE,
+        [OPCODE_CONSTANT] = &&label_OPCODE_CONSTANT,
+        [OPCODE_LOAD] = &&label_OPCODE_LOAD,
+        [OPCODE_STORE] = &&label_OPCODE_STORE,
+        [OPCODE_POP] = &&label_OPCODE_POP,
+        [OPCODE_LOAD_TEMPORARY] = &&label_OPCODE_LOAD_TEMPORARY,
+        [OPCODE_STORE_TEMPORARY] = &&label_OPCODE_STORE_TEMPORARY,
+        [OPCODE_COPY_TEMPORARY] = &&label_OPCODE_COPY_TEMPORARY,
+        [OPCODE_NEGATE] = &&label_OPCODE_NEGATE,
+        [OPCODE_NOT] = &&label_OPCODE_NOT,
+        [OPCODE_BITWISE_NOT] = &&label_OPCODE_BITWISE_NOT,
+        [OPCODE_BOOLEAN] = &&label_OPCODE_BOOLEAN,
+        [OPCODE_ADD] = &&label_OPCODE_ADD,
+        [OPCODE_SUBTRACT] = &&label_OPCODE_SUBTRACT,
+        [OPCODE_MULTIPLY] = &&label_OPCODE_MULTIPLY,
+        [OPCODE_DIVIDE] = &&label_OPCODE_DIVIDE,
+        [OPCODE_MODULO] = &&label_OPCODE_MODULO,
+        [OPCODE_SHIFT_LEFT] = &&label_OPCODE_SHIFT_LEFT,
+        [OPCODE_SHIFT_RIGHT] = &&label_OPCODE_SHIFT_RIGHT,
+        [OPCODE_LESS] = &&label_OPCODE_LESS,
+        [OPCODE_GREATER] = &&label_OPCODE_GREATER,
+        [OPCODE_LESS_EQUAL] = &&label_OPCODE_LESS_EQUAL,
+        [OPCODE_GREATER_EQUAL] = &&label_OPCODE_GREATER_EQUAL,
+        [OPCODE_EQUAL] = &&label_OPCODE_EQUAL,
+        [OPCODE_NOT_EQUAL] = &&label_OPCODE_NOT_EQUAL,
+        [OPCODE_BITWISE_AND] = &&label_OPCODE_BITWISE_AND,
+        [OPCODE_BITWISE_OR] = &&label_OPCODE_BITWISE_OR,
+        [OPCODE_BITWISE_XOR] = &&label_OPCODE_BITWISE_XOR,
+        [OPCODE_JUMP] = &&label_OPCODE_JUMP,
+        [OPCODE_JUMP_IF_ZERO] = &&label_OPCODE_JUMP_IF_ZERO,
+        [OPCODE_JUMP_IF_ZERO_OR_POP] = &&label_OPCODE_JUMP_IF_ZERO_OR_POP,
+        [OPCODE_JUMP_IF_NOT_ZERO_OR_POP] = &&label_OPCODE_JUMP_IF_NOT_ZERO_OR_POP
+    };
+#define VM_CASE(opcode) label_##opcode:
+#define VM_NEXT() instruction = *instruction_pointer++; goto *dispatch_table[BytecodeOpcode(instruction)]
+    VM_NEXT();
+#else
+#define VM_CASE(opcode) case opcode:
+#define VM_NEXT() continue
+    for(;;)
+    {
+    instruction = *instruction_pointer++;
+    switch(BytecodeOpcode(instruction))
+    {
+#endif
+
+    VM_CASE(OPCODE_RETURN)
+        *result = *top;
+        return VM_OK;
+    VM_CASE(OPCODE_IMMEDIATE)
+        *++top = BytecodeOperand(instruction);
+        VM_NEXT();
+    VM_CASE(OPCODE_CONSTANT)
+        *++top = constants[BytecodeOperand(instruction)];
+        VM_NEXT();
+    VM_CASE(OPCODE_LOAD)
+        *++top = variables[BytecodeOperand(instruction)];
+        VM_NEXT();
+    VM_CASE(OPCODE_STORE)
+        variables[BytecodeOperand(instruction)] = *top;
+        VM_NEXT();
+    VM_CASE(OPCODE_POP)
+        top--;
+        VM_NEXT();
+    VM_CASE(OPCODE_LOAD_TEMPORARY)
+        *++top = stack[BytecodeOperand(instruction)];
+        VM_NEXT();
+    VM_CASE(OPCODE_STORE_TEMPORARY)
+        stack[BytecodeOperand(instruction)] = *top--;
+        VM_NEXT();
+    VM_CASE(OPCODE_COPY_TEMPORARY)
+        stack[BytecodeOperand(instruction)] = *top;
+        VM_NEXT();
+    VM_CASE(OPCODE_NEGATE)
+        *top = (int)(0u - (uint32_t)*top);
+        VM_NEXT();
+    VM_CASE(OPCODE_NOT)
+        *top = !*top;
+        VM_NEXT();
+    VM_CASE(OPCODE_BITWISE_NOT)
+        *top = ~*top;
+        VM_NEXT();
+    VM_CASE(OPCODE_BOOLEAN)
+        *top = *top != 0;
+        VM_NEXT();
+
+    /* Wrapping arithmetic goes through unsigned, where overflow is defined */
+    VM_CASE(OPCODE_ADD)
+        top--;
+        *top = (int)((uint32_t)top[0] + (uint32_t)top[1]);
+        VM_NEXT();
+    VM_CASE(OPCODE_SUBTRACT)
+        top--;
+        *top = (int)((uint32_t)top[0] - (uint32_t)top[1]);
+        VM_NEXT();
+    VM_CASE(OPCODE_MULTIPLY)
+        top--;
+        *top = (int)((uint32_t)top[0] * (uint32_t)top[1]);
+        VM_NEXT();
+    VM_CASE(OPCODE_DIVIDE)
+        top--;
+        if(top[1] == 0) return VM_DIVISION_BY_ZERO;
+        if(top[0] == INT_MIN && top[1] == -1) return VM_OVERFLOW;
+        *top = top[0] / top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_MODULO)
+        top--;
+        if(top[1] == 0) return VM_DIVISION_BY_ZERO;
+        if(top[0] == INT_MIN && top[1] == -1) return VM_OVERFLOW;
+        *top = top[0] % top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_SHIFT_LEFT)
+        top--;
+        if(top[1] < 0 || top[1] >= 32) return VM_SHIFT_OUT_OF_RANGE;
+        left = (uint32_t)top[0];
+        *top = (int)(left << top[1]);
+        VM_NEXT();
+    VM_CASE(OPCODE_SHIFT_RIGHT)
+        top--;
+        if(top[1] < 0 || top[1] >= 32) return VM_SHIFT_OUT_OF_RANGE;
+        *top = top[0] >> top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_LESS)
+        top--;
+        *top = top[0] < top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_GREATER)
+        top--;
+        *top = top[0] > top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_LESS_EQUAL)
+        top--;
+        *top = top[0] <= top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_GREATER_EQUAL)
+        top--;
+        *top = top[0] >= top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_EQUAL)
+        top--;
+        *top = top[0] == top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_NOT_EQUAL)
+        top--;
+        *top = top[0] != top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_BITWISE_AND)
+        top--;
+        *top = top[0] & top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_BITWISE_OR)
+        top--;
+        *top = top[0] | top[1];
+        VM_NEXT();
+    VM_CASE(OPCODE_BITWISE_XOR)
+        top--;
+        *top = top[0] ^ top[1];
+        VM_NEXT();
+
+    VM_CASE(OPCODE_JUMP)
+        instruction_pointer = code + BytecodeOperand(instruction);
+        VM_NEXT();
+    VM_CASE(OPCODE_JUMP_IF_ZERO)
+        if(*top-- == 0) instruction_pointer = code + BytecodeOperand(instruction);
+        VM_NEXT();
+    VM_CASE(OPCODE_JUMP_IF_ZERO_OR_POP)
+        if(*top == 0) instruction_pointer = code + BytecodeOperand(instruction);
+        else top--;
+        VM_NEXT();
+    VM_CASE(OPCODE_JUMP_IF_NOT_ZERO_OR_POP)
+        if(*top != 0) instruction_pointer = code + BytecodeOperand(instruction);
+        else top--;
+        VM_NEXT();
+
+#if !VM_THREADED_DISPATCH
+        default:
+            return VM_OK;
+    }
+    }
+#endif
+}
+
+#if VM_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+#undef VM_CASE
+#undef VM_NEXT
@@ -0,0 +1,710 @@
+/* x86-64 code generation
+ *
+ * CompileX86 turns an expression into a native function
+ *
+ *     int function(int *variables, int *status);
+ *
+ * Variables use the same slot numbering as the bytecode. The machine code can be
+ * loaded into executable memory and called directly (JitLoad). GNU as source for
+ * the same instructions can be produced alongside it. Every instruction is emitted
+ * through one function that appends both its encoding and, when asked, its AT&T
+ * text, so the two cannot drift apart. Semantics are the VM's: arithmetic wraps,
+ * and division by zero, INT_MIN / -1 and out-of-range shifts store a VmStatus
+ * through `status` and return 0.
+ *
+ * Registers are given out like a stack. The value at depth i of the expression
+ * stack lives in x86_stack_registers[i]; deeper values are pushed on the machine
+ * stack, which only ever holds the innermost ones, so they are popped back in order.
+ * eax, ecx and edx are scratch. They hold popped operands and what idiv, shifts and
+ * setcc need. rdi holds `variables` and rsi holds `status` throughout. */
+
+typedef enum
+{
+    X86_EAX,
+    X86_ECX,
+    X86_EDX,
+    X86_EBX,
+    X86_ESP,
+    X86_EBP,
+    X86_ESI,
+    X86_EDI,
+    X86_R8D,
+    X86_R9D,
+    X86_R10D,
+    X86_R11D
+} X86Register;
+
+static char *x86_register_string_table[] = {
+    "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d"
+};
+
+static char *x86_register_64_string_table[] = {
+    "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11"
+};
+
+#define X86_STACK_REGISTER_COUNT 4
+
+static X86Register const x86_stack_registers[X86_STACK_REGISTER_COUNT] = { X86_R8D, X86_R9D, X86_R10D, X86_R11D };
+
+/* Condition codes, as in the low nibble of jcc and setcc */
+typedef enum
+{
+    X86_CONDITION_ABOVE = 0x7,
+    X86_CONDITION_EQUAL = 0x4,
+    X86_CONDITION_NOT_EQUAL = 0x5,
+    X86_CONDITION_LESS = 0xC,
+    X86_CONDITION_GREATER_EQUAL = 0xD,
+    X86_CONDITION_LESS_EQUAL = 0xE,
+    X86_CONDITION_GREATER = 0xF,
+    X86_CONDITION_ALWAYS = 0x10 // Plain jmp
+} X86Condition;
+
+static char *x86_condition_string_table[] = {
+    [X86_CONDITION_ABOVE] = "a",
+    [X86_CONDITION_EQUAL] = "e",
+    [X86_CONDITION_NOT_EQUAL] = "ne",
+    [X86_CONDITION_LESS] = "l",
+    [X86_CONDITION_GREATER_EQUAL] = "ge",
+    [X86_CONDITION_LESS_EQUAL] = "le",
+    [X86_CONDITION_GREATER] = "g",
+    [X86_CONDITION_ALWAYS] = "mp"
+};
+
+/* Register to register instructions of the form `op r/m32, r32` */
+typedef struct
+{
+    uint8_t opcode;
+    char const *name;
+} X86Operation;
+
+static X86Operation const x86_add = { 0x01, "addl" };
+static X86Operation const x86_subtract = { 0x29, "subl" };
+static X86Operation const x86_and = { 0x21, "andl" };
+static X86Operation const x86_or = { 0x09, "orl" };
+static X86Operation const x86_xor = { 0x31, "xorl" };
+static X86Operation const x86_compare = { 0x39, "cmpl" };
+static X86Operation const x86_test = { 0x85, "testl" };
+static X86Operation const x86_move = { 0x89, "movl" };
+
+typedef struct
+{
+    int position; // Where the rel32 goes
+    int label;
+} X86Fixup;
+
+typedef struct
+{
+    uint8_t *code; // Buffer
+    Symbol *variables; // Buffer, the Symbol of each variable slot
+
+    StringBuilder *assembly; // NULL when no text is wanted
+    char const *name;
+    int *labels; // Buffer, code offset of each label, -1 until bound
+    X86Fixup *fixups; // Buffer
+} X86Program;
+
+X86Program CreateX86Program(void)
+{
+    X86Program program;
+    memset(&program, 0, sizeof program);
+
+    return program;
+}
+
+void FreeX86Program(X86Program *program)
+{
+    if(program->code) BufferFree(program->code);
+    if(program->variables) BufferFree(program->variables);
+    if(program->labels) BufferFree(program->labels);
+    if(program->fixups) BufferFree(program->fixups);
+    memset(program, 0, sizeof *program);
+}
+
+/* Encoding */
+
+static void X86Byte(X86Program *program, uint8_t byte)
+{
+    BufferPush(program->code, byte);
+}
+
+static void X86Int32(X86Program *program, int32_t value)
+{
+    uint32_t bits = (uint32_t)value;
+    X86Byte(program, bits & 0xFF);
+    X86Byte(program, (bits >> 8) & 0xFF);
+    X86Byte(program, (bits >> 16) & 0xFF);
+    X86Byte(program, bits >> 24);
+}
+
+/* A REX prefix, only when one of the registers needs it */
+static void X86Rex(X86Program *program, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (rm >= 8 ? 1 : 0);
+    if(rex != 0x40)
+    {
+        X86Byte(program, rex);
+    }
+}
+
+static void X86ModRM(X86Program *program, int mod, int reg, int rm)
+{
+    X86Byte(program, (uint8_t)((mod << 6) | ((reg & 7) << 3) | (rm & 7)));
+}
+
+static void X86Text(X86Program *program, char const *format, ...)
+{
+    if(!program->assembly)
+    {
+        return;
+    }
+
+    char line[128];
+    va_list list;
+    va_start(list, format);
+    int length = vsnprintf(line, sizeof line, format, list);
+    va_end(list);
+
+    Assert(length > 0 && length < (int)sizeof line);
+    PushCharactersToStringBuilder(program->assembly, line, length);
+}
+
+/* Instructions */
+
+static void X86Operate(X86Program *program, X86Operation operation, X86Register destination, X86Register source)
+{
+    X86Rex(program, false, source, destination);
+    X86Byte(program, operation.opcode);
+    X86ModRM(program, 3, source, destination);
+    X86Text(program, "    %s %%%s, %%%s\n", operation.name, x86_register_string_table[source], x86_register_string_table[destination]);
+}
+
+static void X86Move(X86Program *program, X86Register destination, X86Register source)
+{
+    if(destination != source)
+    {
+        X86Operate(program, x86_move, destination, source);
+    }
+}
+
+static void X86MoveImmediate(X86Program *program, X86Register destination, int value)
+{
+    X86Rex(program, false, 0, destination);
+    X86Byte(program, 0xB8 + (destination & 7));
+    X86Int32(program, value);
+    X86Text(program, "    movl $%d, %%%s\n", value, x86_register_string_table[destination]);
+}
+
+static void X86LoadVariable(X86Program *program, X86Register destination, int slot)
+{
+    X86Rex(program, false, destination, X86_EDI);
+    X86Byte(program, 0x8B);
+    X86ModRM(program, 2, destination, X86_EDI);
+    X86Int32(program, slot * 4);
+    X86Text(program, "    movl %d(%%rdi), %%%s\n", slot * 4, x86_register_string_table[destination]);
+}
+
+static void X86StoreVariable(X86Program *program, X86Register source, int slot)
+{
+    X86Rex(program, false, source, X86_EDI);
+    X86Byte(program, 0x89);
+    X86ModRM(program, 2, source, X86_EDI);
+    X86Int32(program, slot * 4);
+    X86Text(program, "    movl %%%s, %d(%%rdi)\n", x86_register_string_table[source], slot * 4);
+}
+
+static void X86Multiply(X86Program *program, X86Register destination, X86Register source)
+{
+    X86Rex(program, false, destination, source);
+    X86Byte(program, 0x0F);
+    X86Byte(program, 0xAF);
+    X86ModRM(program, 3, destination, source);
+    X86Text(program, "    imull %%%s, %%%s\n", x86_register_string_table[source], x86_register_string_table[destination]);
+}
+
+/* The F7 group: 2 not, 3 neg, 7 idiv */
+static void X86Group3(X86Program *program, int extension, char const *name, X86Register operand)
+{
+    X86Rex(program, false, 0, operand);
+    X86Byte(program, 0xF7);
+    X86ModRM(program, 3, extension, operand);
+    X86Text(program, "    %s %%%s\n", name, x86_register_string_table[operand]);
+}
+
+/* The D3 group, shifting by cl: 4 shl, 7 sar */
+static void X86Shift(X86Program *program, int extension, char const *name, X86Register operand)
+{
+    X86Rex(program, false, 0, operand);
+    X86Byte(program, 0xD3);
+    X86ModRM(program, 3, extension, operand);
+    X86Text(program, "    %s %%cl, %%%s\n", name, x86_register_string_table[operand]);
+}
+
+static void X86CompareImmediate(X86Program *program, X86Register operand, int value)
+{
+    X86Rex(program, false, 0, operand);
+    X86Byte(program, 0x81);
+    X86ModRM(program, 3, 7, operand);
+    X86Int32(program, value);
+    X86Text(program, "    cmpl $%d, %%%s\n", value, x86_register_string_table[operand]);
+}
+
+static void X86SignExtend(X86Program *program)
+{
+    X86Byte(program, 0x99);
+    X86Text(program, "    cltd\n");
+}
+
+/* destination = condition ? 1 : 0, from the flags */
+static void X86SetCondition(X86Program *program, X86Condition condition, X86Register destination)
+{
+    X86Byte(program, 0x0F);
+    X86Byte(program, 0x90 + condition);
+    X86ModRM(program, 3, 0, X86_EAX);
+    X86Rex(program, false, destination, 0);
+    X86Byte(program, 0x0F);
+    X86Byte(program, 0xB6);
+    X86ModRM(program, 3, destination, X86_EAX);
+    X86Text(program, "    set%s %%al\n    movzbl %%al, %%%s\n", x86_condition_string_table[condition],
+            x86_register_string_table[destination]);
+}
+
+static void X86Push(X86Program *program, X86Register source)
+{
+    X86Rex(program, false, 0, source);
+    X86Byte(program, 0x50 + (source & 7));
+    X86Text(program, "    pushq %%%s\n", x86_register_64_string_table[source]);
+}
+
+static void X86Pop(X86Program *program, X86Register destination)
+{
+    X86Rex(program, false, 0, destination);
+    X86Byte(program, 0x58 + (destination & 7));
+    X86Text(program, "    popq %%%s\n", x86_register_64_string_table[destination]);
+}
+
+static void X86StoreStatus(X86Program *program, VmStatus status)
+{
+    X86Byte(program, 0xC7);
+    X86ModRM(program, 0, 0, X86_ESI);
+    X86Int32(program, status);
+    X86Text(program, "    movl $%d, (%%rsi)\n", status);
+}
+
+static void X86Return(X86Program *program)
+{
+    /* movq %rbp, %rsp; popq %rbp; ret */
+    X86Byte(program, 0x48);
+    X86Byte(program, 0x89);
+    X86Byte(program, 0xEC);
+    X86Byte(program, 0x5D);
+    X86Byte(program, 0xC3);
+    X86Text(program, "    movq %%rbp, %%rsp\n    popq %%rbp\n    ret\n");
+}
+
+static int X86CreateLabel(X86Program *program)
+{
+    int unbound = -1;
+    BufferPush(program->labels, unbound);
+
+    return BufferLength(program->labels) - 1;
+}
+
+static void X86BindLabel(X86Program *program, int label)
+{
+    program->labels[label] = BufferLength(program->code);
+    X86Text(program, ".L%s_%d:\n", program->name, label);
+}
+
+static void X86Jump(X86Program *program, X86Condition condition, int label)
+{
+    if(condition == X86_CONDITION_ALWAYS)
+    {
+        X86Byte(program, 0xE9);
+    } else
+    {
+        X86Byte(program, 0x0F);
+        X86Byte(program, 0x80 + condition);
+    }
+
+    X86Fixup fixup;
+    fixup.position = BufferLength(program->code);
+    fixup.label = label;
+    BufferPush(program->fixups, fixup);
+    X86Int32(program, 0);
+
+    X86Text(program, "    j%s .L%s_%d\n", x86_condition_string_table[condition], program->name, label);
+}
+
+/* Code generation */
+
+/* Labels of an &&, || or ?: being compiled. `skip` starts the code for a false
+ * condition, `join` follows the whole expression. */
+typedef struct
+{
+    int skip;
+    int join;
+} X86Branch;
+
+typedef struct
+{
+    X86Program *program;
+    int depth; // Values on the expression stack
+    X86Branch *branches; // Buffer, the &&, || and ?: being compiled, innermost last
+    int error_labels[VM_SHIFT_OUT_OF_RANGE + 1];
+} X86Compiler;
+
+/* Takes the value at depth `slot`, which has to be the top or just under a top that
+ * was already taken, and returns the register it is in. Values on the machine stack
+ * are popped into `scratch`. */
+static X86Register X86Take(X86Compiler *compiler, int slot, X86Register scratch)
+{
+    if(slot < X86_STACK_REGISTER_COUNT)
+    {
+        return x86_stack_registers[slot];
+    }
+
+    X86Pop(compiler->program, scratch);
+
+    return scratch;
+}
+
+/* Makes `source` the value at depth `slot` */
+static void X86Put(X86Compiler *compiler, int slot, X86Register source)
+{
+    if(slot < X86_STACK_REGISTER_COUNT)
+    {
+        X86Move(compiler->program, x86_stack_registers[slot], source);
+    } else
+    {
+        X86Push(compiler->program, source);
+    }
+}
+
+/* Register to compute a new value at depth `slot` in */
+static X86Register X86Target(int slot)
+{
+    return slot < X86_STACK_REGISTER_COUNT ? x86_stack_registers[slot] : X86_EAX;
+}
+
+static int X86ErrorLabel(X86Compiler *compiler, VmStatus status)
+{
+    if(compiler->error_labels[status] < 0)
+    {
+        compiler->error_labels[status] = X86CreateLabel(compiler->program);
+    }
+
+    return compiler->error_labels[status];
+}
+
+static X86Branch *X86InnermostBranch(X86Compiler *compiler)
+{
+    return &compiler->branches[BufferLength(compiler->branches) - 1];
+}
+
+static X86Branch X86PopBranch(X86Compiler *compiler)
+{
+    X86Branch branch = *X86InnermostBranch(compiler);
+    BufferHeaderGet(compiler->branches)->length--;
+
+    return branch;
+}
+
+static void X86Binary(X86Compiler *compiler, TokenKind operator)
+{
+    X86Program *program = compiler->program;
+    int left_slot = compiler->depth - 2;
+    X86Register right = X86Take(compiler, left_slot + 1, X86_ECX);
+    X86Register left = X86Take(compiler, left_slot, X86_EAX);
+    int ok;
+
+    switch(operator)
+    {
+        case TOKEN_PLUS: case TOKEN_PLUS_ASSIGNMENT: X86Operate(program, x86_add, left, right); break;
+        case TOKEN_MINUS: case TOKEN_MINUS_ASSIGNMENT: X86Operate(program, x86_subtract, left, right); break;
+        case TOKEN_BITWISE_AND: case TOKEN_AND_ASSIGNMENT: X86Operate(program, x86_and, left, right); break;
+        case TOKEN_BITWISE_OR: case TOKEN_OR_ASSIGNMENT: X86Operate(program, x86_or, left, right); break;
+        case TOKEN_BITWISE_XOR: case TOKEN_XOR_ASSIGNMENT: X86Operate(program, x86_xor, left, right); break;
+        case TOKEN_STAR: case TOKEN_STAR_ASSIGNMENT: X86Multiply(program, left, right); break;
+
+        case TOKEN_SLASH: case TOKEN_SLASH_ASSIGNMENT:
+        case TOKEN_PERCENT: case TOKEN_PERCENT_ASSIGNMENT:
+            /* idiv divides edx:eax; right is never in either */
+            X86Operate(program, x86_test, right, right);
+            X86Jump(program, X86_CONDITION_EQUAL, X86ErrorLabel(compiler, VM_DIVISION_BY_ZERO));
+            X86Move(program, X86_EAX, left);
+            ok = X86CreateLabel(program);
+            X86CompareImmediate(program, right, -1);
+            X86Jump(program, X86_CONDITION_NOT_EQUAL, ok);
+            X86CompareImmediate(program, X86_EAX, INT_MIN);
+            X86Jump(program, X86_CONDITION_EQUAL, X86ErrorLabel(compiler, VM_OVERFLOW));
+            X86BindLabel(program, ok);
+            X86SignExtend(program);
+            X86Group3(program, 7, "idivl", right);
+            left = operator == TOKEN_SLASH || operator == TOKEN_SLASH_ASSIGNMENT ? X86_EAX : X86_EDX;
+            break;
+
+        case TOKEN_BITWISE_LEFT_SHIFT: case TOKEN_LEFT_SHIFT_ASSIGNMENT:
+        case TOKEN_BITWISE_RIGHT_SHIFT: case TOKEN_RIGHT_SHIFT_ASSIGNMENT:
+            /* The count has to be in cl; unsigned above 31 also catches negative counts */
+            X86Move(program, X86_ECX, right);
+            X86CompareImmediate(program, X86_ECX, 31);
+            X86Jump(program, X86_CONDITION_ABOVE, X86ErrorLabel(compiler, VM_SHIFT_OUT_OF_RANGE));
+            if(operator == TOKEN_BITWISE_LEFT_SHIFT || operator == TOKEN_LEFT_SHIFT_ASSIGNMENT)
+            {
+                X86Shift(program, 4, "shll", left);
+            } else
+            {
+                X86Shift(program, 7, "sarl", left);
+            }
+            break;
+
+        case TOKEN_LESS_THAN:
+        case TOKEN_GREATER_THAN:
+        case TOKEN_LESS_EQUAL:
+        case TOKEN_GREATER_EQUAL:
+        case TOKEN_DOUBLE_EQUALS:
+        case TOKEN_NOT_EQUAL:
+        {
+            X86Condition condition = operator == TOKEN_LESS_THAN ? X86_CONDITION_LESS :
+                                     operator == TOKEN_GREATER_THAN ? X86_CONDITION_GREATER :
+                                     operator == TOKEN_LESS_EQUAL ? X86_CONDITION_LESS_EQUAL :
+                                     operator == TOKEN_GREATER_EQUAL ? X86_CONDITION_GREATER_EQUAL :
+                                     operator == TOKEN_DOUBLE_EQUALS ? X86_CONDITION_EQUAL : X86_CONDITION_NOT_EQUAL;
+            X86Operate(program, x86_compare, left, right);
+            X86SetCondition(program, condition, left);
+            break;
+        }
+
+        default:
+            break;
+    }
+
+    X86Put(compiler, left_slot, left);
+    compiler->depth--;
+}
+
+/* Compiles the tree at root into a function named `name`. With `assembly` set, the
+ * GNU as source of the function is appended to it as well. Returns false, after
+ * reporting why, for what has no machine equivalent here: * and & on pointers and
+ * assignments to anything but a variable. */
+bool CompileX86(X86Program *program, ExpressionPool *pool, ExpressionId root, char const *name, StringBuilder *assembly)
+{
+    X86Compiler compiler;
+    compiler.program = program;
+    compiler.depth = 0;
+    compiler.branches = NULL;
+    memset(compiler.error_labels, -1, sizeof compiler.error_labels);
+
+    program->name = name;
+    program->assembly = assembly;
+    X86Text(program, "    .globl %s\n    .type %s, @function\n%s:\n", name, name, name);
+
+    /* pushq %rbp; movq %rsp, %rbp */
+    X86Byte(program, 0x55);
+    X86Byte(program, 0x48);
+    X86Byte(program, 0x89);
+    X86Byte(program, 0xE5);
+    X86Text(program, "    pushq %%rbp\n    movq %%rsp, %%rbp\n");
+    X86StoreStatus(program, VM_OK);
+
+    bool ok = true;
+    ExpressionWalker walker = CreateExpressionWalker(pool, root);
+    ExpressionWalkEvent event;
+    ExpressionId id;
+
+    while(ok && ExpressionWalkerNext(&walker, &event, &id))
+    {
+        ExpressionNode *node = GetExpression(pool, id);
+        int slot = compiler.depth;
+        X86Register value;
+
+        if(event == EXPRESSION_WALK_ENTER)
+        {
+            if(node->kind == EXPRESSION_NUMBER)
+            {
+                X86MoveImmediate(program, X86Target(slot), ExpressionNumber(pool, id));
+                X86Put(&compiler, slot, X86Target(slot));
+                compiler.depth++;
+            } else if(node->kind == EXPRESSION_IDENTIFIER)
+            {
+                X86LoadVariable(program, X86Target(slot), VariableSlot(&program->variables, node->first));
+                X86Put(&compiler, slot, X86Target(slot));
+                compiler.depth++;
+            } else if(node->kind == EXPRESSION_NONE)
+            {
+                ok = false;
+            } else if(node->kind == EXPRESSION_UNARY && (node->operator == TOKEN_STAR || node->operator == TOKEN_BITWISE_AND))
+            {
+                ReportError("native code has no pointers, %s is not supported\n", token_string_table[node->operator]);
+                ok = false;
+            } else if(node->kind == EXPRESSION_ASSIGNMENT && GetExpression(pool, node->first)->kind != EXPRESSION_IDENTIFIER)
+            {
+                ReportError("native code can only assign to variables\n");
+                ok = false;
+            }
+        } else if(event == EXPRESSION_WALK_OPERAND)
+        {
+            bool logical = node->kind == EXPRESSION_BINARY &&
+                           (node->operator == TOKEN_LOGICAL_AND || node->operator == TOKEN_LOGICAL_OR);
+
+            if(IsUnreadAssignmentTarget(&walker, node))
+            {
+                ExpressionWalkerSkipOperand(&walker);
+            } else if((logical || node->kind == EXPRESSION_TERNARY) && walker.operand == 1)
+            {
+                /* Branch on the first operand. Every path leaves its result in eax and
+                 * the join puts it where the value belongs. */
+                X86Branch branch;
+                branch.skip = X86CreateLabel(program);
+                branch.join = X86CreateLabel(program);
+                value = X86Take(&compiler, slot - 1, X86_EAX);
+                compiler.depth--;
+                X86Operate(program, x86_test, value, value);
+                X86Jump(program, node->operator == TOKEN_LOGICAL_OR ? X86_CONDITION_NOT_EQUAL : X86_CONDITION_EQUAL, branch.skip);
+                BufferPush(compiler.branches, branch);
+            } else if(node->kind == EXPRESSION_TERNARY && walker.operand == 2)
+            {
+                X86Branch *branch = X86InnermostBranch(&compiler);
+                X86Move(program, X86_EAX, X86Take(&compiler, slot - 1, X86_EAX));
+                compiler.depth--;
+                X86Jump(program, X86_CONDITION_ALWAYS, branch->join);
+                X86BindLabel(program, branch->skip);
+            } else if(node->kind == EXPRESSION_BINARY && node->operator == TOKEN_COMMA && walker.operand == 1)
+            {
+                X86Take(&compiler, slot - 1, X86_EAX);
+                compiler.depth--;
+            }
+        } else if(node->kind == EXPRESSION_UNARY)
+        {
+            value = X86Take(&compiler, slot - 1, X86_EAX);
+            if(node->operator == TOKEN_MINUS)
+            {
+                X86Group3(program, 3, "negl", value);
+            } else if(node->operator == TOKEN_BITWISE_NOT)
+            {
+                X86Group3(program, 2, "notl", value);
+            } else if(node->operator == TOKEN_EXCLAMATION_POINT)
+            {
+                X86Operate(program, x86_test, value, value);
+                X86SetCondition(program, X86_CONDITION_EQUAL, value);
+            }
+            X86Put(&compiler, slot - 1, value);
+        } else if(node->kind == EXPRESSION_BINARY && (node->operator == TOKEN_LOGICAL_AND || node->operator == TOKEN_LOGICAL_OR))
+        {
+            X86Branch branch = X86PopBranch(&compiler);
+            value = X86Take(&compiler, slot - 1, X86_EAX);
+            X86Operate(program, x86_test, value, value);
+            X86SetCondition(program, X86_CONDITION_NOT_EQUAL, X86_EAX);
+            X86Jump(program, X86_CONDITION_ALWAYS, branch.join);
+            X86BindLabel(program, branch.skip);
+            X86MoveImmediate(program, X86_EAX, node->operator == TOKEN_LOGICAL_OR);
+            X86BindLabel(program, branch.join);
+            X86Put(&compiler, slot - 1, X86_EAX);
+        } else if(node->kind == EXPRESSION_BINARY && node->operator == TOKEN_COMMA)
+        {
+            /* The right operand is already where the result goes */
+        } else if(node->kind == EXPRESSION_BINARY)
+        {
+            X86Binary(&compiler, node->operator);
+        } else if(node->kind == EXPRESSION_ASSIGNMENT)
+        {
+            if(node->operator != TOKEN_EQUAL)
+            {
+                X86Binary(&compiler, node->operator);
+            }
+
+            int variable = VariableSlot(&program->variables, GetExpression(pool, node->first)->first);
+            value = X86Take(&compiler, compiler.depth - 1, X86_EAX);
+            X86StoreVariable(program, value, variable);
+            X86Put(&compiler, compiler.depth - 1, value);
+        } else if(node->kind == EXPRESSION_TERNARY)
+        {
+            X86Branch branch = X86PopBranch(&compiler);
+            X86Move(program, X86_EAX, X86Take(&compiler, slot - 1, X86_EAX));
+            X86BindLabel(program, branch.join);
+            X86Put(&compiler, slot - 1, X86_EAX);
+        }
+    }
+
+    if(ok)
+    {
+        X86Move(program, X86_EAX, X86Take(&compiler, 0, X86_EAX));
+        X86Return(program);
+
+        VmStatus status = VM_DIVISION_BY_ZERO;
+        while(status <= VM_SHIFT_OUT_OF_RANGE)
+        {
+            if(compiler.error_labels[status] >= 0)
+            {
+                X86BindLabel(program, compiler.error_labels[status]);
+                X86StoreStatus(program, status);
+                X86Operate(program, x86_xor, X86_EAX, X86_EAX);
+                X86Return(program);
+            }
+
+            status++;
+        }
+
+        X86Text(program, "    .size %s, .-%s\n", name, name);
+
+        int i = 0;
+        while(i < BufferLength(program->fixups))
+        {
+            X86Fixup *fixup = &program->fixups[i];
+            int32_t relative = program->labels[fixup->label] - (fixup->position + 4);
+            memcpy(program->code + fixup->position, &relative, sizeof relative);
+            i++;
+        }
+    }
+
+    FreeExpressionWalker(&walker);
+    if(compiler.branches)
+    {
+        BufferFree(compiler.branches);
+    }
+
+    program->assembly = NULL;
+
+    return ok;
+}
+
+/* Machine code copied into its own pages, executable but no longer writable */
+typedef int (*JitFunction)(int *variables, int *status);
+
+typedef struct
+{
+    void *memory;
+    size_t size;
+    JitFunction function;
+} JitCode;
+
+bool JitLoad(JitCode *jit, X86Program *program)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    jit->size = (BufferLength(program->code) + page_size - 1) / page_size * page_size;
+    jit->memory = mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->memory == MAP_FAILED)
+    {
+        ReportError("could not map memory for native code: %s\n", strerror(errno));
+        return false;
+    }
+
+    memcpy(jit->memory, program->code, BufferLength(program->code));
+    if(mprotect(jit->memory, jit->size, PROT_READ | PROT_EXEC) != 0)
+    {
+        ReportError("could not make native code executable: %s\n", strerror(errno));
+        munmap(jit->memory, jit->size);
+        return false;
+    }
+
+    /* Object pointer to function pointer is not ISO C, but is how POSIX loads code */
+    memcpy(&jit->function, &jit->memory, sizeof jit->function);
+
+    return true;
+}
+
+void JitFree(JitCode *jit)
+{
+    munmap(jit->memory, jit->size);
+    memset(jit, 0, sizeof *jit);
+}